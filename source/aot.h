@@ -0,0 +1,313 @@
+/**
+Runtime support for ahead-of-time compiled units
+
+The C code generated by --emit-c (see cgen.c) includes this header and
+is linked against the VM objects, without main.c, into a standalone
+executable. Compiled functions take their closure and a pointer to their
+argument values, and keep their local variables in C variables. Values,
+closures and cells have the same layout and tags as in the interpreters,
+and the generic cases of operators are handled by the interpreter's
+runtime functions.
+
+Generated code defines AOT_MAX_ARGS, the largest parameter count of the
+unit's functions, before including this header.
+*/
+
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "vm.h"
+#include "parser.h"
+#include "interp.h"
+#include "builtins.h"
+
+#ifndef AOT_MAX_ARGS
+#define AOT_MAX_ARGS 1
+#endif
+
+/// Maximum call depth, calls recurse on the C stack
+#define AOT_MAX_DEPTH 10000
+
+/// Tag returned by compiled functions to request a tail call
+#define AOT_TAIL_TAG 0xFF
+
+struct aot_clos;
+
+/// Compiled function code
+typedef value_t (*aot_fn_t)(struct aot_clos* clos, value_t* args);
+
+/**
+Compiled function descriptor
+*/
+typedef struct
+{
+    /// Function code
+    aot_fn_t fn;
+
+    /// Number of parameters
+    uint32_t num_params;
+
+    /// Number of captured variables
+    uint32_t num_capts;
+
+} aot_fun_t;
+
+/**
+Closure of a compiled function
+*/
+typedef struct aot_clos
+{
+    shapeidx_t shape;
+
+    /// Function this is a closure of
+    const aot_fun_t* fun;
+
+    /// Captured variable values, variable length
+    value_t env[];
+
+} aot_clos_t;
+
+/// Value returned to request a tail call
+static const value_t AOT_TAIL = { 0, AOT_TAIL_TAG };
+
+/// Callee and arguments of a pending tail call
+static aot_clos_t* aot_tail_clos;
+static value_t aot_tail_args[AOT_MAX_ARGS];
+
+/// Current call depth
+static uint32_t aot_depth = 0;
+
+/// Value held in a cell
+#define AOT_CELL(v) (((cell_t*)(v).word.heapptr)->val)
+
+static inline value_t aot_int(int64_t v)
+{
+    value_t val;
+    val.word.int64 = v;
+    val.tag = TAG_INT64;
+    return val;
+}
+
+static inline value_t aot_float(double v)
+{
+    value_t val;
+    val.word.float64 = v;
+    val.tag = TAG_FLOAT64;
+    return val;
+}
+
+static inline value_t aot_bool(bool b)
+{
+    return b? VAL_TRUE:VAL_FALSE;
+}
+
+static inline bool aot_truth(value_t v)
+{
+    if (v.tag == TAG_BOOL)
+        return v.word.int8 != 0;
+
+    return eval_truth(v);
+}
+
+static value_t aot_error(const char* msg)
+{
+    printf("%s\n", msg);
+    exit(-1);
+}
+
+static value_t aot_unimpl(const char* msg)
+{
+    printf("%s\n", msg);
+    return VAL_FALSE;
+}
+
+static inline value_t aot_get_global(value_t val, const char* name)
+{
+    if (val.tag == TAG_RAW_PTR)
+    {
+        printf("undefined global variable \"%s\"\n", name);
+        exit(-1);
+    }
+
+    return val;
+}
+
+/// Arithmetic operators, integers wrap around on overflow
+#define AOT_ARITH(name, op, cop)                                        \
+static inline value_t aot_##name(value_t v0, value_t v1)                \
+{                                                                       \
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)                     \
+        return aot_int((int64_t)(                                       \
+            (uint64_t)v0.word.int64 cop (uint64_t)v1.word.int64));      \
+    if (v0.tag == TAG_FLOAT64 && v1.tag == TAG_FLOAT64)                 \
+        return aot_float(v0.word.float64 cop v1.word.float64);          \
+    return eval_binop_vals(&op, v0, v1);                                \
+}
+
+AOT_ARITH(add, OP_ADD, +)
+AOT_ARITH(sub, OP_SUB, -)
+AOT_ARITH(mul, OP_MUL, *)
+
+/// Division and modulo by zero or -1 take the generic path
+static inline value_t aot_div(value_t v0, value_t v1)
+{
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64 && v1.word.int64 > 0)
+        return aot_int(v0.word.int64 / v1.word.int64);
+    return eval_binop_vals(&OP_DIV, v0, v1);
+}
+
+static inline value_t aot_mod(value_t v0, value_t v1)
+{
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64 && v1.word.int64 > 0)
+        return aot_int(v0.word.int64 % v1.word.int64);
+    return eval_binop_vals(&OP_MOD, v0, v1);
+}
+
+/// Comparison operators, evaluated as branch conditions
+#define AOT_COMPARE(name, op, cop)                                      \
+static inline bool aot_test_##name(value_t v0, value_t v1)              \
+{                                                                       \
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)                     \
+        return v0.word.int64 cop v1.word.int64;                         \
+    return aot_truth(eval_binop_vals(&op, v0, v1));                     \
+}
+
+AOT_COMPARE(lt, OP_LT, <)
+AOT_COMPARE(le, OP_LE, <=)
+AOT_COMPARE(gt, OP_GT, >)
+AOT_COMPARE(ge, OP_GE, >=)
+AOT_COMPARE(eq, OP_EQ, ==)
+AOT_COMPARE(ne, OP_NE, !=)
+
+static inline value_t aot_neg(value_t v0)
+{
+    if (v0.tag == TAG_INT64)
+        return aot_int((int64_t)(0 - (uint64_t)v0.word.int64));
+    return eval_neg(v0);
+}
+
+static inline value_t aot_index(value_t v0, value_t v1)
+{
+    return array_get((array_t*)v0.word.heapptr, v1.word.int64);
+}
+
+static value_t aot_array(uint32_t len, value_t* vals)
+{
+    array_t* array = array_alloc(len);
+
+    for (uint32_t i = 0; i < len; ++i)
+        array_set(array, i, vals[i]);
+
+    return value_from_heapptr((heapptr_t)array, TAG_ARRAY);
+}
+
+static inline value_t aot_cell(value_t val)
+{
+    return value_from_heapptr((heapptr_t)cell_alloc(val), TAG_RAW_PTR);
+}
+
+static inline aot_clos_t* aot_clos_alloc(const aot_fun_t* fun)
+{
+    aot_clos_t* clos = (aot_clos_t*)vm_alloc(
+        sizeof(aot_clos_t) + sizeof(value_t) * fun->num_capts,
+        SHAPE_CLOS
+    );
+
+    clos->fun = fun;
+
+    return clos;
+}
+
+/**
+Get the closure to call from a function value
+Checks that the closure takes the given number of arguments
+*/
+static inline aot_clos_t* aot_callee(value_t fun_val, uint32_t num_args)
+{
+    if (fun_val.tag != TAG_CLOS)
+        aot_error("call to non-function value");
+
+    aot_clos_t* clos = (aot_clos_t*)fun_val.word.heapptr;
+
+    if (num_args != clos->fun->num_params)
+        aot_error("incorrect argument count in call");
+
+    return clos;
+}
+
+/**
+Run the tail calls requested by a function, until a value is returned
+*/
+static inline value_t aot_finish(value_t ret)
+{
+    while (ret.tag == AOT_TAIL_TAG)
+        ret = aot_tail_clos->fun->fn(aot_tail_clos, aot_tail_args);
+
+    return ret;
+}
+
+static inline value_t aot_call(aot_clos_t* clos, value_t* args)
+{
+    if (aot_depth >= AOT_MAX_DEPTH)
+        aot_error("stack overflow");
+
+    aot_depth++;
+    value_t ret = aot_finish(clos->fun->fn(clos, args));
+    aot_depth--;
+
+    return ret;
+}
+
+/**
+Entry point of compiled units
+With --bench N, the unit is executed N times and timed
+*/
+static int aot_main(
+    int argc,
+    char** argv,
+    const char* src_name,
+    void (*init_fn)(),
+    const aot_fun_t* unit_fun
+)
+{
+    vm_init();
+    parser_init();
+    interp_init();
+
+    init_fn();
+
+    int num_iters = 0;
+
+    if (argc == 3 && strcmp(argv[1], "--bench") == 0)
+        num_iters = atoi(argv[2]);
+
+    if (num_iters <= 0)
+    {
+        aot_finish(unit_fun->fn(NULL, NULL));
+        return 0;
+    }
+
+    clock_t start = clock();
+
+    for (int i = 0; i < num_iters; ++i)
+        aot_finish(unit_fun->fn(NULL, NULL));
+
+    double msecs = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    printf(
+        "%s (aot): %d iterations, %.1f ms, %.3f us/iteration\n",
+        src_name,
+        num_iters,
+        msecs,
+        1000.0 * msecs / num_iters
+    );
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "builtins.h"
+#include "coro.h"
+#include "task.h"
+#include "io.h"
+#include "par.h"
+#include "seq.h"
+#include "simd.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Report a type error in a builtin call and abort
+void builtin_type_error(const char* name, const char* expected)
+{
+    printf("%s: expected %s\n", name, expected);
+    exit(-1);
+}
+
+/// Convert a numeric argument to a floating-point value
+double arg_to_float64(const char* name, value_t arg)
+{
+    if (arg.tag == TAG_INT64)
+        return (double)arg.word.int64;
+    if (arg.tag == TAG_FLOAT64)
+        return arg.word.float64;
+
+    builtin_type_error(name, "number");
+    return 0;
+}
+
+value_t builtin_print(value_t* args)
+{
+    value_print(args[0]);
+    return VAL_TRUE;
+}
+
+value_t builtin_println(value_t* args)
+{
+    value_print(args[0]);
+    putchar('\n');
+    return VAL_TRUE;
+}
+
+/// Length of an array or string
+value_t builtin_len(value_t* args)
+{
+    if (args[0].tag == TAG_ARRAY)
+        return value_from_int64(args[0].word.array->len);
+    if (args[0].tag == TAG_STRING)
+        return value_from_int64(args[0].word.string->len);
+
+    builtin_type_error("len", "array or string");
+    return VAL_FALSE;
+}
+
+value_t builtin_abs(value_t* args)
+{
+    value_t v = args[0];
+
+    // Note: the absolute value of the minimum integer wraps around
+    if (v.tag == TAG_INT64)
+    {
+        uint64_t i = v.word.int64;
+        return value_from_int64((v.word.int64 < 0)? -i:i);
+    }
+    if (v.tag == TAG_FLOAT64)
+        return value_from_float64(fabs(v.word.float64));
+
+    builtin_type_error("abs", "number");
+    return VAL_FALSE;
+}
+
+value_t builtin_min(value_t* args)
+{
+    value_t v0 = args[0];
+    value_t v1 = args[1];
+
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+        return (v1.word.int64 < v0.word.int64)? v1:v0;
+
+    double f0 = arg_to_float64("min", v0);
+    double f1 = arg_to_float64("min", v1);
+    return value_from_float64(fmin(f0, f1));
+}
+
+value_t builtin_max(value_t* args)
+{
+    value_t v0 = args[0];
+    value_t v1 = args[1];
+
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+        return (v1.word.int64 > v0.word.int64)? v1:v0;
+
+    double f0 = arg_to_float64("max", v0);
+    double f1 = arg_to_float64("max", v1);
+    return value_from_float64(fmax(f0, f1));
+}
+
+value_t builtin_sqrt(value_t* args)
+{
+    return value_from_float64(sqrt(arg_to_float64("sqrt", args[0])));
+}
+
+value_t builtin_floor(value_t* args)
+{
+    return value_from_float64(floor(arg_to_float64("floor", args[0])));
+}
+
+value_t builtin_to_float(value_t* args)
+{
+    return value_from_float64(arg_to_float64("to_float", args[0]));
+}
+
+/// Convert a number to an integer, truncating towards zero
+value_t builtin_to_int(value_t* args)
+{
+    value_t v = args[0];
+
+    if (v.tag == TAG_INT64)
+        return v;
+
+    if (v.tag == TAG_FLOAT64)
+    {
+        double f = v.word.float64;
+
+        if (!(f > -9223372036854775808.0 && f < 9223372036854775808.0))
+        {
+            printf("to_int: value out of range\n");
+            exit(-1);
+        }
+
+        return value_from_int64((int64_t)f);
+    }
+
+    builtin_type_error("to_int", "number");
+    return VAL_FALSE;
+}
+
+/// Get a coroutine argument
+coro_t* arg_to_coro(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_OBJECT || get_shape(arg.word.heapptr) != SHAPE_CORO)
+        builtin_type_error(name, "coroutine");
+
+    return (coro_t*)arg.word.heapptr;
+}
+
+/// Create a coroutine running a closure of one argument
+value_t builtin_coroutine(value_t* args)
+{
+    if (args[0].tag != TAG_CLOS ||
+        ((clos_t*)args[0].word.heapptr)->fun->param_decls->len != 1)
+        builtin_type_error("coroutine", "closure taking one argument");
+
+    clos_t* clos = (clos_t*)args[0].word.heapptr;
+    return value_from_heapptr((heapptr_t)coro_alloc(clos), TAG_OBJECT);
+}
+
+value_t builtin_resume(value_t* args)
+{
+    return coro_resume(arg_to_coro("resume", args[0]), args[1]);
+}
+
+value_t builtin_yield(value_t* args)
+{
+    return coro_yield(args[0]);
+}
+
+/// Test if a coroutine has returned
+value_t builtin_finished(value_t* args)
+{
+    coro_t* coro = arg_to_coro("finished", args[0]);
+    return (coro->state == CORO_DONE)? VAL_TRUE:VAL_FALSE;
+}
+
+/// Get a task argument
+task_t* arg_to_task(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_OBJECT || get_shape(arg.word.heapptr) != SHAPE_TASK)
+        builtin_type_error(name, "task");
+
+    return (task_t*)arg.word.heapptr;
+}
+
+/// Run a closure of one argument as a task, on the worker threads
+value_t builtin_spawn(value_t* args)
+{
+    if (args[0].tag != TAG_CLOS ||
+        ((clos_t*)args[0].word.heapptr)->fun->param_decls->len != 1)
+        builtin_type_error("spawn", "closure taking one argument");
+
+    clos_t* clos = (clos_t*)args[0].word.heapptr;
+    return value_from_heapptr((heapptr_t)task_spawn(clos, args[1]), TAG_OBJECT);
+}
+
+/// Wait for a task to finish and get its result
+value_t builtin_join(value_t* args)
+{
+    return task_join(arg_to_task("join", args[0]));
+}
+
+/// Get a file descriptor argument
+int arg_to_fd(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_INT64 || arg.word.int64 < 0 || arg.word.int64 > INT32_MAX)
+        builtin_type_error(name, "file descriptor");
+
+    return (int)arg.word.int64;
+}
+
+/// Get a string argument
+string_t* arg_to_string(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_STRING)
+        builtin_type_error(name, "string");
+
+    return arg.word.string;
+}
+
+value_t builtin_pipe(value_t* args)
+{
+    return io_pipe();
+}
+
+value_t builtin_socketpair(value_t* args)
+{
+    return io_socketpair();
+}
+
+value_t builtin_open(value_t* args)
+{
+    string_t* path = arg_to_string("open", args[0]);
+    string_t* mode = arg_to_string("open", args[1]);
+    return value_from_int64(io_open(path, mode));
+}
+
+/// Read up to a number of bytes, parking the calling task until some
+/// are available
+value_t builtin_read(value_t* args)
+{
+    int fd = arg_to_fd("read", args[0]);
+
+    if (args[1].tag != TAG_INT64 || args[1].word.int64 < 0 ||
+        args[1].word.int64 > UINT32_MAX)
+        builtin_type_error("read", "length");
+
+    return io_read(fd, (uint32_t)args[1].word.int64);
+}
+
+/// Write a string, parking the calling task until it is all written
+value_t builtin_write(value_t* args)
+{
+    int fd = arg_to_fd("write", args[0]);
+    return io_write(fd, arg_to_string("write", args[1]));
+}
+
+value_t builtin_close(value_t* args)
+{
+    io_close(arg_to_fd("close", args[0]));
+    return VAL_TRUE;
+}
+
+/// Get an array argument
+array_t* arg_to_array(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_ARRAY)
+        builtin_type_error(name, "array");
+
+    return arg.word.array;
+}
+
+/// Get a closure argument taking a number of arguments
+clos_t* arg_to_clos(const char* name, value_t arg, uint32_t arity)
+{
+    if (arg.tag != TAG_CLOS ||
+        ((clos_t*)arg.word.heapptr)->fun->param_decls->len != arity)
+        builtin_type_error(name, arity == 1? "closure taking one argument":"closure taking two arguments");
+
+    return (clos_t*)arg.word.heapptr;
+}
+
+/// Get the length argument of an array to make
+static uint32_t arg_to_length(const char* name, value_t arg)
+{
+    if (arg.tag != TAG_INT64 || arg.word.int64 < 0 || arg.word.int64 > UINT32_MAX)
+        builtin_type_error(name, "length");
+
+    return (uint32_t)arg.word.int64;
+}
+
+/// Make an array of a given length, from a closure called on each index
+value_t builtin_array(value_t* args)
+{
+    uint32_t len = arg_to_length("array", args[0]);
+    clos_t* clos = arg_to_clos("array", args[1], 1);
+    array_t* out = par_array(len, clos, par_auto(len, clos));
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+/// Test if a value is a sequence
+bool is_seq(value_t val)
+{
+    return val.tag == TAG_OBJECT && get_shape(val.word.heapptr) == SHAPE_SEQ;
+}
+
+/// Sequence of the integers in a range
+value_t builtin_range(value_t* args)
+{
+    if (args[0].tag != TAG_INT64 || args[1].tag != TAG_INT64)
+        builtin_type_error("range", "integer");
+
+    seq_t* seq = seq_range(args[0].word.int64, args[1].word.int64);
+    return value_from_heapptr((heapptr_t)seq, TAG_OBJECT);
+}
+
+/// Sequence of the elements of an array
+value_t builtin_seq(value_t* args)
+{
+    seq_t* seq = seq_array(arg_to_array("seq", args[0]));
+    return value_from_heapptr((heapptr_t)seq, TAG_OBJECT);
+}
+
+/// Make an array of the elements of a sequence
+value_t builtin_collect(value_t* args)
+{
+    if (!is_seq(args[0]))
+        builtin_type_error("collect", "sequence");
+
+    array_t* array = seq_collect((seq_t*)args[0].word.heapptr);
+    return value_from_heapptr((heapptr_t)array, TAG_ARRAY);
+}
+
+/// Map and filter add a stage to sequences, and make arrays from arrays
+value_t builtin_map(value_t* args)
+{
+    if (is_seq(args[0]))
+    {
+        clos_t* clos = arg_to_clos("map", args[1], 1);
+        seq_t* seq = seq_stage(SEQ_MAP, (seq_t*)args[0].word.heapptr, clos);
+        return value_from_heapptr((heapptr_t)seq, TAG_OBJECT);
+    }
+
+    array_t* array = arg_to_array("map", args[0]);
+    clos_t* clos = arg_to_clos("map", args[1], 1);
+    array_t* out = par_map(array, clos, par_auto(array->len, clos));
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+value_t builtin_filter(value_t* args)
+{
+    if (is_seq(args[0]))
+    {
+        clos_t* clos = arg_to_clos("filter", args[1], 1);
+        seq_t* seq = seq_stage(SEQ_FILTER, (seq_t*)args[0].word.heapptr, clos);
+        return value_from_heapptr((heapptr_t)seq, TAG_OBJECT);
+    }
+
+    array_t* array = arg_to_array("filter", args[0]);
+    clos_t* clos = arg_to_clos("filter", args[1], 1);
+    array_t* out = par_filter(array, clos, par_auto(array->len, clos));
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+value_t builtin_reduce(value_t* args)
+{
+    if (is_seq(args[0]))
+    {
+        clos_t* clos = arg_to_clos("reduce", args[1], 2);
+        return seq_reduce((seq_t*)args[0].word.heapptr, clos, args[2]);
+    }
+
+    array_t* array = arg_to_array("reduce", args[0]);
+    clos_t* clos = arg_to_clos("reduce", args[1], 2);
+    return par_reduce(array, clos, args[2], false);
+}
+
+value_t builtin_foreach(value_t* args)
+{
+    if (is_seq(args[0]))
+    {
+        seq_foreach((seq_t*)args[0].word.heapptr, arg_to_clos("foreach", args[1], 1));
+        return VAL_TRUE;
+    }
+
+    array_t* array = arg_to_array("foreach", args[0]);
+    par_foreach(array, arg_to_clos("foreach", args[1], 1), false);
+    return VAL_TRUE;
+}
+
+value_t builtin_pmap(value_t* args)
+{
+    array_t* array = arg_to_array("pmap", args[0]);
+    array_t* out = par_map(array, arg_to_clos("pmap", args[1], 1), true);
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+value_t builtin_pfilter(value_t* args)
+{
+    array_t* array = arg_to_array("pfilter", args[0]);
+    array_t* out = par_filter(array, arg_to_clos("pfilter", args[1], 1), true);
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+value_t builtin_preduce(value_t* args)
+{
+    array_t* array = arg_to_array("preduce", args[0]);
+    return par_reduce(array, arg_to_clos("preduce", args[1], 2), args[2], true);
+}
+
+value_t builtin_pforeach(value_t* args)
+{
+    array_t* array = arg_to_array("pforeach", args[0]);
+    par_foreach(array, arg_to_clos("pforeach", args[1], 1), true);
+    return VAL_TRUE;
+}
+
+/**
+Fail on arrays of numbers a vector builtin can't take, telling arrays
+mixing integers and floats apart from arrays of other values
+*/
+static void elems_type_error(const char* name, array_t* a, array_t* b, const char* expected)
+{
+    bool ints = false;
+    bool floats = false;
+
+    for (array_t* array = a; array; array = (array == a)? b:NULL)
+    {
+        for (uint32_t i = 0; i < array->len; ++i)
+        {
+            if (array->elems[i].tag == TAG_INT64)
+                ints = true;
+            else if (array->elems[i].tag == TAG_FLOAT64)
+                floats = true;
+            else
+                builtin_type_error(name, expected);
+        }
+    }
+
+    if (ints && floats)
+    {
+        printf("%s: mixed integer and float elements\n", name);
+        exit(-1);
+    }
+
+    builtin_type_error(name, expected);
+}
+
+/// Sum of an array of integers or of floats, 0 if empty
+value_t builtin_sum(value_t* args)
+{
+    array_t* array = arg_to_array("sum", args[0]);
+    const simd_kernels_t* k = simd_kernels();
+    int64_t i;
+    double f;
+
+    if (array->len == 0)
+        return value_from_int64(0);
+    if (array->elems[0].tag == TAG_INT64 && k->sum_i64(array->elems, array->len, &i))
+        return value_from_int64(i);
+    if (array->elems[0].tag == TAG_FLOAT64 && k->sum_f64(array->elems, array->len, &f))
+        return value_from_float64(f);
+
+    elems_type_error("sum", array, NULL, "array of integers or of floats");
+    return VAL_FALSE;
+}
+
+/**
+Smallest or largest element of a non-empty array of numbers
+NaNs are skipped, as by min and max
+*/
+static value_t extremum(const char* name, value_t arg, bool max)
+{
+    array_t* array = arg_to_array(name, arg);
+    const simd_kernels_t* k = simd_kernels();
+    int64_t i;
+    double f;
+
+    if (array->len > 0 && array->elems[0].tag == TAG_INT64 &&
+        (max? k->max_i64:k->min_i64)(array->elems, array->len, &i))
+        return value_from_int64(i);
+    if (array->len > 0 && array->elems[0].tag == TAG_FLOAT64 &&
+        (max? k->max_f64:k->min_f64)(array->elems, array->len, &f))
+        return value_from_float64(f);
+
+    elems_type_error(name, array, NULL, "non-empty array of integers or of floats");
+    return VAL_FALSE;
+}
+
+value_t builtin_minimum(value_t* args)
+{
+    return extremum("minimum", args[0], false);
+}
+
+value_t builtin_maximum(value_t* args)
+{
+    return extremum("maximum", args[0], true);
+}
+
+/// Get two array arguments of the same length
+static void arg_to_arrays(const char* name, value_t* args, array_t** a, array_t** b)
+{
+    *a = arg_to_array(name, args[0]);
+    *b = arg_to_array(name, args[1]);
+
+    if ((*a)->len != (*b)->len)
+        builtin_type_error(name, "arrays of the same length");
+}
+
+/// Dot product of two arrays of integers or of floats
+value_t builtin_dot(value_t* args)
+{
+    array_t* a;
+    array_t* b;
+    arg_to_arrays("dot", args, &a, &b);
+    const simd_kernels_t* k = simd_kernels();
+    int64_t i;
+    double f;
+
+    if (a->len == 0)
+        return value_from_int64(0);
+    if (a->elems[0].tag == TAG_INT64 && k->dot_i64(a->elems, b->elems, a->len, &i))
+        return value_from_int64(i);
+    if (a->elems[0].tag == TAG_FLOAT64 && k->dot_f64(a->elems, b->elems, a->len, &f))
+        return value_from_float64(f);
+
+    elems_type_error("dot", a, b, "arrays of integers or of floats");
+    return VAL_FALSE;
+}
+
+/// Add or multiply two arrays of integers or of floats elementwise
+static value_t elementwise(const char* name, value_t* args, bool mul)
+{
+    array_t* a;
+    array_t* b;
+    arg_to_arrays(name, args, &a, &b);
+    const simd_kernels_t* k = simd_kernels();
+
+    array_t* out = array_alloc(a->len);
+    out->len = a->len;
+
+    if (a->len == 0)
+        return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+    if (a->elems[0].tag == TAG_INT64 &&
+        (mul? k->mul_i64:k->add_i64)(a->elems, b->elems, out->elems, a->len))
+        return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+    if (a->elems[0].tag == TAG_FLOAT64 &&
+        (mul? k->mul_f64:k->add_f64)(a->elems, b->elems, out->elems, a->len))
+        return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+
+    elems_type_error(name, a, b, "arrays of integers or of floats");
+    return VAL_FALSE;
+}
+
+value_t builtin_vadd(value_t* args)
+{
+    return elementwise("vadd", args, false);
+}
+
+value_t builtin_vmul(value_t* args)
+{
+    return elementwise("vmul", args, true);
+}
+
+/// Make an array of a given length holding a value
+value_t builtin_fill(value_t* args)
+{
+    uint32_t len = arg_to_length("fill", args[0]);
+
+    array_t* out = array_alloc(len);
+    out->len = len;
+    simd_kernels()->fill(out->elems, len, args[1]);
+
+    return value_from_heapptr((heapptr_t)out, TAG_ARRAY);
+}
+
+/// Builtin function table
+const builtin_t BUILTINS[] = {
+    { .name = "print", .arity = 1, .fn = builtin_print },
+    { .name = "println", .arity = 1, .fn = builtin_println },
+    { .name = "len", .arity = 1, .fn = builtin_len, .pure = true },
+    { .name = "abs", .arity = 1, .fn = builtin_abs, .pure = true },
+    { .name = "min", .arity = 2, .fn = builtin_min, .pure = true },
+    { .name = "max", .arity = 2, .fn = builtin_max, .pure = true },
+    { .name = "sqrt", .arity = 1, .fn = builtin_sqrt, .pure = true },
+    { .name = "floor", .arity = 1, .fn = builtin_floor, .pure = true },
+    { .name = "to_float", .arity = 1, .fn = builtin_to_float, .pure = true },
+    { .name = "to_int", .arity = 1, .fn = builtin_to_int, .pure = true },
+    { .name = "coroutine", .arity = 1, .fn = builtin_coroutine, .reenters = true },
+    { .name = "resume", .arity = 2, .fn = builtin_resume, .reenters = true },
+    { .name = "yield", .arity = 1, .fn = builtin_yield, .reenters = true },
+    { .name = "finished", .arity = 1, .fn = builtin_finished },
+    { .name = "spawn", .arity = 2, .fn = builtin_spawn, .reenters = true },
+    { .name = "join", .arity = 1, .fn = builtin_join, .reenters = true },
+    { .name = "pipe", .arity = 0, .fn = builtin_pipe },
+    { .name = "socketpair", .arity = 0, .fn = builtin_socketpair },
+    { .name = "open", .arity = 2, .fn = builtin_open },
+    { .name = "read", .arity = 2, .fn = builtin_read, .reenters = true },
+    { .name = "write", .arity = 2, .fn = builtin_write, .reenters = true },
+    { .name = "close", .arity = 1, .fn = builtin_close },
+    { .name = "array", .arity = 2, .fn = builtin_array, .reenters = true },
+    { .name = "map", .arity = 2, .fn = builtin_map, .reenters = true },
+    { .name = "filter", .arity = 2, .fn = builtin_filter, .reenters = true },
+    { .name = "reduce", .arity = 3, .fn = builtin_reduce, .reenters = true },
+    { .name = "foreach", .arity = 2, .fn = builtin_foreach, .reenters = true },
+    { .name = "pmap", .arity = 2, .fn = builtin_pmap, .reenters = true },
+    { .name = "pfilter", .arity = 2, .fn = builtin_pfilter, .reenters = true },
+    { .name = "preduce", .arity = 3, .fn = builtin_preduce, .reenters = true },
+    { .name = "pforeach", .arity = 2, .fn = builtin_pforeach, .reenters = true },
+    { .name = "range", .arity = 2, .fn = builtin_range, .pure = true },
+    { .name = "seq", .arity = 1, .fn = builtin_seq, .pure = true },
+    { .name = "collect", .arity = 1, .fn = builtin_collect, .reenters = true },
+    { .name = "sum", .arity = 1, .fn = builtin_sum, .pure = true },
+    { .name = "minimum", .arity = 1, .fn = builtin_minimum, .pure = true },
+    { .name = "maximum", .arity = 1, .fn = builtin_maximum, .pure = true },
+    { .name = "dot", .arity = 2, .fn = builtin_dot, .pure = true },
+    { .name = "vadd", .arity = 2, .fn = builtin_vadd, .pure = true },
+    { .name = "vmul", .arity = 2, .fn = builtin_vmul, .pure = true },
+    { .name = "fill", .arity = 2, .fn = builtin_fill, .pure = true }
+};
+
+const uint32_t NUM_BUILTINS = sizeof(BUILTINS) / sizeof(BUILTINS[0]);
+
+/**
+Find the builtin bound to a name
+Returns the builtin table index, or -1 if there is none
+*/
+int32_t builtin_lookup(string_t* name)
+{
+    for (uint32_t i = 0; i < NUM_BUILTINS; ++i)
+    {
+        const char* builtin_name = BUILTINS[i].name;
+
+        if (strlen(builtin_name) == name->len &&
+            strncmp(builtin_name, name->data, name->len) == 0)
+            return i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,51 @@
+/**
+Native builtin functions
+
+Builtins are native C functions callable from Zeta code. References to
+builtin names are bound to their table entry during variable resolution,
+so that calls dispatch through a function pointer without any name
+lookup. To add a builtin, write its C function and add an entry for it
+in the BUILTINS table.
+*/
+
+#ifndef __BUILTINS_H__
+#define __BUILTINS_H__
+
+#include "vm.h"
+
+/// Native function, receives its arguments in consecutive slots
+typedef value_t (*native_fn_t)(value_t* args);
+
+/**
+Builtin function descriptor
+*/
+typedef struct
+{
+    /// Name the builtin is bound to
+    const char* name;
+
+    /// Number of arguments expected
+    uint32_t arity;
+
+    /// Native implementation
+    native_fn_t fn;
+
+    /// Other Zeta code may run before the builtin returns, such as a
+    /// closure it calls or the resumer of a coroutine. That code can
+    /// read and write any variable, and closures the builtin calls or
+    /// keeps must be run by the interpreters.
+    bool reenters;
+
+    /// The builtin has no effects besides producing a value, allocating
+    /// and failing, so calls to it can run in parallel (see par.h)
+    bool pure;
+
+} builtin_t;
+
+/// Builtin function table
+extern const builtin_t BUILTINS[];
+extern const uint32_t NUM_BUILTINS;
+
+int32_t builtin_lookup(string_t* name);
+
+#endif
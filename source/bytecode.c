@@ -0,0 +1,1545 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "bytecode.h"
+#include "profile.h"
+#include "jit.h"
+#include "ir.h"
+#include "coro.h"
+#include "task.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Opcode names, for bytecode dumps
+const char* BC_OP_NAMES[BC_NUM_OPS] = {
+    [BC_MOV] = "mov",
+    [BC_CONST] = "const",
+    [BC_ARRAY] = "array",
+    [BC_INDEX] = "index",
+    [BC_ADD] = "add",
+    [BC_SUB] = "sub",
+    [BC_MUL] = "mul",
+    [BC_DIV] = "div",
+    [BC_MOD] = "mod",
+    [BC_LT] = "lt",
+    [BC_LE] = "le",
+    [BC_GT] = "gt",
+    [BC_GE] = "ge",
+    [BC_EQ] = "eq",
+    [BC_NE] = "ne",
+    [BC_ADD_I64] = "add_i64",
+    [BC_SUB_I64] = "sub_i64",
+    [BC_MUL_I64] = "mul_i64",
+    [BC_DIV_I64] = "div_i64",
+    [BC_MOD_I64] = "mod_i64",
+    [BC_LT_I64] = "lt_i64",
+    [BC_LE_I64] = "le_i64",
+    [BC_GT_I64] = "gt_i64",
+    [BC_GE_I64] = "ge_i64",
+    [BC_EQ_I64] = "eq_i64",
+    [BC_NE_I64] = "ne_i64",
+    [BC_ADD_F64] = "add_f64",
+    [BC_SUB_F64] = "sub_f64",
+    [BC_MUL_F64] = "mul_f64",
+    [BC_DIV_F64] = "div_f64",
+    [BC_LT_F64] = "lt_f64",
+    [BC_LE_F64] = "le_f64",
+    [BC_GT_F64] = "gt_f64",
+    [BC_GE_F64] = "ge_f64",
+    [BC_EQ_F64] = "eq_f64",
+    [BC_NE_F64] = "ne_f64",
+    [BC_EQ_STR] = "eq_str",
+    [BC_NE_STR] = "ne_str",
+    [BC_NEG] = "neg",
+    [BC_NOT] = "not",
+    [BC_JUMP] = "jump",
+    [BC_LOOP] = "loop",
+    [BC_JTRUE] = "jtrue",
+    [BC_JFALSE] = "jfalse",
+    [BC_JLT] = "jlt",
+    [BC_JLE] = "jle",
+    [BC_JGT] = "jgt",
+    [BC_JGE] = "jge",
+    [BC_JEQ] = "jeq",
+    [BC_JNE] = "jne",
+    [BC_JNLT] = "jnlt",
+    [BC_JNLE] = "jnle",
+    [BC_JNGT] = "jngt",
+    [BC_JNGE] = "jnge",
+    [BC_GET_GLOBAL] = "get_global",
+    [BC_SET_GLOBAL] = "set_global",
+    [BC_CELL] = "cell",
+    [BC_GET_CELL] = "get_cell",
+    [BC_SET_CELL] = "set_cell",
+    [BC_GET_ENV] = "get_env",
+    [BC_SELF] = "self",
+    [BC_CLOS] = "clos",
+    [BC_CALL] = "call",
+    [BC_TCALL] = "tcall",
+    [BC_NATIVE] = "native",
+    [BC_RET] = "ret"
+};
+
+/// Operators implemented by the generic binary operator instructions
+const opinfo_t* BC_BINOP_INFO[BC_NUM_OPS] = {
+    [BC_ADD] = &OP_ADD,
+    [BC_SUB] = &OP_SUB,
+    [BC_MUL] = &OP_MUL,
+    [BC_DIV] = &OP_DIV,
+    [BC_MOD] = &OP_MOD,
+    [BC_LT] = &OP_LT,
+    [BC_LE] = &OP_LE,
+    [BC_GT] = &OP_GT,
+    [BC_GE] = &OP_GE,
+    [BC_EQ] = &OP_EQ,
+    [BC_NE] = &OP_NE
+};
+
+/// Integer, floating-point and string specializations of each
+/// generic instruction, 0 if there is none
+const uint16_t BC_QUICK_I64[BC_NUM_OPS] = {
+    [BC_ADD] = BC_ADD_I64,
+    [BC_SUB] = BC_SUB_I64,
+    [BC_MUL] = BC_MUL_I64,
+    [BC_DIV] = BC_DIV_I64,
+    [BC_MOD] = BC_MOD_I64,
+    [BC_LT] = BC_LT_I64,
+    [BC_LE] = BC_LE_I64,
+    [BC_GT] = BC_GT_I64,
+    [BC_GE] = BC_GE_I64,
+    [BC_EQ] = BC_EQ_I64,
+    [BC_NE] = BC_NE_I64
+};
+
+const uint16_t BC_QUICK_F64[BC_NUM_OPS] = {
+    [BC_ADD] = BC_ADD_F64,
+    [BC_SUB] = BC_SUB_F64,
+    [BC_MUL] = BC_MUL_F64,
+    [BC_DIV] = BC_DIV_F64,
+    [BC_LT] = BC_LT_F64,
+    [BC_LE] = BC_LE_F64,
+    [BC_GT] = BC_GT_F64,
+    [BC_GE] = BC_GE_F64,
+    [BC_EQ] = BC_EQ_F64,
+    [BC_NE] = BC_NE_F64
+};
+
+const uint16_t BC_QUICK_STR[BC_NUM_OPS] = {
+    [BC_EQ] = BC_EQ_STR,
+    [BC_NE] = BC_NE_STR
+};
+
+/// Generic instruction for each specialized instruction
+const uint16_t BC_GENERIC_OP[BC_NUM_OPS] = {
+    [BC_ADD_I64] = BC_ADD,
+    [BC_SUB_I64] = BC_SUB,
+    [BC_MUL_I64] = BC_MUL,
+    [BC_DIV_I64] = BC_DIV,
+    [BC_MOD_I64] = BC_MOD,
+    [BC_LT_I64] = BC_LT,
+    [BC_LE_I64] = BC_LE,
+    [BC_GT_I64] = BC_GT,
+    [BC_GE_I64] = BC_GE,
+    [BC_EQ_I64] = BC_EQ,
+    [BC_NE_I64] = BC_NE,
+    [BC_ADD_F64] = BC_ADD,
+    [BC_SUB_F64] = BC_SUB,
+    [BC_MUL_F64] = BC_MUL,
+    [BC_DIV_F64] = BC_DIV,
+    [BC_LT_F64] = BC_LT,
+    [BC_LE_F64] = BC_LE,
+    [BC_GT_F64] = BC_GT,
+    [BC_GE_F64] = BC_GE,
+    [BC_EQ_F64] = BC_EQ,
+    [BC_NE_F64] = BC_NE,
+    [BC_EQ_STR] = BC_EQ,
+    [BC_NE_STR] = BC_NE
+};
+
+/**
+Compilation context for one function
+*/
+typedef struct
+{
+    bc_fun_t* fun;
+
+    /// Number of temporary registers currently in use
+    uint32_t num_temps;
+
+} comp_ctx_t;
+
+void compile_expr(comp_ctx_t* ctx, heapptr_t expr, reg_t dst);
+
+/// Report a compilation error and abort
+void compile_error(const char* msg)
+{
+    printf("bytecode compilation error: %s\n", msg);
+    exit(-1);
+}
+
+/// Append an instruction, returns its index
+uint32_t emit(comp_ctx_t* ctx, opcode_t op, reg_t a, reg_t b, reg_t c)
+{
+    bc_fun_t* fun = ctx->fun;
+
+    if (fun->code_len == fun->code_cap)
+    {
+        fun->code_cap = fun->code_cap? (2 * fun->code_cap):32;
+        fun->code = realloc(fun->code, sizeof(instr_t) * fun->code_cap);
+    }
+
+    instr_t* instr = &fun->code[fun->code_len];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = c;
+
+    return fun->code_len++;
+}
+
+/// Add a value to the constant pool, returns its index
+reg_t add_const(comp_ctx_t* ctx, value_t val)
+{
+    bc_fun_t* fun = ctx->fun;
+
+    if (fun->num_consts == fun->consts_cap)
+    {
+        fun->consts_cap = fun->consts_cap? (2 * fun->consts_cap):8;
+        fun->consts = realloc(fun->consts, sizeof(value_t) * fun->consts_cap);
+    }
+
+    if (fun->num_consts >= BC_MAX_REGS)
+        compile_error("too many constants");
+
+    fun->consts[fun->num_consts] = val;
+    return fun->num_consts++;
+}
+
+/// Allocate a temporary register
+reg_t alloc_temp(comp_ctx_t* ctx)
+{
+    uint32_t reg = ctx->fun->num_locals + ctx->num_temps;
+
+    if (reg >= BC_MAX_REGS)
+        compile_error("too many registers");
+
+    ctx->num_temps++;
+
+    if (reg + 1 > ctx->fun->num_regs)
+        ctx->fun->num_regs = reg + 1;
+
+    return reg;
+}
+
+/// End of a list of jumps to patch
+#define NO_JUMP 0xFFFF
+
+/// Get the jump target operand of a branch instruction
+reg_t* jump_target(instr_t* instr)
+{
+    if (instr->op >= BC_JLT && instr->op <= BC_JNGE)
+        return &instr->c;
+
+    return &instr->b;
+}
+
+/// Set the jump target of a previously emitted branch to the next instruction
+void patch_jump(comp_ctx_t* ctx, uint32_t jump_idx)
+{
+    if (ctx->fun->code_len > BC_MAX_REGS)
+        compile_error("function too long");
+
+    ctx->fun->code[jump_idx].b = ctx->fun->code_len;
+}
+
+/**
+Set the targets of a list of jumps to the next instruction
+The list is chained through the jump target operands
+*/
+void patch_list(comp_ctx_t* ctx, uint32_t jumps)
+{
+    if (ctx->fun->code_len >= NO_JUMP)
+        compile_error("function too long");
+
+    while (jumps != NO_JUMP)
+    {
+        reg_t* target = jump_target(&ctx->fun->code[jumps]);
+        jumps = *target;
+        *target = ctx->fun->code_len;
+    }
+}
+
+/// Concatenate two lists of jumps to patch
+uint32_t concat_jumps(comp_ctx_t* ctx, uint32_t list0, uint32_t list1)
+{
+    if (list0 == NO_JUMP)
+        return list1;
+
+    reg_t* target = jump_target(&ctx->fun->code[list0]);
+    while (*target != NO_JUMP)
+        target = jump_target(&ctx->fun->code[*target]);
+
+    *target = list1;
+    return list0;
+}
+
+/**
+Get a register holding the value of an expression
+Local variables are read in place, other expressions are
+evaluated into a fresh temporary
+*/
+reg_t compile_operand(comp_ctx_t* ctx, heapptr_t expr)
+{
+    if (get_shape(expr) == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+
+        if (!ref->global && !ref->builtin && !ref->capt && !decl_boxed(ref->decl))
+            return ref->idx;
+    }
+
+    reg_t reg = alloc_temp(ctx);
+    compile_expr(ctx, expr, reg);
+    return reg;
+}
+
+/// Map a binary operator to its opcode, BC_NUM_OPS if unsupported
+opcode_t binop_opcode(const opinfo_t* op)
+{
+    if (op == &OP_INDEX) return BC_INDEX;
+    if (op == &OP_ADD) return BC_ADD;
+    if (op == &OP_SUB) return BC_SUB;
+    if (op == &OP_MUL) return BC_MUL;
+    if (op == &OP_DIV) return BC_DIV;
+    if (op == &OP_MOD) return BC_MOD;
+    if (op == &OP_LT) return BC_LT;
+    if (op == &OP_LE) return BC_LE;
+    if (op == &OP_GT) return BC_GT;
+    if (op == &OP_GE) return BC_GE;
+    if (op == &OP_EQ) return BC_EQ;
+    if (op == &OP_NE) return BC_NE;
+    return BC_NUM_OPS;
+}
+
+/// Get the operand index of a global slot
+reg_t global_operand(uint32_t idx)
+{
+    if (idx >= BC_MAX_REGS)
+        compile_error("too many global variables");
+
+    return idx;
+}
+
+/// Get the fused compare-and-branch opcode for a comparison
+opcode_t cmp_jump_opcode(const opinfo_t* op, bool jump_if)
+{
+    if (op == &OP_LT) return jump_if? BC_JLT:BC_JNLT;
+    if (op == &OP_LE) return jump_if? BC_JLE:BC_JNLE;
+    if (op == &OP_GT) return jump_if? BC_JGT:BC_JNGT;
+    if (op == &OP_GE) return jump_if? BC_JGE:BC_JNGE;
+    if (op == &OP_EQ) return jump_if? BC_JEQ:BC_JNE;
+    if (op == &OP_NE) return jump_if? BC_JNE:BC_JEQ;
+    return BC_NUM_OPS;
+}
+
+/**
+Compile a conditional branch on the truth value of an expression
+The code jumps if the value is jump_if, and falls through otherwise.
+Comparisons branch directly, and logical operators short-circuit.
+Returns the list of jumps to patch with the branch target.
+*/
+uint32_t compile_branch(comp_ctx_t* ctx, heapptr_t expr, bool jump_if)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    uint32_t num_temps = ctx->num_temps;
+    uint32_t jumps = NO_JUMP;
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        const opinfo_t* op = binop->op;
+
+        if (op == &OP_AND || op == &OP_OR)
+        {
+            bool is_and = (op == &OP_AND);
+
+            // "a and b" is false if either operand is false,
+            // "a or b" is true if either operand is true
+            if (jump_if != is_and)
+            {
+                uint32_t jumps0 = compile_branch(ctx, binop->left_expr, jump_if);
+                uint32_t jumps1 = compile_branch(ctx, binop->right_expr, jump_if);
+                return concat_jumps(ctx, jumps0, jumps1);
+            }
+
+            // Otherwise, the value is that of the right operand,
+            // unless the left operand short-circuits
+            uint32_t skip = compile_branch(ctx, binop->left_expr, !jump_if);
+            jumps = compile_branch(ctx, binop->right_expr, jump_if);
+            patch_list(ctx, skip);
+            return jumps;
+        }
+
+        opcode_t cmp_op = cmp_jump_opcode(op, jump_if);
+
+        if (cmp_op != BC_NUM_OPS)
+        {
+            reg_t r0 = compile_operand(ctx, binop->left_expr);
+            reg_t r1 = compile_operand(ctx, binop->right_expr);
+            jumps = emit(ctx, cmp_op, r0, r1, NO_JUMP);
+            ctx->num_temps = num_temps;
+            return jumps;
+        }
+    }
+
+    if (shape == SHAPE_AST_UNOP && ((ast_unop_t*)expr)->op == &OP_NOT)
+        return compile_branch(ctx, ((ast_unop_t*)expr)->expr, !jump_if);
+
+    reg_t t = compile_operand(ctx, expr);
+    jumps = emit(ctx, jump_if? BC_JTRUE:BC_JFALSE, t, NO_JUMP, 0);
+    ctx->num_temps = num_temps;
+    return jumps;
+}
+
+/**
+Test if an expression writes its destination register only after
+having read all of its inputs. Such expressions can be compiled
+directly into the register of a variable they read.
+*/
+bool writes_last(heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+        return ((ast_binop_t*)expr)->op != &OP_ASSIGN;
+
+    return (
+        shape == SHAPE_AST_REF ||
+        shape == SHAPE_AST_CONST ||
+        shape == SHAPE_STRING ||
+        shape == SHAPE_ARRAY ||
+        shape == SHAPE_AST_UNOP ||
+        shape == SHAPE_AST_FUN
+    );
+}
+
+/**
+Compile a write to a local variable of the current function
+*/
+void compile_store_local(
+    comp_ctx_t* ctx,
+    ast_decl_t* decl,
+    heapptr_t rhs_expr,
+    reg_t dst
+)
+{
+    // The destination is never a boxed variable register, it
+    // can hold the value while it is written into the cell
+    if (decl_boxed(decl))
+    {
+        compile_expr(ctx, rhs_expr, dst);
+        emit(ctx, BC_SET_CELL, decl->idx, dst, 0);
+        return;
+    }
+
+    if (writes_last(rhs_expr))
+    {
+        compile_expr(ctx, rhs_expr, decl->idx);
+
+        if (dst != decl->idx)
+            emit(ctx, BC_MOV, dst, decl->idx, 0);
+
+        return;
+    }
+
+    compile_expr(ctx, rhs_expr, dst);
+    emit(ctx, BC_MOV, decl->idx, dst, 0);
+}
+
+/**
+Compile an assignment expression, writing its value into dst
+*/
+void compile_assign(
+    comp_ctx_t* ctx,
+    heapptr_t lhs_expr,
+    heapptr_t rhs_expr,
+    reg_t dst
+)
+{
+    // Assignment to variable declaration
+    if (get_shape(lhs_expr) == SHAPE_AST_DECL)
+    {
+        ast_decl_t* decl = (ast_decl_t*)lhs_expr;
+
+        if (decl->global)
+        {
+            compile_expr(ctx, rhs_expr, dst);
+            emit(ctx, BC_SET_GLOBAL, global_operand(decl->idx), dst, 0);
+            return;
+        }
+
+        // Flags are set on the first declaration of a variable
+        ast_decl_t* local = (ast_decl_t*)array_get_ptr(
+            ctx->fun->ast->local_decls,
+            decl->idx
+        );
+
+        compile_store_local(ctx, local, rhs_expr, dst);
+        return;
+    }
+
+    // Assignment to a variable
+    if (get_shape(lhs_expr) == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)lhs_expr;
+
+        if (ref->global)
+        {
+            compile_expr(ctx, rhs_expr, dst);
+            emit(ctx, BC_SET_GLOBAL, global_operand(ref->idx), dst, 0);
+            return;
+        }
+
+        // Captured variables that are assigned are always boxed
+        if (ref->capt)
+        {
+            compile_expr(ctx, rhs_expr, dst);
+            reg_t cell = alloc_temp(ctx);
+            emit(ctx, BC_GET_ENV, cell, ref->idx, 0);
+            emit(ctx, BC_SET_CELL, cell, dst, 0);
+            return;
+        }
+
+        compile_store_local(ctx, ref->decl, rhs_expr, dst);
+        return;
+    }
+
+    compile_error("unsupported assignment");
+}
+
+/**
+Compile an expression, writing its value into register dst
+*/
+void compile_expr(comp_ctx_t* ctx, heapptr_t expr, reg_t dst)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    // Temporaries used by subexpressions are released on exit
+    uint32_t num_temps = ctx->num_temps;
+
+    // Variable reference
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+
+        if (ref->builtin)
+            compile_error("builtin functions can only be called");
+
+        if (ref->global)
+        {
+            emit(ctx, BC_GET_GLOBAL, dst, global_operand(ref->idx), 0);
+        }
+        else if (ref->capt)
+        {
+            emit(ctx, BC_GET_ENV, dst, ref->idx, 0);
+
+            if (decl_boxed(ref->decl))
+                emit(ctx, BC_GET_CELL, dst, dst, 0);
+        }
+        else if (decl_boxed(ref->decl))
+        {
+            emit(ctx, BC_GET_CELL, dst, ref->idx, 0);
+        }
+        else if (dst != ref->idx)
+        {
+            emit(ctx, BC_MOV, dst, ref->idx, 0);
+        }
+    }
+
+    else if (shape == SHAPE_AST_CONST)
+    {
+        ast_const_t* cst = (ast_const_t*)expr;
+        emit(ctx, BC_CONST, dst, add_const(ctx, cst->val), 0);
+    }
+
+    else if (shape == SHAPE_STRING)
+    {
+        value_t str = value_from_heapptr(expr, TAG_STRING);
+        emit(ctx, BC_CONST, dst, add_const(ctx, str), 0);
+    }
+
+    // Array literal expression
+    else if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        // The element values must be in consecutive registers
+        reg_t first = ctx->fun->num_locals + ctx->num_temps;
+        for (size_t i = 0; i < array_expr->len; ++i)
+            alloc_temp(ctx);
+
+        for (size_t i = 0; i < array_expr->len; ++i)
+            compile_expr(ctx, array_get_ptr(array_expr, i), first + i);
+
+        emit(ctx, BC_ARRAY, dst, first, array_expr->len);
+    }
+
+    // Binary operator (e.g. a + b)
+    else if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op == &OP_ASSIGN)
+        {
+            compile_assign(ctx, binop->left_expr, binop->right_expr, dst);
+        }
+        else if (binop->op == &OP_AND || binop->op == &OP_OR)
+        {
+            uint32_t jfalse = compile_branch(ctx, expr, false);
+            emit(ctx, BC_CONST, dst, add_const(ctx, VAL_TRUE), 0);
+            uint32_t jump = emit(ctx, BC_JUMP, 0, 0, 0);
+
+            patch_list(ctx, jfalse);
+            emit(ctx, BC_CONST, dst, add_const(ctx, VAL_FALSE), 0);
+            patch_jump(ctx, jump);
+        }
+        else
+        {
+            opcode_t op = binop_opcode(binop->op);
+
+            if (op == BC_NUM_OPS)
+            {
+                printf("unimplemented binary operator: %s\n", binop->op->str);
+                exit(-1);
+            }
+
+            reg_t r0 = compile_operand(ctx, binop->left_expr);
+            reg_t r1 = compile_operand(ctx, binop->right_expr);
+            emit(ctx, op, dst, r0, r1);
+        }
+    }
+
+    // Unary operator (e.g.: -x, not a)
+    else if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+
+        reg_t r0 = compile_operand(ctx, unop->expr);
+
+        if (unop->op == &OP_NEG)
+            emit(ctx, BC_NEG, dst, r0, 0);
+        else if (unop->op == &OP_NOT)
+            emit(ctx, BC_NOT, dst, r0, 0);
+        else
+        {
+            printf("unimplemented unary operator: %s\n", unop->op->str);
+            exit(-1);
+        }
+    }
+
+    // Sequence/block expression
+    else if (shape == SHAPE_AST_SEQ)
+    {
+        ast_seq_t* seqexpr = (ast_seq_t*)expr;
+        array_t* expr_list = seqexpr->expr_list;
+
+        if (expr_list->len == 0)
+            emit(ctx, BC_CONST, dst, add_const(ctx, VAL_FALSE), 0);
+
+        // Each expression overwrites the previous value
+        for (size_t i = 0; i < expr_list->len; ++i)
+            compile_expr(ctx, array_get_ptr(expr_list, i), dst);
+    }
+
+    // If expression
+    else if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        uint32_t jfalse = compile_branch(ctx, ifexpr->test_expr, false);
+
+        compile_expr(ctx, ifexpr->then_expr, dst);
+        uint32_t jump = emit(ctx, BC_JUMP, 0, 0, 0);
+
+        patch_list(ctx, jfalse);
+        compile_expr(ctx, ifexpr->else_expr, dst);
+        patch_jump(ctx, jump);
+    }
+
+    // Call expression
+    else if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        heapptr_t fun_expr = callexpr->fun_expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        const builtin_t* builtin = call_builtin(callexpr);
+
+        if (builtin)
+        {
+            // The arguments must be in consecutive registers
+            reg_t args = ctx->fun->num_locals + ctx->num_temps;
+            for (size_t i = 0; i < arg_exprs->len; ++i)
+                alloc_temp(ctx);
+
+            for (size_t i = 0; i < arg_exprs->len; ++i)
+                compile_expr(ctx, array_get_ptr(arg_exprs, i), args + i);
+
+            emit(ctx, BC_NATIVE, dst, args, builtin - BUILTINS);
+        }
+        else
+        {
+            // The closure, call header and arguments must be in
+            // consecutive registers, the arguments are evaluated
+            // directly into the callee's parameter registers
+            reg_t base = ctx->fun->num_locals + ctx->num_temps;
+            reg_t args = base + 1 + BC_CALL_HDR_REGS;
+            for (size_t i = 0; i < 1 + BC_CALL_HDR_REGS + arg_exprs->len; ++i)
+                alloc_temp(ctx);
+
+            compile_expr(ctx, fun_expr, base);
+
+            for (size_t i = 0; i < arg_exprs->len; ++i)
+                compile_expr(ctx, array_get_ptr(arg_exprs, i), args + i);
+
+            emit(ctx, BC_CALL, dst, base, arg_exprs->len);
+        }
+    }
+
+    // Function/closure expression
+    else if (shape == SHAPE_AST_FUN)
+    {
+        ast_fun_t* nested = (ast_fun_t*)expr;
+        ast_fun_t* ast = ctx->fun->ast;
+        array_t* capt_vars = nested->capt_vars;
+
+        // The captured values must be in consecutive registers
+        // Note: for boxed variables, the cell is copied
+        reg_t first = ctx->fun->num_locals + ctx->num_temps;
+        for (size_t i = 0; i < capt_vars->len; ++i)
+            alloc_temp(ctx);
+
+        for (size_t i = 0; i < capt_vars->len; ++i)
+        {
+            ast_decl_t* decl = (ast_decl_t*)array_get_ptr(capt_vars, i);
+
+            if (fun_owns_decl(ast, decl))
+                emit(ctx, BC_MOV, first + i, decl->idx, 0);
+            else
+                emit(ctx, BC_GET_ENV, first + i, capt_idx(ast, decl), 0);
+        }
+
+        value_t fun_val = value_from_heapptr(expr, TAG_RAW_PTR);
+        emit(ctx, BC_CLOS, dst, first, add_const(ctx, fun_val));
+    }
+
+    else
+    {
+        printf("unknown expression type, shapeidx=%d\n", shape);
+        compile_error("cannot compile expression");
+    }
+
+    ctx->num_temps = num_temps;
+}
+
+/**
+Turn calls in tail position into tail calls
+A call is in tail position if it is followed, possibly through
+jumps, by the return of its destination register
+*/
+void mark_tail_calls(bc_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->code_len; ++i)
+    {
+        instr_t* call = &fun->code[i];
+
+        if (call->op != BC_CALL)
+            continue;
+
+        instr_t* next = call + 1;
+        while (next->op == BC_JUMP)
+            next = &fun->code[next->b];
+
+        if (next->op == BC_RET && next->a == call->a)
+            call->op = BC_TCALL;
+    }
+}
+
+/**
+Compile a function to bytecode
+Note: variable resolution must have been performed first
+*/
+bc_fun_t* bc_compile(ast_fun_t* ast)
+{
+    bc_fun_t* fun = calloc(1, sizeof(bc_fun_t));
+
+    fun->ast = ast;
+    fun->num_locals = ast->local_decls->len;
+    fun->num_regs = fun->num_locals;
+
+    // Register 0 is reserved for the return value
+    // if the function has no locals
+    if (fun->num_regs == 0)
+        fun->num_regs = 1;
+
+    if (fun->num_locals >= BC_MAX_REGS)
+        compile_error("too many local variables");
+
+    comp_ctx_t ctx;
+    ctx.fun = fun;
+    ctx.num_temps = 0;
+
+    // Move the boxed variables into their cell on entry
+    for (uint32_t i = 0; i < ast->local_decls->len; ++i)
+    {
+        ast_decl_t* decl = (ast_decl_t*)array_get_ptr(ast->local_decls, i);
+
+        if (!decl_boxed(decl))
+            continue;
+
+        if (i >= ast->param_decls->len)
+            emit(&ctx, BC_CONST, i, add_const(&ctx, VAL_FALSE), 0);
+
+        emit(&ctx, BC_CELL, i, i, 0);
+    }
+
+    reg_t ret = alloc_temp(&ctx);
+    compile_expr(&ctx, ast->body_expr, ret);
+    emit(&ctx, BC_RET, ret, 0, 0);
+
+    mark_tail_calls(fun);
+
+    return fun;
+}
+
+/// Lock serializing compilations, which tasks may trigger concurrently
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+Get the compiled bytecode for a function, compiling it if needed
+*/
+bc_fun_t* bc_get_fun(ast_fun_t* fun)
+{
+    // The release store publishes the compiled function to the
+    // threads that find it with the acquire load
+    bc_fun_t* bc_fun = atomic_load_explicit(&fun->bc_fun, memory_order_acquire);
+
+    if (bc_fun == NULL)
+    {
+        pthread_mutex_lock(&compile_lock);
+
+        bc_fun = atomic_load_explicit(&fun->bc_fun, memory_order_relaxed);
+
+        if (bc_fun == NULL)
+        {
+            bc_fun = opt_ir? ir_compile(fun):bc_compile(fun);
+            atomic_store_explicit(&fun->bc_fun, bc_fun, memory_order_release);
+        }
+
+        pthread_mutex_unlock(&compile_lock);
+    }
+
+    return bc_fun;
+}
+
+/*
+Instructions are rewritten in place by quickening and deoptimization,
+which only the main thread does, while workers may be running the same
+code. Opcodes are read and written atomically by the interpreter.
+*/
+
+static inline uint16_t load_op(const instr_t* instr)
+{
+    return __atomic_load_n(&instr->op, __ATOMIC_RELAXED);
+}
+
+static inline void store_op(instr_t* instr, uint16_t op)
+{
+    __atomic_store_n(&instr->op, op, __ATOMIC_RELAXED);
+}
+
+/// Generic form of an opcode, which may or may not be specialized
+static inline uint16_t generic_op(uint16_t op)
+{
+    return BC_GENERIC_OP[op]? BC_GENERIC_OP[op]:op;
+}
+
+/**
+Specialize a generic binary operator instruction in place, based on
+the types of its operands. Later executions of the instruction take
+the specialized path as long as the operand types stay the same.
+*/
+void bc_quicken(instr_t* instr, value_t v0, value_t v1)
+{
+    uint16_t quick_op = 0;
+
+    uint16_t op = load_op(instr);
+
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+        quick_op = BC_QUICK_I64[op];
+    else if (v0.tag == TAG_FLOAT64 && v1.tag == TAG_FLOAT64)
+        quick_op = BC_QUICK_F64[op];
+    else if (v0.tag == TAG_STRING && v1.tag == TAG_STRING)
+        quick_op = BC_QUICK_STR[op];
+
+    if (quick_op != 0)
+        store_op(instr, quick_op);
+}
+
+/**
+Dispatch macros for the interpreter loop
+With GCC, the loop uses threaded dispatch: each instruction handler jumps
+directly to the handler of the next instruction through a table of label
+addresses (computed goto). This gives each handler its own indirect branch,
+which is much easier to predict than the single shared branch of a switch.
+Define BC_SWITCH_DISPATCH to use the portable switch-based loop instead.
+*/
+#if defined(__GNUC__) && !defined(BC_SWITCH_DISPATCH)
+#define BC_THREADED
+#endif
+
+/// Guard failure in a specialized instruction
+/// Revert the instruction to its generic form and execute that instead,
+/// workers execute the generic form without rewriting the instruction
+#define BC_DEOPT() \
+    { \
+        uint16_t generic = generic_op(load_op(instr)); \
+        if (!task_on_worker()) \
+            store_op(instr, generic); \
+        BC_DISPATCH_OP(generic); \
+    }
+
+/// Specialized integer and floating-point binary operator handlers
+#define BC_I64_BINOP(op, expr) \
+    BC_CASE(op) \
+    { \
+        value_t v0 = regs[instr->b]; \
+        value_t v1 = regs[instr->c]; \
+        if (v0.tag != TAG_INT64 || v1.tag != TAG_INT64) \
+            BC_DEOPT(); \
+        uint64_t i0 = v0.word.int64; \
+        uint64_t i1 = v1.word.int64; \
+        regs[instr->a] = (expr); \
+    } \
+    BC_NEXT();
+
+#define BC_F64_BINOP(op, expr) \
+    BC_CASE(op) \
+    { \
+        value_t v0 = regs[instr->b]; \
+        value_t v1 = regs[instr->c]; \
+        if (v0.tag != TAG_FLOAT64 || v1.tag != TAG_FLOAT64) \
+            BC_DEOPT(); \
+        double f0 = v0.word.float64; \
+        double f1 = v1.word.float64; \
+        regs[instr->a] = (expr); \
+    } \
+    BC_NEXT();
+
+#define BC_BOOL(cond) ((cond)? VAL_TRUE:VAL_FALSE)
+
+/// Fused compare-and-branch handlers
+#define BC_CMP_JUMP(op, binop, cond, jump_if) \
+    BC_CASE(op) \
+    { \
+        value_t v0 = regs[instr->a]; \
+        value_t v1 = regs[instr->b]; \
+        bool t; \
+        if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64) \
+        { \
+            int64_t i0 = v0.word.int64; \
+            int64_t i1 = v1.word.int64; \
+            t = (cond); \
+        } \
+        else \
+        { \
+            t = eval_truth(eval_binop_vals(&binop, v0, v1)); \
+        } \
+        if (t == jump_if) \
+            pc = code + instr->c; \
+    } \
+    BC_NEXT();
+
+#ifdef BC_THREADED
+#define BC_CASE(op) op_##op:
+#define BC_NEXT() goto *op_labels[load_op(instr = pc++)]
+#define BC_DISPATCH_OP(op) goto *handler_labels[op]
+#define BC_DISPATCH_BEGIN BC_NEXT();
+#define BC_DISPATCH_END
+#else
+#define BC_CASE(op) case op:
+#define BC_NEXT() continue
+#define BC_DISPATCH_OP(op) { opcode = (op); goto op_dispatch; }
+#define BC_DISPATCH_BEGIN for (;;) { opcode = load_op(instr = pc++); \
+    if (opt_profile) prof_record(fun, instr - code, regs); \
+    op_dispatch: switch (opcode) {
+#define BC_DISPATCH_END \
+    default: printf("invalid opcode: %d\n", opcode); exit(-1); } }
+#endif
+
+/// Number of bytecode interpreter loops running on the C stack
+_Thread_local uint32_t bc_depth = 0;
+
+/**
+Execute a bytecode function
+The register frame and its call header are pushed on the VM stack.
+*/
+value_t bc_run(bc_fun_t* fun, clos_t* clos)
+{
+    value_t* frame = vm_push_frame(BC_CALL_HDR_REGS + fun->num_regs);
+    value_t* regs = frame + BC_CALL_HDR_REGS;
+
+    value_t ret = opt_jit? jit_enter(fun, clos, regs):bc_exec(fun, clos, regs);
+
+    vm_pop_frame(frame);
+
+    return ret;
+}
+
+/**
+Call a closure from the host, with the given argument values
+*/
+value_t bc_call(clos_t* clos, value_t* args, size_t num_args)
+{
+    vm_cstack_check();
+
+    bc_fun_t* fun = bc_get_fun(clos->fun);
+
+    value_t* frame = vm_push_frame(BC_CALL_HDR_REGS + fun->num_regs);
+    value_t* regs = frame + BC_CALL_HDR_REGS;
+    memcpy(regs, args, sizeof(value_t) * num_args);
+
+    value_t ret = opt_jit? jit_enter(fun, clos, regs):bc_exec(fun, clos, regs);
+
+    vm_pop_frame(frame);
+
+    return ret;
+}
+
+/**
+Execute a bytecode function in an existing register frame
+The frame must be preceded by space for a call header. Calls between
+bytecode functions are handled in the same loop, with frames allocated
+on the VM stack, so that they don't use the C stack. Calls to functions
+compiled to machine code go through jit_enter.
+*/
+value_t bc_exec(bc_fun_t* fun, clos_t* clos, value_t* regs)
+{
+    // Return to the host when this function returns
+    bc_call_t* host_call = (bc_call_t*)(regs - BC_CALL_HDR_REGS);
+    host_call->fun = NULL;
+
+    bc_depth++;
+    value_t ret = bc_exec_at(fun, clos, regs, fun->code);
+    bc_depth--;
+    return ret;
+}
+
+/**
+Continue executing bytecode from a given instruction of a frame
+The frames below it must lead back to a call header from the host.
+This is how suspended coroutines are resumed: all their state is in
+frames on the VM stack, so the loop can pick up where it left off.
+Callers must count the loop in bc_depth.
+*/
+value_t bc_exec_at(bc_fun_t* fun, clos_t* clos, value_t* regs, instr_t* pc)
+{
+    instr_t* code = fun->code;
+    value_t* consts = fun->consts;
+    globals_t* globals = fun->ast->globals;
+    instr_t* instr;
+    value_t ret;
+
+#ifndef BC_THREADED
+    uint16_t opcode;
+#endif
+
+#ifdef BC_THREADED
+    // Handler addresses, indexed by opcode
+    static void* handler_labels[BC_NUM_OPS] = {
+        [BC_MOV] = &&op_BC_MOV,
+        [BC_CONST] = &&op_BC_CONST,
+        [BC_ARRAY] = &&op_BC_ARRAY,
+        [BC_INDEX] = &&op_BC_INDEX,
+        [BC_ADD] = &&op_BC_ADD,
+        [BC_SUB] = &&op_BC_SUB,
+        [BC_MUL] = &&op_BC_MUL,
+        [BC_DIV] = &&op_BC_DIV,
+        [BC_MOD] = &&op_BC_MOD,
+        [BC_LT] = &&op_BC_LT,
+        [BC_LE] = &&op_BC_LE,
+        [BC_GT] = &&op_BC_GT,
+        [BC_GE] = &&op_BC_GE,
+        [BC_EQ] = &&op_BC_EQ,
+        [BC_NE] = &&op_BC_NE,
+        [BC_ADD_I64] = &&op_BC_ADD_I64,
+        [BC_SUB_I64] = &&op_BC_SUB_I64,
+        [BC_MUL_I64] = &&op_BC_MUL_I64,
+        [BC_DIV_I64] = &&op_BC_DIV_I64,
+        [BC_MOD_I64] = &&op_BC_MOD_I64,
+        [BC_LT_I64] = &&op_BC_LT_I64,
+        [BC_LE_I64] = &&op_BC_LE_I64,
+        [BC_GT_I64] = &&op_BC_GT_I64,
+        [BC_GE_I64] = &&op_BC_GE_I64,
+        [BC_EQ_I64] = &&op_BC_EQ_I64,
+        [BC_NE_I64] = &&op_BC_NE_I64,
+        [BC_ADD_F64] = &&op_BC_ADD_F64,
+        [BC_SUB_F64] = &&op_BC_SUB_F64,
+        [BC_MUL_F64] = &&op_BC_MUL_F64,
+        [BC_DIV_F64] = &&op_BC_DIV_F64,
+        [BC_LT_F64] = &&op_BC_LT_F64,
+        [BC_LE_F64] = &&op_BC_LE_F64,
+        [BC_GT_F64] = &&op_BC_GT_F64,
+        [BC_GE_F64] = &&op_BC_GE_F64,
+        [BC_EQ_F64] = &&op_BC_EQ_F64,
+        [BC_NE_F64] = &&op_BC_NE_F64,
+        [BC_EQ_STR] = &&op_BC_EQ_STR,
+        [BC_NE_STR] = &&op_BC_NE_STR,
+        [BC_NEG] = &&op_BC_NEG,
+        [BC_NOT] = &&op_BC_NOT,
+        [BC_JUMP] = &&op_BC_JUMP,
+        [BC_LOOP] = &&op_BC_LOOP,
+        [BC_JTRUE] = &&op_BC_JTRUE,
+        [BC_JFALSE] = &&op_BC_JFALSE,
+        [BC_JLT] = &&op_BC_JLT,
+        [BC_JLE] = &&op_BC_JLE,
+        [BC_JGT] = &&op_BC_JGT,
+        [BC_JGE] = &&op_BC_JGE,
+        [BC_JEQ] = &&op_BC_JEQ,
+        [BC_JNE] = &&op_BC_JNE,
+        [BC_JNLT] = &&op_BC_JNLT,
+        [BC_JNLE] = &&op_BC_JNLE,
+        [BC_JNGT] = &&op_BC_JNGT,
+        [BC_JNGE] = &&op_BC_JNGE,
+        [BC_GET_GLOBAL] = &&op_BC_GET_GLOBAL,
+        [BC_SET_GLOBAL] = &&op_BC_SET_GLOBAL,
+        [BC_CELL] = &&op_BC_CELL,
+        [BC_GET_CELL] = &&op_BC_GET_CELL,
+        [BC_SET_CELL] = &&op_BC_SET_CELL,
+        [BC_GET_ENV] = &&op_BC_GET_ENV,
+        [BC_SELF] = &&op_BC_SELF,
+        [BC_CLOS] = &&op_BC_CLOS,
+        [BC_CALL] = &&op_BC_CALL,
+        [BC_TCALL] = &&op_BC_TCALL,
+        [BC_NATIVE] = &&op_BC_NATIVE,
+        [BC_RET] = &&op_BC_RET
+    };
+
+    // Dispatch table. When profiling, every instruction goes through
+    // the profiling handler first. The table is only rewritten when
+    // profiling is toggled, so that the fast path is unaffected.
+    static void* op_labels[BC_NUM_OPS];
+
+    if (op_labels[0] != (opt_profile? &&op_PROFILE:handler_labels[0]))
+    {
+        for (size_t i = 0; i < BC_NUM_OPS; ++i)
+            op_labels[i] = opt_profile? &&op_PROFILE:handler_labels[i];
+    }
+#endif
+
+    BC_DISPATCH_BEGIN
+    {
+#ifdef BC_THREADED
+        op_PROFILE:
+        prof_record(fun, instr - code, regs);
+        BC_DISPATCH_OP(load_op(instr));
+#endif
+
+        BC_CASE(BC_MOV)
+        regs[instr->a] = regs[instr->b];
+        BC_NEXT();
+
+        BC_CASE(BC_CONST)
+        regs[instr->a] = consts[instr->b];
+        BC_NEXT();
+
+        BC_CASE(BC_ARRAY)
+        {
+            array_t* array = array_alloc(instr->c);
+            for (size_t i = 0; i < instr->c; ++i)
+                array_set(array, i, regs[instr->b + i]);
+            regs[instr->a] = value_from_heapptr((heapptr_t)array, TAG_ARRAY);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_INDEX)
+        regs[instr->a] = array_get(
+            regs[instr->b].word.array,
+            regs[instr->c].word.int64
+        );
+        BC_NEXT();
+
+        BC_CASE(BC_ADD)
+        BC_CASE(BC_SUB)
+        BC_CASE(BC_MUL)
+        BC_CASE(BC_DIV)
+        BC_CASE(BC_MOD)
+        BC_CASE(BC_LT)
+        BC_CASE(BC_LE)
+        BC_CASE(BC_GT)
+        BC_CASE(BC_GE)
+        BC_CASE(BC_EQ)
+        BC_CASE(BC_NE)
+        {
+            // Workers reach here from specialized instructions they
+            // don't revert
+            const opinfo_t* op = BC_BINOP_INFO[generic_op(load_op(instr))];
+            value_t v0 = regs[instr->b];
+            value_t v1 = regs[instr->c];
+            if (!task_on_worker())
+                bc_quicken(instr, v0, v1);
+            regs[instr->a] = eval_binop_vals(op, v0, v1);
+        }
+        BC_NEXT();
+
+        // Note: integer arithmetic is done on unsigned values so that
+        // overflow wraps around. Division by zero and -1 deoptimize.
+        BC_I64_BINOP(BC_ADD_I64, value_from_int64(i0 + i1))
+        BC_I64_BINOP(BC_SUB_I64, value_from_int64(i0 - i1))
+        BC_I64_BINOP(BC_MUL_I64, value_from_int64(i0 * i1))
+        BC_I64_BINOP(BC_DIV_I64, ((int64_t)i1 == 0 || (int64_t)i1 == -1)?
+            eval_binop_vals(&OP_DIV, v0, v1):
+            value_from_int64((int64_t)i0 / (int64_t)i1))
+        BC_I64_BINOP(BC_MOD_I64, ((int64_t)i1 == 0 || (int64_t)i1 == -1)?
+            eval_binop_vals(&OP_MOD, v0, v1):
+            value_from_int64((int64_t)i0 % (int64_t)i1))
+        BC_I64_BINOP(BC_LT_I64, BC_BOOL((int64_t)i0 < (int64_t)i1))
+        BC_I64_BINOP(BC_LE_I64, BC_BOOL((int64_t)i0 <= (int64_t)i1))
+        BC_I64_BINOP(BC_GT_I64, BC_BOOL((int64_t)i0 > (int64_t)i1))
+        BC_I64_BINOP(BC_GE_I64, BC_BOOL((int64_t)i0 >= (int64_t)i1))
+        BC_I64_BINOP(BC_EQ_I64, BC_BOOL(i0 == i1))
+        BC_I64_BINOP(BC_NE_I64, BC_BOOL(i0 != i1))
+
+        BC_F64_BINOP(BC_ADD_F64, value_from_float64(f0 + f1))
+        BC_F64_BINOP(BC_SUB_F64, value_from_float64(f0 - f1))
+        BC_F64_BINOP(BC_MUL_F64, value_from_float64(f0 * f1))
+        BC_F64_BINOP(BC_DIV_F64, value_from_float64(f0 / f1))
+        BC_F64_BINOP(BC_LT_F64, BC_BOOL(f0 < f1))
+        BC_F64_BINOP(BC_LE_F64, BC_BOOL(f0 <= f1))
+        BC_F64_BINOP(BC_GT_F64, BC_BOOL(f0 > f1))
+        BC_F64_BINOP(BC_GE_F64, BC_BOOL(f0 >= f1))
+        BC_F64_BINOP(BC_EQ_F64, BC_BOOL(f0 == f1))
+        BC_F64_BINOP(BC_NE_F64, BC_BOOL(f0 != f1))
+
+        // Strings are interned, equal strings have the same address
+        BC_CASE(BC_EQ_STR)
+        BC_CASE(BC_NE_STR)
+        {
+            value_t v0 = regs[instr->b];
+            value_t v1 = regs[instr->c];
+            if (v0.tag != TAG_STRING || v1.tag != TAG_STRING)
+                BC_DEOPT();
+            bool eq = v0.word.string == v1.word.string;
+            regs[instr->a] = BC_BOOL((generic_op(load_op(instr)) == BC_EQ)? eq:!eq);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_NEG)
+        regs[instr->a] = eval_neg(regs[instr->b]);
+        BC_NEXT();
+
+        BC_CASE(BC_NOT)
+        regs[instr->a] = eval_truth(regs[instr->b])? VAL_FALSE:VAL_TRUE;
+        BC_NEXT();
+
+        BC_CASE(BC_JUMP)
+        pc = code + instr->b;
+        BC_NEXT();
+
+        // Hot loops continue in machine code, in the same frame
+        BC_CASE(BC_LOOP)
+        if (opt_jit && jit_tier_up(fun, true))
+        {
+            ret = jit_enter_loop(fun, clos, regs);
+            goto bc_return;
+        }
+        pc = code + instr->b;
+        BC_NEXT();
+
+        BC_CASE(BC_JTRUE)
+        if (eval_truth(regs[instr->a]))
+            pc = code + instr->b;
+        BC_NEXT();
+
+        BC_CASE(BC_JFALSE)
+        if (!eval_truth(regs[instr->a]))
+            pc = code + instr->b;
+        BC_NEXT();
+
+        BC_CMP_JUMP(BC_JLT, OP_LT, i0 < i1, true)
+        BC_CMP_JUMP(BC_JLE, OP_LE, i0 <= i1, true)
+        BC_CMP_JUMP(BC_JGT, OP_GT, i0 > i1, true)
+        BC_CMP_JUMP(BC_JGE, OP_GE, i0 >= i1, true)
+        BC_CMP_JUMP(BC_JEQ, OP_EQ, i0 == i1, true)
+        BC_CMP_JUMP(BC_JNE, OP_EQ, i0 == i1, false)
+        BC_CMP_JUMP(BC_JNLT, OP_LT, i0 < i1, false)
+        BC_CMP_JUMP(BC_JNLE, OP_LE, i0 <= i1, false)
+        BC_CMP_JUMP(BC_JNGT, OP_GT, i0 > i1, false)
+        BC_CMP_JUMP(BC_JNGE, OP_GE, i0 >= i1, false)
+
+        BC_CASE(BC_GET_GLOBAL)
+        {
+            value_t val = globals->vals[instr->b];
+
+            if (val.tag == TAG_RAW_PTR)
+                global_undef_error(globals, instr->b);
+
+            regs[instr->a] = val;
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_SET_GLOBAL)
+        globals->vals[instr->a] = regs[instr->b];
+        BC_NEXT();
+
+        BC_CASE(BC_CELL)
+        {
+            cell_t* cell = cell_alloc(regs[instr->b]);
+            regs[instr->a] = value_from_heapptr((heapptr_t)cell, TAG_RAW_PTR);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_GET_CELL)
+        regs[instr->a] = ((cell_t*)regs[instr->b].word.heapptr)->val;
+        BC_NEXT();
+
+        BC_CASE(BC_SET_CELL)
+        ((cell_t*)regs[instr->a].word.heapptr)->val = regs[instr->b];
+        BC_NEXT();
+
+        BC_CASE(BC_GET_ENV)
+        regs[instr->a] = clos->env[instr->b];
+        BC_NEXT();
+
+        BC_CASE(BC_SELF)
+        regs[instr->a] = value_from_heapptr((heapptr_t)clos, TAG_CLOS);
+        BC_NEXT();
+
+        BC_CASE(BC_CLOS)
+        {
+            ast_fun_t* nested = (ast_fun_t*)consts[instr->c].word.heapptr;
+            clos_t* new_clos = clos_alloc(nested);
+            for (size_t i = 0; i < nested->capt_vars->len; ++i)
+                new_clos->env[i] = regs[instr->b + i];
+            regs[instr->a] = value_from_heapptr((heapptr_t)new_clos, TAG_CLOS);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_CALL)
+        {
+            clos_t* callee = get_callee(regs[instr->b], instr->c);
+
+            // Save the caller state in the call header
+            value_t* callee_regs = regs + instr->b + 1 + BC_CALL_HDR_REGS;
+            bc_call_t* call = (bc_call_t*)(callee_regs - BC_CALL_HDR_REGS);
+            call->fun = fun;
+            call->clos = clos;
+            call->regs = regs;
+            call->ret_pc = pc;
+
+            bc_fun_t* callee_fun = bc_get_fun(callee->fun);
+
+            // Compiled callees run in native code, in the same frame
+            if (opt_jit && jit_tier_up(callee_fun, false))
+            {
+                vm_pop_frame(callee_regs);
+                vm_push_frame(callee_fun->num_regs);
+                ret = jit_enter(callee_fun, callee, callee_regs);
+                vm_pop_frame(regs);
+                vm_push_frame(fun->num_regs);
+                regs[instr->a] = ret;
+                BC_NEXT();
+            }
+
+            fun = callee_fun;
+            code = fun->code;
+            consts = fun->consts;
+            globals = fun->ast->globals;
+            clos = callee;
+            regs = callee_regs;
+            pc = code;
+
+            // The callee frame overlaps the top of the caller frame
+            vm_pop_frame(regs);
+            vm_push_frame(fun->num_regs);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_TCALL)
+        {
+            clos_t* callee = get_callee(regs[instr->b], instr->c);
+
+            // Move the arguments into the parameter registers
+            value_t* args = regs + instr->b + 1 + BC_CALL_HDR_REGS;
+            memmove(regs, args, sizeof(value_t) * instr->c);
+
+            // The call header of the current function is kept, so
+            // the callee returns directly to the current caller
+            bc_fun_t* callee_fun = bc_get_fun(callee->fun);
+
+            // Self tail calls are loop back-edges
+            if (opt_jit && jit_tier_up(callee_fun, callee_fun == fun))
+            {
+                vm_pop_frame(regs);
+                vm_push_frame(callee_fun->num_regs);
+                ret = jit_enter(callee_fun, callee, regs);
+                goto bc_return;
+            }
+
+            fun = callee_fun;
+            code = fun->code;
+            consts = fun->consts;
+            globals = fun->ast->globals;
+            clos = callee;
+            pc = code;
+
+            vm_pop_frame(regs);
+            vm_push_frame(fun->num_regs);
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_NATIVE)
+        regs[instr->a] = BUILTINS[instr->c].fn(regs + instr->b);
+
+        // After a yield, the coroutine is suspended in this frame and
+        // the yielded value returned to the resumer
+        if (coro_yielding)
+        {
+            coro_suspend(fun, clos, regs, pc);
+            return regs[instr->a];
+        }
+        BC_NEXT();
+
+        BC_CASE(BC_RET)
+        ret = regs[instr->a];
+        bc_return:
+        {
+            bc_call_t* call = (bc_call_t*)(regs - BC_CALL_HDR_REGS);
+
+            if (call->fun == NULL)
+                return ret;
+
+            fun = call->fun;
+            code = fun->code;
+            consts = fun->consts;
+            globals = fun->ast->globals;
+            clos = call->clos;
+            regs = call->regs;
+            pc = call->ret_pc;
+
+            vm_pop_frame(regs);
+            vm_push_frame(fun->num_regs);
+
+            // Write the value into the destination of the call
+            regs[pc[-1].a] = ret;
+        }
+        BC_NEXT();
+    }
+    BC_DISPATCH_END
+}
+
+/**
+Compile and evaluate a source unit function
+Note: variable resolution must have been performed first
+*/
+value_t bc_eval_unit(ast_fun_t* unit_fun)
+{
+    bc_fun_t* fun = bc_get_fun(unit_fun);
+
+    return bc_run(fun, NULL);
+}
+
+/**
+Print a textual listing of a bytecode function
+*/
+void bc_dump(bc_fun_t* fun)
+{
+    printf(
+        "fun: %d locals, %d registers, %d instrs\n",
+        fun->num_locals,
+        fun->num_regs,
+        fun->code_len
+    );
+
+    for (uint32_t i = 0; i < fun->code_len; ++i)
+    {
+        instr_t* instr = &fun->code[i];
+
+        printf(
+            "%4d: %-8s %d, %d, %d",
+            i,
+            BC_OP_NAMES[instr->op],
+            instr->a,
+            instr->b,
+            instr->c
+        );
+
+        if (instr->op == BC_CONST)
+        {
+            printf("    ; ");
+            value_print(fun->consts[instr->b]);
+        }
+
+        putchar('\n');
+    }
+}
+
+void test_bytecode()
+{
+    ast_fun_t* unit_fun = load_str("let x = 3\nlet y = 4\nx + y", "test");
+    bc_fun_t* fun = bc_get_fun(unit_fun);
+
+    // Find the addition instruction
+    instr_t* add_instr = NULL;
+    for (uint32_t i = 0; i < fun->code_len; ++i)
+        if (fun->code[i].op == BC_ADD)
+            add_instr = &fun->code[i];
+    assert (add_instr != NULL);
+
+    // The instruction is specialized when first executed
+    assert (value_equals(bc_run(fun, NULL), value_from_int64(7)));
+    assert (add_instr->op == BC_ADD_I64);
+    assert (value_equals(bc_run(fun, NULL), value_from_int64(7)));
+
+    // When the guard fails, the generic instruction is executed,
+    // which then specializes itself for the new operand types
+    assert (fun->num_consts == 2);
+    fun->consts[0] = value_from_float64(3.5);
+    fun->consts[1] = value_from_float64(4.0);
+    assert (value_equals(bc_run(fun, NULL), value_from_float64(7.5)));
+    assert (add_instr->op == BC_ADD_F64);
+
+    // Calls in tail position become tail calls
+    unit_fun = load_str("let f = fun (n) if n < 1 then n else f(n - 1)\nf(3) + f(4)", "test");
+    fun = bc_get_fun(unit_fun);
+    assert (fun->code[fun->code_len - 2].op == BC_ADD);
+    assert (value_equals(bc_run(fun, NULL), value_from_int64(0)));
+    ast_fun_t* f_ast = NULL;
+    for (uint32_t i = 0; i < fun->num_consts; ++i)
+        if (fun->consts[i].tag == TAG_RAW_PTR)
+            f_ast = (ast_fun_t*)fun->consts[i].word.heapptr;
+    bc_fun_t* f_fun = bc_get_fun(f_ast);
+    uint32_t num_tcalls = 0;
+    for (uint32_t i = 0; i < f_fun->code_len; ++i)
+    {
+        assert (f_fun->code[i].op != BC_CALL);
+        if (f_fun->code[i].op == BC_TCALL)
+            num_tcalls++;
+    }
+    assert (num_tcalls == 1);
+
+    // Comparisons in branch conditions are fused with the jump
+    unit_fun = load_str("let f = fun (n) if n < 1 and n != 0 then 1 else 0\nf(-2)", "test");
+    fun = bc_get_fun(unit_fun);
+    assert (value_equals(bc_run(fun, NULL), value_from_int64(1)));
+    f_fun = NULL;
+    for (uint32_t i = 0; i < fun->num_consts; ++i)
+        if (fun->consts[i].tag == TAG_RAW_PTR)
+            f_fun = bc_get_fun((ast_fun_t*)fun->consts[i].word.heapptr);
+    for (uint32_t i = 0; i < f_fun->code_len; ++i)
+        assert (f_fun->code[i].op != BC_LT && f_fun->code[i].op != BC_NE);
+}
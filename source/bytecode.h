@@ -0,0 +1,258 @@
+/**
+Zeta bytecode compiler and interpreter
+
+Function ASTs are compiled into a compact, register-based bytecode. Each
+function gets a flat frame of value registers. The first registers hold
+the local variables, in local_decls order, followed by the temporaries
+needed to evaluate subexpressions. Instructions name their operand
+registers directly, so that reading a local variable never needs a copy.
+*/
+
+#ifndef __BYTECODE_H__
+#define __BYTECODE_H__
+
+#include "vm.h"
+#include "parser.h"
+#include "interp.h"
+
+/// Register index type
+typedef uint16_t reg_t;
+
+/// Maximum number of registers in a frame
+#define BC_MAX_REGS 0xFFFF
+
+/**
+Bytecode opcodes
+Operands are noted a, b, c, and r[x] denotes register x
+*/
+typedef enum
+{
+    /// r[a] = r[b]
+    BC_MOV,
+
+    /// r[a] = consts[b]
+    BC_CONST,
+
+    /// r[a] = new array with the c values in r[b]..r[b+c-1]
+    BC_ARRAY,
+
+    /// r[a] = r[b][r[c]]
+    BC_INDEX,
+
+    /// r[a] = r[b] <op> r[c]
+    /// The generic binary operators rewrite themselves into a specialized
+    /// variant based on the operand types seen when first executed
+    BC_ADD,
+    BC_SUB,
+    BC_MUL,
+    BC_DIV,
+    BC_MOD,
+    BC_LT,
+    BC_LE,
+    BC_GT,
+    BC_GE,
+    BC_EQ,
+    BC_NE,
+
+    /// Specialized (quickened) variants of the binary operators
+    /// These guard on the operand tags and revert to the generic
+    /// instruction if the guard fails
+    BC_ADD_I64,
+    BC_SUB_I64,
+    BC_MUL_I64,
+    BC_DIV_I64,
+    BC_MOD_I64,
+    BC_LT_I64,
+    BC_LE_I64,
+    BC_GT_I64,
+    BC_GE_I64,
+    BC_EQ_I64,
+    BC_NE_I64,
+    BC_ADD_F64,
+    BC_SUB_F64,
+    BC_MUL_F64,
+    BC_DIV_F64,
+    BC_LT_F64,
+    BC_LE_F64,
+    BC_GT_F64,
+    BC_GE_F64,
+    BC_EQ_F64,
+    BC_NE_F64,
+    BC_EQ_STR,
+    BC_NE_STR,
+
+    /// r[a] = <op> r[b]
+    BC_NEG,
+    BC_NOT,
+
+    /// Jump to instruction b
+    BC_JUMP,
+
+    /// Loop back-edge, jump back to instruction b
+    /// Counts as a back-edge for tiering, and hot loops continue in
+    /// machine code from their header (see jit.c)
+    BC_LOOP,
+
+    /// Jump to instruction b if r[a] is true/false
+    BC_JTRUE,
+    BC_JFALSE,
+
+    /// Fused compare and branch
+    /// Jump to instruction c if r[a] <op> r[b] is true, or false for the
+    /// BC_JN* variants. Integers are compared directly, other operand
+    /// types use the generic comparison semantics.
+    BC_JLT,
+    BC_JLE,
+    BC_JGT,
+    BC_JGE,
+    BC_JEQ,
+    BC_JNE,
+    BC_JNLT,
+    BC_JNLE,
+    BC_JNGT,
+    BC_JNGE,
+
+    /// r[a] = value of global slot b
+    BC_GET_GLOBAL,
+
+    /// Global slot a = r[b]
+    BC_SET_GLOBAL,
+
+    /// r[a] = new cell holding r[b]
+    BC_CELL,
+
+    /// r[a] = value of the cell in r[b]
+    BC_GET_CELL,
+
+    /// Set the value of the cell in r[a] to r[b]
+    BC_SET_CELL,
+
+    /// r[a] = captured variable b of the current closure
+    BC_GET_ENV,
+
+    /// r[a] = current closure
+    BC_SELF,
+
+    /// r[a] = new closure of the function in consts[c], with the
+    /// captured variable values in r[b], r[b+1], ...
+    BC_CLOS,
+
+    /// r[a] = call the closure in r[b] with c arguments
+    /// The call header occupies the registers following r[b], and the
+    /// arguments follow it. These become the callee's first registers.
+    BC_CALL,
+
+    /// Tail call, operands as for BC_CALL
+    /// The callee replaces the current function and reuses its frame
+    BC_TCALL,
+
+    /// r[a] = call builtin c with its arguments in r[b], r[b+1], ...
+    BC_NATIVE,
+
+    /// Return r[a]
+    BC_RET,
+
+    /// Number of opcodes
+    BC_NUM_OPS
+
+} opcode_t;
+
+/**
+Bytecode instruction
+*/
+typedef struct
+{
+    uint16_t op;
+
+    reg_t a;
+    reg_t b;
+    reg_t c;
+
+} instr_t;
+
+/**
+Compiled bytecode function
+*/
+typedef struct bc_fun
+{
+    /// Function AST this was compiled from
+    ast_fun_t* ast;
+
+    /// Number of local variable registers
+    uint32_t num_locals;
+
+    /// Total number of registers, locals and temporaries
+    uint32_t num_regs;
+
+    /// Instructions
+    instr_t* code;
+    uint32_t code_len;
+    uint32_t code_cap;
+
+    /// Constant pool
+    value_t* consts;
+    uint32_t num_consts;
+    uint32_t consts_cap;
+
+    /// Compiled machine code, NULL if not compiled (see jit.c)
+    value_t (*jit_code)(value_t* regs, clos_t* clos);
+
+    /// Entry point of the machine code at the loop header, the target
+    /// of the function's BC_LOOP instructions, NULL if it has none
+    value_t (*jit_loop_code)(value_t* regs, clos_t* clos);
+
+    /// Type feedback, indexed by instruction (see profile.c)
+    /// This is NULL unless the function ran with profiling enabled
+    struct prof_entry* prof;
+
+} bc_fun_t;
+
+/**
+Call frame header
+Saved state of the caller, stored in the registers
+between the callee closure and the call arguments
+*/
+typedef struct
+{
+    /// Caller function, NULL when returning to the host
+    bc_fun_t* fun;
+
+    /// Caller closure
+    clos_t* clos;
+
+    /// Caller registers
+    value_t* regs;
+
+    /// Return address, the instruction following the call
+    instr_t* ret_pc;
+
+} bc_call_t;
+
+/// Number of registers holding a call header
+#define BC_CALL_HDR_REGS \
+    ((sizeof(bc_call_t) + sizeof(value_t) - 1) / sizeof(value_t))
+
+/// Number of bytecode interpreter loops running on the C stack
+extern _Thread_local uint32_t bc_depth;
+
+extern const char* BC_OP_NAMES[BC_NUM_OPS];
+extern const opinfo_t* BC_BINOP_INFO[BC_NUM_OPS];
+extern const uint16_t BC_GENERIC_OP[BC_NUM_OPS];
+extern const uint16_t BC_QUICK_I64[BC_NUM_OPS];
+extern const uint16_t BC_QUICK_F64[BC_NUM_OPS];
+extern const uint16_t BC_QUICK_STR[BC_NUM_OPS];
+
+opcode_t cmp_jump_opcode(const opinfo_t* op, bool jump_if);
+
+bc_fun_t* bc_compile(ast_fun_t* fun);
+bc_fun_t* bc_get_fun(ast_fun_t* fun);
+value_t bc_run(bc_fun_t* fun, clos_t* clos);
+value_t bc_exec(bc_fun_t* fun, clos_t* clos, value_t* regs);
+value_t bc_exec_at(bc_fun_t* fun, clos_t* clos, value_t* regs, instr_t* pc);
+value_t bc_call(clos_t* clos, value_t* args, size_t num_args);
+value_t bc_eval_unit(ast_fun_t* unit_fun);
+void bc_dump(bc_fun_t* fun);
+
+void test_bytecode();
+
+#endif
@@ -0,0 +1,932 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+#include "cgen.h"
+#include "interp.h"
+#include "builtins.h"
+#include "opt.h"
+#include "parser.h"
+#include "vm.h"
+
+/**
+Growable character buffer
+*/
+typedef struct
+{
+    char* str;
+
+    size_t len;
+
+    size_t cap;
+
+} cbuf_t;
+
+static void cbuf_vprintf(cbuf_t* buf, const char* fmt, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    size_t len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+
+    if (buf->len + len + 1 > buf->cap)
+    {
+        buf->cap = 2 * buf->cap + len + 256;
+        buf->str = realloc(buf->str, buf->cap);
+    }
+
+    vsnprintf(buf->str + buf->len, len + 1, fmt, args);
+    buf->len += len;
+}
+
+static void cbuf_printf(cbuf_t* buf, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    cbuf_vprintf(buf, fmt, args);
+    va_end(args);
+}
+
+/// Append a C string literal, with the characters that need it escaped
+static void cbuf_cstr(cbuf_t* buf, const char* data, size_t len)
+{
+    cbuf_printf(buf, "\"");
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char ch = data[i];
+
+        if (ch == '"' || ch == '\\')
+            cbuf_printf(buf, "\\%c", ch);
+        else if (ch < 32 || ch >= 127)
+            cbuf_printf(buf, "\\%03o", ch);
+        else
+            cbuf_printf(buf, "%c", ch);
+    }
+
+    cbuf_printf(buf, "\"");
+}
+
+/**
+Code generation state for a source unit
+*/
+typedef struct
+{
+    /// Functions to compile, in index order. The unit function is first.
+    array_t* funs;
+
+    /// String constants, interned
+    array_t* strs;
+
+    /// Largest parameter count
+    uint32_t max_args;
+
+} cgen_unit_t;
+
+/**
+Code generation state for a function
+*/
+typedef struct
+{
+    cgen_unit_t* unit;
+
+    /// Function being compiled and its index
+    ast_fun_t* fun;
+    uint32_t fun_idx;
+
+    /// Function body code
+    cbuf_t body;
+
+    /// Indentation level of the body code
+    uint32_t indent;
+
+    /// Number of value, condition and closure variables used
+    uint32_t num_temps;
+    uint32_t num_conds;
+    uint32_t num_closs;
+
+    /// Set if a self tail call jumps back to the function entry
+    bool self_tail;
+
+} cgen_ctx_t;
+
+/// Index of an object in a list, which is added to the list if needed
+static uint32_t cgen_list_idx(array_t** list, heapptr_t obj)
+{
+    for (uint32_t i = 0; i < (*list)->len; ++i)
+        if (array_get_ptr(*list, i) == obj)
+            return i;
+
+    *list = array_append(*list, value_from_heapptr(obj, TAG_OBJECT));
+
+    return (*list)->len - 1;
+}
+
+/// Append an indented line of code to the function body
+static void cgen_line(cgen_ctx_t* ctx, const char* fmt, ...)
+{
+    cbuf_printf(&ctx->body, "%*s", 4 * ctx->indent, "");
+
+    va_list args;
+    va_start(args, fmt);
+    cbuf_vprintf(&ctx->body, fmt, args);
+    va_end(args);
+
+    cbuf_printf(&ctx->body, "\n");
+}
+
+/// Append a line with the name of a global variable as a string literal
+static void cgen_name_line(cgen_ctx_t* ctx, const char* fmt, string_t* name)
+{
+    cbuf_t lit = { NULL, 0, 0 };
+    cbuf_cstr(&lit, name->data, name->len);
+    cgen_line(ctx, fmt, lit.str);
+    free(lit.str);
+}
+
+static uint32_t cgen_temp(cgen_ctx_t* ctx)
+{
+    return ctx->num_temps++;
+}
+
+static uint32_t cgen_cond(cgen_ctx_t* ctx)
+{
+    return ctx->num_conds++;
+}
+
+static uint32_t cgen_expr(cgen_ctx_t* ctx, heapptr_t expr);
+static uint32_t cgen_test(cgen_ctx_t* ctx, heapptr_t expr);
+
+/// Test if a local variable of the function being compiled is boxed
+static bool local_boxed(cgen_ctx_t* ctx, uint32_t idx)
+{
+    return decl_boxed((ast_decl_t*)array_get_ptr(ctx->fun->local_decls, idx));
+}
+
+/// Name of the runtime function for a comparison operator
+static const char* compare_fn(const opinfo_t* op)
+{
+    if (op == &OP_LT) return "aot_test_lt";
+    if (op == &OP_LE) return "aot_test_le";
+    if (op == &OP_GT) return "aot_test_gt";
+    if (op == &OP_GE) return "aot_test_ge";
+    if (op == &OP_EQ) return "aot_test_eq";
+    if (op == &OP_NE) return "aot_test_ne";
+    return NULL;
+}
+
+/// Name of the runtime function for an arithmetic operator
+static const char* arith_fn(const opinfo_t* op)
+{
+    if (op == &OP_ADD) return "aot_add";
+    if (op == &OP_SUB) return "aot_sub";
+    if (op == &OP_MUL) return "aot_mul";
+    if (op == &OP_DIV) return "aot_div";
+    if (op == &OP_MOD) return "aot_mod";
+    return NULL;
+}
+
+/**
+Generate the evaluation of a list of expressions into consecutive temps
+Returns the C expression for a pointer to the values, in buf
+*/
+static void cgen_args(cgen_ctx_t* ctx, array_t* exprs, cbuf_t* buf)
+{
+    uint32_t temps[exprs->len + 1];
+
+    for (uint32_t i = 0; i < exprs->len; ++i)
+        temps[i] = cgen_expr(ctx, array_get_ptr(exprs, i));
+
+    if (exprs->len == 0)
+    {
+        cbuf_printf(buf, "NULL");
+        return;
+    }
+
+    cbuf_printf(buf, "(value_t[]){ ");
+    for (uint32_t i = 0; i < exprs->len; ++i)
+        cbuf_printf(buf, "%st%u", (i > 0)? ", ":"", temps[i]);
+    cbuf_printf(buf, " }");
+}
+
+static uint32_t cgen_assign(cgen_ctx_t* ctx, ast_binop_t* binop)
+{
+    uint32_t t = cgen_expr(ctx, binop->right_expr);
+    heapptr_t lhs_expr = binop->left_expr;
+    shapeidx_t shape = get_shape(lhs_expr);
+
+    if (shape == SHAPE_AST_DECL)
+    {
+        ast_decl_t* decl = (ast_decl_t*)lhs_expr;
+
+        if (decl->global)
+            cgen_line(ctx, "globals[%u] = t%u;", decl->idx, t);
+        else if (local_boxed(ctx, decl->idx))
+            cgen_line(ctx, "AOT_CELL(l%u) = t%u;", decl->idx, t);
+        else
+            cgen_line(ctx, "l%u = t%u;", decl->idx, t);
+
+        return t;
+    }
+
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)lhs_expr;
+
+        if (ref->global)
+        {
+            cgen_line(ctx, "globals[%u] = t%u;", ref->idx, t);
+        }
+        else if (ref->capt)
+        {
+            // Captured variables that are assigned are always boxed
+            assert (decl_boxed(ref->decl));
+            cgen_line(ctx, "AOT_CELL(clos->env[%u]) = t%u;", ref->idx, t);
+        }
+        else if (decl_boxed(ref->decl))
+        {
+            cgen_line(ctx, "AOT_CELL(l%u) = t%u;", ref->idx, t);
+        }
+        else
+        {
+            cgen_line(ctx, "l%u = t%u;", ref->idx, t);
+        }
+
+        return t;
+    }
+
+    cgen_line(ctx, "aot_error(\"invalid assignment\");");
+    return t;
+}
+
+static uint32_t cgen_call(cgen_ctx_t* ctx, ast_call_t* callexpr)
+{
+    array_t* arg_exprs = callexpr->arg_exprs;
+    const builtin_t* builtin = call_builtin(callexpr);
+    cbuf_t args = { NULL, 0, 0 };
+
+    // Compiled closures can't be run by the interpreters
+    if (builtin && builtin->reenters)
+    {
+        uint32_t t = cgen_temp(ctx);
+        cgen_line(
+            ctx,
+            "t%u = aot_error(\"%s is not supported in compiled code\");",
+            t,
+            builtin->name
+        );
+        return t;
+    }
+
+    // Builtins are called directly through the builtin table
+    if (builtin)
+    {
+        cgen_args(ctx, arg_exprs, &args);
+        uint32_t t = cgen_temp(ctx);
+        cgen_line(
+            ctx,
+            "t%u = BUILTINS[%u].fn(%s);",
+            t,
+            (uint32_t)(builtin - BUILTINS),
+            args.str
+        );
+        free(args.str);
+        return t;
+    }
+
+    uint32_t f = cgen_expr(ctx, callexpr->fun_expr);
+    uint32_t k = ctx->num_closs++;
+    cgen_line(ctx, "k%u = aot_callee(t%u, %u);", k, f, arg_exprs->len);
+
+    cgen_args(ctx, arg_exprs, &args);
+    uint32_t t = cgen_temp(ctx);
+    cgen_line(ctx, "t%u = aot_call(k%u, %s);", t, k, args.str);
+    free(args.str);
+
+    return t;
+}
+
+static uint32_t cgen_fun_expr(cgen_ctx_t* ctx, ast_fun_t* fun)
+{
+    uint32_t idx = cgen_list_idx(&ctx->unit->funs, (heapptr_t)fun);
+    uint32_t k = ctx->num_closs++;
+
+    cgen_line(ctx, "k%u = aot_clos_alloc(&fun_%u);", k, idx);
+
+    // Copy the captured variables from the current frame or closure
+    // Note: for boxed variables, the cell is copied
+    for (uint32_t i = 0; i < fun->capt_vars->len; ++i)
+    {
+        ast_decl_t* decl = (ast_decl_t*)array_get_ptr(fun->capt_vars, i);
+
+        if (fun_owns_decl(ctx->fun, decl))
+            cgen_line(ctx, "k%u->env[%u] = l%u;", k, i, decl->idx);
+        else
+            cgen_line(ctx, "k%u->env[%u] = clos->env[%u];", k, i, capt_idx(ctx->fun, decl));
+    }
+
+    uint32_t t = cgen_temp(ctx);
+    cgen_line(ctx, "t%u = value_from_heapptr((heapptr_t)k%u, TAG_CLOS);", t, k);
+
+    return t;
+}
+
+static void cgen_const(cgen_ctx_t* ctx, uint32_t t, value_t val)
+{
+    switch (val.tag)
+    {
+        case TAG_BOOL:
+        cgen_line(ctx, "t%u = %s;", t, val.word.int8? "VAL_TRUE":"VAL_FALSE");
+        break;
+
+        case TAG_INT64:
+        if (val.word.int64 == INT64_MIN)
+            cgen_line(ctx, "t%u = aot_int(INT64_MIN);", t);
+        else
+            cgen_line(ctx, "t%u = aot_int(%" PRId64 ");", t, val.word.int64);
+        break;
+
+        case TAG_FLOAT64:
+        if (isnan(val.word.float64))
+            cgen_line(ctx, "t%u = aot_float(NAN);", t);
+        else if (isinf(val.word.float64))
+            cgen_line(ctx, "t%u = aot_float(%sINFINITY);", t, (val.word.float64 < 0)? "-":"");
+        else
+            cgen_line(ctx, "t%u = aot_float(%a);", t, val.word.float64);
+        break;
+
+        default:
+        assert (false);
+    }
+}
+
+/**
+Generate code evaluating an expression into a value temp
+Returns the index of the temp
+*/
+static uint32_t cgen_expr(cgen_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    // Variable reference
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+        uint32_t t = cgen_temp(ctx);
+
+        if (ref->capt)
+        {
+            if (decl_boxed(ref->decl))
+                cgen_line(ctx, "t%u = AOT_CELL(clos->env[%u]);", t, ref->idx);
+            else
+                cgen_line(ctx, "t%u = clos->env[%u];", t, ref->idx);
+        }
+        else if (ref->global)
+        {
+            char fmt[64];
+            sprintf(fmt, "t%u = aot_get_global(globals[%u], %%s);", t, ref->idx);
+            cgen_name_line(ctx, fmt, ref->name);
+        }
+        else if (ref->builtin)
+        {
+            cgen_line(ctx, "t%u = aot_error(\"builtin functions can only be called\");", t);
+        }
+        else if (decl_boxed(ref->decl))
+        {
+            cgen_line(ctx, "t%u = AOT_CELL(l%u);", t, ref->idx);
+        }
+        else
+        {
+            cgen_line(ctx, "t%u = l%u;", t, ref->idx);
+        }
+
+        return t;
+    }
+
+    if (shape == SHAPE_AST_CONST)
+    {
+        uint32_t t = cgen_temp(ctx);
+        cgen_const(ctx, t, ((ast_const_t*)expr)->val);
+        return t;
+    }
+
+    if (shape == SHAPE_STRING)
+    {
+        uint32_t idx = cgen_list_idx(&ctx->unit->strs, expr);
+        uint32_t t = cgen_temp(ctx);
+        cgen_line(ctx, "t%u = strs[%u];", t, idx);
+        return t;
+    }
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+        cbuf_t elems = { NULL, 0, 0 };
+        cgen_args(ctx, array_expr, &elems);
+
+        uint32_t t = cgen_temp(ctx);
+        cgen_line(ctx, "t%u = aot_array(%u, %s);", t, array_expr->len, elems.str);
+        free(elems.str);
+
+        return t;
+    }
+
+    // Binary operator (e.g. a + b)
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        const opinfo_t* op = binop->op;
+
+        if (op == &OP_ASSIGN)
+            return cgen_assign(ctx, binop);
+
+        // Comparisons and logical operators produce booleans from tests
+        if (op == &OP_AND || op == &OP_OR || compare_fn(op))
+        {
+            uint32_t c = cgen_test(ctx, expr);
+            uint32_t t = cgen_temp(ctx);
+            cgen_line(ctx, "t%u = aot_bool(c%u);", t, c);
+            return t;
+        }
+
+        uint32_t t0 = cgen_expr(ctx, binop->left_expr);
+        uint32_t t1 = cgen_expr(ctx, binop->right_expr);
+        uint32_t t = cgen_temp(ctx);
+
+        if (op == &OP_INDEX)
+            cgen_line(ctx, "t%u = aot_index(t%u, t%u);", t, t0, t1);
+        else if (arith_fn(op))
+            cgen_line(ctx, "t%u = %s(t%u, t%u);", t, arith_fn(op), t0, t1);
+        else
+            cgen_line(ctx, "t%u = aot_unimpl(\"unimplemented binary operator: %s\");", t, op->str);
+
+        return t;
+    }
+
+    // Unary operator (e.g.: -x, not a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+
+        if (unop->op == &OP_NOT)
+        {
+            uint32_t c = cgen_test(ctx, expr);
+            uint32_t t = cgen_temp(ctx);
+            cgen_line(ctx, "t%u = aot_bool(c%u);", t, c);
+            return t;
+        }
+
+        uint32_t t0 = cgen_expr(ctx, unop->expr);
+        uint32_t t = cgen_temp(ctx);
+
+        if (unop->op == &OP_NEG)
+            cgen_line(ctx, "t%u = aot_neg(t%u);", t, t0);
+        else
+            cgen_line(ctx, "t%u = aot_unimpl(\"unimplemented unary operator: %s\");", t, unop->op->str);
+
+        return t;
+    }
+
+    // Sequence/block expression
+    if (shape == SHAPE_AST_SEQ)
+    {
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+
+        if (expr_list->len == 0)
+        {
+            uint32_t t = cgen_temp(ctx);
+            cgen_line(ctx, "t%u = VAL_FALSE;", t);
+            return t;
+        }
+
+        uint32_t t = 0;
+        for (uint32_t i = 0; i < expr_list->len; ++i)
+            t = cgen_expr(ctx, array_get_ptr(expr_list, i));
+
+        // The value of the last expression
+        return t;
+    }
+
+    // If expression
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        uint32_t c = cgen_test(ctx, ifexpr->test_expr);
+        uint32_t t = cgen_temp(ctx);
+
+        cgen_line(ctx, "if (c%u) {", c);
+        ctx->indent++;
+        uint32_t t0 = cgen_expr(ctx, ifexpr->then_expr);
+        cgen_line(ctx, "t%u = t%u;", t, t0);
+        ctx->indent--;
+        cgen_line(ctx, "} else {");
+        ctx->indent++;
+        uint32_t t1 = cgen_expr(ctx, ifexpr->else_expr);
+        cgen_line(ctx, "t%u = t%u;", t, t1);
+        ctx->indent--;
+        cgen_line(ctx, "}");
+
+        return t;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+        return cgen_call(ctx, (ast_call_t*)expr);
+
+    // Function/closure expression
+    if (shape == SHAPE_AST_FUN)
+        return cgen_fun_expr(ctx, (ast_fun_t*)expr);
+
+    printf("cgen error, unknown expression type, shapeidx=%d\n", shape);
+    exit(-1);
+}
+
+/**
+Generate code evaluating the truth value of a branch test expression
+Returns the index of the condition variable holding it
+*/
+static uint32_t cgen_test(cgen_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        const opinfo_t* op = binop->op;
+
+        // The right operand is only evaluated if the left one doesn't
+        // decide the result
+        if (op == &OP_AND || op == &OP_OR)
+        {
+            uint32_t c = cgen_cond(ctx);
+            uint32_t c0 = cgen_test(ctx, binop->left_expr);
+            cgen_line(ctx, "c%u = c%u;", c, c0);
+            cgen_line(ctx, (op == &OP_AND)? "if (c%u) {":"if (!c%u) {", c);
+            ctx->indent++;
+            uint32_t c1 = cgen_test(ctx, binop->right_expr);
+            cgen_line(ctx, "c%u = c%u;", c, c1);
+            ctx->indent--;
+            cgen_line(ctx, "}");
+            return c;
+        }
+
+        if (compare_fn(op))
+        {
+            uint32_t t0 = cgen_expr(ctx, binop->left_expr);
+            uint32_t t1 = cgen_expr(ctx, binop->right_expr);
+            uint32_t c = cgen_cond(ctx);
+            cgen_line(ctx, "c%u = %s(t%u, t%u);", c, compare_fn(op), t0, t1);
+            return c;
+        }
+    }
+
+    if (shape == SHAPE_AST_UNOP && ((ast_unop_t*)expr)->op == &OP_NOT)
+    {
+        uint32_t c0 = cgen_test(ctx, ((ast_unop_t*)expr)->expr);
+        uint32_t c = cgen_cond(ctx);
+        cgen_line(ctx, "c%u = !c%u;", c, c0);
+        return c;
+    }
+
+    uint32_t t = cgen_expr(ctx, expr);
+    uint32_t c = cgen_cond(ctx);
+    cgen_line(ctx, "c%u = aot_truth(t%u);", c, t);
+    return c;
+}
+
+/**
+Generate code returning the value of an expression in tail position
+Calls in tail position don't grow the C stack: self tail calls jump back
+to the function entry, and other tail calls are returned to the caller's
+trampoline (see aot_finish)
+*/
+static void cgen_tail(cgen_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_SEQ)
+    {
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+
+        if (expr_list->len == 0)
+        {
+            cgen_line(ctx, "return VAL_FALSE;");
+            return;
+        }
+
+        for (uint32_t i = 0; i + 1 < expr_list->len; ++i)
+            cgen_expr(ctx, array_get_ptr(expr_list, i));
+
+        cgen_tail(ctx, array_get_ptr(expr_list, expr_list->len - 1));
+        return;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        uint32_t c = cgen_test(ctx, ifexpr->test_expr);
+
+        cgen_line(ctx, "if (c%u) {", c);
+        ctx->indent++;
+        cgen_tail(ctx, ifexpr->then_expr);
+        ctx->indent--;
+        cgen_line(ctx, "} else {");
+        ctx->indent++;
+        cgen_tail(ctx, ifexpr->else_expr);
+        ctx->indent--;
+        cgen_line(ctx, "}");
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_CALL && !call_builtin((ast_call_t*)expr))
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        uint32_t f = cgen_expr(ctx, callexpr->fun_expr);
+        uint32_t k = ctx->num_closs++;
+        cgen_line(ctx, "k%u = aot_callee(t%u, %u);", k, f, arg_exprs->len);
+
+        uint32_t temps[arg_exprs->len + 1];
+        for (uint32_t i = 0; i < arg_exprs->len; ++i)
+            temps[i] = cgen_expr(ctx, array_get_ptr(arg_exprs, i));
+
+        // The unit function has no closure and can't call itself
+        if (ctx->fun_idx != 0)
+        {
+            cgen_line(ctx, "if (k%u->fun == &fun_%u) {", k, ctx->fun_idx);
+            ctx->indent++;
+            cgen_line(ctx, "clos = k%u;", k);
+            for (uint32_t i = 0; i < arg_exprs->len; ++i)
+                cgen_line(ctx, "l%u = t%u;", i, temps[i]);
+            cgen_line(ctx, "goto entry;");
+            ctx->indent--;
+            cgen_line(ctx, "}");
+            ctx->self_tail = true;
+        }
+
+        cgen_line(ctx, "aot_tail_clos = k%u;", k);
+        for (uint32_t i = 0; i < arg_exprs->len; ++i)
+            cgen_line(ctx, "aot_tail_args[%u] = t%u;", i, temps[i]);
+        cgen_line(ctx, "return AOT_TAIL;");
+
+        return;
+    }
+
+    uint32_t t = cgen_expr(ctx, expr);
+    cgen_line(ctx, "return t%u;", t);
+}
+
+/**
+Generate the C function for a Zeta function
+*/
+static void cgen_fun(cgen_unit_t* unit, uint32_t fun_idx, cbuf_t* out)
+{
+    cgen_ctx_t ctx;
+    ctx.unit = unit;
+    ctx.fun = (ast_fun_t*)array_get_ptr(unit->funs, fun_idx);
+    ctx.fun_idx = fun_idx;
+    ctx.body = (cbuf_t){ NULL, 0, 0 };
+    ctx.indent = 1;
+    ctx.num_temps = 0;
+    ctx.num_conds = 0;
+    ctx.num_closs = 0;
+    ctx.self_tail = false;
+
+    ast_fun_t* fun = ctx.fun;
+    uint32_t num_params = fun->param_decls->len;
+    uint32_t num_locals = fun->local_decls->len;
+
+    if (num_params > unit->max_args)
+        unit->max_args = num_params;
+
+    cgen_tail(&ctx, fun->body_expr);
+
+    cbuf_printf(out, "// ");
+    if (fun->name)
+        cbuf_printf(out, "%.*s", (int)fun->name->len, fun->name->data);
+    else
+        cbuf_printf(out, (fun_idx == 0)? "<unit>":"<anonymous>");
+    cbuf_printf(out, "\n");
+
+    cbuf_printf(out, "static value_t fun_%u_code(aot_clos_t* clos, value_t* args)\n", fun_idx);
+    cbuf_printf(out, "{\n");
+
+    for (uint32_t i = 0; i < num_locals; ++i)
+        cbuf_printf(out, "    value_t l%u;\n", i);
+    for (uint32_t i = 0; i < ctx.num_temps; ++i)
+        cbuf_printf(out, "    value_t t%u;\n", i);
+    for (uint32_t i = 0; i < ctx.num_conds; ++i)
+        cbuf_printf(out, "    bool c%u;\n", i);
+    for (uint32_t i = 0; i < ctx.num_closs; ++i)
+        cbuf_printf(out, "    aot_clos_t* k%u;\n", i);
+    cbuf_printf(out, "\n");
+
+    for (uint32_t i = 0; i < num_params; ++i)
+        cbuf_printf(out, "    l%u = args[%u];\n", i, i);
+    if (ctx.self_tail)
+        cbuf_printf(out, "entry:\n");
+
+    // Other locals start out false, boxed variables get a fresh cell
+    for (uint32_t i = num_params; i < num_locals; ++i)
+        cbuf_printf(out, "    l%u = VAL_FALSE;\n", i);
+    for (uint32_t i = 0; i < num_locals; ++i)
+        if (local_boxed(&ctx, i))
+            cbuf_printf(out, "    l%u = aot_cell(l%u);\n", i, i);
+
+    cbuf_printf(out, "\n%s}\n\n", ctx.body.str);
+    free(ctx.body.str);
+}
+
+/**
+Generate C code for a resolved source unit
+Returns a heap-allocated string, to be freed by the caller
+*/
+char* cgen_unit(ast_fun_t* unit_fun, const char* src_name)
+{
+    cgen_unit_t unit;
+    unit.funs = array_alloc(4);
+    unit.strs = array_alloc(4);
+    unit.max_args = 1;
+
+    cgen_list_idx(&unit.funs, (heapptr_t)unit_fun);
+
+    // Compiling a function may add the functions nested in it to the list
+    cbuf_t funs = { NULL, 0, 0 };
+    for (uint32_t i = 0; i < unit.funs->len; ++i)
+        cgen_fun(&unit, i, &funs);
+
+    uint32_t num_globals = unit_fun->globals->len;
+
+    cbuf_t out = { NULL, 0, 0 };
+    cbuf_printf(&out, "// Generated by zeta --emit-c from ");
+    cbuf_printf(&out, "%s\n\n", src_name);
+    cbuf_printf(&out, "#define AOT_MAX_ARGS %u\n", unit.max_args);
+    cbuf_printf(&out, "#include \"aot.h\"\n\n");
+
+    cbuf_printf(&out, "static value_t globals[%u];\n", num_globals? num_globals:1);
+    cbuf_printf(&out, "static value_t strs[%u];\n\n", unit.strs->len? unit.strs->len:1);
+
+    for (uint32_t i = 0; i < unit.funs->len; ++i)
+    {
+        ast_fun_t* fun = (ast_fun_t*)array_get_ptr(unit.funs, i);
+        cbuf_printf(&out, "static value_t fun_%u_code(aot_clos_t* clos, value_t* args);\n", i);
+        cbuf_printf(
+            &out,
+            "static const aot_fun_t fun_%u = { fun_%u_code, %u, %u };\n",
+            i,
+            i,
+            fun->param_decls->len,
+            fun->capt_vars->len
+        );
+    }
+
+    cbuf_printf(&out, "\n%s", funs.str);
+    free(funs.str);
+
+    cbuf_printf(&out, "static void init_unit()\n{\n");
+    cbuf_printf(&out, "    for (uint32_t i = 0; i < %u; ++i)\n", num_globals);
+    cbuf_printf(&out, "        globals[i] = VAL_UNDEF;\n");
+
+    for (uint32_t i = 0; i < unit.strs->len; ++i)
+    {
+        string_t* str = (string_t*)array_get_ptr(unit.strs, i);
+        cbuf_printf(&out, "    strs[%u] = value_from_heapptr((heapptr_t)vm_get_cstr(", i);
+        cbuf_cstr(&out, str->data, str->len);
+        cbuf_printf(&out, "), TAG_STRING);\n");
+    }
+
+    cbuf_printf(&out, "}\n\n");
+
+    cbuf_printf(&out, "int main(int argc, char** argv)\n{\n");
+    cbuf_printf(&out, "    return aot_main(argc, argv, ");
+    cbuf_cstr(&out, src_name, strlen(src_name));
+    cbuf_printf(&out, ", init_unit, &fun_0);\n}\n");
+
+    return out.str;
+}
+
+/// Test that the code generated for a unit contains a given string
+static void test_cgen_has(const char* src, const char* expected)
+{
+    ast_fun_t* unit_fun = load_str(src, "test");
+    char* code = cgen_unit(unit_fun, "test");
+
+    if (!strstr(code, expected))
+    {
+        printf(
+            "generated C code for:\n%s\ndoesn't contain \"%s\":\n%s\n",
+            src,
+            expected,
+            code
+        );
+        exit(-1);
+    }
+
+    free(code);
+}
+
+/**
+Test that a unit compiled to C computes the same integer as the
+interpreter for an expression evaluated after it. The runtime sources,
+AOT_SRCS in the makefile, are expected in the working directory, as
+when running the tests from make.
+*/
+static void test_cgen_run(const char* src, const char* expr)
+{
+    const char* c_name = "/tmp/zeta_cgen_test.c";
+    const char* bin_name = "/tmp/zeta_cgen_test";
+    const char* out_name = "/tmp/zeta_cgen_test.out";
+    const char* srcs =
+        "vm.c parser.c interp.c bytecode.c builtins.c opt.c profile.c "
+        "x86.c jit.c tier.c cgen.c ir.c coro.c task.c io.c par.c seq.c simd.c";
+
+    char* unit_src = malloc(strlen(src) + strlen(expr) + 16);
+    sprintf(unit_src, "%s\n%s", src, expr);
+    value_t expected = eval_str(unit_src, "test");
+    assert (expected.tag == TAG_INT64);
+
+    sprintf(unit_src, "%s\nprint(%s)", src, expr);
+    char* code = cgen_unit(load_str(unit_src, "test"), "test");
+    FILE* file = fopen(c_name, "w");
+    assert (file != NULL);
+    fputs(code, file);
+    fclose(file);
+    free(code);
+
+    char cmd[512];
+    snprintf(
+        cmd, sizeof(cmd),
+        "gcc -std=c11 -fcommon -I. -o %s %s %s -lm -pthread && %s > %s",
+        bin_name, c_name, srcs, bin_name, out_name
+    );
+
+    int64_t output;
+    file = (system(cmd) == 0)? fopen(out_name, "r"):NULL;
+    if (!file || fscanf(file, "%" SCNd64, &output) != 1 || output != expected.word.int64)
+    {
+        printf("compiled C code doesn't match the interpreter for:\n%s\n", unit_src);
+        exit(-1);
+    }
+
+    fclose(file);
+    free(unit_src);
+    remove(c_name);
+    remove(bin_name);
+    remove(out_name);
+}
+
+void test_cgen()
+{
+    // The calls and closures tested must not be inlined
+    opt_inline = false;
+    opt_escape = false;
+
+    test_cgen_has("1 + 2", "return t0;");
+    test_cgen_has("let x = 3\nx * x", "aot_mul(");
+    test_cgen_has("let x = 3\nx", "aot_get_global(globals[0], \"x\")");
+    test_cgen_has("print('a\"b')", "vm_get_cstr(\"a\\\"b\")");
+    test_cgen_has("print(1)", "BUILTINS[0].fn((value_t[]){ t0 })");
+    test_cgen_has("let a = [1, 2]\na[1]", "aot_array(2, (value_t[]){ t0, t1 })");
+    test_cgen_has("yield(1)", "aot_error(\"yield is not supported in compiled code\")");
+
+    // Self tail calls are loops, other tail calls return to a trampoline
+    test_cgen_has(
+        "let f = fun (n) if n < 1 then 0 else f(n - 1)\nf(5)",
+        "goto entry;"
+    );
+    test_cgen_has(
+        "let f = fun (n) if n < 1 then 0 else f(n - 1)\nf(5)",
+        "c0 = aot_test_lt(t0, t1);"
+    );
+    test_cgen_has("let f = fun () 1\nf()", "return AOT_TAIL;");
+    test_cgen_has("let f = fun (a, b) a\nf(1, 2)", "#define AOT_MAX_ARGS 2");
+
+    // Mutable captured variables live in cells
+    test_cgen_has(
+        "let f = fun () { var x = 1\nlet g = fun () x = x + 1\ng() }\nf()",
+        "AOT_CELL(clos->env[0]) = t"
+    );
+    test_cgen_has(
+        "let f = fun () { var x = 1\nlet g = fun () x = x + 1\ng() }\nf()",
+        "l0 = aot_cell(l0);"
+    );
+
+    opt_inline = true;
+    opt_escape = true;
+
+    // Compiled code computes the same values as the interpreter
+    test_cgen_run(
+        "let fib = fun (n) if n < 2 then n else fib(n - 1) + fib(n - 2)\n"
+        "let sum = fun (a, i, acc) if i == len(a) then acc else sum(a, i + 1, acc + a[i] * i)\n"
+        "var k = 0\n"
+        "let inc = fun () k = k + 3",
+        "fib(15) + sum([4, 5, 6], 0, 0) + inc() + inc()"
+    );
+}
@@ -0,0 +1,24 @@
+/**
+C code generator
+
+Translates a resolved source unit into C code, for ahead-of-time
+compilation. Each function of the unit becomes a C function, with its
+local variables and intermediate values held in C variables. The
+generated code includes aot.h and calls into the VM runtime, so it must
+be compiled and linked together with the VM objects, except main.c:
+
+    zeta --emit-c prog.zt > prog.c
+    gcc -std=c11 -O3 -fcommon -I. -o prog prog.c <VM sources> -lm
+*/
+
+#ifndef __CGEN_H__
+#define __CGEN_H__
+
+#include "vm.h"
+#include "parser.h"
+
+char* cgen_unit(ast_fun_t* unit_fun, const char* src_name);
+
+void test_cgen();
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "coro.h"
+#include "interp.h"
+#include "bytecode.h"
+#include "vm.h"
+
+/// Shape of coroutine objects
+shapeidx_t SHAPE_CORO;
+
+/// Coroutine currently running on this thread, NULL outside coroutines
+_Thread_local coro_t* coro_current = NULL;
+
+/// Set by yield, tells the bytecode interpreter to suspend the coroutine
+_Thread_local bool coro_yielding = false;
+
+/**
+Create a coroutine running a closure
+The closure takes one argument, the value of the first resume
+*/
+coro_t* coro_alloc(clos_t* clos)
+{
+    coro_t* coro = (coro_t*)vm_alloc(sizeof(coro_t), SHAPE_CORO);
+    coro->state = CORO_NEW;
+    coro->clos = clos;
+    coro->stackstart = NULL;
+    coro->stacktop = NULL;
+    return coro;
+}
+
+/**
+Run a coroutine until it yields or returns
+Returns the value yielded, or the value returned by the closure
+*/
+value_t coro_resume(coro_t* coro, value_t val)
+{
+    if (coro->state == CORO_DONE)
+    {
+        printf("resume: coroutine is finished\n");
+        exit(-1);
+    }
+
+    if (coro->state == CORO_RUNNING)
+    {
+        printf("resume: coroutine is already running\n");
+        exit(-1);
+    }
+
+    // Coroutines resumed from one another nest on the C stack
+    vm_cstack_check();
+
+    // Switch to the value stack of the coroutine
+    value_t* stackstart = vm_thread.stackstart;
+    value_t* stacklimit = vm_thread.stacklimit;
+    value_t* stacktop = vm_thread.stacktop;
+    coro_t* resumer = coro_current;
+
+    if (coro->state == CORO_NEW)
+    {
+        coro->stackstart = vm_stack_reserve(CORO_STACK_SIZE);
+        coro->stacktop = coro->stackstart;
+    }
+
+    vm_thread.stackstart = coro->stackstart;
+    vm_thread.stacklimit = coro->stackstart + CORO_STACK_SIZE;
+    vm_thread.stacktop = coro->stacktop;
+
+    coro_current = coro;
+    coro->depth = bc_depth + 1;
+
+    value_t ret;
+
+    if (coro->state == CORO_NEW)
+    {
+        coro->state = CORO_RUNNING;
+
+        bc_fun_t* fun = bc_get_fun(coro->clos->fun);
+        value_t* frame = vm_push_frame(BC_CALL_HDR_REGS + fun->num_regs);
+        value_t* regs = frame + BC_CALL_HDR_REGS;
+        regs[0] = val;
+
+        ret = bc_exec(fun, coro->clos, regs);
+    }
+    else
+    {
+        coro->state = CORO_RUNNING;
+
+        // The value resumed with is the result of the pending yield
+        coro->regs[coro->pc[-1].a] = val;
+
+        bc_depth++;
+        ret = bc_exec_at(coro->fun, coro->cur_clos, coro->regs, coro->pc);
+        bc_depth--;
+    }
+
+    vm_thread.stackstart = stackstart;
+    vm_thread.stacklimit = stacklimit;
+    vm_thread.stacktop = stacktop;
+    coro_current = resumer;
+
+    // If the closure returned, the stack is no longer needed
+    if (coro->state == CORO_RUNNING)
+    {
+        coro->state = CORO_DONE;
+        vm_stack_release(coro->stackstart, CORO_STACK_SIZE);
+        coro->stackstart = NULL;
+        coro->stacktop = NULL;
+    }
+
+    return ret;
+}
+
+/**
+Test if the current coroutine can be suspended from the builtin
+being called: the interpreter loop of the coroutine body must be the
+innermost, there is no way to save native frames above it
+*/
+bool coro_can_yield()
+{
+    return coro_current && bc_depth == coro_current->depth;
+}
+
+/**
+Request the suspension of the current coroutine, which happens
+when the bytecode interpreter returns from the yield builtin
+*/
+value_t coro_yield(value_t val)
+{
+    if (coro_current == NULL)
+    {
+        printf("yield: not inside a coroutine\n");
+        exit(-1);
+    }
+
+    if (!coro_can_yield())
+    {
+        printf("yield: cannot yield across a native call\n");
+        exit(-1);
+    }
+
+    coro_yielding = true;
+    return val;
+}
+
+/**
+Save the state of the current coroutine, called by the bytecode
+interpreter when it suspends after a yield
+*/
+void coro_suspend(bc_fun_t* fun, clos_t* clos, value_t* regs, instr_t* pc)
+{
+    coro_t* coro = coro_current;
+    assert (coro && coro->state == CORO_RUNNING);
+
+    coro->fun = fun;
+    coro->cur_clos = clos;
+    coro->regs = regs;
+    coro->pc = pc;
+    coro->stacktop = vm_thread.stacktop;
+    coro->state = CORO_SUSPENDED;
+
+    coro_yielding = false;
+}
+
+void test_coro()
+{
+    // Deep recursion continues on the VM stack
+    test_eval_modes(
+        "let f = fun (n) if n == 0 then 0 else f(n - 1) + 1\n"
+        "f(100000)",
+        100000
+    );
+    test_eval_modes(
+        "let even = fun (n) if n == 0 then true else odd(n - 1) == true\n"
+        "let odd = fun (n) if n == 0 then false else even(n - 1) == true\n"
+        "if even(50001) then 1 else 0",
+        0
+    );
+
+    // Values are passed both ways by resume and yield
+    test_eval_modes(
+        "let gen = coroutine(fun (n) { yield(n)\nyield(n + 1)\nn + 2 })\n"
+        "let a = resume(gen, 1)\n"
+        "let b = resume(gen, false)\n"
+        "let c = resume(gen, false)\n"
+        "a * 100 + b * 10 + c",
+        123
+    );
+    test_eval_modes(
+        "let loop = fun (sum, n) if n == 0 then sum else loop(sum + yield(sum), n - 1)\n"
+        "let co = coroutine(fun (x) loop(x, 3))\n"
+        "let a = resume(co, 1)\n"
+        "let b = resume(co, 2)\n"
+        "let c = resume(co, 3)\n"
+        "let d = resume(co, 4)\n"
+        "a + b * 10 + c * 100 + d * 1000",
+        10000 + 600 + 30 + 1
+    );
+
+    // Coroutines suspend with their whole stack of frames
+    test_eval_modes(
+        "let walk = fun (n) if n == 0 then yield(0) else walk(n - 1) + 1\n"
+        "let co = coroutine(fun (x) walk(x))\n"
+        "let a = resume(co, 1000)\n"
+        "let done = finished(co)\n"
+        "let b = resume(co, 5)\n"
+        "if done or finished(co) == false then -1 else a + b",
+        1005
+    );
+
+    // Coroutines resumed by other coroutines
+    test_eval_modes(
+        "let inner = coroutine(fun (x) { yield(x + 1)\nx + 2 })\n"
+        "let outer = coroutine(fun (x) { yield(resume(inner, x))\nresume(inner, 0) * 10 })\n"
+        "let a = resume(outer, 1)\n"
+        "let b = resume(outer, 0)\n"
+        "a + b",
+        32
+    );
+    test_eval_modes(
+        "let h = fun (n) if n == 0 then 0 else 1 + resume(coroutine(fun (x) h(n - 1)), 0)\n"
+        "h(300)",
+        300
+    );
+
+    // Many coroutines alive at once, and globals written while suspended
+    test_eval_modes(
+        "var total = 0\n"
+        "let count = fun (n) if n == 0 then total else { yield(n)\ncount(n - 1) }\n"
+        "let make = fun () coroutine(fun (x) count(x))\n"
+        "let run = fun (cos, i, n) if i == n then 0 else { total = total + resume(cos[i], 2)\nrun(cos, i + 1, n) }\n"
+        "let cos = [make(), make(), make()]\n"
+        "run(cos, 0, 3)\n"
+        "run(cos, 0, 3)\n"
+        "resume(cos[0], 0)",
+        9
+    );
+}
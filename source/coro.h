@@ -0,0 +1,86 @@
+/**
+Coroutines
+
+A coroutine runs a closure on a value stack of its own. The bytecode
+interpreter keeps its frames on the VM stack rather than the C stack, so
+a running coroutine can be suspended by saving its current frame and
+instruction, and resumed later from any point in the program:
+
+    let gen = coroutine(fun (n) { yield(n) yield(n + 1) n + 2 })
+    resume(gen, 1)      // 1
+    resume(gen, false)  // 2
+    resume(gen, false)  // 3, and the coroutine is finished
+
+The value passed to the first resume is the argument of the closure, and
+the value passed to the following ones is the result of the pending
+yield. Coroutines are asymmetric: yield always returns to the resumer.
+Coroutine bodies run in the bytecode interpreter, and a coroutine can
+only yield from bytecode frames, not from inside a builtin or native
+call made by the coroutine.
+*/
+
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "vm.h"
+#include "interp.h"
+#include "bytecode.h"
+
+/// Size of coroutine value stacks, in values
+#define CORO_STACK_SIZE (1 << 22)
+
+/// Shape of coroutine objects
+extern shapeidx_t SHAPE_CORO;
+
+/// Coroutine states
+typedef enum
+{
+    CORO_NEW,
+    CORO_SUSPENDED,
+    CORO_RUNNING,
+    CORO_DONE
+} coro_state_t;
+
+/**
+Coroutine object
+*/
+typedef struct coro
+{
+    shapeidx_t shape;
+
+    coro_state_t state;
+
+    /// Closure run by the coroutine
+    clos_t* clos;
+
+    /// Value stack, reserved on the first resume, released once done
+    value_t* stackstart;
+    value_t* stacktop;
+
+    /// Execution state while suspended: the innermost frame and the
+    /// instruction following the yield
+    bc_fun_t* fun;
+    clos_t* cur_clos;
+    value_t* regs;
+    instr_t* pc;
+
+    /// Bytecode interpreter nesting depth of the coroutine body
+    uint32_t depth;
+
+} coro_t;
+
+/// Coroutine currently running on this thread, NULL outside coroutines
+extern _Thread_local coro_t* coro_current;
+
+/// Set by yield, tells the bytecode interpreter to suspend the coroutine
+extern _Thread_local bool coro_yielding;
+
+coro_t* coro_alloc(clos_t* clos);
+value_t coro_resume(coro_t* coro, value_t val);
+bool coro_can_yield();
+value_t coro_yield(value_t val);
+void coro_suspend(bc_fun_t* fun, clos_t* clos, value_t* regs, instr_t* pc);
+
+void test_coro();
+
+#endif
@@ -3,9 +3,169 @@
 #include <assert.h>
 #include <alloca.h>
 #include "interp.h"
+#include "bytecode.h"
+#include "builtins.h"
+#include "opt.h"
+#include "ir.h"
+#include "jit.h"
+#include "tier.h"
+#include "coro.h"
+#include "task.h"
+#include "seq.h"
 #include "parser.h"
 #include "vm.h"
 
+/// Execute code with the bytecode interpreter instead of the AST interpreter
+bool opt_bytecode = false;
+
+/// Shapes of closure and cell objects
+shapeidx_t SHAPE_CLOS;
+shapeidx_t SHAPE_CELL;
+
+/**
+Initialize data needed by the interpreters
+*/
+void interp_init()
+{
+    SHAPE_CLOS = shape_alloc_empty()->idx;
+    SHAPE_CELL = shape_alloc_empty()->idx;
+    SHAPE_CORO = shape_alloc_empty()->idx;
+    SHAPE_TASK = shape_alloc_empty()->idx;
+    SHAPE_SEQ = shape_alloc_empty()->idx;
+}
+
+/// Value of unassigned global slots
+/// Raw pointers are never the value of a variable
+const value_t VAL_UNDEF = { 0, TAG_RAW_PTR };
+
+/**
+Allocate a global variable slot table
+*/
+globals_t* globals_alloc()
+{
+    globals_t* globals = calloc(1, sizeof(globals_t));
+    return globals;
+}
+
+/**
+Find the global slot for a name, -1 if there is none
+*/
+int32_t globals_find(globals_t* globals, string_t* name)
+{
+    // Note: identifier strings are interned
+    for (uint32_t i = 0; i < globals->len; ++i)
+        if (globals->names[i] == name)
+            return i;
+
+    return -1;
+}
+
+/**
+Get the global slot for a name, allocating it if needed
+*/
+uint32_t globals_slot(globals_t* globals, string_t* name)
+{
+    int32_t idx = globals_find(globals, name);
+
+    if (idx >= 0)
+        return idx;
+
+    if (globals->len == globals->cap)
+    {
+        globals->cap = globals->cap? (2 * globals->cap):32;
+        globals->names = realloc(globals->names, sizeof(string_t*) * globals->cap);
+        globals->decls = realloc(globals->decls, sizeof(ast_decl_t*) * globals->cap);
+        globals->vals = realloc(globals->vals, sizeof(value_t) * globals->cap);
+    }
+
+    globals->names[globals->len] = name;
+    globals->decls[globals->len] = NULL;
+    globals->vals[globals->len] = VAL_UNDEF;
+
+    return globals->len++;
+}
+
+/**
+Report a read of an unassigned global variable and abort
+*/
+value_t global_undef_error(globals_t* globals, uint32_t idx)
+{
+    printf("undefined global variable \"");
+    string_print(globals->names[idx]);
+    printf("\"\n");
+    exit(-1);
+}
+
+/**
+Allocate a closure object for a function
+The environment is sized from the function's captured variable list
+*/
+clos_t* clos_alloc(ast_fun_t* fun)
+{
+    clos_t* clos = (clos_t*)vm_alloc(
+        sizeof(clos_t) + sizeof(value_t) * fun->capt_vars->len,
+        SHAPE_CLOS
+    );
+
+    clos->fun = fun;
+
+    return clos;
+}
+
+/**
+Allocate a mutable variable cell
+*/
+cell_t* cell_alloc(value_t val)
+{
+    cell_t* cell = (cell_t*)vm_alloc(sizeof(cell_t), SHAPE_CELL);
+    cell->val = val;
+    return cell;
+}
+
+/**
+Test if a variable is stored in a cell, which is the case
+for variables that are both captured and mutable
+*/
+bool decl_boxed(ast_decl_t* decl)
+{
+    return decl->capt && decl->mut;
+}
+
+/**
+Test if a function declares a given variable
+*/
+bool fun_owns_decl(ast_fun_t* fun, ast_decl_t* decl)
+{
+    return (
+        decl->idx < fun->local_decls->len &&
+        array_get_ptr(fun->local_decls, decl->idx) == (heapptr_t)decl
+    );
+}
+
+/**
+Get the index of a captured variable in the closure environment of a
+function. The variable gets added to the captured variables of the
+function if needed, and to those of every function between it and the
+function declaring the variable, since a flat closure can only copy
+values from the frame or closure environment of its parent.
+*/
+uint32_t capt_idx(ast_fun_t* fun, ast_decl_t* decl)
+{
+    for (uint32_t i = 0; i < fun->capt_vars->len; ++i)
+        if (array_get_ptr(fun->capt_vars, i) == (heapptr_t)decl)
+            return i;
+
+    if (!fun_owns_decl(fun->parent, decl))
+        capt_idx(fun->parent, decl);
+
+    fun->capt_vars = array_append(
+        fun->capt_vars,
+        value_from_heapptr((heapptr_t)decl, TAG_OBJECT)
+    );
+
+    return fun->capt_vars->len - 1;
+}
+
 void find_decls(heapptr_t expr, ast_fun_t* fun)
 {
     // Get the shape of the AST node
@@ -15,16 +175,35 @@ void find_decls(heapptr_t expr, ast_fun_t* fun)
     {
         ast_decl_t* decl = (ast_decl_t*)expr;
 
-        // If this variable is already declared, do nothing
+        // Declarations at the top level of a unit are globals
+        if (fun->parent == NULL)
+        {
+            globals_t* globals = fun->globals;
+            decl->global = true;
+            decl->idx = globals_slot(globals, decl->name);
+
+            if (globals->decls[decl->idx] == NULL)
+                globals->decls[decl->idx] = decl;
+
+            return;
+        }
+
+        // If this variable is already declared, reuse the same slot
         for (size_t i = 0; i < fun->local_decls->len; ++i)
         {
             ast_decl_t* local = (ast_decl_t*)array_get_ptr(fun->local_decls, i);
             if (local->name == decl->name)
+            {
+                decl->idx = local->idx;
                 return;
+            }
         }
 
         decl->idx = fun->local_decls->len;
-        array_set_obj(fun->local_decls, decl->idx, (heapptr_t)decl);
+        fun->local_decls = array_append(
+            fun->local_decls,
+            value_from_heapptr((heapptr_t)decl, TAG_OBJECT)
+        );
 
         /*
         printf("found decl\n");
@@ -57,7 +236,70 @@ void find_decls(heapptr_t expr, ast_fun_t* fun)
         return;
     }
 
-    // TODO: complete, add assertion
+    // Unary operator (e.g. -a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        find_decls(unop->expr, fun);
+        return;
+    }
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        for (size_t i = 0; i < array_expr->len; ++i)
+            find_decls(array_get_ptr(array_expr, i), fun);
+
+        return;
+    }
+
+    // If expression
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        find_decls(ifexpr->test_expr, fun);
+        find_decls(ifexpr->then_expr, fun);
+        find_decls(ifexpr->else_expr, fun);
+        return;
+    }
+
+    // Call expression
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        find_decls(callexpr->fun_expr, fun);
+
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            find_decls(array_get_ptr(callexpr->arg_exprs, i), fun);
+
+        return;
+    }
+
+    // Note: nested functions have their own scope, constants,
+    // strings and references declare nothing
+}
+
+/**
+Get the builtin called by a call expression, NULL if the
+callee is not a reference to a builtin
+*/
+const builtin_t* call_builtin(ast_call_t* callexpr)
+{
+    heapptr_t fun_expr = callexpr->fun_expr;
+
+    if (get_shape(fun_expr) != SHAPE_AST_REF)
+        return NULL;
+
+    ast_ref_t* fun_ident = (ast_ref_t*)fun_expr;
+
+    if (!fun_ident->builtin)
+        return NULL;
+
+    return &BUILTINS[fun_ident->idx];
 }
 
 void var_res(heapptr_t expr, ast_fun_t* fun)
@@ -80,6 +322,8 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
 
                 if (local->name == ref->name)
                 {
+                    ref->decl = local;
+
                     // If the variable is from this scope
                     if (cur == fun)
                     {
@@ -91,11 +335,13 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
                     {
                         // Mark the declaration as captured
                         local->capt = true;
+                        ref->capt = true;
+                        ref->idx = capt_idx(fun, local);
 
-
-
-
-
+                        // If the variable may be captured before being
+                        // initialized, it can't be copied by value
+                        if (!local->init)
+                            local->mut = true;
                     }
 
                     return;
@@ -109,8 +355,26 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
         printf("\n");
         */
 
+        globals_t* globals = fun->globals;
+        int32_t global_idx = globals_find(globals, ref->name);
+
+        // Builtin functions are bound to their table entry, unless
+        // shadowed by a global declaration
+        int32_t builtin_idx = builtin_lookup(ref->name);
+        if (builtin_idx >= 0 &&
+            (global_idx < 0 || globals->decls[global_idx] == NULL))
+        {
+            ref->builtin = true;
+            ref->idx = builtin_idx;
+            return;
+        }
+
         // If unresolved, mark as global
+        // Globals not defined yet get a slot that a unit evaluated
+        // later in the same global scope may define
         ref->global = true;
+        ref->idx = globals_slot(globals, ref->name);
+        ref->decl = globals->decls[ref->idx];
 
         return;
     }
@@ -132,12 +396,125 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
     {
         ast_binop_t* binop = (ast_binop_t*)expr;
 
+        if (binop->op == &OP_ASSIGN)
+        {
+            // The value is resolved first, it is evaluated
+            // before the variable is written
+            var_res(binop->right_expr, fun);
+
+            // Declaration with initialization
+            if (get_shape(binop->left_expr) == SHAPE_AST_DECL)
+            {
+                ast_decl_t* decl = (ast_decl_t*)binop->left_expr;
+
+                // Functions are named after the variable they initialize
+                if (get_shape(binop->right_expr) == SHAPE_AST_FUN)
+                    ((ast_fun_t*)binop->right_expr)->name = decl->name;
+
+                if (decl->global)
+                    return;
+                ast_decl_t* local = (ast_decl_t*)array_get_ptr(
+                    fun->local_decls,
+                    decl->idx
+                );
+
+                // Redeclaring a variable assigns it again
+                if (local->init)
+                    local->mut = true;
+
+                local->init = true;
+                return;
+            }
+
+            var_res(binop->left_expr, fun);
+
+            // Assignment to a variable
+            if (get_shape(binop->left_expr) == SHAPE_AST_REF)
+            {
+                ast_ref_t* ref = (ast_ref_t*)binop->left_expr;
+
+                if (ref->decl && ref->decl->cst)
+                {
+                    printf("cannot assign to constant \"");
+                    string_print(ref->name);
+                    printf("\"\n");
+                    exit(-1);
+                }
+
+                if (ref->decl)
+                    ref->decl->mut = true;
+            }
+
+            return;
+        }
+
         var_res(binop->left_expr, fun);
         var_res(binop->right_expr, fun);
         return;
     }
 
-    // TODO: complete, add assertion
+    // Unary operator (e.g. -a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        var_res(unop->expr, fun);
+        return;
+    }
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        for (size_t i = 0; i < array_expr->len; ++i)
+            var_res(array_get_ptr(array_expr, i), fun);
+
+        return;
+    }
+
+    // If expression
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        var_res(ifexpr->test_expr, fun);
+        var_res(ifexpr->then_expr, fun);
+        var_res(ifexpr->else_expr, fun);
+        return;
+    }
+
+    // Call expression
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        var_res(callexpr->fun_expr, fun);
+
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            var_res(array_get_ptr(callexpr->arg_exprs, i), fun);
+
+        // The argument count of builtin calls is checked once here
+        const builtin_t* builtin = call_builtin(callexpr);
+        if (builtin && builtin->arity != callexpr->arg_exprs->len)
+        {
+            printf(
+                "incorrect argument count in call to builtin \"%s\"\n",
+                builtin->name
+            );
+            exit(-1);
+        }
+
+        return;
+    }
+
+    // Nested function expression
+    if (shape == SHAPE_AST_FUN)
+    {
+        var_res_pass((ast_fun_t*)expr, fun);
+        return;
+    }
+
+    // Note: constants, strings and declarations need no resolution
 }
 
 /**
@@ -147,10 +524,22 @@ void var_res_pass(ast_fun_t* fun, ast_fun_t* parent)
 {
     fun->parent = parent;
 
+    // Nested functions share the global scope of their unit
+    if (parent)
+        fun->globals = parent->globals;
+    else if (fun->globals == NULL)
+        fun->globals = globals_alloc();
+
     // Add the function parameters to the local scope
     for (size_t i = 0; i < fun->param_decls->len; ++i)
     {
-        array_set(fun->local_decls, i, array_get(fun->param_decls, i));
+        ast_decl_t* param = (ast_decl_t*)array_get_ptr(fun->param_decls, i);
+        param->idx = i;
+        param->init = true;
+        fun->local_decls = array_append(
+            fun->local_decls,
+            array_get(fun->param_decls, i)
+        );
     }
 
     // Find declarations in the function body
@@ -178,16 +567,146 @@ bool eval_truth(value_t value)
     }
 }
 
+/**
+Evaluate a binary operator on two values
+These are the generic semantics of the arithmetic, comparison and equality
+operators, shared by the AST and bytecode interpreters. Integer arithmetic
+wraps around on overflow. Integers and floating-point values are distinct
+types and are not implicitly converted.
+*/
+value_t eval_binop_vals(const opinfo_t* op, value_t v0, value_t v1)
+{
+    if (op == &OP_EQ)
+        return value_equals(v0, v1)? VAL_TRUE:VAL_FALSE;
+    if (op == &OP_NE)
+        return value_equals(v0, v1)? VAL_FALSE:VAL_TRUE;
+
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+    {
+        int64_t i0 = v0.word.int64;
+        int64_t i1 = v1.word.int64;
+
+        if (op == &OP_ADD)
+            return value_from_int64((int64_t)((uint64_t)i0 + (uint64_t)i1));
+        if (op == &OP_SUB)
+            return value_from_int64((int64_t)((uint64_t)i0 - (uint64_t)i1));
+        if (op == &OP_MUL)
+            return value_from_int64((int64_t)((uint64_t)i0 * (uint64_t)i1));
+
+        if (op == &OP_DIV || op == &OP_MOD)
+        {
+            if (i1 == 0)
+            {
+                printf("division by zero\n");
+                exit(-1);
+            }
+
+            // Avoid the overflow trap of INT64_MIN / -1
+            if (i1 == -1)
+            {
+                if (op == &OP_DIV)
+                    return value_from_int64((int64_t)(0 - (uint64_t)i0));
+                return value_from_int64(0);
+            }
+
+            if (op == &OP_DIV)
+                return value_from_int64(i0 / i1);
+            return value_from_int64(i0 % i1);
+        }
+
+        if (op == &OP_LT)
+            return (i0 < i1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_LE)
+            return (i0 <= i1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_GT)
+            return (i0 > i1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_GE)
+            return (i0 >= i1)? VAL_TRUE:VAL_FALSE;
+    }
+
+    else if (v0.tag == TAG_FLOAT64 && v1.tag == TAG_FLOAT64)
+    {
+        double f0 = v0.word.float64;
+        double f1 = v1.word.float64;
+
+        if (op == &OP_ADD)
+            return value_from_float64(f0 + f1);
+        if (op == &OP_SUB)
+            return value_from_float64(f0 - f1);
+        if (op == &OP_MUL)
+            return value_from_float64(f0 * f1);
+        if (op == &OP_DIV)
+            return value_from_float64(f0 / f1);
+
+        if (op == &OP_LT)
+            return (f0 < f1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_LE)
+            return (f0 <= f1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_GT)
+            return (f0 > f1)? VAL_TRUE:VAL_FALSE;
+        if (op == &OP_GE)
+            return (f0 >= f1)? VAL_TRUE:VAL_FALSE;
+    }
+
+    printf("invalid operand types for binary operator: %s\n", op->str);
+    exit(-1);
+}
+
+/**
+Evaluate the negation of a value
+*/
+value_t eval_neg(value_t v0)
+{
+    if (v0.tag == TAG_INT64)
+        return value_from_int64((int64_t)(0 - (uint64_t)v0.word.int64));
+
+    if (v0.tag == TAG_FLOAT64)
+        return value_from_float64(-v0.word.float64);
+
+    printf("invalid operand type for negation\n");
+    exit(-1);
+}
+
+/**
+Allocate the cells of the boxed local variables of a function
+Parameter values are moved into their cell
+*/
+void init_cells(ast_fun_t* fun, value_t* locals)
+{
+    for (uint32_t i = 0; i < fun->local_decls->len; ++i)
+    {
+        ast_decl_t* decl = (ast_decl_t*)array_get_ptr(fun->local_decls, i);
+
+        if (!decl_boxed(decl))
+            continue;
+
+        value_t init_val = (i < fun->param_decls->len)? locals[i]:VAL_FALSE;
+        cell_t* cell = cell_alloc(init_val);
+        locals[i] = value_from_heapptr((heapptr_t)cell, TAG_RAW_PTR);
+    }
+}
+
+/**
+Write the value of a local variable of the current function
+*/
+void store_local(frame_t* frame, ast_decl_t* decl, value_t val)
+{
+    if (decl_boxed(decl))
+        ((cell_t*)frame->locals[decl->idx].word.heapptr)->val = val;
+    else
+        frame->locals[decl->idx] = val;
+}
+
 /**
 Evaluate an assignment expression
 */
 value_t eval_assign(
     heapptr_t lhs_expr,
     heapptr_t rhs_expr,
-    value_t* locals
+    frame_t* frame
 )
 {
-    value_t val = eval_expr(rhs_expr, locals);
+    value_t val = eval_expr(rhs_expr, frame);
 
     shapeidx_t shape = get_shape(lhs_expr);
 
@@ -196,9 +715,19 @@ value_t eval_assign(
     {
         ast_decl_t* decl = (ast_decl_t*)lhs_expr;
 
-        assert (!decl->capt);
+        if (decl->global)
+        {
+            frame->fun->globals->vals[decl->idx] = val;
+            return val;
+        }
 
-        locals[decl->idx] = val;
+        // Flags are set on the first declaration of a variable
+        ast_decl_t* local = (ast_decl_t*)array_get_ptr(
+            frame->fun->local_decls,
+            decl->idx
+        );
+
+        store_local(frame, local, val);
 
         return val;
     }
@@ -206,8 +735,24 @@ value_t eval_assign(
     // Assignment to a variable
     if (shape == SHAPE_AST_REF)
     {
-        // TODO
-        assert (false);
+        ast_ref_t* ref = (ast_ref_t*)lhs_expr;
+
+        if (ref->global)
+        {
+            frame->fun->globals->vals[ref->idx] = val;
+            return val;
+        }
+
+        // Captured variables that are assigned are always boxed
+        if (ref->capt)
+        {
+            assert (decl_boxed(ref->decl));
+            value_t cell = frame->clos->env[ref->idx];
+            ((cell_t*)cell.word.heapptr)->val = val;
+            return val;
+        }
+
+        store_local(frame, ref->decl, val);
 
         return val;
     }
@@ -216,12 +761,236 @@ value_t eval_assign(
     exit(-1);
 }
 
+/**
+Get the closure to call from a function value
+Checks that the closure takes the given number of arguments
+*/
+clos_t* get_callee(value_t fun_val, size_t num_args)
+{
+    if (fun_val.tag != TAG_CLOS)
+    {
+        printf("call to non-function value\n");
+        exit(-1);
+    }
+
+    clos_t* clos = (clos_t*)fun_val.word.heapptr;
+
+    if (num_args != clos->fun->param_decls->len)
+    {
+        printf("incorrect argument count in call\n");
+        exit(-1);
+    }
+
+    return clos;
+}
+
+/**
+Test if an operator is a comparison with a direct integer form
+*/
+bool is_compare_op(const opinfo_t* op)
+{
+    return (
+        op == &OP_LT || op == &OP_LE || op == &OP_GT || op == &OP_GE ||
+        op == &OP_EQ || op == &OP_NE
+    );
+}
+
+/**
+Evaluate the truth value of a branch test expression
+Comparisons of integers are evaluated directly, without producing
+a boolean value first, and logical operators short-circuit
+*/
+bool eval_test(heapptr_t expr, frame_t* frame)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        const opinfo_t* op = binop->op;
+
+        if (op == &OP_AND)
+        {
+            return (
+                eval_test(binop->left_expr, frame) &&
+                eval_test(binop->right_expr, frame)
+            );
+        }
+
+        if (op == &OP_OR)
+        {
+            return (
+                eval_test(binop->left_expr, frame) ||
+                eval_test(binop->right_expr, frame)
+            );
+        }
+
+        if (is_compare_op(op))
+        {
+            value_t v0 = eval_expr(binop->left_expr, frame);
+            value_t v1 = eval_expr(binop->right_expr, frame);
+
+            if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+            {
+                int64_t i0 = v0.word.int64;
+                int64_t i1 = v1.word.int64;
+
+                if (op == &OP_LT) return i0 < i1;
+                if (op == &OP_LE) return i0 <= i1;
+                if (op == &OP_GT) return i0 > i1;
+                if (op == &OP_GE) return i0 >= i1;
+                if (op == &OP_EQ) return i0 == i1;
+                return i0 != i1;
+            }
+
+            return eval_truth(eval_binop_vals(op, v0, v1));
+        }
+    }
+
+    if (shape == SHAPE_AST_UNOP && ((ast_unop_t*)expr)->op == &OP_NOT)
+        return !eval_test(((ast_unop_t*)expr)->expr, frame);
+
+    return eval_truth(eval_expr(expr, frame));
+}
+
+/**
+Evaluate the body of the function of a frame
+Calls in tail position replace the function of the frame and reuse its
+slots instead of recursing, so that tail-recursive loops run in
+constant stack space
+*/
+value_t eval_body(frame_t* frame)
+{
+    heapptr_t expr = frame->fun->body_expr;
+
+    for (;;)
+    {
+        shapeidx_t shape = get_shape(expr);
+
+        // The last expression of a sequence is in tail position
+        if (shape == SHAPE_AST_SEQ)
+        {
+            array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+
+            if (expr_list->len == 0)
+                break;
+
+            for (size_t i = 0; i < expr_list->len - 1; ++i)
+                eval_expr(array_get_ptr(expr_list, i), frame);
+
+            expr = array_get_ptr(expr_list, expr_list->len - 1);
+            continue;
+        }
+
+        // Both branches of an if expression are in tail position
+        if (shape == SHAPE_AST_IF)
+        {
+            ast_if_t* ifexpr = (ast_if_t*)expr;
+
+            if (eval_test(ifexpr->test_expr, frame))
+                expr = ifexpr->then_expr;
+            else
+                expr = ifexpr->else_expr;
+
+            continue;
+        }
+
+        // Tail call
+        if (shape == SHAPE_AST_CALL && !call_builtin((ast_call_t*)expr))
+        {
+            ast_call_t* callexpr = (ast_call_t*)expr;
+            array_t* arg_exprs = callexpr->arg_exprs;
+
+            value_t fun_val = eval_expr(callexpr->fun_expr, frame);
+            clos_t* clos = get_callee(fun_val, arg_exprs->len);
+
+            // The arguments may read the current frame, so they are
+            // evaluated above it, then moved into the parameter slots
+            value_t* args = vm_push_frame(arg_exprs->len);
+
+            for (size_t i = 0; i < arg_exprs->len; ++i)
+                args[i] = eval_expr(array_get_ptr(arg_exprs, i), frame);
+
+            // Self tail calls are loop back-edges. Once the callee has
+            // tiered up, the rest of the loop runs as bytecode.
+            if (opt_tiered && tier_up_bc(clos->fun, clos->fun == frame->fun))
+            {
+                value_t ret = bc_call(clos, args, arg_exprs->len);
+                vm_pop_frame(args);
+                return ret;
+            }
+
+            memmove(frame->locals, args, sizeof(value_t) * arg_exprs->len);
+
+            // Resize the frame for the callee
+            vm_pop_frame(frame->locals);
+            vm_push_frame(clos->fun->local_decls->len);
+
+            frame->fun = clos->fun;
+            frame->clos = clos;
+
+            init_cells(frame->fun, frame->locals);
+
+            expr = frame->fun->body_expr;
+            continue;
+        }
+
+        break;
+    }
+
+    return eval_expr(expr, frame);
+}
+
+/**
+Call a closure, with arguments evaluated in the caller's frame
+The callee frame is pushed on the VM stack, and the argument
+values are written directly into its parameter slots
+*/
+value_t eval_call(value_t fun_val, array_t* arg_exprs, frame_t* caller)
+{
+    clos_t* clos = get_callee(fun_val, arg_exprs->len);
+    ast_fun_t* fun = clos->fun;
+
+    // Hot functions run as bytecode. Calls in the AST interpreter
+    // recurse on the C stack, so deep calls also continue as bytecode,
+    // whose frames are only limited by the size of the VM stack.
+    if ((opt_tiered && tier_up_bc(fun, false)) || vm_cstack_low())
+    {
+        value_t* args = vm_push_frame(arg_exprs->len);
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+            args[i] = eval_expr(array_get_ptr(arg_exprs, i), caller);
+
+        value_t ret = bc_call(clos, args, arg_exprs->len);
+        vm_pop_frame(args);
+        return ret;
+    }
+
+    value_t* locals = vm_push_frame(fun->local_decls->len);
+
+    for (size_t i = 0; i < arg_exprs->len; ++i)
+        locals[i] = eval_expr(array_get_ptr(arg_exprs, i), caller);
+
+    frame_t frame;
+    frame.fun = fun;
+    frame.clos = clos;
+    frame.locals = locals;
+
+    init_cells(fun, locals);
+
+    value_t ret = eval_body(&frame);
+
+    vm_pop_frame(locals);
+
+    return ret;
+}
+
 /**
 Evaluate an expression in a given frame
 */
 value_t eval_expr(
     heapptr_t expr, 
-    value_t* locals
+    frame_t* frame
 )
 {
     // Get the shape of the AST node
@@ -237,22 +1006,37 @@ value_t eval_expr(
         // If this is a captured (closure) variable
         if (ref->capt)
         {
-            // TODO
-            assert (false);
-
-
+            value_t val = frame->clos->env[ref->idx];
 
+            if (decl_boxed(ref->decl))
+                return ((cell_t*)val.word.heapptr)->val;
 
+            return val;
+        }
 
+        if (ref->global)
+        {
+            globals_t* globals = frame->fun->globals;
+            value_t val = globals->vals[ref->idx];
 
+            if (val.tag == TAG_RAW_PTR)
+                return global_undef_error(globals, ref->idx);
 
+            return val;
+        }
 
+        if (ref->builtin)
+        {
+            printf("builtin functions can only be called\n");
+            exit(-1);
         }
 
-        // TODO: handle globals
-        assert (!ref->global);
+        value_t val = frame->locals[ref->idx];
+
+        if (decl_boxed(ref->decl))
+            return ((cell_t*)val.word.heapptr)->val;
 
-        return locals[ref->idx];
+        return val;
     }
 
     if (shape == SHAPE_AST_CONST)
@@ -276,7 +1060,7 @@ value_t eval_expr(
         for (size_t i = 0; i < array_expr->len; ++i)
         {
             heapptr_t expr = array_get(array_expr, i).word.heapptr;
-            value_t value = eval_expr(expr, locals);
+            value_t value = eval_expr(expr, frame);
             array_set(val_array, i, value);
         }
 
@@ -290,40 +1074,25 @@ value_t eval_expr(
 
         // Assignment
         if (binop->op == &OP_ASSIGN)
-            return eval_assign(binop->left_expr, binop->right_expr, locals);
+            return eval_assign(binop->left_expr, binop->right_expr, frame);
 
-        value_t v0 = eval_expr(binop->left_expr, locals);
-        value_t v1 = eval_expr(binop->right_expr, locals);
-        int64_t i0 = v0.word.int64;
-        int64_t i1 = v1.word.int64;
+        // Short-circuit logical operators
+        if (binop->op == &OP_AND || binop->op == &OP_OR)
+            return eval_test(expr, frame)? VAL_TRUE:VAL_FALSE;
 
-        if (binop->op == &OP_INDEX)
-            return array_get((array_t*)v0.word.heapptr, i1);
-
-        if (binop->op == &OP_ADD)
-            return value_from_int64(i0 + i1);
-        if (binop->op == &OP_SUB)
-            return value_from_int64(i0 - i1);
-        if (binop->op == &OP_MUL)
-            return value_from_int64(i0 * i1);
-        if (binop->op == &OP_DIV)
-            return value_from_int64(i0 / i1);
-        if (binop->op == &OP_MOD)
-            return value_from_int64(i0 % i1);
+        value_t v0 = eval_expr(binop->left_expr, frame);
+        value_t v1 = eval_expr(binop->right_expr, frame);
 
-        if (binop->op == &OP_LT)
-            return (i0 < i1)? VAL_TRUE:VAL_FALSE;
-        if (binop->op == &OP_LE)
-            return (i0 <= i1)? VAL_TRUE:VAL_FALSE;
-        if (binop->op == &OP_GT)
-            return (i0 > i1)? VAL_TRUE:VAL_FALSE;
-        if (binop->op == &OP_GE)
-            return (i0 >= i1)? VAL_TRUE:VAL_FALSE;
+        if (binop->op == &OP_INDEX)
+            return array_get((array_t*)v0.word.heapptr, v1.word.int64);
 
-        if (binop->op == &OP_EQ)
-            return (memcmp(&v0, &v1, sizeof(v0)) == 0)? VAL_TRUE:VAL_FALSE;
-        if (binop->op == &OP_NE)
-            return (memcmp(&v0, &v1, sizeof(v0)) != 0)? VAL_TRUE:VAL_FALSE;
+        if (binop->op == &OP_ADD || binop->op == &OP_SUB ||
+            binop->op == &OP_MUL || binop->op == &OP_DIV ||
+            binop->op == &OP_MOD ||
+            binop->op == &OP_LT || binop->op == &OP_LE ||
+            binop->op == &OP_GT || binop->op == &OP_GE ||
+            binop->op == &OP_EQ || binop->op == &OP_NE)
+            return eval_binop_vals(binop->op, v0, v1);
 
         printf("unimplemented binary operator: %s\n", binop->op->str);
         return VAL_FALSE;
@@ -334,10 +1103,10 @@ value_t eval_expr(
     {
         ast_unop_t* unop = (ast_unop_t*)expr;
 
-        value_t v0 = eval_expr(unop->expr, locals);
+        value_t v0 = eval_expr(unop->expr, frame);
 
         if (unop->op == &OP_NEG)
-            return value_from_int64(-v0.word.int64);
+            return eval_neg(v0);
 
         if (unop->op == &OP_NOT)
             return eval_truth(v0)? VAL_FALSE:VAL_TRUE;
@@ -352,12 +1121,12 @@ value_t eval_expr(
         ast_seq_t* seqexpr = (ast_seq_t*)expr;
         array_t* expr_list = seqexpr->expr_list;
 
-        value_t value;
+        value_t value = VAL_FALSE;
 
         for (size_t i = 0; i < expr_list->len; ++i)
         {
             heapptr_t expr = array_get(expr_list, i).word.heapptr;
-            value = eval_expr(expr, locals);
+            value = eval_expr(expr, frame);
         }
 
         // Return the value of the last expression
@@ -369,12 +1138,10 @@ value_t eval_expr(
     {
         ast_if_t* ifexpr = (ast_if_t*)expr;
 
-        value_t t = eval_expr(ifexpr->test_expr, locals);
-
-        if (eval_truth(t))
-            return eval_expr(ifexpr->then_expr, locals);
+        if (eval_test(ifexpr->test_expr, frame))
+            return eval_expr(ifexpr->then_expr, frame);
         else
-            return eval_expr(ifexpr->else_expr, locals);
+            return eval_expr(ifexpr->else_expr, frame);
     }
 
     // Call expression
@@ -384,32 +1151,47 @@ value_t eval_expr(
         heapptr_t fun_expr = callexpr->fun_expr;
         array_t* arg_exprs = callexpr->arg_exprs;
 
-        if (get_shape(fun_expr) == SHAPE_AST_REF && arg_exprs->len == 1)
+        const builtin_t* builtin = call_builtin(callexpr);
+
+        // Builtin calls receive their arguments on the VM stack
+        if (builtin)
         {
-            ast_ref_t* fun_ident = (ast_ref_t*)fun_expr;
-            char* name_cstr = fun_ident->name->data;
+            value_t* args = vm_push_frame(arg_exprs->len);
 
-            heapptr_t arg_expr = array_get(arg_exprs, 0).word.heapptr;
-            value_t arg_val = eval_expr(arg_expr, locals);
+            for (size_t i = 0; i < arg_exprs->len; ++i)
+                args[i] = eval_expr(array_get_ptr(arg_exprs, i), frame);
 
-            if (strncmp(name_cstr, "println", strlen("println")) == 0)
-            {
-                value_print(arg_val);
-                putchar('\n');
-                return VAL_TRUE;
-            }
+            value_t ret = builtin->fn(args);
+
+            vm_pop_frame(args);
+
+            return ret;
         }
 
-        printf("eval error, unknown function in call expression\n");
-        return VAL_FALSE;
+        value_t fun_val = eval_expr(fun_expr, frame);
+
+        return eval_call(fun_val, arg_exprs, frame);
     }
 
     // Function/closure expression
     if (shape == SHAPE_AST_FUN)
     {
-        // For now, return the function unchanged
-        // Later, we will have closure objects
-        return value_from_heapptr(expr, TAG_CLOS);
+        ast_fun_t* fun = (ast_fun_t*)expr;
+        clos_t* clos = clos_alloc(fun);
+
+        // Copy the captured variables from the current frame or closure
+        // Note: for boxed variables, the cell is copied
+        for (uint32_t i = 0; i < fun->capt_vars->len; ++i)
+        {
+            ast_decl_t* decl = (ast_decl_t*)array_get_ptr(fun->capt_vars, i);
+
+            if (fun_owns_decl(frame->fun, decl))
+                clos->env[i] = frame->locals[decl->idx];
+            else
+                clos->env[i] = frame->clos->env[capt_idx(frame->fun, decl)];
+        }
+
+        return value_from_heapptr((heapptr_t)clos, TAG_CLOS);
     }
 
     printf("eval error, unknown expression type, shapeidx=%d\n", get_shape(expr));
@@ -417,10 +1199,14 @@ value_t eval_expr(
 }
 
 /**
-Evaluate the source code in a given string
-This can also be used to evaluate files
+Parse a source string into a unit function and resolve its variables
+in a given global scope. If globals is NULL, the unit gets its own.
 */
-value_t eval_str(const char* cstr, const char* src_name)
+ast_fun_t* load_str_in(
+    const char* cstr,
+    const char* src_name,
+    globals_t* globals
+)
 {
     // TODO: feed src_name into input
 
@@ -437,21 +1223,103 @@ value_t eval_str(const char* cstr, const char* src_name)
     // Parse the input as a source code unit
     ast_fun_t* unit_fun = parse_unit(&input);
 
+    if (unit_fun == NULL)
+    {
+        printf("failed to parse source unit \"%s\"\n", src_name);
+        exit(-1);
+    }
+
     // Resolve all variables in the unit
+    unit_fun->globals = globals;
     var_res_pass(unit_fun, NULL);
 
+    // Functions in a global scope shared with other units may be
+    // redefined by them, so only standalone units are inlined
+    if (globals == NULL)
+        inline_pass(unit_fun);
+
+    // Replace the arrays and closures which can't escape their function
+    escape_pass(unit_fun);
+
+    // Simplify the unit before it is executed
+    opt_pass(unit_fun);
+
+    return unit_fun;
+}
+
+/**
+Parse a source string into a unit function and resolve its variables
+*/
+ast_fun_t* load_str(const char* cstr, const char* src_name)
+{
+    return load_str_in(cstr, src_name, NULL);
+}
+
+/**
+Evaluate a source unit function with the AST interpreter
+*/
+value_t eval_unit(ast_fun_t* unit_fun)
+{
     // Allocate space for the local variables
-    value_t* locals = alloca(sizeof(value_t) * unit_fun->local_decls->len);
+    value_t* locals = vm_push_frame(unit_fun->local_decls->len);
+
+    frame_t frame;
+    frame.fun = unit_fun;
+    frame.clos = NULL;
+    frame.locals = locals;
+
+    init_cells(unit_fun, locals);
 
     // Evaluate the unit function body in the local frame
-    return eval_expr(unit_fun->body_expr, locals);
+    value_t ret = eval_body(&frame);
+
+    vm_pop_frame(locals);
+
+    return ret;
 }
 
-void test_eval(char* cstr, value_t expected)
+/**
+Execute a source unit function with the selected interpreter
+*/
+value_t exec_unit(ast_fun_t* unit_fun)
 {
-    value_t value = eval_str(cstr, "test");
+    if (opt_bytecode || (opt_tiered && tier_up_bc(unit_fun, false)))
+        return bc_eval_unit(unit_fun);
+
+    return eval_unit(unit_fun);
+}
 
-    if (!value_equals(value, expected))
+/**
+Evaluate the source code in a given string
+This can also be used to evaluate files
+*/
+value_t eval_str(const char* cstr, const char* src_name)
+{
+    ast_fun_t* unit_fun = load_str(cstr, src_name);
+
+    return exec_unit(unit_fun);
+}
+
+void test_eval(char* cstr, value_t expected)
+{
+    // Evaluate the code with both the AST and bytecode interpreters
+    value_t ast_value = eval_unit(load_str(cstr, "test"));
+    value_t bc_value = bc_eval_unit(load_str(cstr, "test"));
+
+    // Also evaluate the code without inlining and scalar replacement,
+    // which remove calls, closures and arrays
+    opt_inline = false;
+    opt_escape = false;
+    value_t unopt_value = eval_unit(load_str(cstr, "test"));
+    opt_inline = true;
+    opt_escape = true;
+
+    // Also compile the code to bytecode through the SSA IR
+    opt_ir = true;
+    value_t ir_value = bc_eval_unit(load_str(cstr, "test"));
+    opt_ir = false;
+
+    if (!value_equals(ast_value, expected))
     {
         printf(
             "value doesn't match expected for input:\n%s\n",
@@ -460,6 +1328,88 @@ void test_eval(char* cstr, value_t expected)
 
         exit(-1);
     }
+
+    if (!value_equals(unopt_value, expected))
+    {
+        printf(
+            "unoptimized value doesn't match expected for input:\n%s\n",
+            cstr
+        );
+
+        exit(-1);
+    }
+
+    if (!value_equals(bc_value, expected))
+    {
+        printf(
+            "bytecode value doesn't match expected for input:\n%s\n",
+            cstr
+        );
+
+        exit(-1);
+    }
+
+    if (!value_equals(ir_value, expected))
+    {
+        printf(
+            "ir value doesn't match expected for input:\n%s\n",
+            cstr
+        );
+
+        exit(-1);
+    }
+}
+
+/**
+Evaluate an expression producing a closure and check the value of
+its first captured variable with both interpreters
+*/
+void test_clos_env(char* cstr, value_t expected)
+{
+    value_t clos_vals[2] = {
+        eval_unit(load_str(cstr, "test")),
+        bc_eval_unit(load_str(cstr, "test"))
+    };
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        assert (clos_vals[i].tag == TAG_CLOS);
+        clos_t* clos = (clos_t*)clos_vals[i].word.heapptr;
+        assert (clos->fun->capt_vars->len > 0);
+
+        value_t val = clos->env[0];
+        ast_decl_t* decl = (ast_decl_t*)array_get_ptr(clos->fun->capt_vars, 0);
+        if (decl_boxed(decl))
+            val = ((cell_t*)val.word.heapptr)->val;
+
+        if (!value_equals(val, expected))
+        {
+            printf(
+                "captured value doesn't match expected for input:\n%s\n",
+                cstr
+            );
+
+            exit(-1);
+        }
+    }
+}
+
+/**
+Check that units evaluated in the same global scope share their globals
+*/
+void test_globals()
+{
+    globals_t* globals = globals_alloc();
+
+    // The second unit defines a global read by the first one
+    ast_fun_t* unit_a = load_str_in("let f = fun () z + 1", "test", globals);
+    ast_fun_t* unit_b = load_str_in("var z = 41\nf()", "test", globals);
+    assert (eval_unit(unit_a).tag == TAG_CLOS);
+    assert (value_equals(eval_unit(unit_b), value_from_int64(42)));
+
+    ast_fun_t* unit_c = load_str_in("z = 1\nf()", "test", globals);
+    assert (value_equals(bc_eval_unit(unit_c), value_from_int64(2)));
+    assert (globals->len == 2);
 }
 
 void test_eval_int(char* cstr, int64_t expected)
@@ -467,6 +1417,11 @@ void test_eval_int(char* cstr, int64_t expected)
     test_eval(cstr, value_from_int64(expected));
 }
 
+void test_eval_float(char* cstr, double expected)
+{
+    test_eval(cstr, value_from_float64(expected));
+}
+
 void test_eval_true(char* cstr)
 {
     test_eval(cstr, VAL_TRUE);
@@ -477,6 +1432,64 @@ void test_eval_false(char* cstr)
     test_eval(cstr, VAL_FALSE);
 }
 
+/// Evaluate a unit producing a closure, for tests calling it from C
+clos_t* test_eval_clos(char* cstr)
+{
+    value_t val = eval_str(cstr, "test");
+    assert (val.tag == TAG_CLOS);
+    return (clos_t*)val.word.heapptr;
+}
+
+/**
+Check that a unit evaluates to the expected integer with the AST and
+bytecode interpreters, through the IR, with the JIT and in tiered mode
+*/
+void test_eval_modes(char* cstr, int64_t expected)
+{
+    static const char* mode_names[] = { "ast", "bytecode", "ir", "jit", "tiered" };
+
+    bool jit = opt_jit;
+    bool tiered = opt_tiered;
+    uint32_t threshold = jit_threshold;
+    uint32_t bc_threshold = tier_bc_threshold;
+    value_t values[5];
+
+    values[0] = eval_unit(load_str(cstr, "test"));
+    values[1] = bc_eval_unit(load_str(cstr, "test"));
+
+    opt_ir = true;
+    values[2] = bc_eval_unit(load_str(cstr, "test"));
+    opt_ir = false;
+
+    opt_jit = true;
+    jit_threshold = 1;
+    values[3] = bc_eval_unit(load_str(cstr, "test"));
+
+    opt_tiered = true;
+    jit_threshold = 4;
+    tier_bc_threshold = 2;
+    values[4] = exec_unit(load_str(cstr, "test"));
+
+    opt_jit = jit;
+    opt_tiered = tiered;
+    jit_threshold = threshold;
+    tier_bc_threshold = bc_threshold;
+
+    for (size_t i = 0; i < 5; ++i)
+    {
+        if (!value_equals(values[i], value_from_int64(expected)))
+        {
+            printf(
+                "%s value doesn't match expected for input:\n%s\n",
+                mode_names[i],
+                cstr
+            );
+
+            exit(-1);
+        }
+    }
+}
+
 void test_interp()
 {
     test_eval_int("0", 0);
@@ -508,6 +1521,24 @@ void test_interp()
     test_eval_true("'f' != 'b'");
     test_eval_false("'f' != 'f'");
 
+    // Integer overflow wraps around
+    test_eval_int("0x7FFFFFFFFFFFFFFF + 1", INT64_MIN);
+    test_eval_int("-(0 - 0x7FFFFFFFFFFFFFFF - 1)", INT64_MIN);
+    test_eval_int("7 / 2", 3);
+    test_eval_int("7 mod 3", 1);
+
+    // Floating-point arithmetic
+    test_eval_float("1.5", 1.5);
+    test_eval_float("1.5 + 2.25", 3.75);
+    test_eval_float("2.0 * 3.5 - 1.0", 6.0);
+    test_eval_float("-(1.0 / 4.0)", -0.25);
+    test_eval_float("1e3", 1000.0);
+    test_eval_true("0.5 < 1.5");
+    test_eval_true("2.0 >= 2.0");
+    test_eval_true("0.1 + 0.2 != 0.3");
+    test_eval_true("0.0 == -0.0");
+    test_eval_false("1 == 1.0");
+
     // Arrays
     test_eval_int("[7][0]", 7);
     test_eval_int("[0,1,2][0]", 0);
@@ -522,10 +1553,70 @@ void test_interp()
     test_eval_int("if false then 1 else 0", 0);
     test_eval_int("if 0 < 10 then 7 else 3", 7);
     test_eval_int("if not true then 1 else 0", 0);
+    test_eval_int("if 1.5 < 2.0 then 1 else 0", 1);
+    test_eval_int("if 'a' != 'a' then 1 else 0", 0);
+
+    // Logical operators
+    test_eval_true("true and true");
+    test_eval_false("true and false");
+    test_eval_true("false or true");
+    test_eval_false("false or false");
+    test_eval_true("1 < 2 and not (3 < 2)");
+    test_eval_true("not (1 < 2 and 3 < 2)");
+    test_eval_int("if 1 > 2 or 2 > 1 and 3 >= 3 then 1 else 0", 1);
+    test_eval_int("if (1 > 2 or 2 < 1) and 3 >= 3 then 1 else 0", 0);
+    test_eval_int("var x = 0\nlet f = fun () { x = 1\ntrue }\nfalse and f()\nx", 0);
+    test_eval_int("var x = 0\nlet f = fun () { x = 1\ntrue }\ntrue or f()\nx", 0);
+    test_eval_int("var x = 0\nlet f = fun () { x = 1\ntrue }\ntrue and f()\nx", 1);
 
     // Variable declarations
     test_eval_int("var x = 3\nx", 3);
     test_eval_int("let x = 7\nx+1", 8);
+    test_eval_int("let x = 7\nlet y = x * 2\ny - x", 7);
+    test_eval_int("var x = 2\nvar y = [x, x+1, x+2, x+3, x+4]\ny[4]", 6);
+    test_eval_int("let x = 3\nlet y = if x < 2 then 1 else x\ny", 3);
+    test_eval_int("var x = 1\nx = x + 4\nx", 5);
+    test_eval_int("var x = 1\nx = { x = x + 1\nx * 3 }\nx", 6);
+    test_eval_int("var x = 1\nvar x = x + 2\nx", 3);
+
+    // Closure captures
+    test_clos_env("let f = fun (x) fun () x\nf(3)", value_from_int64(3));
+    test_clos_env("let f = fun (x) fun () fun () x + 1\nf(3)", value_from_int64(3));
+    test_clos_env("let f = fun () { var x = 3\nlet g = fun () x\nx = 5\ng }\nf()", value_from_int64(5));
+    test_clos_env("let f = fun () { let g = fun () h\nlet h = 7\ng }\nf()", value_from_int64(7));
+
+    // Function calls
+    test_eval_int("let f = fun (x) x + 1\nf(2)", 3);
+    test_eval_int("let add = fun (x, y) x + y\nadd(add(1, 2), 3)", 6);
+    test_eval_int("let f = fun () 7\nlet g = fun (x) f() * x\ng(3)", 21);
+    test_eval_int("let fib = fun (n) if n < 2 then n else fib(n-1) + fib(n-2)\nfib(10)", 55);
+    test_eval_int("let mk = fun (x) fun (y) x + y\nlet add3 = mk(3)\nadd3(4)", 7);
+    test_eval_int("var n = 0\nlet inc = fun () n = n + 1\ninc()\ninc()\nn", 2);
+    test_eval_int("let f = fun (x) { let g = fun () x\nx = x + 1\ng() }\nf(1)", 2);
+
+    // Global variables
+    test_eval_int("var x = 1\nlet f = fun () x = x + 1\nf()\nx", 2);
+    test_eval_int("var x = 3\nlet f = fun () x\nx = 4\nf()", 4);
+    test_eval_int("let f = fun () g()\nlet g = fun () 5\nf()", 5);
+    test_eval_int("y = 6\ny + 1", 7);
+    test_eval_int("let len = fun (a) 7\nlen([])", 7);
+    test_eval_int("let f = fun (len) len\nf(8)", 8);
+    test_globals();
+    // Builtin functions
+    test_eval_int("len([1, 2, 3])", 3);
+    test_eval_int("len('foo')", 3);
+    test_eval_int("abs(-3) + abs(4)", 7);
+    test_eval_int("min(3, 2) * max(3, 2)", 6);
+    test_eval_float("min(3, 2.5)", 2.5);
+    test_eval_float("sqrt(16)", 4.0);
+    test_eval_float("floor(2.5) + to_float(1)", 3.0);
+    test_eval_int("to_int(-2.75)", -2);
+    test_eval_int("let sq = fun (x) x * x\nlet n = len([sq(1), sq(2)])\nsq(n)", 4);
+    // Tail calls run in constant stack space
+    test_eval_int("let loop = fun (n, acc) if n == 0 then acc else loop(n - 1, acc + 1)\nloop(100000, 0)", 100000);
+    test_eval_false("let even = fun (n) if n == 0 then true else odd(n - 1)\nlet odd = fun (n) if n == 0 then false else even(n - 1)\neven(100001)");
+    test_eval_int("let f = fun (n) { let m = n * 2\nif n < 100000 then f(n + 1) else m }\nf(0)", 200000);
+    test_eval_int("let g = fun (x, y) x - y\nlet f = fun (a, b) g(b, a)\nf(1, 5)", 4);
 
 
 
@@ -12,11 +12,132 @@ semantics supported are limited.
 #define __INTERP_H__
 
 #include "vm.h"
+#include "parser.h"
+#include "builtins.h"
 
-value_t eval_expr(heapptr_t expr, value_t* locals);
+/// Shapes of closure and cell objects
+extern shapeidx_t SHAPE_CLOS;
+extern shapeidx_t SHAPE_CELL;
+
+/**
+Closure object
+Closures are flat: the values of the variables captured from outer scopes
+are copied into the closure environment when it is created, in the order
+of the function's capt_vars list. Captured variables that are mutable are
+shared between scopes through cells, and the environment holds the cell.
+*/
+typedef struct clos
+{
+    shapeidx_t shape;
+
+    /// Function this is a closure of
+    ast_fun_t* fun;
+
+    /// Captured variable values, variable length
+    value_t env[];
+
+} clos_t;
+
+/**
+Mutable variable cell
+*/
+typedef struct
+{
+    shapeidx_t shape;
+
+    value_t val;
+
+} cell_t;
+
+/**
+Interpreter activation frame
+*/
+typedef struct
+{
+    /// Function being executed
+    ast_fun_t* fun;
+
+    /// Closure being executed, NULL for source units
+    clos_t* clos;
+
+    /// Local variable slots
+    value_t* locals;
+
+} frame_t;
+
+/**
+Global variable slots of a source unit
+Each global name is assigned a slot index during variable resolution,
+so that globals are read and written by index. Units evaluated in the
+same global scope, such as the lines entered in the shell, share their
+slots. Names they define are found by name when the next unit is
+resolved, which also fills in the slots of names referenced earlier.
+*/
+typedef struct globals
+{
+    /// Number of slots
+    uint32_t len;
+
+    /// Slot capacity
+    uint32_t cap;
+
+    /// Name of each slot
+    string_t** names;
+
+    /// Declaration of each slot, NULL if not declared
+    ast_decl_t** decls;
+
+    /// Value of each slot, VAL_UNDEF if never assigned
+    value_t* vals;
+
+} globals_t;
+
+/// Value of unassigned global slots
+extern const value_t VAL_UNDEF;
+
+extern bool opt_bytecode;
+
+void interp_init();
+
+globals_t* globals_alloc();
+uint32_t globals_slot(globals_t* globals, string_t* name);
+value_t global_undef_error(globals_t* globals, uint32_t idx);
+
+clos_t* clos_alloc(ast_fun_t* fun);
+cell_t* cell_alloc(value_t val);
+bool decl_boxed(ast_decl_t* decl);
+bool fun_owns_decl(ast_fun_t* fun, ast_decl_t* decl);
+uint32_t capt_idx(ast_fun_t* fun, ast_decl_t* decl);
+
+void var_res_pass(ast_fun_t* fun, ast_fun_t* parent);
+
+bool eval_truth(value_t value);
+
+value_t eval_binop_vals(const opinfo_t* op, value_t v0, value_t v1);
+
+value_t eval_neg(value_t v0);
+
+value_t eval_expr(heapptr_t expr, frame_t* frame);
+const builtin_t* call_builtin(ast_call_t* callexpr);
+clos_t* get_callee(value_t fun_val, size_t num_args);
+value_t eval_body(frame_t* frame);
+value_t eval_call(value_t fun_val, array_t* arg_exprs, frame_t* caller);
+
+ast_fun_t* load_str_in(
+    const char* cstr,
+    const char* src_name,
+    globals_t* globals
+);
+ast_fun_t* load_str(const char* cstr, const char* src_name);
+
+value_t eval_unit(ast_fun_t* unit_fun);
+
+value_t exec_unit(ast_fun_t* unit_fun);
 
 value_t eval_str(const char* cstr, const char* src_name);
 
+clos_t* test_eval_clos(char* cstr);
+void test_eval_modes(char* cstr, int64_t expected);
 void test_interp();
 
 #endif
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "io.h"
+#include "task.h"
+#include "coro.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Maximum number of events handled per epoll wait
+#define IO_MAX_EVENTS 64
+
+/**
+Operations parked on a file descriptor, at most one per direction
+*/
+typedef struct
+{
+    io_op_t* reader;
+    io_op_t* writer;
+
+    /// Registered with the epoll instance
+    bool added;
+
+} io_fd_t;
+
+/// Epoll instance of the reactor
+static int epoll_fd = -1;
+
+static pthread_once_t io_once = PTHREAD_ONCE_INIT;
+
+/// Lock guarding the descriptor table
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Parked operations, indexed by file descriptor
+static io_fd_t* fds = NULL;
+static size_t num_fds = 0;
+
+static void* io_reactor(void* arg);
+
+/// Start the reactor thread
+static void io_start()
+{
+    // Writes to closed pipes and sockets fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    pthread_t thread;
+    if (epoll_fd < 0 || pthread_create(&thread, NULL, io_reactor, NULL) != 0)
+    {
+        printf("failed to start the I/O reactor\n");
+        exit(-1);
+    }
+
+    pthread_detach(thread);
+}
+
+static void io_error(const char* name)
+{
+    printf("%s: %s\n", name, strerror(errno));
+    exit(-1);
+}
+
+/**
+Attempt an operation, without blocking on non-blocking descriptors
+Returns true once the operation is complete.
+*/
+static bool io_try(io_op_t* op)
+{
+    for (;;)
+    {
+        ssize_t num_bytes;
+
+        if (op->kind == IO_READ)
+            num_bytes = read(op->fd, op->buf, op->len);
+        else
+            num_bytes = write(op->fd, op->str->data + op->done, op->str->len - op->done);
+
+        if (num_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+
+            io_error(op->kind == IO_READ? "read":"write");
+        }
+
+        op->done += num_bytes;
+
+        if (op->kind == IO_READ || op->done == op->str->len)
+            return true;
+    }
+}
+
+/// Result of a complete operation
+static value_t io_result(io_op_t* op)
+{
+    if (op->kind == IO_WRITE)
+        return value_from_int64(op->done);
+
+    // The string is only allocated once the length read is known, and
+    // interned, since strings are compared by identity
+    string_t* str = vm_get_str(op->buf, op->done);
+    free(op->buf);
+    return value_from_heapptr((heapptr_t)str, TAG_STRING);
+}
+
+/**
+Run an operation to completion
+Tasks are parked until the reactor completes the operation, other
+threads block until the descriptor is ready.
+*/
+static value_t io_run(io_op_t* op)
+{
+    if (io_try(op))
+        return io_result(op);
+
+    if (task_can_suspend())
+    {
+        io_op_t* parked = malloc(sizeof(io_op_t));
+        *parked = *op;
+        return task_wait_io(parked);
+    }
+
+    struct pollfd pfd;
+    pfd.fd = op->fd;
+    pfd.events = (op->kind == IO_READ)? POLLIN:POLLOUT;
+
+    do
+    {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            io_error(op->kind == IO_READ? "read":"write");
+    } while (!io_try(op));
+
+    return io_result(op);
+}
+
+/// Get the table entry of a descriptor, with the lock held
+static io_fd_t* io_get_fd(int fd)
+{
+    if ((size_t)fd >= num_fds)
+    {
+        size_t new_num = num_fds? num_fds:64;
+        while (new_num <= (size_t)fd)
+            new_num *= 2;
+
+        fds = realloc(fds, sizeof(io_fd_t) * new_num);
+        memset(fds + num_fds, 0, sizeof(io_fd_t) * (new_num - num_fds));
+        num_fds = new_num;
+    }
+
+    return &fds[fd];
+}
+
+/// Wait for readiness in the directions operations are parked on
+static void io_arm(int fd, io_fd_t* entry)
+{
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.events |= entry->reader? EPOLLIN:0;
+    event.events |= entry->writer? EPOLLOUT:0;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, entry->added? EPOLL_CTL_MOD:EPOLL_CTL_ADD, fd, &event) != 0)
+        io_error("epoll_ctl");
+
+    entry->added = true;
+}
+
+/**
+Park a task on an operation, called by the scheduler once the task
+is suspended
+*/
+void io_park(io_op_t* op)
+{
+    pthread_once(&io_once, io_start);
+
+    pthread_mutex_lock(&io_lock);
+
+    io_fd_t* entry = io_get_fd(op->fd);
+    io_op_t** slot = (op->kind == IO_READ)? &entry->reader:&entry->writer;
+
+    if (*slot)
+    {
+        printf(
+            "%s: another task is waiting on descriptor %d\n",
+            op->kind == IO_READ? "read":"write",
+            op->fd
+        );
+        exit(-1);
+    }
+
+    *slot = op;
+    io_arm(op->fd, entry);
+
+    pthread_mutex_unlock(&io_lock);
+}
+
+/**
+Reactor thread, completes the parked operations as their descriptors
+become ready and wakes up their tasks
+*/
+static void* io_reactor(void* arg)
+{
+    struct epoll_event events[IO_MAX_EVENTS];
+
+    for (;;)
+    {
+        int num_events = epoll_wait(epoll_fd, events, IO_MAX_EVENTS, -1);
+
+        if (num_events < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            io_error("epoll_wait");
+        }
+
+        for (int i = 0; i < num_events; ++i)
+        {
+            int fd = events[i].data.fd;
+            uint32_t flags = events[i].events;
+            io_op_t* done[2];
+            size_t num_done = 0;
+
+            pthread_mutex_lock(&io_lock);
+            io_fd_t* entry = io_get_fd(fd);
+
+            // Errors and hang-ups are reported by the operations
+            if (entry->reader && (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+                io_try(entry->reader))
+            {
+                done[num_done++] = entry->reader;
+                entry->reader = NULL;
+            }
+
+            if (entry->writer && (flags & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+                io_try(entry->writer))
+            {
+                done[num_done++] = entry->writer;
+                entry->writer = NULL;
+            }
+
+            if (entry->reader || entry->writer)
+                io_arm(fd, entry);
+
+            pthread_mutex_unlock(&io_lock);
+
+            for (size_t j = 0; j < num_done; ++j)
+            {
+                task_wake(done[j]->task, io_result(done[j]));
+                free(done[j]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/// Make an array of two descriptors
+static value_t io_fd_pair(int fds[2])
+{
+    array_t* array = array_alloc(2);
+    array = array_append(array, value_from_int64(fds[0]));
+    array = array_append(array, value_from_int64(fds[1]));
+    return value_from_heapptr((heapptr_t)array, TAG_ARRAY);
+}
+
+/**
+Create a pipe, returns its read and write ends
+*/
+value_t io_pipe()
+{
+    int fds[2];
+
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+        io_error("pipe");
+
+    return io_fd_pair(fds);
+}
+
+/**
+Create a pair of connected Unix sockets
+*/
+value_t io_socketpair()
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0)
+        io_error("socketpair");
+
+    return io_fd_pair(fds);
+}
+
+/**
+Open a file, the mode is "r" to read, "w" to write, "a" to append,
+or "rw" to read and write
+*/
+int io_open(string_t* path, string_t* mode)
+{
+    char cpath[path->len + 1];
+    memcpy(cpath, path->data, path->len);
+    cpath[path->len] = '\0';
+
+    int flags;
+
+    if (mode->len == 1 && mode->data[0] == 'r')
+        flags = O_RDONLY;
+    else if (mode->len == 1 && mode->data[0] == 'w')
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (mode->len == 1 && mode->data[0] == 'a')
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    else if (mode->len == 2 && strncmp(mode->data, "rw", 2) == 0)
+        flags = O_RDWR | O_CREAT;
+    else
+    {
+        printf("open: invalid mode\n");
+        exit(-1);
+    }
+
+    // Non-blocking mode only matters for FIFOs, regular files are
+    // always ready
+    int fd = open(cpath, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        printf("open: %s: %s\n", cpath, strerror(errno));
+        exit(-1);
+    }
+
+    return fd;
+}
+
+/**
+Read up to len bytes from a descriptor
+*/
+value_t io_read(int fd, uint32_t len)
+{
+    io_op_t op = { IO_READ, fd, NULL, malloc(len? len:1), len, 0, NULL };
+    return io_run(&op);
+}
+
+/**
+Write a whole string to a descriptor, returns its length
+*/
+value_t io_write(int fd, string_t* str)
+{
+    io_op_t op = { IO_WRITE, fd, str, NULL, 0, 0, NULL };
+    return io_run(&op);
+}
+
+/**
+Close a descriptor, no task may be parked on it
+*/
+void io_close(int fd)
+{
+    pthread_mutex_lock(&io_lock);
+
+    if ((size_t)fd < num_fds)
+    {
+        io_fd_t* entry = &fds[fd];
+
+        if (entry->reader || entry->writer)
+        {
+            printf("close: a task is waiting on descriptor %d\n", fd);
+            exit(-1);
+        }
+
+        if (entry->added)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        entry->added = false;
+    }
+
+    pthread_mutex_unlock(&io_lock);
+
+    if (close(fd) != 0)
+        io_error("close");
+}
+
+/**
+Check that a unit evaluates to the expected string
+*/
+static void test_io_str(char* cstr, const char* expected)
+{
+    value_t values[2];
+    values[0] = eval_unit(load_str(cstr, "test"));
+    values[1] = bc_eval_unit(load_str(cstr, "test"));
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        string_t* str = values[i].word.string;
+
+        if (values[i].tag != TAG_STRING ||
+            str->len != strlen(expected) ||
+            strncmp(str->data, expected, str->len) != 0)
+        {
+            printf("I/O test %zu failed for:\n%s\n", i, cstr);
+            exit(-1);
+        }
+    }
+}
+
+void test_io()
+{
+    // Reads and writes outside of tasks
+    test_io_str(
+        "let p = pipe()\n"
+        "write(p[1], \"hello\")\n"
+        "read(p[0], 100)",
+        "hello"
+    );
+    test_io_str(
+        "let s = socketpair()\n"
+        "write(s[0], \"abcdef\")\n"
+        "read(s[1], 4)",
+        "abcd"
+    );
+    test_eval_modes(
+        "let p = pipe()\n"
+        "write(p[1], \"abc\")\n"
+        "close(p[1])\n"
+        "let n = len(read(p[0], 10))\n"
+        "let m = len(read(p[0], 10))\n"
+        "close(p[0])\n"
+        "n * 10 + m",
+        30
+    );
+
+    // Strings read are interned, and compare equal to literals, also
+    // when the reactor completes the read
+    test_eval_modes(
+        "let p = pipe()\n"
+        "write(p[1], \"hello\")\n"
+        "if read(p[0], 100) == \"hello\" then 1 else 0",
+        1
+    );
+    test_eval_modes(
+        "let s = socketpair()\n"
+        "let t = spawn(fun (fd) read(fd, 100) == \"ping\", s[0])\n"
+        "write(s[1], \"ping\")\n"
+        "if join(t) then 1 else 0",
+        1
+    );
+
+    // A task parked until another writes
+    test_io_str(
+        "let s = socketpair()\n"
+        "let t = spawn(fun (fd) read(fd, 100), s[0])\n"
+        "write(s[1], \"ping\")\n"
+        "join(t)",
+        "ping"
+    );
+
+    // Tasks talking to each other through a socket
+    test_eval_modes(
+        "let s = socketpair()\n"
+        "let server = spawn(fun (fd) { write(fd, read(fd, 100))\nread(fd, 100) }, s[0])\n"
+        "let client = spawn(fun (fd) { write(fd, \"ping\")\nlet r = read(fd, 100)\nwrite(fd, \"bye\")\nr }, s[1])\n"
+        "len(join(client)) * 10 + len(join(server))",
+        43
+    );
+
+    // Writes larger than the pipe buffer park the writer until the
+    // reader catches up. Reads only allocate the bytes they get, so
+    // this allocates about 200 KB of strings however the reads split
+    test_eval_modes(
+        "let p = pipe()\n"
+        "let writer = fun (i) if i == 0 then close(p[1]) else { write(p[1], \"0123456789\")\nwriter(i - 1) }\n"
+        "let reader = fun (n) { let s = read(p[0], 4096)\nif len(s) == 0 then n else reader(n + len(s)) }\n"
+        "let w = spawn(writer, 20000)\n"
+        "let r = spawn(reader, 0)\n"
+        "join(w)\n"
+        "let n = join(r)\n"
+        "close(p[0])\n"
+        "n",
+        200000
+    );
+
+    // Many tasks parked at once, the echo tasks are queued first and
+    // wait for the task writing to them
+    test_eval_modes(
+        "let echo = fun (s) { write(s[0], read(s[0], 10))\nclose(s[0]) }\n"
+        "let start = fun (i) if i == 0 then [] else {\n"
+        "    let s = socketpair()\n"
+        "    let t = spawn(echo, s)\n"
+        "    let l = [t, s[1], start(i - 1)]\n"
+        "    l }\n"
+        "let wake = fun (l) if len(l) == 0 then 0 else {\n"
+        "    write(l[1], \"x\")\n"
+        "    wake(l[2]) }\n"
+        "let finish = fun (l) if len(l) == 0 then 0 else {\n"
+        "    join(l[0])\n"
+        "    let n = len(read(l[1], 10))\n"
+        "    close(l[1])\n"
+        "    n + finish(l[2]) }\n"
+        "let l = start(200)\n"
+        "join(spawn(fun (x) { wake(l)\nfinish(l) }, 0))",
+        200
+    );
+}
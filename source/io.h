@@ -0,0 +1,70 @@
+/**
+Non-blocking I/O
+
+File descriptors are plain integers. Pipes and sockets are created in
+non-blocking mode, and reads and writes on them never block a worker:
+
+    let s = socketpair()
+    let t = spawn(fun (fd) read(fd, 100), s[0])
+    write(s[1], "ping")
+    join(t)             // "ping"
+
+When a task reads from or writes to a descriptor that isn't ready, the
+task is parked and its worker moves on to other tasks. A reactor thread
+waits for readiness events with epoll, completes the operation, and
+makes the task ready again with its result. Reads return the bytes
+available, up to the length requested, and an empty string at the end
+of the input. Writes complete once the whole string is written.
+
+Outside of tasks, and in tasks that can't be suspended, the thread
+blocks until the descriptor is ready.
+*/
+
+#ifndef __IO_H__
+#define __IO_H__
+
+#include "vm.h"
+#include "task.h"
+
+/// Kinds of I/O operations
+typedef enum
+{
+    IO_READ,
+    IO_WRITE
+} io_kind_t;
+
+/**
+I/O operation a task is parked on
+*/
+typedef struct io_op
+{
+    io_kind_t kind;
+
+    int fd;
+
+    /// String written
+    string_t* str;
+
+    /// Buffer read into, and its size
+    char* buf;
+    size_t len;
+
+    /// Number of bytes transferred so far
+    size_t done;
+
+    /// Task parked on the operation
+    task_t* task;
+
+} io_op_t;
+
+value_t io_pipe();
+value_t io_socketpair();
+int io_open(string_t* path, string_t* mode);
+value_t io_read(int fd, uint32_t len);
+value_t io_write(int fd, string_t* str);
+void io_close(int fd);
+void io_park(io_op_t* op);
+
+void test_io();
+
+#endif
@@ -0,0 +1,2881 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include "ir.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "opt.h"
+#include "interp.h"
+#include "builtins.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Compile functions to bytecode through the SSA IR
+bool opt_ir = false;
+
+/// Print the IR of functions as they are compiled
+bool opt_dump_ir = false;
+
+/// Opcode names, for IR dumps
+const char* IR_OP_NAMES[IR_NUM_OPS] = {
+    [IR_PARAM] = "param",
+    [IR_SELF] = "self",
+    [IR_CONST] = "const",
+    [IR_GET_GLOBAL] = "get_global",
+    [IR_SET_GLOBAL] = "set_global",
+    [IR_GET_ENV] = "get_env",
+    [IR_CELL] = "cell",
+    [IR_GET_CELL] = "get_cell",
+    [IR_SET_CELL] = "set_cell",
+    [IR_ARRAY] = "array",
+    [IR_INDEX] = "index",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_MOD] = "mod",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_GT] = "gt",
+    [IR_GE] = "ge",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_NEG] = "neg",
+    [IR_NOT] = "not",
+    [IR_CLOS] = "clos",
+    [IR_CALL] = "call",
+    [IR_NATIVE] = "native",
+    [IR_PHI] = "phi",
+    [IR_GUARD_CLOS] = "guard_clos",
+    [IR_JUMP] = "jump",
+    [IR_BRANCH] = "branch",
+    [IR_RET] = "ret",
+    [IR_TCALL] = "tcall"
+};
+
+/// Operator implemented by each binary operator instruction
+static const opinfo_t* IR_BINOP_INFO[IR_NUM_OPS] = {
+    [IR_ADD] = &OP_ADD,
+    [IR_SUB] = &OP_SUB,
+    [IR_MUL] = &OP_MUL,
+    [IR_DIV] = &OP_DIV,
+    [IR_MOD] = &OP_MOD,
+    [IR_LT] = &OP_LT,
+    [IR_LE] = &OP_LE,
+    [IR_GT] = &OP_GT,
+    [IR_GE] = &OP_GE,
+    [IR_EQ] = &OP_EQ,
+    [IR_NE] = &OP_NE
+};
+
+/// Generic bytecode instruction for each binary operator instruction
+static const uint16_t IR_BC_OP[IR_NUM_OPS] = {
+    [IR_ADD] = BC_ADD,
+    [IR_SUB] = BC_SUB,
+    [IR_MUL] = BC_MUL,
+    [IR_DIV] = BC_DIV,
+    [IR_MOD] = BC_MOD,
+    [IR_LT] = BC_LT,
+    [IR_LE] = BC_LE,
+    [IR_GT] = BC_GT,
+    [IR_GE] = BC_GE,
+    [IR_EQ] = BC_EQ,
+    [IR_NE] = BC_NE
+};
+
+/// Report an IR compilation error and abort
+static void ir_error(const char* msg)
+{
+    printf("ir compilation error: %s\n", msg);
+    exit(-1);
+}
+
+static bool ir_is_binop(ir_op_t op)
+{
+    return op >= IR_ADD && op <= IR_NE;
+}
+
+static bool ir_is_term(ir_op_t op)
+{
+    return op >= IR_JUMP;
+}
+
+/// Allocate a block and add it to a function
+static ir_block_t* ir_new_block(ir_fun_t* fun)
+{
+    ir_block_t* block = calloc(1, sizeof(ir_block_t));
+    block->id = fun->num_blocks;
+
+    if (fun->num_blocks == fun->blocks_cap)
+    {
+        fun->blocks_cap = fun->blocks_cap? (2 * fun->blocks_cap):8;
+        fun->blocks = realloc(fun->blocks, sizeof(ir_block_t*) * fun->blocks_cap);
+    }
+
+    fun->blocks[fun->num_blocks++] = block;
+    return block;
+}
+
+/// Allocate an instruction, not yet part of any block
+static ir_instr_t* ir_new_instr(ir_fun_t* fun, ir_op_t op, uint32_t num_args)
+{
+    ir_instr_t* instr = calloc(1, sizeof(ir_instr_t));
+    instr->op = op;
+    instr->id = fun->num_instrs;
+    instr->args = calloc(num_args? num_args:1, sizeof(ir_instr_t*));
+    instr->num_args = num_args;
+    instr->type = IR_ANY;
+    instr->spec = IR_ANY;
+
+    if (fun->num_instrs == fun->instrs_cap)
+    {
+        fun->instrs_cap = fun->instrs_cap? (2 * fun->instrs_cap):32;
+        fun->instrs = realloc(fun->instrs, sizeof(ir_instr_t*) * fun->instrs_cap);
+    }
+
+    fun->instrs[fun->num_instrs++] = instr;
+    return instr;
+}
+
+/// Append an operand to an instruction
+static void ir_add_arg(ir_instr_t* instr, ir_instr_t* arg)
+{
+    instr->args = realloc(instr->args, sizeof(ir_instr_t*) * (instr->num_args + 1));
+    instr->args[instr->num_args++] = arg;
+}
+
+/// Insert an instruction before another, or at the end of the block if NULL
+static void ir_insert(ir_block_t* block, ir_instr_t* instr, ir_instr_t* pos)
+{
+    instr->block = block;
+    instr->next = pos;
+    instr->prev = pos? pos->prev:block->last;
+
+    if (instr->prev)
+        instr->prev->next = instr;
+    else
+        block->first = instr;
+
+    if (pos)
+        pos->prev = instr;
+    else
+        block->last = instr;
+}
+
+/// Remove an instruction from its block
+static void ir_unlink(ir_instr_t* instr)
+{
+    ir_block_t* block = instr->block;
+
+    if (instr->prev)
+        instr->prev->next = instr->next;
+    else
+        block->first = instr->next;
+
+    if (instr->next)
+        instr->next->prev = instr->prev;
+    else
+        block->last = instr->prev;
+
+    instr->prev = NULL;
+    instr->next = NULL;
+    instr->block = NULL;
+}
+
+/// Get the first instruction of a block which is not a phi node
+static ir_instr_t* ir_first_instr(ir_block_t* block)
+{
+    ir_instr_t* instr = block->first;
+
+    while (instr && instr->op == IR_PHI)
+        instr = instr->next;
+
+    return instr;
+}
+
+/// Get the value an instruction was replaced by
+static ir_instr_t* ir_val(ir_instr_t* instr)
+{
+    while (instr->repl)
+        instr = instr->repl;
+
+    return instr;
+}
+
+/// Remove an instruction, its uses are to be replaced by another value
+/// Note: the operands are updated by ir_update_args
+static void ir_replace(ir_instr_t* instr, ir_instr_t* val)
+{
+    assert (instr != val);
+    ir_unlink(instr);
+    instr->repl = val;
+}
+
+/// Update the operands of all instructions after replacements
+static void ir_update_args(ir_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            for (uint32_t j = 0; j < instr->num_args; ++j)
+                instr->args[j] = ir_val(instr->args[j]);
+}
+
+/// Number of successors of a block
+static uint32_t ir_num_succs(ir_block_t* block)
+{
+    ir_instr_t* term = block->last;
+
+    if (term && term->op == IR_JUMP)
+        return 1;
+    if (term && term->op == IR_BRANCH)
+        return 2;
+
+    return 0;
+}
+
+static void ir_add_pred(ir_block_t* block, ir_block_t* pred)
+{
+    if (block->num_preds == block->preds_cap)
+    {
+        block->preds_cap = block->preds_cap? (2 * block->preds_cap):2;
+        block->preds = realloc(block->preds, sizeof(ir_block_t*) * block->preds_cap);
+    }
+
+    block->preds[block->num_preds++] = pred;
+}
+
+/// Get the index of a predecessor of a block
+static uint32_t ir_pred_idx(ir_block_t* block, ir_block_t* pred)
+{
+    for (uint32_t i = 0; i < block->num_preds; ++i)
+        if (block->preds[i] == pred)
+            return i;
+
+    assert (false);
+    return 0;
+}
+
+/// Remove a predecessor of a block, and the matching phi node operands
+static void ir_remove_pred(ir_block_t* block, uint32_t k)
+{
+    for (uint32_t i = k; i + 1 < block->num_preds; ++i)
+        block->preds[i] = block->preds[i + 1];
+    block->num_preds--;
+
+    for (ir_instr_t* phi = block->first; phi && phi->op == IR_PHI; phi = phi->next)
+    {
+        for (uint32_t i = k; i + 1 < phi->num_args; ++i)
+            phi->args[i] = phi->args[i + 1];
+        phi->num_args--;
+    }
+}
+
+/// Find the common dominator of two blocks
+static ir_block_t* ir_intersect(ir_block_t* b0, ir_block_t* b1)
+{
+    while (b0 != b1)
+    {
+        while (b0->rpo > b1->rpo)
+            b0 = b0->idom;
+        while (b1->rpo > b0->rpo)
+            b1 = b1->idom;
+    }
+
+    return b0;
+}
+
+/**
+Sort the blocks in reverse postorder and number them in that order,
+remove the unreachable blocks and compute the dominator tree
+*/
+static void ir_order(ir_fun_t* fun)
+{
+    uint32_t num_blocks = fun->num_blocks;
+
+    ir_block_t** post = malloc(sizeof(ir_block_t*) * num_blocks);
+    uint32_t num_post = 0;
+
+    // Depth-first search, with an explicit stack of blocks and
+    // of the index of the next successor to visit
+    ir_block_t** stack = malloc(sizeof(ir_block_t*) * num_blocks);
+    uint32_t* succ_idx = malloc(sizeof(uint32_t) * num_blocks);
+    uint32_t depth = 0;
+
+    for (uint32_t i = 0; i < num_blocks; ++i)
+        fun->blocks[i]->rpo = UINT32_MAX;
+
+    fun->entry->rpo = 0;
+    stack[depth] = fun->entry;
+    succ_idx[depth++] = 0;
+
+    while (depth > 0)
+    {
+        ir_block_t* block = stack[depth - 1];
+        uint32_t num_succs = ir_num_succs(block);
+
+        if (succ_idx[depth - 1] == num_succs)
+        {
+            post[num_post++] = block;
+            depth--;
+            continue;
+        }
+
+        // The false branch is visited first, so that the true
+        // branch follows the branch in the block order
+        uint32_t k = num_succs - 1 - succ_idx[depth - 1]++;
+        ir_block_t* succ = block->last->targets[k];
+
+        if (succ->rpo == UINT32_MAX)
+        {
+            succ->rpo = 0;
+            stack[depth] = succ;
+            succ_idx[depth++] = 0;
+        }
+    }
+
+    // Remove the edges out of unreachable blocks
+    for (uint32_t i = 0; i < num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+
+        if (block->rpo != UINT32_MAX)
+            continue;
+
+        for (uint32_t k = 0; k < ir_num_succs(block); ++k)
+        {
+            ir_block_t* succ = block->last->targets[k];
+            if (succ->rpo != UINT32_MAX)
+                ir_remove_pred(succ, ir_pred_idx(succ, block));
+        }
+
+        while (block->first)
+            ir_unlink(block->first);
+
+        free(block->preds);
+        free(block);
+    }
+
+    for (uint32_t i = 0; i < num_post; ++i)
+    {
+        ir_block_t* block = post[num_post - 1 - i];
+        fun->blocks[i] = block;
+        block->rpo = i;
+        block->id = i;
+        block->idom = NULL;
+    }
+    fun->num_blocks = num_post;
+
+    // Iterative dominator computation, see "A Simple, Fast Dominance
+    // Algorithm" by Cooper, Harvey and Kennedy
+    fun->entry->idom = fun->entry;
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (uint32_t i = 1; i < fun->num_blocks; ++i)
+        {
+            ir_block_t* block = fun->blocks[i];
+            ir_block_t* idom = NULL;
+
+            for (uint32_t k = 0; k < block->num_preds; ++k)
+            {
+                ir_block_t* pred = block->preds[k];
+
+                if (pred->idom == NULL)
+                    continue;
+
+                idom = idom? ir_intersect(pred, idom):pred;
+            }
+
+            if (idom != block->idom)
+            {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    free(stack);
+    free(succ_idx);
+    free(post);
+}
+
+/**
+Replace the phi nodes whose operands are all the same value, or the
+phi node itself, by that value
+*/
+static void ir_simplify_phis(ir_fun_t* fun)
+{
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        {
+            ir_instr_t* next;
+
+            for (ir_instr_t* phi = fun->blocks[i]->first; phi && phi->op == IR_PHI; phi = next)
+            {
+                next = phi->next;
+                ir_instr_t* same = NULL;
+                bool trivial = true;
+
+                for (uint32_t j = 0; j < phi->num_args; ++j)
+                {
+                    ir_instr_t* arg = ir_val(phi->args[j]);
+
+                    if (arg == phi || arg == same)
+                        continue;
+
+                    if (same)
+                    {
+                        trivial = false;
+                        break;
+                    }
+
+                    same = arg;
+                }
+
+                if (trivial && same)
+                {
+                    ir_replace(phi, same);
+                    changed = true;
+                }
+            }
+        }
+
+        ir_update_args(fun);
+    }
+}
+
+/**
+IR construction context for one function
+*/
+typedef struct
+{
+    ir_fun_t* fun;
+
+    ast_fun_t* ast;
+
+    /// Block instructions are appended to, NULL after a terminator
+    ir_block_t* cur;
+
+    /// Current value of each local variable
+    /// Note: for boxed variables, this is the cell
+    ir_instr_t** defs;
+    uint32_t num_locals;
+
+    /// Phi nodes of the parameters in the loop header
+    ir_instr_t** header_phis;
+
+    /// Current closure, NULL for source units
+    ir_instr_t* self;
+
+    /// Value of variables read before being assigned
+    ir_instr_t* undef;
+
+} ir_ctx_t;
+
+static ir_instr_t* ir_build_expr(ir_ctx_t* ctx, heapptr_t expr);
+
+/// Append an instruction with the given operands to the current block
+static ir_instr_t* ir_emit(ir_ctx_t* ctx, ir_op_t op, uint32_t num_args, ...)
+{
+    ir_instr_t* instr = ir_new_instr(ctx->fun, op, num_args);
+
+    va_list args;
+    va_start(args, num_args);
+    for (uint32_t i = 0; i < num_args; ++i)
+        instr->args[i] = va_arg(args, ir_instr_t*);
+    va_end(args);
+
+    ir_insert(ctx->cur, instr, NULL);
+    return instr;
+}
+
+static ir_instr_t* ir_emit_const(ir_ctx_t* ctx, value_t val)
+{
+    ir_instr_t* instr = ir_emit(ctx, IR_CONST, 0);
+    instr->val = val;
+    return instr;
+}
+
+/**
+End the current block with a terminator
+The variable values on exit are saved for the successor blocks.
+*/
+static void ir_end_block(ir_ctx_t* ctx, ir_instr_t* term)
+{
+    ir_block_t* block = ctx->cur;
+    ir_insert(block, term, NULL);
+
+    for (uint32_t k = 0; k < ir_num_succs(block); ++k)
+        ir_add_pred(term->targets[k], block);
+
+    block->defs = malloc(sizeof(ir_instr_t*) * (ctx->num_locals + 1));
+    memcpy(block->defs, ctx->defs, sizeof(ir_instr_t*) * ctx->num_locals);
+
+    ctx->cur = NULL;
+}
+
+static void ir_jump(ir_ctx_t* ctx, ir_block_t* target)
+{
+    ir_instr_t* jump = ir_new_instr(ctx->fun, IR_JUMP, 0);
+    jump->targets[0] = target;
+    ir_end_block(ctx, jump);
+}
+
+static void ir_branch(ir_ctx_t* ctx, ir_instr_t* cond, ir_block_t* t, ir_block_t* f)
+{
+    ir_instr_t* branch = ir_new_instr(ctx->fun, IR_BRANCH, 1);
+    branch->args[0] = cond;
+    branch->targets[0] = t;
+    branch->targets[1] = f;
+    ir_end_block(ctx, branch);
+}
+
+/**
+Start appending to a block whose predecessors are all complete
+Variables with different values in the predecessors are merged
+with phi nodes.
+*/
+static void ir_start_block(ir_ctx_t* ctx, ir_block_t* block)
+{
+    ctx->cur = block;
+
+    for (uint32_t i = 0; i < ctx->num_locals; ++i)
+    {
+        if (block->num_preds == 0)
+        {
+            ctx->defs[i] = ctx->undef;
+            continue;
+        }
+
+        ir_instr_t* val = block->preds[0]->defs[i];
+        bool same = true;
+
+        for (uint32_t k = 1; k < block->num_preds; ++k)
+            if (block->preds[k]->defs[i] != val)
+                same = false;
+
+        if (!same)
+        {
+            ir_instr_t* phi = ir_new_instr(ctx->fun, IR_PHI, block->num_preds);
+            for (uint32_t k = 0; k < block->num_preds; ++k)
+                phi->args[k] = block->preds[k]->defs[i];
+            ir_insert(block, phi, ir_first_instr(block));
+            val = phi;
+        }
+
+        ctx->defs[i] = val;
+    }
+}
+
+/// Merge two values at the start of a block with two predecessors
+static ir_instr_t* ir_merge(ir_ctx_t* ctx, ir_instr_t* v0, ir_instr_t* v1)
+{
+    if (v0 == v1)
+        return v0;
+
+    ir_instr_t* phi = ir_new_instr(ctx->fun, IR_PHI, 2);
+    phi->args[0] = v0;
+    phi->args[1] = v1;
+    ir_insert(ctx->cur, phi, ir_first_instr(ctx->cur));
+    return phi;
+}
+
+/// Get the declaration holding the flags of a local variable
+static ast_decl_t* ir_local_decl(ir_ctx_t* ctx, uint32_t idx)
+{
+    return (ast_decl_t*)array_get_ptr(ctx->ast->local_decls, idx);
+}
+
+/// Write a local variable of the current function
+static void ir_store_local(ir_ctx_t* ctx, ast_decl_t* decl, ir_instr_t* val)
+{
+    if (decl_boxed(decl))
+        ir_emit(ctx, IR_SET_CELL, 2, ctx->defs[decl->idx], val);
+    else
+        ctx->defs[decl->idx] = val;
+}
+
+static ir_instr_t* ir_build_assign(ir_ctx_t* ctx, heapptr_t lhs_expr, heapptr_t rhs_expr)
+{
+    shapeidx_t shape = get_shape(lhs_expr);
+
+    if (shape != SHAPE_AST_DECL && shape != SHAPE_AST_REF)
+        ir_error("unsupported assignment");
+
+    ir_instr_t* val = ir_build_expr(ctx, rhs_expr);
+
+    if (shape == SHAPE_AST_DECL)
+    {
+        ast_decl_t* decl = (ast_decl_t*)lhs_expr;
+
+        if (decl->global)
+        {
+            ir_emit(ctx, IR_SET_GLOBAL, 1, val)->idx = decl->idx;
+            return val;
+        }
+
+        // Flags are set on the first declaration of a variable
+        ir_store_local(ctx, ir_local_decl(ctx, decl->idx), val);
+        return val;
+    }
+
+    ast_ref_t* ref = (ast_ref_t*)lhs_expr;
+
+    if (ref->global)
+    {
+        ir_emit(ctx, IR_SET_GLOBAL, 1, val)->idx = ref->idx;
+        return val;
+    }
+
+    // Captured variables that are assigned are always boxed
+    if (ref->capt)
+    {
+        ir_instr_t* cell = ir_emit(ctx, IR_GET_ENV, 0);
+        cell->idx = ref->idx;
+        ir_emit(ctx, IR_SET_CELL, 2, cell, val);
+        return val;
+    }
+
+    ir_store_local(ctx, ref->decl, val);
+    return val;
+}
+
+/**
+Build a conditional branch on the truth value of an expression
+Logical operators short-circuit.
+*/
+static void ir_build_cond(ir_ctx_t* ctx, heapptr_t expr, ir_block_t* t, ir_block_t* f)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op == &OP_AND || binop->op == &OP_OR)
+        {
+            ir_block_t* right = ir_new_block(ctx->fun);
+
+            if (binop->op == &OP_AND)
+                ir_build_cond(ctx, binop->left_expr, right, f);
+            else
+                ir_build_cond(ctx, binop->left_expr, t, right);
+
+            ir_start_block(ctx, right);
+            ir_build_cond(ctx, binop->right_expr, t, f);
+            return;
+        }
+    }
+
+    if (shape == SHAPE_AST_UNOP && ((ast_unop_t*)expr)->op == &OP_NOT)
+    {
+        ir_build_cond(ctx, ((ast_unop_t*)expr)->expr, f, t);
+        return;
+    }
+
+    ir_branch(ctx, ir_build_expr(ctx, expr), t, f);
+}
+
+/// Get the instruction for a binary operator, IR_NUM_OPS if unsupported
+static ir_op_t ir_binop(const opinfo_t* op)
+{
+    for (int i = IR_ADD; i <= IR_NE; ++i)
+        if (IR_BINOP_INFO[i] == op)
+            return i;
+
+    if (op == &OP_INDEX)
+        return IR_INDEX;
+
+    return IR_NUM_OPS;
+}
+
+/// Build the call of a closure, up to the closure check
+static ir_instr_t* ir_build_callee(ir_ctx_t* ctx, ast_call_t* callexpr, ir_instr_t** args)
+{
+    array_t* arg_exprs = callexpr->arg_exprs;
+
+    ir_instr_t* fun_val = ir_build_expr(ctx, callexpr->fun_expr);
+
+    for (uint32_t i = 0; i < arg_exprs->len; ++i)
+        args[i] = ir_build_expr(ctx, array_get_ptr(arg_exprs, i));
+
+    ir_instr_t* guard = ir_emit(ctx, IR_GUARD_CLOS, 1, fun_val);
+    guard->idx = arg_exprs->len;
+
+    return guard;
+}
+
+/**
+Build an expression, returns the instruction producing its value
+*/
+static ir_instr_t* ir_build_expr(ir_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_CONST)
+        return ir_emit_const(ctx, ((ast_const_t*)expr)->val);
+
+    if (shape == SHAPE_STRING)
+        return ir_emit_const(ctx, value_from_heapptr(expr, TAG_STRING));
+
+    // Variable reference
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+
+        if (ref->builtin)
+            ir_error("builtin functions can only be called");
+
+        if (ref->global)
+        {
+            ir_instr_t* instr = ir_emit(ctx, IR_GET_GLOBAL, 0);
+            instr->idx = ref->idx;
+            return instr;
+        }
+
+        if (ref->capt)
+        {
+            ir_instr_t* instr = ir_emit(ctx, IR_GET_ENV, 0);
+            instr->idx = ref->idx;
+
+            if (decl_boxed(ref->decl))
+                instr = ir_emit(ctx, IR_GET_CELL, 1, instr);
+
+            return instr;
+        }
+
+        if (decl_boxed(ref->decl))
+            return ir_emit(ctx, IR_GET_CELL, 1, ctx->defs[ref->idx]);
+
+        return ctx->defs[ref->idx];
+    }
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        ir_instr_t* elems[array_expr->len + 1];
+        for (uint32_t i = 0; i < array_expr->len; ++i)
+            elems[i] = ir_build_expr(ctx, array_get_ptr(array_expr, i));
+
+        ir_instr_t* instr = ir_emit(ctx, IR_ARRAY, 0);
+        for (uint32_t i = 0; i < array_expr->len; ++i)
+            ir_add_arg(instr, elems[i]);
+
+        return instr;
+    }
+
+    // Binary operator (e.g. a + b)
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op == &OP_ASSIGN)
+            return ir_build_assign(ctx, binop->left_expr, binop->right_expr);
+
+        if (binop->op == &OP_AND || binop->op == &OP_OR)
+        {
+            ir_block_t* t = ir_new_block(ctx->fun);
+            ir_block_t* f = ir_new_block(ctx->fun);
+            ir_block_t* join = ir_new_block(ctx->fun);
+
+            ir_build_cond(ctx, expr, t, f);
+
+            ir_start_block(ctx, t);
+            ir_instr_t* v0 = ir_emit_const(ctx, VAL_TRUE);
+            ir_jump(ctx, join);
+
+            ir_start_block(ctx, f);
+            ir_instr_t* v1 = ir_emit_const(ctx, VAL_FALSE);
+            ir_jump(ctx, join);
+
+            ir_start_block(ctx, join);
+            return ir_merge(ctx, v0, v1);
+        }
+
+        ir_op_t op = ir_binop(binop->op);
+
+        if (op == IR_NUM_OPS)
+        {
+            printf("unimplemented binary operator: %s\n", binop->op->str);
+            exit(-1);
+        }
+
+        ir_instr_t* v0 = ir_build_expr(ctx, binop->left_expr);
+        ir_instr_t* v1 = ir_build_expr(ctx, binop->right_expr);
+        return ir_emit(ctx, op, 2, v0, v1);
+    }
+
+    // Unary operator (e.g.: -x, not a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+
+        ir_instr_t* v0 = ir_build_expr(ctx, unop->expr);
+
+        if (unop->op == &OP_NEG)
+            return ir_emit(ctx, IR_NEG, 1, v0);
+        if (unop->op == &OP_NOT)
+            return ir_emit(ctx, IR_NOT, 1, v0);
+
+        printf("unimplemented unary operator: %s\n", unop->op->str);
+        exit(-1);
+    }
+
+    // Sequence/block expression
+    if (shape == SHAPE_AST_SEQ)
+    {
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+
+        ir_instr_t* val = NULL;
+        for (uint32_t i = 0; i < expr_list->len; ++i)
+            val = ir_build_expr(ctx, array_get_ptr(expr_list, i));
+
+        return val? val:ir_emit_const(ctx, VAL_FALSE);
+    }
+
+    // If expression
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        ir_block_t* t = ir_new_block(ctx->fun);
+        ir_block_t* f = ir_new_block(ctx->fun);
+        ir_block_t* join = ir_new_block(ctx->fun);
+
+        ir_build_cond(ctx, ifexpr->test_expr, t, f);
+
+        ir_start_block(ctx, t);
+        ir_instr_t* v0 = ir_build_expr(ctx, ifexpr->then_expr);
+        ir_jump(ctx, join);
+
+        ir_start_block(ctx, f);
+        ir_instr_t* v1 = ir_build_expr(ctx, ifexpr->else_expr);
+        ir_jump(ctx, join);
+
+        ir_start_block(ctx, join);
+        return ir_merge(ctx, v0, v1);
+    }
+
+    // Call expression
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        const builtin_t* builtin = call_builtin(callexpr);
+
+        if (builtin)
+        {
+            ir_instr_t* args[arg_exprs->len + 1];
+            for (uint32_t i = 0; i < arg_exprs->len; ++i)
+                args[i] = ir_build_expr(ctx, array_get_ptr(arg_exprs, i));
+
+            ir_instr_t* instr = ir_emit(ctx, IR_NATIVE, 0);
+            instr->idx = builtin - BUILTINS;
+            for (uint32_t i = 0; i < arg_exprs->len; ++i)
+                ir_add_arg(instr, args[i]);
+
+            return instr;
+        }
+
+        ir_instr_t* args[arg_exprs->len + 1];
+        ir_instr_t* callee = ir_build_callee(ctx, callexpr, args);
+
+        ir_instr_t* instr = ir_emit(ctx, IR_CALL, 1, callee);
+        for (uint32_t i = 0; i < arg_exprs->len; ++i)
+            ir_add_arg(instr, args[i]);
+
+        return instr;
+    }
+
+    // Function/closure expression
+    if (shape == SHAPE_AST_FUN)
+    {
+        ast_fun_t* nested = (ast_fun_t*)expr;
+        array_t* capt_vars = nested->capt_vars;
+
+        // Note: for boxed variables, the cell is captured
+        ir_instr_t* capts[capt_vars->len + 1];
+        for (uint32_t i = 0; i < capt_vars->len; ++i)
+        {
+            ast_decl_t* decl = (ast_decl_t*)array_get_ptr(capt_vars, i);
+
+            if (fun_owns_decl(ctx->ast, decl))
+            {
+                capts[i] = ctx->defs[decl->idx];
+            }
+            else
+            {
+                capts[i] = ir_emit(ctx, IR_GET_ENV, 0);
+                capts[i]->idx = capt_idx(ctx->ast, decl);
+            }
+        }
+
+        ir_instr_t* instr = ir_emit(ctx, IR_CLOS, 0);
+        instr->val = value_from_heapptr(expr, TAG_RAW_PTR);
+        for (uint32_t i = 0; i < capt_vars->len; ++i)
+            ir_add_arg(instr, capts[i]);
+
+        return instr;
+    }
+
+    printf("unknown expression type, shapeidx=%d\n", shape);
+    ir_error("cannot build expression");
+    return NULL;
+}
+
+/// Test if a call is a call of the current function by its own name
+static bool ir_self_call(ir_ctx_t* ctx, ast_call_t* callexpr)
+{
+    heapptr_t fun_expr = callexpr->fun_expr;
+
+    if (ctx->self == NULL || ctx->ast->name == NULL)
+        return false;
+
+    if (callexpr->arg_exprs->len != ctx->ast->param_decls->len)
+        return false;
+
+    return (
+        get_shape(fun_expr) == SHAPE_AST_REF &&
+        ((ast_ref_t*)fun_expr)->name == ctx->ast->name
+    );
+}
+
+/**
+Build an expression in tail position, which ends the function
+Tail calls of the function to itself are turned into jumps to the
+loop header, when the closure called is the current closure.
+*/
+static void ir_build_tail(ir_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_SEQ)
+    {
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+
+        if (expr_list->len > 0)
+        {
+            for (uint32_t i = 0; i + 1 < expr_list->len; ++i)
+                ir_build_expr(ctx, array_get_ptr(expr_list, i));
+
+            ir_build_tail(ctx, array_get_ptr(expr_list, expr_list->len - 1));
+            return;
+        }
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        ir_block_t* t = ir_new_block(ctx->fun);
+        ir_block_t* f = ir_new_block(ctx->fun);
+
+        ir_build_cond(ctx, ifexpr->test_expr, t, f);
+
+        ir_start_block(ctx, t);
+        ir_build_tail(ctx, ifexpr->then_expr);
+
+        ir_start_block(ctx, f);
+        ir_build_tail(ctx, ifexpr->else_expr);
+        return;
+    }
+
+    if (shape == SHAPE_AST_CALL && !call_builtin((ast_call_t*)expr))
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        uint32_t num_args = callexpr->arg_exprs->len;
+
+        ir_instr_t* fun_val = ir_build_expr(ctx, callexpr->fun_expr);
+
+        ir_instr_t* args[num_args + 1];
+        for (uint32_t i = 0; i < num_args; ++i)
+            args[i] = ir_build_expr(ctx, array_get_ptr(callexpr->arg_exprs, i));
+
+        // The current closure needs no check, and comparing with it
+        // doesn't depend on the arguments, so that it can be hoisted
+        if (ir_self_call(ctx, callexpr))
+        {
+            ir_block_t* loop = ir_new_block(ctx->fun);
+            ir_block_t* other = ir_new_block(ctx->fun);
+
+            ir_branch(ctx, ir_emit(ctx, IR_EQ, 2, fun_val, ctx->self), loop, other);
+
+            // The arguments become the parameter values on the back-edge
+            ir_start_block(ctx, loop);
+            for (uint32_t i = 0; i < num_args; ++i)
+                ir_add_arg(ctx->header_phis[i], args[i]);
+            ir_jump(ctx, ctx->fun->header);
+
+            ir_start_block(ctx, other);
+        }
+
+        ir_instr_t* callee = ir_emit(ctx, IR_GUARD_CLOS, 1, fun_val);
+        callee->idx = num_args;
+
+        ir_instr_t* tcall = ir_new_instr(ctx->fun, IR_TCALL, 1);
+        tcall->args[0] = callee;
+        for (uint32_t i = 0; i < num_args; ++i)
+            ir_add_arg(tcall, args[i]);
+
+        ir_end_block(ctx, tcall);
+        return;
+    }
+
+    ir_instr_t* ret = ir_new_instr(ctx->fun, IR_RET, 1);
+    ret->args[0] = ir_build_expr(ctx, expr);
+    ir_end_block(ctx, ret);
+}
+
+/**
+Build the IR of a function
+Note: variable resolution must have been performed first
+*/
+ir_fun_t* ir_build(ast_fun_t* ast)
+{
+    ir_fun_t* fun = calloc(1, sizeof(ir_fun_t));
+    fun->ast = ast;
+
+    uint32_t num_params = ast->param_decls->len;
+
+    ir_ctx_t ctx;
+    ctx.fun = fun;
+    ctx.ast = ast;
+    ctx.num_locals = ast->local_decls->len;
+    ctx.defs = calloc(ctx.num_locals + 1, sizeof(ir_instr_t*));
+    ctx.header_phis = calloc(num_params + 1, sizeof(ir_instr_t*));
+
+    // The entry block receives the arguments, and is the
+    // preheader of the loop formed by self tail calls
+    fun->entry = ir_new_block(fun);
+    ctx.cur = fun->entry;
+
+    // Source units have no closure
+    ctx.self = ast->parent? ir_emit(&ctx, IR_SELF, 0):NULL;
+    ctx.undef = ir_emit_const(&ctx, VAL_FALSE);
+
+    ir_instr_t* params[num_params + 1];
+    for (uint32_t i = 0; i < num_params; ++i)
+    {
+        params[i] = ir_emit(&ctx, IR_PARAM, 0);
+        params[i]->idx = i;
+    }
+
+    for (uint32_t i = 0; i < ctx.num_locals; ++i)
+        ctx.defs[i] = ctx.undef;
+
+    fun->header = ir_new_block(fun);
+    ir_jump(&ctx, fun->header);
+    ctx.cur = fun->header;
+
+    // Each iteration starts with the parameter values and fresh
+    // cells for the boxed variables, as a new call would
+    for (uint32_t i = 0; i < num_params; ++i)
+    {
+        ir_instr_t* phi = ir_new_instr(fun, IR_PHI, 1);
+        phi->args[0] = params[i];
+        ir_insert(fun->header, phi, NULL);
+        ctx.header_phis[i] = phi;
+        ctx.defs[i] = phi;
+    }
+
+    for (uint32_t i = 0; i < ctx.num_locals; ++i)
+        if (decl_boxed(ir_local_decl(&ctx, i)))
+            ctx.defs[i] = ir_emit(&ctx, IR_CELL, 1, ctx.defs[i]);
+
+    ir_build_tail(&ctx, ast->body_expr);
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        free(fun->blocks[i]->defs);
+        fun->blocks[i]->defs = NULL;
+    }
+
+    free(ctx.defs);
+    free(ctx.header_phis);
+
+    ir_order(fun);
+    ir_simplify_phis(fun);
+
+    return fun;
+}
+
+/// Test if an instruction has an effect besides producing a value
+static bool ir_has_effect(ir_instr_t* instr)
+{
+    switch (instr->op)
+    {
+        case IR_SET_GLOBAL:
+        case IR_SET_CELL:
+        case IR_CALL:
+        case IR_NATIVE:
+        return true;
+
+        default:
+        return ir_is_term(instr->op);
+    }
+}
+
+/**
+Test if an instruction may fail at run time
+Specialized operators can be assumed to succeed once the types of their
+operands are known. Globals can't become undefined, so reading a global
+that is defined when the function is compiled can't fail either.
+*/
+static bool ir_may_fail(ir_fun_t* fun, ir_instr_t* instr)
+{
+    switch (instr->op)
+    {
+        case IR_GET_GLOBAL:
+        return fun->ast->globals->vals[instr->idx].tag == VAL_UNDEF.tag;
+
+        case IR_PARAM:
+        case IR_SELF:
+        case IR_CONST:
+        case IR_GET_ENV:
+        case IR_CELL:
+        case IR_GET_CELL:
+        case IR_ARRAY:
+        case IR_CLOS:
+        case IR_PHI:
+        case IR_EQ:
+        case IR_NE:
+        return false;
+
+        case IR_DIV:
+        case IR_MOD:
+        if (instr->spec == TAG_FLOAT64)
+            return false;
+        if (instr->spec != TAG_INT64)
+            return true;
+        return !(
+            instr->args[1]->op == IR_CONST &&
+            instr->args[1]->val.word.int64 != 0
+        );
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_NEG:
+        case IR_NOT:
+        return instr->spec == IR_ANY;
+
+        default:
+        return true;
+    }
+}
+
+/**
+Constant folding
+Operators with constant operands are evaluated, as long as this can't
+fail, and branches on constants become jumps. Returns true if a branch
+was removed, in which case the blocks must be reordered.
+*/
+static bool ir_fold(ir_fun_t* fun)
+{
+    bool branch_folded = false;
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        {
+            for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            {
+                if (instr->op == IR_BRANCH && instr->args[0]->op == IR_CONST)
+                {
+                    value_t v0 = instr->args[0]->val;
+
+                    if (v0.tag != TAG_BOOL)
+                        continue;
+
+                    ir_block_t* taken = instr->targets[eval_truth(v0)? 0:1];
+                    ir_block_t* other = instr->targets[eval_truth(v0)? 1:0];
+
+                    ir_remove_pred(other, ir_pred_idx(other, instr->block));
+                    instr->op = IR_JUMP;
+                    instr->num_args = 0;
+                    instr->targets[0] = taken;
+                    instr->targets[1] = NULL;
+
+                    fun->num_folded++;
+                    branch_folded = true;
+                    continue;
+                }
+
+                bool all_const = instr->num_args > 0;
+                for (uint32_t j = 0; j < instr->num_args; ++j)
+                    if (instr->args[j]->op != IR_CONST)
+                        all_const = false;
+
+                if (!all_const)
+                    continue;
+
+                value_t v0 = instr->args[0]->val;
+                value_t result;
+
+                if (ir_is_binop(instr->op))
+                {
+                    const opinfo_t* op = IR_BINOP_INFO[instr->op];
+                    value_t v1 = instr->args[1]->val;
+
+                    if (!binop_foldable(op, v0, v1))
+                        continue;
+
+                    result = eval_binop_vals(op, v0, v1);
+                }
+                else if (instr->op == IR_NEG &&
+                    (v0.tag == TAG_INT64 || v0.tag == TAG_FLOAT64))
+                {
+                    result = eval_neg(v0);
+                }
+                else if (instr->op == IR_NOT && v0.tag == TAG_BOOL)
+                {
+                    result = eval_truth(v0)? VAL_FALSE:VAL_TRUE;
+                }
+                else
+                {
+                    continue;
+                }
+
+                instr->op = IR_CONST;
+                instr->val = result;
+                instr->num_args = 0;
+
+                fun->num_folded++;
+                changed = true;
+            }
+        }
+    }
+
+    return branch_folded;
+}
+
+/// Compute the type of a value from the types of its operands
+static uint8_t ir_value_type(ir_instr_t* instr)
+{
+    const uint8_t INT = IR_TYPE(TAG_INT64);
+    const uint8_t FLOAT = IR_TYPE(TAG_FLOAT64);
+
+    switch (instr->op)
+    {
+        case IR_CONST:
+        return IR_TYPE(instr->val.tag);
+
+        case IR_SELF:
+        case IR_CLOS:
+        case IR_GUARD_CLOS:
+        return IR_TYPE(TAG_CLOS);
+
+        case IR_CELL:
+        return IR_TYPE(TAG_RAW_PTR);
+
+        case IR_ARRAY:
+        return IR_TYPE(TAG_ARRAY);
+
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NE:
+        case IR_NOT:
+        return IR_TYPE(TAG_BOOL);
+
+        case IR_PHI:
+        {
+            uint8_t type = 0;
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+                type |= instr->args[i]->type;
+            return type;
+        }
+
+        case IR_NEG:
+        {
+            uint8_t t0 = instr->args[0]->type;
+            return (t0 == 0 || t0 == INT || t0 == FLOAT)? t0:IR_ANY;
+        }
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_MOD:
+        {
+            uint8_t t0 = instr->args[0]->type;
+            uint8_t t1 = instr->args[1]->type;
+
+            if (t0 == 0 || t1 == 0)
+                return 0;
+            if (t0 == INT && t1 == INT)
+                return INT;
+            if (t0 == FLOAT && t1 == FLOAT && instr->op != IR_MOD)
+                return FLOAT;
+
+            return IR_ANY;
+        }
+
+        default:
+        return IR_ANY;
+    }
+}
+
+/**
+Type inference
+Types start out empty and grow until a fixed point is reached, so that
+the phi nodes of loops get the most precise type consistent with all
+their incoming values.
+*/
+static void ir_infer_types(ir_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            instr->type = 0;
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        {
+            for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            {
+                uint8_t type = ir_value_type(instr);
+
+                if (type != instr->type)
+                {
+                    instr->type = type;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+/**
+Remove the closure checks which always succeed, and specialize the
+operators whose operand types are known
+*/
+static void ir_specialize(ir_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_instr_t* next;
+
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = next)
+        {
+            next = instr->next;
+
+            if (instr->op == IR_GUARD_CLOS)
+            {
+                ir_instr_t* callee = instr->args[0];
+                ast_fun_t* ast = NULL;
+
+                if (callee->op == IR_CLOS)
+                    ast = (ast_fun_t*)callee->val.word.heapptr;
+                else if (callee->op == IR_SELF)
+                    ast = fun->ast;
+
+                if (ast && ast->param_decls->len == instr->idx)
+                {
+                    ir_replace(instr, callee);
+                    fun->num_guards++;
+                }
+
+                continue;
+            }
+
+            uint8_t spec = IR_ANY;
+
+            if (ir_is_binop(instr->op))
+            {
+                uint8_t t0 = instr->args[0]->type;
+                uint8_t t1 = instr->args[1]->type;
+
+                if (t0 != t1)
+                    continue;
+
+                if (t0 == IR_TYPE(TAG_INT64))
+                    spec = TAG_INT64;
+                else if (t0 == IR_TYPE(TAG_FLOAT64) && instr->op != IR_MOD)
+                    spec = TAG_FLOAT64;
+                else if (t0 == IR_TYPE(TAG_STRING) &&
+                    (instr->op == IR_EQ || instr->op == IR_NE))
+                    spec = TAG_STRING;
+            }
+            else if (instr->op == IR_NEG)
+            {
+                uint8_t t0 = instr->args[0]->type;
+
+                if (t0 == IR_TYPE(TAG_INT64))
+                    spec = TAG_INT64;
+                else if (t0 == IR_TYPE(TAG_FLOAT64))
+                    spec = TAG_FLOAT64;
+            }
+            else if (instr->op == IR_NOT)
+            {
+                if (instr->args[0]->type == IR_TYPE(TAG_BOOL))
+                    spec = TAG_BOOL;
+            }
+
+            if (spec != IR_ANY && instr->spec != spec)
+            {
+                instr->spec = spec;
+                fun->num_spec++;
+            }
+        }
+    }
+
+    ir_update_args(fun);
+}
+
+/// Test if an instruction computes a value which only depends on its operands
+static bool ir_cse_candidate(ir_instr_t* instr)
+{
+    switch (instr->op)
+    {
+        case IR_CONST:
+        case IR_SELF:
+        case IR_GET_ENV:
+        case IR_INDEX:
+        case IR_NEG:
+        case IR_NOT:
+        case IR_GUARD_CLOS:
+        return true;
+
+        default:
+        return ir_is_binop(instr->op);
+    }
+}
+
+/// Test if two instructions compute the same value
+static bool ir_same(ir_instr_t* i0, ir_instr_t* i1)
+{
+    if (i0->op != i1->op || i0->idx != i1->idx || i0->num_args != i1->num_args)
+        return false;
+
+    for (uint32_t i = 0; i < i0->num_args; ++i)
+        if (ir_val(i0->args[i]) != ir_val(i1->args[i]))
+            return false;
+
+    if (i0->op == IR_CONST)
+    {
+        return (
+            i0->val.tag == i1->val.tag &&
+            i0->val.word.int64 == i1->val.word.int64
+        );
+    }
+
+    return true;
+}
+
+/**
+Stack of values available at a point of the dominator tree walk
+*/
+typedef struct
+{
+    ir_instr_t** vals;
+    uint32_t len;
+    uint32_t cap;
+
+} ir_avail_t;
+
+/**
+Common subexpression elimination over the dominator tree
+An instruction is replaced by an identical one which dominates it.
+*/
+static void ir_cse_block(ir_fun_t* fun, ir_block_t* block, ir_avail_t* avail)
+{
+    uint32_t mark = avail->len;
+    ir_instr_t* next;
+
+    for (ir_instr_t* instr = block->first; instr; instr = next)
+    {
+        next = instr->next;
+
+        if (!ir_cse_candidate(instr))
+            continue;
+
+        ir_instr_t* same = NULL;
+        for (uint32_t i = avail->len; i > 0 && !same; --i)
+            if (ir_same(avail->vals[i - 1], instr))
+                same = avail->vals[i - 1];
+
+        if (same)
+        {
+            ir_replace(instr, same);
+            fun->num_cse++;
+            continue;
+        }
+
+        if (avail->len == avail->cap)
+        {
+            avail->cap = avail->cap? (2 * avail->cap):32;
+            avail->vals = realloc(avail->vals, sizeof(ir_instr_t*) * avail->cap);
+        }
+        avail->vals[avail->len++] = instr;
+    }
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* child = fun->blocks[i];
+
+        if (child->idom == block && child != block)
+            ir_cse_block(fun, child, avail);
+    }
+
+    avail->len = mark;
+}
+
+/**
+Load elimination within blocks
+Reads of globals and cells are replaced by the last value read or
+written, until a write or a call which could change it.
+*/
+static void ir_cse_loads(ir_fun_t* fun, ir_block_t* block)
+{
+    // Known (slot or cell, value) pairs
+    uint32_t num_instrs = 0;
+    for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        num_instrs++;
+
+    ir_instr_t** cells = malloc(sizeof(ir_instr_t*) * (num_instrs + 1));
+    ir_instr_t** cell_vals = malloc(sizeof(ir_instr_t*) * (num_instrs + 1));
+    uint32_t num_cells = 0;
+
+    uint32_t* slots = malloc(sizeof(uint32_t) * (num_instrs + 1));
+    ir_instr_t** slot_vals = malloc(sizeof(ir_instr_t*) * (num_instrs + 1));
+    uint32_t num_slots = 0;
+
+    ir_instr_t* next;
+
+    for (ir_instr_t* instr = block->first; instr; instr = next)
+    {
+        next = instr->next;
+
+        switch (instr->op)
+        {
+            case IR_GET_GLOBAL:
+            case IR_SET_GLOBAL:
+            {
+                uint32_t k = 0;
+                while (k < num_slots && slots[k] != instr->idx)
+                    k++;
+
+                if (instr->op == IR_GET_GLOBAL && k < num_slots)
+                {
+                    ir_replace(instr, slot_vals[k]);
+                    fun->num_cse++;
+                    break;
+                }
+
+                if (k == num_slots)
+                    slots[num_slots++] = instr->idx;
+
+                slot_vals[k] = (instr->op == IR_SET_GLOBAL)? ir_val(instr->args[0]):instr;
+            }
+            break;
+
+            case IR_CELL:
+            cells[num_cells] = instr;
+            cell_vals[num_cells++] = ir_val(instr->args[0]);
+            break;
+
+            case IR_GET_CELL:
+            {
+                ir_instr_t* cell = ir_val(instr->args[0]);
+
+                uint32_t k = 0;
+                while (k < num_cells && cells[k] != cell)
+                    k++;
+
+                if (k < num_cells)
+                {
+                    ir_replace(instr, cell_vals[k]);
+                    fun->num_cse++;
+                    break;
+                }
+
+                cells[num_cells] = cell;
+                cell_vals[num_cells++] = instr;
+            }
+            break;
+
+            // Cells may be aliased, so a write forgets all the others
+            case IR_SET_CELL:
+            cells[0] = ir_val(instr->args[0]);
+            cell_vals[0] = ir_val(instr->args[1]);
+            num_cells = 1;
+            break;
+
+            // Builtins don't access globals or cells, unless they
+            // let other code run
+            case IR_CALL:
+            case IR_NATIVE:
+            if (instr->op == IR_CALL || BUILTINS[instr->idx].reenters)
+            {
+                num_cells = 0;
+                num_slots = 0;
+            }
+            break;
+
+            default:
+            break;
+        }
+    }
+
+    free(cells);
+    free(cell_vals);
+    free(slots);
+    free(slot_vals);
+}
+
+static void ir_cse(ir_fun_t* fun)
+{
+    ir_avail_t avail = { NULL, 0, 0 };
+    ir_cse_block(fun, fun->entry, &avail);
+    free(avail.vals);
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        ir_cse_loads(fun, fun->blocks[i]);
+
+    ir_update_args(fun);
+}
+
+/// Test if an instruction is part of the loop
+static bool ir_in_loop(ir_instr_t* instr)
+{
+    return instr->block->in_loop;
+}
+
+/**
+Find the blocks of the loop formed by the back-edges to the header
+Returns false if the function doesn't loop.
+*/
+static bool ir_find_loop(ir_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        fun->blocks[i]->in_loop = false;
+
+    ir_block_t* header = fun->header;
+    ir_block_t** stack = malloc(sizeof(ir_block_t*) * (fun->num_blocks + 1));
+    uint32_t depth = 0;
+
+    header->in_loop = true;
+
+    for (uint32_t k = 0; k < header->num_preds; ++k)
+    {
+        ir_block_t* pred = header->preds[k];
+
+        if (pred != fun->entry && !pred->in_loop)
+        {
+            pred->in_loop = true;
+            stack[depth++] = pred;
+        }
+    }
+
+    bool has_loop = depth > 0;
+
+    while (depth > 0)
+    {
+        ir_block_t* block = stack[--depth];
+
+        for (uint32_t k = 0; k < block->num_preds; ++k)
+        {
+            ir_block_t* pred = block->preds[k];
+
+            if (!pred->in_loop)
+            {
+                pred->in_loop = true;
+                stack[depth++] = pred;
+            }
+        }
+    }
+
+    free(stack);
+
+    if (!has_loop)
+        header->in_loop = false;
+
+    return has_loop;
+}
+
+/**
+Loop-invariant code motion
+Values computed in the loop from operands defined outside of it are
+moved to the end of the entry block, which precedes the loop header.
+Instructions which may fail are only moved if they are in the header
+before any effect or other possible failure, so that they would have
+failed in the first iteration anyway.
+*/
+static void ir_licm(ir_fun_t* fun)
+{
+    if (!ir_find_loop(fun))
+        return;
+
+    // Find what the loop may write
+    bool writes_cells = false;
+    bool makes_calls = false;
+    uint32_t num_globals = fun->ast->globals? fun->ast->globals->len:0;
+    bool* writes_global = calloc(num_globals + 1, sizeof(bool));
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+
+        if (!block->in_loop)
+            continue;
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->op == IR_SET_CELL)
+                writes_cells = true;
+            else if (instr->op == IR_CALL)
+                makes_calls = true;
+            else if (instr->op == IR_NATIVE && BUILTINS[instr->idx].reenters)
+                makes_calls = true;
+            else if (instr->op == IR_SET_GLOBAL && instr->idx < num_globals)
+                writes_global[instr->idx] = true;
+        }
+    }
+
+    ir_block_t* preheader = fun->entry;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+
+        if (!block->in_loop)
+            continue;
+
+        bool barrier = (block != fun->header);
+        ir_instr_t* next;
+
+        for (ir_instr_t* instr = block->first; instr; instr = next)
+        {
+            next = instr->next;
+
+            bool invariant;
+
+            if (instr->op == IR_GET_GLOBAL)
+                invariant = (
+                    !makes_calls &&
+                    instr->idx < num_globals &&
+                    !writes_global[instr->idx]
+                );
+            else if (instr->op == IR_GET_CELL)
+                invariant = !makes_calls && !writes_cells;
+            else
+                invariant = ir_cse_candidate(instr) && instr->op != IR_SELF;
+
+            for (uint32_t j = 0; j < instr->num_args; ++j)
+                if (ir_in_loop(instr->args[j]))
+                    invariant = false;
+
+            if (invariant && (!barrier || !ir_may_fail(fun, instr)))
+            {
+                ir_unlink(instr);
+                ir_insert(preheader, instr, preheader->last);
+                fun->num_hoisted++;
+                continue;
+            }
+
+            if (ir_has_effect(instr) || ir_may_fail(fun, instr))
+                barrier = true;
+        }
+    }
+
+    free(writes_global);
+}
+
+/**
+Dead code elimination
+Values which are not used by an instruction with an effect, directly
+or indirectly, are removed. Instructions which may fail are kept.
+*/
+static void ir_dce(ir_fun_t* fun)
+{
+    bool* live = calloc(fun->num_instrs + 1, sizeof(bool));
+    ir_instr_t** work = malloc(sizeof(ir_instr_t*) * (fun->num_instrs + 1));
+    uint32_t num_work = 0;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+        {
+            if (ir_has_effect(instr) || ir_may_fail(fun, instr))
+            {
+                live[instr->id] = true;
+                work[num_work++] = instr;
+            }
+        }
+    }
+
+    while (num_work > 0)
+    {
+        ir_instr_t* instr = work[--num_work];
+
+        for (uint32_t j = 0; j < instr->num_args; ++j)
+        {
+            ir_instr_t* arg = instr->args[j];
+
+            if (!live[arg->id])
+            {
+                live[arg->id] = true;
+                work[num_work++] = arg;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_instr_t* next;
+
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = next)
+        {
+            next = instr->next;
+
+            if (!live[instr->id])
+            {
+                ir_unlink(instr);
+                fun->num_dead++;
+            }
+        }
+    }
+
+    free(live);
+    free(work);
+}
+
+/**
+Optimize the IR of a function
+*/
+void ir_optimize(ir_fun_t* fun)
+{
+    while (ir_fold(fun))
+    {
+        ir_order(fun);
+        ir_simplify_phis(fun);
+    }
+
+    ir_infer_types(fun);
+    ir_specialize(fun);
+
+    ir_cse(fun);
+    ir_licm(fun);
+    ir_cse(fun);
+
+    ir_dce(fun);
+}
+
+/// Bit set operations, for the liveness sets
+static bool bits_test(uint64_t* bits, uint32_t i)
+{
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void bits_set(uint64_t* bits, uint32_t i)
+{
+    bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void bits_clear(uint64_t* bits, uint32_t i)
+{
+    bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/**
+Split the edges from blocks with two successors to blocks with phi
+nodes, so that the moves implementing the phi nodes have a place of
+their own. The new blocks follow their predecessor in the block order.
+*/
+static void ir_split_edges(ir_fun_t* fun)
+{
+    uint32_t num_blocks = fun->num_blocks;
+    ir_block_t** order = malloc(sizeof(ir_block_t*) * (3 * num_blocks + 1));
+    uint32_t num_order = 0;
+
+    for (uint32_t i = 0; i < num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+        order[num_order++] = block;
+
+        if (ir_num_succs(block) < 2)
+            continue;
+
+        for (uint32_t k = 0; k < 2; ++k)
+        {
+            ir_block_t* succ = block->last->targets[k];
+
+            if (succ->first == NULL || succ->first->op != IR_PHI)
+                continue;
+
+            ir_block_t* edge = ir_new_block(fun);
+            ir_instr_t* jump = ir_new_instr(fun, IR_JUMP, 0);
+            jump->targets[0] = succ;
+            ir_insert(edge, jump, NULL);
+
+            ir_add_pred(edge, block);
+            edge->idom = block;
+            succ->preds[ir_pred_idx(succ, block)] = edge;
+            block->last->targets[k] = edge;
+
+            order[num_order++] = edge;
+        }
+    }
+
+    memcpy(fun->blocks, order, sizeof(ir_block_t*) * num_order);
+    fun->num_blocks = num_order;
+    free(order);
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        fun->blocks[i]->id = i;
+}
+
+/// Test if an instruction produces a value which needs a register
+static bool ir_needs_reg(ir_instr_t* instr)
+{
+    if (instr->op == IR_SET_GLOBAL || instr->op == IR_SET_CELL)
+        return false;
+
+    return !ir_is_term(instr->op) && !instr->fused;
+}
+
+/**
+Compute the live ranges of the values
+Each value gets a single range of positions, from its definition to
+its last use, covering the blocks it is live through. Positions follow
+the block order, with one position for the phi nodes of each block.
+*/
+static void ir_live_ranges(ir_fun_t* fun)
+{
+    uint32_t num_words = (fun->num_instrs + 63) / 64;
+
+    uint32_t pos = 1;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+        block->start_pos = pos++;
+        block->live_in = calloc(num_words + 1, sizeof(uint64_t));
+        block->live_out = calloc(num_words + 1, sizeof(uint64_t));
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->op == IR_PHI)
+            {
+                instr->live_start = instr->live_end = block->start_pos;
+                continue;
+            }
+
+            instr->live_start = instr->live_end = pos;
+            block->end_pos = pos++;
+        }
+    }
+
+    // Backward dataflow analysis
+    uint64_t* live = calloc(num_words + 1, sizeof(uint64_t));
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (uint32_t i = fun->num_blocks; i > 0; --i)
+        {
+            ir_block_t* block = fun->blocks[i - 1];
+            memset(live, 0, sizeof(uint64_t) * num_words);
+
+            for (uint32_t k = 0; k < ir_num_succs(block); ++k)
+            {
+                ir_block_t* succ = block->last->targets[k];
+
+                for (uint32_t w = 0; w < num_words; ++w)
+                    live[w] |= succ->live_in[w];
+
+                uint32_t pred_idx = ir_pred_idx(succ, block);
+                for (ir_instr_t* phi = succ->first; phi && phi->op == IR_PHI; phi = phi->next)
+                    bits_set(live, phi->args[pred_idx]->id);
+            }
+
+            memcpy(block->live_out, live, sizeof(uint64_t) * num_words);
+
+            for (ir_instr_t* instr = block->last; instr; instr = instr->prev)
+            {
+                bits_clear(live, instr->id);
+
+                if (instr->op == IR_PHI)
+                    continue;
+
+                for (uint32_t j = 0; j < instr->num_args; ++j)
+                    bits_set(live, instr->args[j]->id);
+            }
+
+            if (memcmp(live, block->live_in, sizeof(uint64_t) * num_words) != 0)
+            {
+                memcpy(block->live_in, live, sizeof(uint64_t) * num_words);
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+
+    // Extend the ranges to the uses and the blocks values are live through
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->op == IR_PHI)
+            {
+                // The moves into the phi node happen at the end of the predecessors
+                for (uint32_t k = 0; k < block->num_preds; ++k)
+                {
+                    uint32_t end_pos = block->preds[k]->end_pos;
+                    if (end_pos < instr->live_start)
+                        instr->live_start = end_pos;
+                    if (end_pos > instr->live_end)
+                        instr->live_end = end_pos;
+                }
+
+                continue;
+            }
+
+            for (uint32_t j = 0; j < instr->num_args; ++j)
+            {
+                ir_instr_t* arg = instr->args[j];
+                if (instr->live_start > arg->live_end)
+                    arg->live_end = instr->live_start;
+            }
+        }
+
+        for (uint32_t id = 0; id < fun->num_instrs; ++id)
+        {
+            ir_instr_t* instr = fun->instrs[id];
+
+            if (bits_test(block->live_in, id) && block->start_pos < instr->live_start)
+                instr->live_start = block->start_pos;
+            if (bits_test(block->live_in, id) && block->start_pos > instr->live_end)
+                instr->live_end = block->start_pos;
+            if (bits_test(block->live_out, id) && block->end_pos > instr->live_end)
+                instr->live_end = block->end_pos;
+        }
+    }
+
+    // Arguments are in their registers on entry
+    for (ir_instr_t* instr = fun->entry->first; instr; instr = instr->next)
+        if (instr->op == IR_PARAM)
+            instr->live_start = 0;
+}
+
+static int ir_cmp_start(const void* p0, const void* p1)
+{
+    const ir_instr_t* i0 = *(ir_instr_t* const*)p0;
+    const ir_instr_t* i1 = *(ir_instr_t* const*)p1;
+
+    if (i0->live_start != i1->live_start)
+        return (i0->live_start < i1->live_start)? -1:1;
+
+    return (i0->id < i1->id)? -1:(i0->id > i1->id);
+}
+
+/**
+Linear scan register allocation
+Returns the number of registers used. Arguments stay in the registers
+they are passed in. A phi node may take the register of a value whose
+last use is the move into the phi node.
+*/
+static uint32_t ir_alloc_regs(ir_fun_t* fun)
+{
+    uint32_t num_params = fun->ast->param_decls->len;
+
+    ir_instr_t** vals = malloc(sizeof(ir_instr_t*) * (fun->num_instrs + 1));
+    uint32_t num_vals = 0;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            if (ir_needs_reg(instr))
+                vals[num_vals++] = instr;
+
+    qsort(vals, num_vals, sizeof(ir_instr_t*), ir_cmp_start);
+
+    uint32_t* busy_until = calloc(num_vals + num_params + 1, sizeof(uint32_t));
+    uint32_t num_regs = num_params;
+
+    for (uint32_t i = 0; i < num_vals; ++i)
+    {
+        ir_instr_t* val = vals[i];
+        uint32_t reg = 0;
+
+        if (val->op == IR_PARAM)
+        {
+            reg = val->idx;
+        }
+        else
+        {
+            while (busy_until[reg] > val->live_start ||
+                (busy_until[reg] == val->live_start && val->op != IR_PHI))
+                reg++;
+        }
+
+        val->reg = reg;
+        busy_until[reg] = val->live_end;
+
+        if (reg + 1 > num_regs)
+            num_regs = reg + 1;
+    }
+
+    free(vals);
+    free(busy_until);
+
+    return num_regs;
+}
+
+/// Size of the area needed to pass the operands of an instruction
+static uint32_t ir_area_size(ir_instr_t* instr)
+{
+    switch (instr->op)
+    {
+        case IR_CALL:
+        case IR_TCALL:
+        return BC_CALL_HDR_REGS + instr->num_args;
+
+        case IR_NATIVE:
+        case IR_ARRAY:
+        case IR_CLOS:
+        return instr->num_args;
+
+        default:
+        return 0;
+    }
+}
+
+/**
+Bytecode generation context
+*/
+typedef struct
+{
+    bc_fun_t* fun;
+
+    /// First register of the operand area, above all values
+    /// Also used as a scratch register for the phi moves
+    uint32_t area;
+
+    /// First instruction of each block
+    uint32_t* block_starts;
+
+    /// Jumps to patch, with their target blocks
+    uint32_t* jumps;
+    ir_block_t** jump_targets;
+    uint32_t num_jumps;
+    uint32_t jumps_cap;
+
+} ir_lower_ctx_t;
+
+/// Append a bytecode instruction, returns its index
+static uint32_t ir_emit_bc(ir_lower_ctx_t* ctx, opcode_t op, uint32_t a, uint32_t b, uint32_t c)
+{
+    bc_fun_t* fun = ctx->fun;
+
+    if (fun->code_len == fun->code_cap)
+    {
+        fun->code_cap = fun->code_cap? (2 * fun->code_cap):32;
+        fun->code = realloc(fun->code, sizeof(instr_t) * fun->code_cap);
+    }
+
+    if (fun->code_len >= BC_MAX_REGS)
+        ir_error("function too long");
+
+    instr_t* instr = &fun->code[fun->code_len];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = c;
+
+    return fun->code_len++;
+}
+
+/// Add a value to the constant pool, reusing equal constants
+static uint32_t ir_add_const(ir_lower_ctx_t* ctx, value_t val)
+{
+    bc_fun_t* fun = ctx->fun;
+
+    for (uint32_t i = 0; i < fun->num_consts; ++i)
+        if (fun->consts[i].tag == val.tag && fun->consts[i].word.int64 == val.word.int64)
+            return i;
+
+    if (fun->num_consts == fun->consts_cap)
+    {
+        fun->consts_cap = fun->consts_cap? (2 * fun->consts_cap):8;
+        fun->consts = realloc(fun->consts, sizeof(value_t) * fun->consts_cap);
+    }
+
+    if (fun->num_consts >= BC_MAX_REGS)
+        ir_error("too many constants");
+
+    fun->consts[fun->num_consts] = val;
+    return fun->num_consts++;
+}
+
+/// Emit a jump to a block, patched once the block is placed
+static void ir_emit_jump(ir_lower_ctx_t* ctx, opcode_t op, uint32_t a, uint32_t b, ir_block_t* target)
+{
+    if (ctx->num_jumps == ctx->jumps_cap)
+    {
+        ctx->jumps_cap = ctx->jumps_cap? (2 * ctx->jumps_cap):16;
+        ctx->jumps = realloc(ctx->jumps, sizeof(uint32_t) * ctx->jumps_cap);
+        ctx->jump_targets = realloc(ctx->jump_targets, sizeof(ir_block_t*) * ctx->jumps_cap);
+    }
+
+    ctx->jumps[ctx->num_jumps] = ir_emit_bc(ctx, op, a, b, 0);
+    ctx->jump_targets[ctx->num_jumps++] = target;
+}
+
+/// Copy operand values into the operand area
+static void ir_emit_operands(ir_lower_ctx_t* ctx, ir_instr_t* instr, uint32_t first, uint32_t dst)
+{
+    for (uint32_t j = first; j < instr->num_args; ++j)
+        ir_emit_bc(ctx, BC_MOV, dst + j - first, instr->args[j]->reg, 0);
+}
+
+/**
+Emit the moves into the phi nodes of a block, as a parallel copy
+Cycles of moves are broken with the scratch register.
+*/
+static void ir_emit_phi_moves(ir_lower_ctx_t* ctx, ir_block_t* pred, ir_block_t* succ)
+{
+    uint32_t num_phis = 0;
+    for (ir_instr_t* phi = succ->first; phi && phi->op == IR_PHI; phi = phi->next)
+        num_phis++;
+
+    uint32_t dsts[num_phis + 1];
+    uint32_t srcs[num_phis + 1];
+    uint32_t num_moves = 0;
+
+    uint32_t pred_idx = ir_pred_idx(succ, pred);
+    for (ir_instr_t* phi = succ->first; phi && phi->op == IR_PHI; phi = phi->next)
+    {
+        if (phi->reg == phi->args[pred_idx]->reg)
+            continue;
+
+        dsts[num_moves] = phi->reg;
+        srcs[num_moves++] = phi->args[pred_idx]->reg;
+    }
+
+    while (num_moves > 0)
+    {
+        // Find a move whose destination is not read by another move
+        uint32_t i = 0;
+        for (; i < num_moves; ++i)
+        {
+            bool read = false;
+            for (uint32_t j = 0; j < num_moves; ++j)
+                if (srcs[j] == dsts[i])
+                    read = true;
+
+            if (!read)
+                break;
+        }
+
+        if (i < num_moves)
+        {
+            ir_emit_bc(ctx, BC_MOV, dsts[i], srcs[i], 0);
+            dsts[i] = dsts[num_moves - 1];
+            srcs[i] = srcs[num_moves - 1];
+            num_moves--;
+            continue;
+        }
+
+        uint32_t saved = dsts[0];
+        ir_emit_bc(ctx, BC_MOV, ctx->area, saved, 0);
+        for (uint32_t j = 0; j < num_moves; ++j)
+            if (srcs[j] == saved)
+                srcs[j] = ctx->area;
+    }
+}
+
+/// Emit the bytecode of an instruction
+static void ir_lower_instr(ir_lower_ctx_t* ctx, ir_fun_t* fun, ir_instr_t* instr, ir_block_t* next_block)
+{
+    uint32_t area = ctx->area;
+    ir_instr_t** args = instr->args;
+
+    switch (instr->op)
+    {
+        // Arguments are already in place
+        case IR_PARAM:
+        case IR_PHI:
+        break;
+
+        case IR_SELF:
+        ir_emit_bc(ctx, BC_SELF, instr->reg, 0, 0);
+        break;
+
+        case IR_CONST:
+        ir_emit_bc(ctx, BC_CONST, instr->reg, ir_add_const(ctx, instr->val), 0);
+        break;
+
+        case IR_GET_GLOBAL:
+        if (instr->idx >= BC_MAX_REGS)
+            ir_error("too many global variables");
+        ir_emit_bc(ctx, BC_GET_GLOBAL, instr->reg, instr->idx, 0);
+        break;
+
+        case IR_SET_GLOBAL:
+        if (instr->idx >= BC_MAX_REGS)
+            ir_error("too many global variables");
+        ir_emit_bc(ctx, BC_SET_GLOBAL, instr->idx, args[0]->reg, 0);
+        break;
+
+        case IR_GET_ENV:
+        ir_emit_bc(ctx, BC_GET_ENV, instr->reg, instr->idx, 0);
+        break;
+
+        case IR_CELL:
+        ir_emit_bc(ctx, BC_CELL, instr->reg, args[0]->reg, 0);
+        break;
+
+        case IR_GET_CELL:
+        ir_emit_bc(ctx, BC_GET_CELL, instr->reg, args[0]->reg, 0);
+        break;
+
+        case IR_SET_CELL:
+        ir_emit_bc(ctx, BC_SET_CELL, args[0]->reg, args[1]->reg, 0);
+        break;
+
+        case IR_ARRAY:
+        ir_emit_operands(ctx, instr, 0, area);
+        ir_emit_bc(ctx, BC_ARRAY, instr->reg, area, instr->num_args);
+        break;
+
+        case IR_INDEX:
+        ir_emit_bc(ctx, BC_INDEX, instr->reg, args[0]->reg, args[1]->reg);
+        break;
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_MOD:
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NE:
+        {
+            // Fused comparisons are emitted with their branch
+            if (instr->fused)
+                break;
+
+            opcode_t op = IR_BC_OP[instr->op];
+
+            // Specialized operators skip the quickening step
+            if (instr->spec == TAG_INT64 && BC_QUICK_I64[op])
+                op = BC_QUICK_I64[op];
+            else if (instr->spec == TAG_FLOAT64 && BC_QUICK_F64[op])
+                op = BC_QUICK_F64[op];
+            else if (instr->spec == TAG_STRING && BC_QUICK_STR[op])
+                op = BC_QUICK_STR[op];
+
+            ir_emit_bc(ctx, op, instr->reg, args[0]->reg, args[1]->reg);
+        }
+        break;
+
+        case IR_NEG:
+        ir_emit_bc(ctx, BC_NEG, instr->reg, args[0]->reg, 0);
+        break;
+
+        case IR_NOT:
+        ir_emit_bc(ctx, BC_NOT, instr->reg, args[0]->reg, 0);
+        break;
+
+        case IR_CLOS:
+        ir_emit_operands(ctx, instr, 0, area);
+        ir_emit_bc(ctx, BC_CLOS, instr->reg, area, ir_add_const(ctx, instr->val));
+        break;
+
+        case IR_CALL:
+        case IR_TCALL:
+        ir_emit_bc(ctx, BC_MOV, area, args[0]->reg, 0);
+        ir_emit_operands(ctx, instr, 1, area + 1 + BC_CALL_HDR_REGS);
+        ir_emit_bc(
+            ctx,
+            (instr->op == IR_CALL)? BC_CALL:BC_TCALL,
+            (instr->op == IR_CALL)? instr->reg:0,
+            area,
+            instr->num_args - 1
+        );
+        break;
+
+        case IR_NATIVE:
+        ir_emit_operands(ctx, instr, 0, area);
+        ir_emit_bc(ctx, BC_NATIVE, instr->reg, area, instr->idx);
+        break;
+
+        case IR_RET:
+        ir_emit_bc(ctx, BC_RET, args[0]->reg, 0, 0);
+        break;
+
+        case IR_JUMP:
+        {
+            ir_block_t* target = instr->targets[0];
+
+            ir_emit_phi_moves(ctx, instr->block, target);
+
+            if (target == fun->header && instr->block != fun->entry)
+                ir_emit_jump(ctx, BC_LOOP, 0, 0, target);
+            else if (target != next_block)
+                ir_emit_jump(ctx, BC_JUMP, 0, 0, target);
+        }
+        break;
+
+        case IR_BRANCH:
+        {
+            ir_instr_t* cond = args[0];
+            ir_block_t* t = instr->targets[0];
+            ir_block_t* f = instr->targets[1];
+
+            // Jump to the block which doesn't follow
+            bool jump_if = (t != next_block);
+            ir_block_t* target = jump_if? t:f;
+
+            if (cond->fused)
+            {
+                opcode_t op = cmp_jump_opcode(IR_BINOP_INFO[cond->op], jump_if);
+                ir_emit_jump(ctx, op, cond->args[0]->reg, cond->args[1]->reg, target);
+            }
+            else
+            {
+                ir_emit_jump(ctx, jump_if? BC_JTRUE:BC_JFALSE, cond->reg, 0, target);
+            }
+
+            if (jump_if && f != next_block)
+                ir_emit_jump(ctx, BC_JUMP, 0, 0, f);
+        }
+        break;
+
+        default:
+        assert (false);
+    }
+}
+
+/**
+Translate optimized IR into register bytecode
+Note: the IR is modified and can't be optimized further
+*/
+bc_fun_t* ir_lower(ir_fun_t* fun)
+{
+    // The bytecode call instructions check their callee
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_instr_t* next;
+
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = next)
+        {
+            next = instr->next;
+
+            if (instr->op == IR_GUARD_CLOS)
+                ir_replace(instr, instr->args[0]);
+        }
+    }
+
+    ir_update_args(fun);
+    ir_split_edges(fun);
+
+    // Fuse the comparisons only used by the branch which follows them
+    uint32_t* num_uses = calloc(fun->num_instrs + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            for (uint32_t j = 0; j < instr->num_args; ++j)
+                num_uses[instr->args[j]->id]++;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_instr_t* term = fun->blocks[i]->last;
+        ir_instr_t* cond = term->prev;
+
+        if (term->op == IR_BRANCH &&
+            cond && cond == term->args[0] &&
+            cond->op >= IR_LT && cond->op <= IR_NE &&
+            num_uses[cond->id] == 1)
+            cond->fused = true;
+    }
+
+    free(num_uses);
+
+    ir_live_ranges(fun);
+    uint32_t num_vals = ir_alloc_regs(fun);
+
+    uint32_t area_size = 1;
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+        {
+            uint32_t size = ir_area_size(instr);
+            if (size > area_size)
+                area_size = size;
+        }
+    }
+
+    if (num_vals + area_size >= BC_MAX_REGS)
+        ir_error("too many registers");
+
+    bc_fun_t* bc_fun = calloc(1, sizeof(bc_fun_t));
+    bc_fun->ast = fun->ast;
+    bc_fun->num_locals = fun->ast->param_decls->len;
+    bc_fun->num_regs = num_vals + area_size;
+
+    ir_lower_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fun = bc_fun;
+    ctx.area = num_vals;
+    ctx.block_starts = malloc(sizeof(uint32_t) * (fun->num_blocks + 1));
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+        ir_block_t* next_block = (i + 1 < fun->num_blocks)? fun->blocks[i + 1]:NULL;
+
+        ctx.block_starts[block->id] = bc_fun->code_len;
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+            ir_lower_instr(&ctx, fun, instr, next_block);
+    }
+
+    for (uint32_t i = 0; i < ctx.num_jumps; ++i)
+    {
+        instr_t* jump = &bc_fun->code[ctx.jumps[i]];
+        uint32_t target = ctx.block_starts[ctx.jump_targets[i]->id];
+
+        if (jump->op >= BC_JLT && jump->op <= BC_JNGE)
+            jump->c = target;
+        else
+            jump->b = target;
+    }
+
+    free(ctx.block_starts);
+    free(ctx.jumps);
+    free(ctx.jump_targets);
+
+    return bc_fun;
+}
+
+/**
+Free the IR of a function
+*/
+void ir_free(ir_fun_t* fun)
+{
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+        free(block->preds);
+        free(block->defs);
+        free(block->live_in);
+        free(block->live_out);
+        free(block);
+    }
+
+    for (uint32_t i = 0; i < fun->num_instrs; ++i)
+    {
+        free(fun->instrs[i]->args);
+        free(fun->instrs[i]);
+    }
+
+    free(fun->blocks);
+    free(fun->instrs);
+    free(fun);
+}
+
+/**
+Print the IR of a function
+*/
+void ir_dump(ir_fun_t* fun)
+{
+    static const char* SPEC_NAMES[] = {
+        [TAG_BOOL] = "bool",
+        [TAG_INT64] = "i64",
+        [TAG_FLOAT64] = "f64",
+        [TAG_STRING] = "str",
+        [TAG_ARRAY] = "array",
+        [TAG_RAW_PTR] = "ptr",
+        [TAG_OBJECT] = "obj",
+        [TAG_CLOS] = "clos"
+    };
+
+    printf("fun ");
+    print_fun_name(fun->ast);
+    printf(
+        ": %d params, %d folded, %d guards removed, %d specialized, "
+        "%d cse, %d hoisted, %d dead\n",
+        fun->ast->param_decls->len,
+        fun->num_folded,
+        fun->num_guards,
+        fun->num_spec,
+        fun->num_cse,
+        fun->num_hoisted,
+        fun->num_dead
+    );
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        ir_block_t* block = fun->blocks[i];
+
+        printf("b%d:", block->id);
+        if (block->num_preds > 0)
+        {
+            printf(" preds");
+            for (uint32_t k = 0; k < block->num_preds; ++k)
+                printf(" b%d", block->preds[k]->id);
+        }
+        if (block == fun->header && block->num_preds > 1)
+            printf(", loop header");
+        putchar('\n');
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            printf("  ");
+            if (!ir_is_term(instr->op) && instr->op != IR_SET_GLOBAL && instr->op != IR_SET_CELL)
+                printf("v%d = ", instr->id);
+
+            printf("%s", IR_OP_NAMES[instr->op]);
+            if (instr->spec != IR_ANY)
+                printf(".%s", SPEC_NAMES[instr->spec]);
+
+            for (uint32_t j = 0; j < instr->num_args; ++j)
+                printf("%s v%d", j? ",":"", instr->args[j]->id);
+
+            switch (instr->op)
+            {
+                case IR_PARAM:
+                case IR_GET_ENV:
+                case IR_GUARD_CLOS:
+                printf(" %d", instr->idx);
+                break;
+
+                case IR_CONST:
+                putchar(' ');
+                value_print(instr->val);
+                break;
+
+                case IR_GET_GLOBAL:
+                case IR_SET_GLOBAL:
+                {
+                    string_t* name = fun->ast->globals->names[instr->idx];
+                    printf("%s %.*s", instr->num_args? ",":"", (int)name->len, name->data);
+                }
+                break;
+
+                case IR_NATIVE:
+                printf("%s %s", instr->num_args? ",":"", BUILTINS[instr->idx].name);
+                break;
+
+                case IR_CLOS:
+                printf("%s ", instr->num_args? ",":"");
+                print_fun_name((ast_fun_t*)instr->val.word.heapptr);
+                break;
+
+                case IR_JUMP:
+                printf(" b%d", instr->targets[0]->id);
+                break;
+
+                case IR_BRANCH:
+                printf(", b%d, b%d", instr->targets[0]->id, instr->targets[1]->id);
+                break;
+
+                default:
+                break;
+            }
+
+            putchar('\n');
+        }
+    }
+}
+
+/**
+Compile a function to bytecode through the IR
+*/
+bc_fun_t* ir_compile(ast_fun_t* ast)
+{
+    ir_fun_t* fun = ir_build(ast);
+    ir_optimize(fun);
+
+    if (opt_dump_ir)
+        ir_dump(fun);
+
+    bc_fun_t* bc_fun = ir_lower(fun);
+    ir_free(fun);
+
+    if (opt_dump_ir)
+    {
+        bc_dump(bc_fun);
+        putchar('\n');
+    }
+
+    return bc_fun;
+}
+
+/// Check that a unit evaluates to the same value through the IR,
+/// with and without machine code compilation of the loops
+void ir_test_eq(char* cstr)
+{
+    value_t expected = eval_unit(load_str(cstr, "test"));
+
+    opt_ir = true;
+    value_t ir_value = bc_eval_unit(load_str(cstr, "test"));
+
+    uint32_t threshold = jit_threshold;
+    opt_jit = true;
+    jit_threshold = 1;
+    value_t jit_value = bc_eval_unit(load_str(cstr, "test"));
+    opt_jit = false;
+    jit_threshold = threshold;
+    opt_ir = false;
+
+    if (!value_equals(ir_value, expected) || !value_equals(jit_value, expected))
+    {
+        printf("ir value doesn't match for input:\n%s\n", cstr);
+        exit(-1);
+    }
+}
+
+/// Build and optimize the IR of the first function defined by a unit
+ir_fun_t* ir_test_fun(char* cstr)
+{
+    opt_inline = false;
+    opt_escape = false;
+    ast_fun_t* unit_fun = load_str(cstr, "test");
+    opt_inline = true;
+    opt_escape = true;
+
+    array_t* expr_list = ((ast_seq_t*)unit_fun->body_expr)->expr_list;
+    heapptr_t expr = NULL;
+
+    for (uint32_t i = 0; i < expr_list->len && !expr; ++i)
+    {
+        ast_binop_t* binop = (ast_binop_t*)array_get_ptr(expr_list, i);
+
+        if (get_shape((heapptr_t)binop) == SHAPE_AST_BINOP &&
+            get_shape(binop->right_expr) == SHAPE_AST_FUN)
+            expr = binop->right_expr;
+    }
+
+    assert (expr != NULL);
+
+    ir_fun_t* fun = ir_build((ast_fun_t*)expr);
+    ir_optimize(fun);
+
+    ir_test_eq(cstr);
+
+    return fun;
+}
+
+/// Count the instructions of a given kind in a block, or all blocks if NULL
+uint32_t ir_test_count(ir_fun_t* fun, ir_block_t* block, ir_op_t op)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < fun->num_blocks; ++i)
+    {
+        if (block && fun->blocks[i] != block)
+            continue;
+
+        for (ir_instr_t* instr = fun->blocks[i]->first; instr; instr = instr->next)
+            if (instr->op == op)
+                count++;
+    }
+
+    return count;
+}
+
+void test_ir()
+{
+    // Straight-line code and control flow
+    ir_test_eq("1 + 2");
+    ir_test_eq("let x = 3\nlet y = 4\nx * y - 1");
+    ir_test_eq("if 1 < 2 then 3 else 4");
+    ir_test_eq("let f = fun (a, b) if a < b and b < 10 then a else b\nf(1, 2) + f(3, 2)");
+    ir_test_eq("let f = fun (a, b) a < b or b == 0\nlet x = f(2, 1)\nf(1, 2) and not x and f(2, 0)");
+    ir_test_eq("let f = fun (a) not a\nf(false)");
+    ir_test_eq("let f = fun (x) { var y = 1\nif x > 0 then y = x * 2 else y = 0\ny + 1 }\nf(4) + f(-1)");
+    ir_test_eq("let f = fun (s) s == \"foo\"\nlet x = f(\"bar\")\nf(\"foo\") and not x");
+    ir_test_eq("let f = fun (a, i) a[i] + a[i]\nf([1, 2, 3], 2)");
+    ir_test_eq("let f = fun (x, y) -x / y + x mod y\nf(7, 2) + f(-9, 4)");
+    ir_test_eq("let f = fun (x) min(x, 3) + abs(x)\nf(-5)");
+
+    // Loops formed by self tail calls
+    ir_test_eq("let f = fun (n, acc) if n == 0 then acc else f(n - 1, acc + n)\nf(100, 0)");
+    ir_test_eq("let f = fun (n, a, b) if n == 0 then a else f(n - 1, b, a)\nf(7, 1, 2)");
+    ir_test_eq("let f = fun (n, x) if n == 0 then x else f(n - 1, x * 1.5)\nf(10, 1.0)");
+    ir_test_eq("let f = fun (n) { let m = n * 2\nif n < 1000 then f(n + 1) else m }\nf(0)");
+    ir_test_eq("let g = fun (n) n\nlet f = fun (n) if n < 10 then f(n + 1) else g(n)\nf(0)");
+
+    // Closures capturing loop variables get a fresh cell per iteration
+    ir_test_eq(
+        "let f = fun (n, k) { var x = n\nlet c = fun () x\nx = x + 1\n"
+        "if n == 0 then c() + k else f(n - 1, k + c()) }\nf(5, 0)"
+    );
+    ir_test_eq("let mk = fun (x) fun (y) x + y\nlet add3 = mk(3)\nadd3(4)");
+    ir_test_eq("var x = 3\nlet f = fun () x\nx = 4\nf()");
+
+    // Globals written in the loop, and by calls
+    ir_test_eq("var t = 0\nlet f = fun (n) if n == 0 then t else { t = t + n\nf(n - 1) }\nf(10)");
+    ir_test_eq(
+        "var t = 1\nlet g = fun () t = t * 2\n"
+        "let f = fun (n, a) if n == 0 then a else { let v = t\ng()\nf(n - 1, a + v + t) }\nf(5, 0)"
+    );
+
+    // Calls of another closure through the function's name aren't loops
+    ir_test_eq(
+        "let g = fun (f, n) 7\n"
+        "let f = fun (f, n) if n == 0 then 1 else f(f, n - 1)\nf(f, 3) * 10 + f(g, 3)"
+    );
+
+    ir_fun_t* fun;
+
+    // Common subexpressions are computed once
+    fun = ir_test_fun("let f = fun (x, y) (x * y) + (x * y)\nf(3, 4)");
+    assert (ir_test_count(fun, NULL, IR_MUL) == 1);
+    ir_free(fun);
+
+    // Globals are only read again after a write or call
+    fun = ir_test_fun("let g = 2\nlet f = fun (x) x * g + g\nf(3)");
+    assert (ir_test_count(fun, NULL, IR_GET_GLOBAL) == 1);
+    ir_free(fun);
+
+    // Calls of closures known to take the right number of arguments
+    // need no check
+    fun = ir_test_fun("let f = fun (x) { let g = fun (y) y + 1\ng(x) * 2 }\nf(1)");
+    assert (ir_test_count(fun, NULL, IR_GUARD_CLOS) == 0);
+    assert (ir_test_count(fun, NULL, IR_CALL) == 1);
+    ir_free(fun);
+
+    // Operators on values of known type are specialized
+    fun = ir_test_fun("let f = fun (b) { let x = if b then 1 else 2\nx + 3 }\nf(true)");
+    for (uint32_t i = 0; i < fun->num_instrs; ++i)
+        if (fun->instrs[i]->op == IR_ADD && fun->instrs[i]->block)
+            assert (fun->instrs[i]->spec == TAG_INT64);
+    ir_free(fun);
+
+    // Loop-invariant values are computed before the loop
+    fun = ir_test_fun("let f = fun (i, n, k) if i == n * k then i else f(i + 1, n, k)\nf(0, 3, 4)");
+    assert (fun->header->num_preds == 2);
+    assert (ir_test_count(fun, fun->entry, IR_MUL) == 1);
+    assert (fun->num_hoisted > 0);
+    ir_free(fun);
+}
@@ -0,0 +1,267 @@
+/**
+SSA intermediate representation
+
+Function ASTs can be translated into an SSA-form IR before being compiled
+to bytecode. Each function becomes a graph of basic blocks, and local
+variables become values, merged with phi nodes where control flow joins.
+Self tail calls, which is how Zeta code loops, become back-edges to a
+loop header. The IR makes the checks done at run time explicit, such as
+the closure check before a call, and is optimized by:
+
+- constant folding and dead branch removal
+- type inference, removing guards which always succeed and specializing
+  operators whose operand types are known
+- common subexpression elimination, including repeated loads of globals,
+  cells and captured variables
+- loop-invariant code motion into the loop preheader
+
+The optimized IR is then translated back into register bytecode.
+*/
+
+#ifndef __IR_H__
+#define __IR_H__
+
+#include "vm.h"
+#include "parser.h"
+#include "bytecode.h"
+
+/// Compile functions to bytecode through the SSA IR
+extern bool opt_ir;
+
+/// Print the IR of functions as they are compiled
+extern bool opt_dump_ir;
+
+/**
+IR opcodes
+Operands are noted v0, v1, ... and immediate operands are named
+*/
+typedef enum
+{
+    /// Incoming argument idx
+    IR_PARAM,
+
+    /// Closure of the function being executed
+    IR_SELF,
+
+    /// Constant value val
+    IR_CONST,
+
+    /// Value of global slot idx, fails if the global is undefined
+    IR_GET_GLOBAL,
+
+    /// Global slot idx = v0
+    IR_SET_GLOBAL,
+
+    /// Captured variable idx of the current closure
+    IR_GET_ENV,
+
+    /// New cell holding v0
+    IR_CELL,
+
+    /// Value of the cell v0
+    IR_GET_CELL,
+
+    /// Set the value of the cell v0 to v1
+    IR_SET_CELL,
+
+    /// New array holding the operand values
+    IR_ARRAY,
+
+    /// v0[v1]
+    IR_INDEX,
+
+    /// Binary operators, v0 <op> v1
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_LT,
+    IR_LE,
+    IR_GT,
+    IR_GE,
+    IR_EQ,
+    IR_NE,
+
+    /// Unary operators, <op> v0
+    IR_NEG,
+    IR_NOT,
+
+    /// New closure of the function in val, capturing the operand values
+    IR_CLOS,
+
+    /// Call the closure v0 with the following operands as arguments
+    IR_CALL,
+
+    /// Call builtin idx with the operand values
+    IR_NATIVE,
+
+    /// Merge of the operand values, one per predecessor block
+    IR_PHI,
+
+    /// Check that v0 is a closure taking idx arguments, produces v0
+    IR_GUARD_CLOS,
+
+    /// Block terminators, jump to the block targets[0]
+    IR_JUMP,
+
+    /// Branch to targets[0] if v0 is true, targets[1] otherwise
+    IR_BRANCH,
+
+    /// Return v0
+    IR_RET,
+
+    /// Tail call of the closure v0, operands as for IR_CALL
+    IR_TCALL,
+
+    /// Number of opcodes
+    IR_NUM_OPS
+
+} ir_op_t;
+
+/// Type of values which can hold any type tag
+#define IR_ANY 0xFF
+
+/// Type of values holding a given type tag
+#define IR_TYPE(tag) ((uint8_t)(1 << (tag)))
+
+struct ir_block;
+
+/**
+IR instruction, which is also the value it produces
+*/
+typedef struct ir_instr
+{
+    ir_op_t op;
+
+    /// Value number, unique in the function
+    uint32_t id;
+
+    /// Immediate operand: slot, argument or builtin index, or arity
+    uint32_t idx;
+
+    /// Constant value, or function for IR_CLOS
+    value_t val;
+
+    /// Operand values
+    struct ir_instr** args;
+    uint32_t num_args;
+
+    /// Branch targets, for terminators
+    struct ir_block* targets[2];
+
+    /// Set of type tags the value may have
+    uint8_t type;
+
+    /// Type tag of both operands of a binary operator, if known,
+    /// in which case it doesn't need to check them
+    uint8_t spec;
+
+    /// Block containing the instruction, NULL once removed
+    struct ir_block* block;
+
+    /// Previous and next instructions in the block
+    struct ir_instr* prev;
+    struct ir_instr* next;
+
+    /// Instruction replacing this one, set when it is removed
+    struct ir_instr* repl;
+
+    /// Bytecode register holding the value
+    uint32_t reg;
+
+    /// Live range, as positions in the bytecode layout
+    uint32_t live_start;
+    uint32_t live_end;
+
+    /// Comparison fused with the branch that uses it
+    bool fused;
+
+} ir_instr_t;
+
+/**
+Basic block
+*/
+typedef struct ir_block
+{
+    /// Block number, in creation order
+    uint32_t id;
+
+    /// Instructions, the phi nodes first and the terminator last
+    ir_instr_t* first;
+    ir_instr_t* last;
+
+    /// Predecessor blocks, in the order of the phi node operands
+    struct ir_block** preds;
+    uint32_t num_preds;
+    uint32_t preds_cap;
+
+    /// Immediate dominator
+    struct ir_block* idom;
+
+    /// Index in reverse postorder
+    uint32_t rpo;
+
+    /// Part of the loop
+    bool in_loop;
+
+    /// Values of the local variables on exit, while building the IR
+    ir_instr_t** defs;
+
+    /// Position of the first instruction and of the terminator
+    uint32_t start_pos;
+    uint32_t end_pos;
+
+    /// Live values on entry and exit, bit sets indexed by value number
+    uint64_t* live_in;
+    uint64_t* live_out;
+
+} ir_block_t;
+
+/**
+IR of a function
+*/
+typedef struct
+{
+    /// Function this was built from
+    ast_fun_t* ast;
+
+    /// Blocks, in reverse postorder once the IR is built
+    ir_block_t** blocks;
+    uint32_t num_blocks;
+    uint32_t blocks_cap;
+
+    /// Entry block, which is also the loop preheader
+    ir_block_t* entry;
+
+    /// Loop header, reached from the entry block and the back-edges
+    ir_block_t* header;
+
+    /// All instructions allocated, including removed ones
+    ir_instr_t** instrs;
+    uint32_t num_instrs;
+    uint32_t instrs_cap;
+
+    /// Optimization statistics, shown in dumps
+    uint32_t num_folded;
+    uint32_t num_guards;
+    uint32_t num_spec;
+    uint32_t num_cse;
+    uint32_t num_hoisted;
+    uint32_t num_dead;
+
+} ir_fun_t;
+
+extern const char* IR_OP_NAMES[IR_NUM_OPS];
+
+ir_fun_t* ir_build(ast_fun_t* fun);
+void ir_optimize(ir_fun_t* fun);
+bc_fun_t* ir_lower(ir_fun_t* fun);
+void ir_free(ir_fun_t* fun);
+void ir_dump(ir_fun_t* fun);
+
+bc_fun_t* ir_compile(ast_fun_t* fun);
+
+void test_ir();
+
+#endif
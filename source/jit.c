@@ -0,0 +1,945 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "x86.h"
+#include "bytecode.h"
+#include "builtins.h"
+#include "tier.h"
+#include "coro.h"
+#include "task.h"
+#include "opt.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Enable the JIT compiler
+bool opt_jit = false;
+
+/// Hotness at which functions are compiled to machine code
+uint32_t jit_threshold = 100;
+
+/// Number of functions compiled
+uint32_t jit_num_compiled = 0;
+
+/// Compiled code signature
+typedef value_t (*jit_fn_t)(value_t* regs, clos_t* clos);
+
+/**
+Tag returned by compiled code to request a tail call
+The arguments are already in place, and the callee is in jit_tail_clos.
+*/
+#define JIT_TAIL_TAG 0xFF
+
+/// Callee of a pending tail call
+clos_t* jit_tail_clos = NULL;
+
+/// Offsets of the word and tag of a register in a frame
+#define REG(r) ((int32_t)(sizeof(value_t) * (r)))
+#define TAG(r) (REG(r) + (int32_t)offsetof(value_t, tag))
+
+/// Machine registers holding the frame base and current closure
+/// These are callee-saved, so they survive calls to C helpers
+#define REGS_REG RBX
+#define CLOS_REG R12
+
+/**
+Call site inline cache
+Holds the last function called from the site, if compiled, so that
+calls to it can be made directly from machine code
+*/
+typedef struct
+{
+    ast_fun_t* fun;
+
+    jit_fn_t code;
+
+    /// Frame size of the callee, in bytes
+    uint64_t frame_size;
+
+} jit_call_cache_t;
+
+/**
+Jump to a bytecode instruction, patched once all
+instructions have been compiled
+*/
+typedef struct
+{
+    size_t pos;
+
+    uint32_t target;
+
+} jit_fixup_t;
+
+/**
+Generic path for instructions without an inline fast path,
+and for guard failures. Executes the instruction as the
+bytecode interpreter would.
+*/
+static void jit_generic(value_t* regs, instr_t* instr, bc_fun_t* fun, clos_t* clos)
+{
+    switch (instr->op)
+    {
+        case BC_ARRAY:
+        {
+            array_t* array = array_alloc(instr->c);
+            for (size_t i = 0; i < instr->c; ++i)
+                array_set(array, i, regs[instr->b + i]);
+            regs[instr->a] = value_from_heapptr((heapptr_t)array, TAG_ARRAY);
+        }
+        break;
+
+        case BC_INDEX:
+        regs[instr->a] = array_get(
+            regs[instr->b].word.array,
+            regs[instr->c].word.int64
+        );
+        break;
+
+        case BC_NEG:
+        regs[instr->a] = eval_neg(regs[instr->b]);
+        break;
+
+        case BC_NOT:
+        regs[instr->a] = eval_truth(regs[instr->b])? VAL_FALSE:VAL_TRUE;
+        break;
+
+        // Only reached for unassigned globals
+        case BC_GET_GLOBAL:
+        global_undef_error(fun->ast->globals, instr->b);
+        break;
+
+        case BC_CELL:
+        {
+            cell_t* cell = cell_alloc(regs[instr->b]);
+            regs[instr->a] = value_from_heapptr((heapptr_t)cell, TAG_RAW_PTR);
+        }
+        break;
+
+        case BC_CLOS:
+        {
+            ast_fun_t* nested = (ast_fun_t*)fun->consts[instr->c].word.heapptr;
+            clos_t* new_clos = clos_alloc(nested);
+            for (size_t i = 0; i < nested->capt_vars->len; ++i)
+                new_clos->env[i] = regs[instr->b + i];
+            regs[instr->a] = value_from_heapptr((heapptr_t)new_clos, TAG_CLOS);
+        }
+        break;
+
+        // Binary operators
+        default:
+        {
+            uint16_t op = BC_GENERIC_OP[instr->op];
+            op = op? op:instr->op;
+            assert (BC_BINOP_INFO[op] != NULL);
+
+            regs[instr->a] = eval_binop_vals(
+                BC_BINOP_INFO[op],
+                regs[instr->b],
+                regs[instr->c]
+            );
+        }
+        break;
+    }
+}
+
+/// Get the comparison operator and polarity of a conditional branch
+static const opinfo_t* jump_cond(uint16_t op, bool* jump_if)
+{
+    *jump_if = (op <= BC_JEQ);
+
+    switch (op)
+    {
+        case BC_JLT: case BC_JNLT: return &OP_LT;
+        case BC_JLE: case BC_JNLE: return &OP_LE;
+        case BC_JGT: case BC_JNGT: return &OP_GT;
+        case BC_JGE: case BC_JNGE: return &OP_GE;
+        default: return &OP_EQ;
+    }
+}
+
+/**
+Generic path for conditional branches
+Returns the truth value of the branch condition, before polarity
+*/
+static bool jit_cond(value_t* regs, instr_t* instr, bc_fun_t* fun, clos_t* clos)
+{
+    if (instr->op == BC_JTRUE || instr->op == BC_JFALSE)
+        return eval_truth(regs[instr->a]);
+
+    bool jump_if;
+    const opinfo_t* op = jump_cond(instr->op, &jump_if);
+    return eval_truth(eval_binop_vals(op, regs[instr->a], regs[instr->b]));
+}
+
+/**
+Call from compiled code, when the call site cache misses
+The cache is updated if the callee is compiled.
+*/
+static void jit_call(
+    value_t* regs,
+    instr_t* instr,
+    bc_fun_t* fun,
+    clos_t* clos,
+    jit_call_cache_t* cache
+)
+{
+    clos_t* callee = get_callee(regs[instr->b], instr->c);
+    value_t* callee_regs = regs + instr->b + 1 + BC_CALL_HDR_REGS;
+    bc_fun_t* callee_fun = bc_get_fun(callee->fun);
+
+    // The callee frame overlaps the top of the caller frame
+    vm_pop_frame(callee_regs);
+    vm_push_frame(callee_fun->num_regs);
+
+    value_t ret = jit_enter(callee_fun, callee, callee_regs);
+
+    vm_pop_frame(regs);
+    vm_push_frame(fun->num_regs);
+
+    regs[instr->a] = ret;
+
+    if (callee_fun->jit_code)
+    {
+        cache->fun = callee->fun;
+        cache->code = callee_fun->jit_code;
+        cache->frame_size = sizeof(value_t) * callee_fun->num_regs;
+    }
+}
+
+/**
+Finish a direct call from compiled code, when the callee
+returned to make a tail call
+*/
+static void jit_call_tail(value_t* regs, instr_t* instr, bc_fun_t* fun, clos_t* clos)
+{
+    value_t* callee_regs = regs + instr->b + 1 + BC_CALL_HDR_REGS;
+    clos_t* callee = jit_tail_clos;
+    bc_fun_t* callee_fun = bc_get_fun(callee->fun);
+
+    vm_pop_frame(callee_regs);
+    vm_push_frame(callee_fun->num_regs);
+
+    value_t ret = jit_enter(callee_fun, callee, callee_regs);
+
+    vm_pop_frame(regs);
+    vm_push_frame(fun->num_regs);
+
+    regs[instr->a] = ret;
+}
+
+/**
+Tail call from compiled code, to another function
+The arguments are moved into place, and the call itself is
+made by jit_enter after the compiled code returns
+*/
+static void jit_tcall(value_t* regs, instr_t* instr, bc_fun_t* fun, clos_t* clos)
+{
+    clos_t* callee = get_callee(regs[instr->b], instr->c);
+    value_t* args = regs + instr->b + 1 + BC_CALL_HDR_REGS;
+    memmove(regs, args, sizeof(value_t) * instr->c);
+    jit_tail_clos = callee;
+}
+
+/// Copy a value between two memory locations, using rax and rdx
+static void emit_copy(
+    x86_asm_t* a,
+    x86_reg_t dst_base,
+    int32_t dst_disp,
+    x86_reg_t src_base,
+    int32_t src_disp
+)
+{
+    x86_mov_rm(a, RAX, src_base, src_disp);
+    x86_mov_rm(a, RDX, src_base, src_disp + (int32_t)offsetof(value_t, tag));
+    x86_mov_mr(a, dst_base, dst_disp, RAX);
+    x86_mov_mr(a, dst_base, dst_disp + (int32_t)offsetof(value_t, tag), RDX);
+}
+
+/// Store rax into a register, with a given tag
+static void emit_store(x86_asm_t* a, reg_t r, tag_t tag)
+{
+    x86_mov_mr(a, REGS_REG, REG(r), RAX);
+    x86_mov_mi(a, REGS_REG, TAG(r), tag);
+}
+
+/// Store the boolean in al into a register
+static void emit_store_bool(x86_asm_t* a, reg_t r)
+{
+    x86_movzx_r8(a, RAX, RAX);
+    emit_store(a, r, TAG_BOOL);
+}
+
+/// Call a helper function with the current frame and instruction
+static void emit_helper(x86_asm_t* a, void* helper, instr_t* instr, bc_fun_t* fun)
+{
+    x86_mov_rr(a, RDI, REGS_REG);
+    x86_mov_ri(a, RSI, (uint64_t)instr);
+    x86_mov_ri(a, RDX, (uint64_t)fun);
+    x86_mov_rr(a, RCX, CLOS_REG);
+    x86_mov_ri(a, RAX, (uint64_t)helper);
+    x86_call_r(a, RAX);
+}
+
+/// The frame pointer push keeps the stack 16-byte aligned for calls
+static void emit_prologue(x86_asm_t* a)
+{
+    x86_push(a, RBP);
+    x86_mov_rr(a, RBP, RSP);
+    x86_push(a, RBX);
+    x86_push(a, R12);
+    x86_mov_rr(a, REGS_REG, RDI);
+    x86_mov_rr(a, CLOS_REG, RSI);
+}
+
+static void emit_epilogue(x86_asm_t* a)
+{
+    x86_pop(a, R12);
+    x86_pop(a, RBX);
+    x86_pop(a, RBP);
+    x86_ret(a);
+}
+
+/**
+Compile a binary operator instruction
+The fast path is chosen from the operand types the instruction was
+specialized for by the interpreter, integers by default.
+*/
+static void emit_binop(x86_asm_t* a, instr_t* instr, bc_fun_t* fun)
+{
+    uint16_t op = BC_GENERIC_OP[instr->op];
+    op = op? op:instr->op;
+
+    bool is_f64 = instr->op >= BC_ADD_F64 && instr->op <= BC_NE_F64;
+    bool is_str = instr->op == BC_EQ_STR || instr->op == BC_NE_STR;
+    tag_t tag = is_f64? TAG_FLOAT64:(is_str? TAG_STRING:TAG_INT64);
+
+    size_t guards[4];
+    size_t num_guards = 0;
+
+    x86_cmp_m8i(a, REGS_REG, TAG(instr->b), tag);
+    guards[num_guards++] = x86_jcc(a, CC_NE);
+    x86_cmp_m8i(a, REGS_REG, TAG(instr->c), tag);
+    guards[num_guards++] = x86_jcc(a, CC_NE);
+
+    if (is_f64)
+    {
+        x86_movsd_rm(a, XMM0, REGS_REG, REG(instr->b));
+
+        if (op <= BC_DIV)
+        {
+            x86_sse_t sse_op =
+                (op == BC_ADD)? SSE_ADD:
+                (op == BC_SUB)? SSE_SUB:
+                (op == BC_MUL)? SSE_MUL:SSE_DIV;
+            x86_sse_rm(a, sse_op, XMM0, REGS_REG, REG(instr->c));
+            x86_movsd_mr(a, REGS_REG, REG(instr->a), XMM0);
+            x86_mov_mi(a, REGS_REG, TAG(instr->a), TAG_FLOAT64);
+        }
+        else
+        {
+            // The flags are set as for an unsigned comparison, and
+            // unordered (NaN) operands set the parity flag
+            x86_movsd_rm(a, XMM1, REGS_REG, REG(instr->c));
+
+            switch (op)
+            {
+                case BC_LT:
+                x86_ucomisd(a, XMM1, XMM0);
+                x86_setcc(a, CC_A, RAX);
+                break;
+
+                case BC_LE:
+                x86_ucomisd(a, XMM1, XMM0);
+                x86_setcc(a, CC_AE, RAX);
+                break;
+
+                case BC_GT:
+                x86_ucomisd(a, XMM0, XMM1);
+                x86_setcc(a, CC_A, RAX);
+                break;
+
+                case BC_GE:
+                x86_ucomisd(a, XMM0, XMM1);
+                x86_setcc(a, CC_AE, RAX);
+                break;
+
+                case BC_EQ:
+                x86_ucomisd(a, XMM0, XMM1);
+                x86_setcc(a, CC_E, RAX);
+                x86_setcc(a, CC_NP, RCX);
+                x86_and_r8(a, RAX, RCX);
+                break;
+
+                default:
+                x86_ucomisd(a, XMM0, XMM1);
+                x86_setcc(a, CC_NE, RAX);
+                x86_setcc(a, CC_P, RCX);
+                x86_or_r8(a, RAX, RCX);
+                break;
+            }
+
+            emit_store_bool(a, instr->a);
+        }
+    }
+    else
+    {
+        x86_mov_rm(a, RAX, REGS_REG, REG(instr->b));
+
+        switch (op)
+        {
+            case BC_ADD:
+            x86_alu_rm(a, ALU_ADD, RAX, REGS_REG, REG(instr->c));
+            emit_store(a, instr->a, TAG_INT64);
+            break;
+
+            case BC_SUB:
+            x86_alu_rm(a, ALU_SUB, RAX, REGS_REG, REG(instr->c));
+            emit_store(a, instr->a, TAG_INT64);
+            break;
+
+            case BC_MUL:
+            x86_imul_rm(a, RAX, REGS_REG, REG(instr->c));
+            emit_store(a, instr->a, TAG_INT64);
+            break;
+
+            // Division by zero and -1 take the generic path
+            case BC_DIV:
+            case BC_MOD:
+            x86_mov_rm(a, RCX, REGS_REG, REG(instr->c));
+            x86_cmp_ri(a, RCX, 0);
+            guards[num_guards++] = x86_jcc(a, CC_E);
+            x86_cmp_ri(a, RCX, -1);
+            guards[num_guards++] = x86_jcc(a, CC_E);
+            x86_cqo(a);
+            x86_idiv(a, RCX);
+            if (op == BC_MOD)
+                x86_mov_rr(a, RAX, RDX);
+            emit_store(a, instr->a, TAG_INT64);
+            break;
+
+            default:
+            {
+                x86_cc_t cc =
+                    (op == BC_LT)? CC_L:
+                    (op == BC_LE)? CC_LE:
+                    (op == BC_GT)? CC_G:
+                    (op == BC_GE)? CC_GE:
+                    (op == BC_EQ)? CC_E:CC_NE;
+                x86_alu_rm(a, ALU_CMP, RAX, REGS_REG, REG(instr->c));
+                x86_setcc(a, cc, RAX);
+                emit_store_bool(a, instr->a);
+            }
+            break;
+        }
+    }
+
+    size_t done = x86_jmp(a);
+
+    for (size_t i = 0; i < num_guards; ++i)
+        x86_patch(a, guards[i], a->len);
+    emit_helper(a, jit_generic, instr, fun);
+
+    x86_patch(a, done, a->len);
+}
+
+/**
+Compile a bytecode function to machine code
+Returns false if the function cannot be compiled
+*/
+bool jit_compile(bc_fun_t* fun)
+{
+#if !defined(__x86_64__)
+    return false;
+#endif
+
+    x86_asm_t as;
+    x86_asm_t* a = &as;
+    x86_init(a);
+
+    // Machine code offset of each instruction
+    size_t* offsets = malloc(sizeof(size_t) * fun->code_len);
+
+    // Each instruction has at most two jumps to other instructions
+    jit_fixup_t* fixups = malloc(sizeof(jit_fixup_t) * 2 * fun->code_len);
+    size_t num_fixups = 0;
+
+    // Target of the loop back-edges, if any
+    uint32_t loop_header = UINT32_MAX;
+
+    emit_prologue(a);
+
+    for (uint32_t i = 0; i < fun->code_len; ++i)
+    {
+        instr_t* instr = &fun->code[i];
+        offsets[i] = a->len;
+
+        switch (instr->op)
+        {
+            case BC_MOV:
+            emit_copy(a, REGS_REG, REG(instr->a), REGS_REG, REG(instr->b));
+            break;
+
+            case BC_CONST:
+            {
+                value_t val = fun->consts[instr->b];
+                x86_mov_ri(a, RAX, (uint64_t)val.word.int64);
+                emit_store(a, instr->a, val.tag);
+            }
+            break;
+
+            case BC_ARRAY:
+            case BC_INDEX:
+            case BC_NEG:
+            case BC_NOT:
+            case BC_CELL:
+            case BC_CLOS:
+            emit_helper(a, jit_generic, instr, fun);
+            break;
+
+            case BC_JUMP:
+            fixups[num_fixups++] = (jit_fixup_t){ x86_jmp(a), instr->b };
+            break;
+
+            case BC_LOOP:
+            assert (loop_header == UINT32_MAX || loop_header == instr->b);
+            loop_header = instr->b;
+            fixups[num_fixups++] = (jit_fixup_t){ x86_jmp(a), instr->b };
+            break;
+
+            case BC_JTRUE:
+            case BC_JFALSE:
+            {
+                x86_cc_t cc = (instr->op == BC_JTRUE)? CC_NE:CC_E;
+
+                x86_cmp_m8i(a, REGS_REG, TAG(instr->a), TAG_BOOL);
+                size_t guard = x86_jcc(a, CC_NE);
+                x86_cmp_m8i(a, REGS_REG, REG(instr->a), 0);
+                fixups[num_fixups++] = (jit_fixup_t){ x86_jcc(a, cc), instr->b };
+                size_t done = x86_jmp(a);
+
+                x86_patch(a, guard, a->len);
+                emit_helper(a, jit_cond, instr, fun);
+                x86_test_r8(a, RAX);
+                fixups[num_fixups++] = (jit_fixup_t){ x86_jcc(a, cc), instr->b };
+
+                x86_patch(a, done, a->len);
+            }
+            break;
+
+            case BC_JLT:
+            case BC_JLE:
+            case BC_JGT:
+            case BC_JGE:
+            case BC_JEQ:
+            case BC_JNE:
+            case BC_JNLT:
+            case BC_JNLE:
+            case BC_JNGT:
+            case BC_JNGE:
+            {
+                bool jump_if;
+                const opinfo_t* op = jump_cond(instr->op, &jump_if);
+                x86_cc_t cc =
+                    (op == &OP_LT)? CC_L:
+                    (op == &OP_LE)? CC_LE:
+                    (op == &OP_GT)? CC_G:
+                    (op == &OP_GE)? CC_GE:CC_E;
+
+                x86_cmp_m8i(a, REGS_REG, TAG(instr->a), TAG_INT64);
+                size_t guard0 = x86_jcc(a, CC_NE);
+                x86_cmp_m8i(a, REGS_REG, TAG(instr->b), TAG_INT64);
+                size_t guard1 = x86_jcc(a, CC_NE);
+                x86_mov_rm(a, RAX, REGS_REG, REG(instr->a));
+                x86_alu_rm(a, ALU_CMP, RAX, REGS_REG, REG(instr->b));
+                fixups[num_fixups++] = (jit_fixup_t){
+                    x86_jcc(a, jump_if? cc:X86_CC_NOT(cc)),
+                    instr->c
+                };
+                size_t done = x86_jmp(a);
+
+                x86_patch(a, guard0, a->len);
+                x86_patch(a, guard1, a->len);
+                emit_helper(a, jit_cond, instr, fun);
+                x86_test_r8(a, RAX);
+                fixups[num_fixups++] = (jit_fixup_t){
+                    x86_jcc(a, jump_if? CC_NE:CC_E),
+                    instr->c
+                };
+
+                x86_patch(a, done, a->len);
+            }
+            break;
+
+            // The global slot array may move as globals are added,
+            // so its address is loaded from the globals table
+            case BC_GET_GLOBAL:
+            case BC_SET_GLOBAL:
+            {
+                x86_mov_ri(a, RCX, (uint64_t)fun->ast->globals);
+                x86_mov_rm(a, RCX, RCX, (int32_t)offsetof(globals_t, vals));
+
+                if (instr->op == BC_SET_GLOBAL)
+                {
+                    emit_copy(a, RCX, REG(instr->a), REGS_REG, REG(instr->b));
+                    break;
+                }
+
+                x86_cmp_m8i(a, RCX, TAG(instr->b), TAG_RAW_PTR);
+                size_t defined = x86_jcc(a, CC_NE);
+                emit_helper(a, jit_generic, instr, fun);
+                x86_patch(a, defined, a->len);
+                emit_copy(a, REGS_REG, REG(instr->a), RCX, REG(instr->b));
+            }
+            break;
+
+            case BC_GET_CELL:
+            x86_mov_rm(a, RCX, REGS_REG, REG(instr->b));
+            emit_copy(a, REGS_REG, REG(instr->a), RCX, (int32_t)offsetof(cell_t, val));
+            break;
+
+            case BC_SET_CELL:
+            x86_mov_rm(a, RCX, REGS_REG, REG(instr->a));
+            emit_copy(a, RCX, (int32_t)offsetof(cell_t, val), REGS_REG, REG(instr->b));
+            break;
+
+            case BC_GET_ENV:
+            emit_copy(
+                a,
+                REGS_REG,
+                REG(instr->a),
+                CLOS_REG,
+                (int32_t)offsetof(clos_t, env) + REG(instr->b)
+            );
+            break;
+
+            case BC_SELF:
+            x86_mov_mr(a, REGS_REG, REG(instr->a), CLOS_REG);
+            x86_mov_mi(a, REGS_REG, TAG(instr->a), TAG_CLOS);
+            break;
+
+            // Calls to the function cached at the call site are made
+            // directly, setting up the callee frame inline
+            case BC_CALL:
+            {
+                jit_call_cache_t* cache = calloc(1, sizeof(jit_call_cache_t));
+                reg_t callee_reg = instr->b + 1 + BC_CALL_HDR_REGS;
+
+                x86_cmp_m8i(a, REGS_REG, TAG(instr->b), TAG_CLOS);
+                size_t guard0 = x86_jcc(a, CC_NE);
+                x86_mov_rm(a, RSI, REGS_REG, REG(instr->b));
+                x86_mov_ri(a, RCX, (uint64_t)cache);
+                x86_mov_rm(a, RDX, RSI, (int32_t)offsetof(clos_t, fun));
+                x86_alu_rm(a, ALU_CMP, RDX, RCX, (int32_t)offsetof(jit_call_cache_t, fun));
+                size_t guard1 = x86_jcc(a, CC_NE);
+
+                // Deep calls go through the helper, which continues
+                // in the interpreter once the C stack runs low. Machine
+                // code only runs on the main thread, as tasks run in the
+                // interpreter, so its thread state is at a fixed address.
+                x86_mov_ri(a, R8, (uint64_t)&vm_thread);
+                x86_alu_rm(a, ALU_CMP, RSP, R8, (int32_t)offsetof(vm_thread_t, cstack_limit));
+                size_t guard2 = x86_jcc(a, CC_B);
+
+                // Push the callee frame, if it fits on the stack
+                x86_lea(a, RDI, REGS_REG, REG(callee_reg));
+                x86_mov_rm(a, RDX, RCX, (int32_t)offsetof(jit_call_cache_t, frame_size));
+                x86_alu_rr(a, ALU_ADD, RDX, RDI);
+                x86_alu_rm(a, ALU_CMP, RDX, R8, (int32_t)offsetof(vm_thread_t, stacklimit));
+                size_t guard3 = x86_jcc(a, CC_A);
+                x86_mov_mr(a, R8, (int32_t)offsetof(vm_thread_t, stacktop), RDX);
+
+                x86_mov_rm(a, RAX, RCX, (int32_t)offsetof(jit_call_cache_t, code));
+                x86_call_r(a, RAX);
+                x86_mov_mr(a, REGS_REG, REG(instr->a), RAX);
+                x86_mov_mr(a, REGS_REG, TAG(instr->a), RDX);
+
+                // Pop the callee frame
+                x86_lea(a, RCX, REGS_REG, REG(fun->num_regs));
+                x86_mov_ri(a, R8, (uint64_t)&vm_thread);
+                x86_mov_mr(a, R8, (int32_t)offsetof(vm_thread_t, stacktop), RCX);
+
+                x86_cmp_m8i(a, REGS_REG, TAG(instr->a), JIT_TAIL_TAG);
+                size_t no_tail = x86_jcc(a, CC_NE);
+                emit_helper(a, jit_call_tail, instr, fun);
+                size_t done = x86_jmp(a);
+
+                x86_patch(a, guard0, a->len);
+                x86_patch(a, guard1, a->len);
+                x86_patch(a, guard2, a->len);
+                x86_patch(a, guard3, a->len);
+                x86_mov_ri(a, R8, (uint64_t)cache);
+                emit_helper(a, jit_call, instr, fun);
+
+                x86_patch(a, done, a->len);
+                x86_patch(a, no_tail, a->len);
+            }
+            break;
+
+            case BC_TCALL:
+            {
+                // Tail calls to the same function become a jump back to
+                // the start, other tail calls return to jit_enter
+                size_t guard0 = 0;
+                size_t guard1 = 0;
+                bool self_call = (instr->c == fun->ast->param_decls->len);
+
+                if (self_call)
+                {
+                    x86_cmp_m8i(a, REGS_REG, TAG(instr->b), TAG_CLOS);
+                    guard0 = x86_jcc(a, CC_NE);
+                    x86_mov_rm(a, RAX, REGS_REG, REG(instr->b));
+                    x86_mov_ri(a, RCX, (uint64_t)fun->ast);
+                    x86_alu_rm(a, ALU_CMP, RCX, RAX, (int32_t)offsetof(clos_t, fun));
+                    guard1 = x86_jcc(a, CC_NE);
+
+                    x86_mov_rr(a, CLOS_REG, RAX);
+                    for (uint32_t j = 0; j < instr->c; ++j)
+                    {
+                        reg_t arg = instr->b + 1 + BC_CALL_HDR_REGS + j;
+                        emit_copy(a, REGS_REG, REG(j), REGS_REG, REG(arg));
+                    }
+                    fixups[num_fixups++] = (jit_fixup_t){ x86_jmp(a), 0 };
+
+                    x86_patch(a, guard0, a->len);
+                    x86_patch(a, guard1, a->len);
+                }
+
+                emit_helper(a, jit_tcall, instr, fun);
+                x86_mov_ri(a, RDX, JIT_TAIL_TAG);
+                emit_epilogue(a);
+            }
+            break;
+
+            case BC_NATIVE:
+            x86_lea(a, RDI, REGS_REG, REG(instr->b));
+            x86_mov_ri(a, RAX, (uint64_t)BUILTINS[instr->c].fn);
+            x86_call_r(a, RAX);
+            x86_mov_mr(a, REGS_REG, REG(instr->a), RAX);
+            x86_mov_mr(a, REGS_REG, TAG(instr->a), RDX);
+            break;
+
+            case BC_RET:
+            x86_mov_rm(a, RAX, REGS_REG, REG(instr->a));
+            x86_mov_rm(a, RDX, REGS_REG, TAG(instr->a));
+            emit_epilogue(a);
+            break;
+
+            default:
+            if (BC_BINOP_INFO[instr->op] || BC_GENERIC_OP[instr->op])
+            {
+                emit_binop(a, instr, fun);
+                break;
+            }
+
+            printf("jit: unsupported opcode %s\n", BC_OP_NAMES[instr->op]);
+            exit(-1);
+        }
+    }
+
+    // Second entry point, used when a hot loop started in the
+    // interpreter continues in machine code
+    size_t loop_entry = a->len;
+    if (loop_header != UINT32_MAX)
+    {
+        emit_prologue(a);
+        fixups[num_fixups++] = (jit_fixup_t){ x86_jmp(a), loop_header };
+    }
+
+    for (size_t i = 0; i < num_fixups; ++i)
+        x86_patch(a, fixups[i].pos, offsets[fixups[i].target]);
+
+    free(fixups);
+    free(offsets);
+
+    // The code is written to pages which are writable but not executable,
+    // which are then made executable but not writable (W^X)
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (a->len + page_size - 1) & ~(page_size - 1);
+
+    uint8_t* mem = mmap(
+        NULL,
+        size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+    {
+        printf("jit: failed to allocate code memory\n");
+        exit(-1);
+    }
+
+    memcpy(mem, a->code, a->len);
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        printf("jit: failed to make code executable\n");
+        exit(-1);
+    }
+
+    x86_free(a);
+
+    fun->jit_code = (jit_fn_t)mem;
+    if (loop_header != UINT32_MAX)
+        fun->jit_loop_code = (jit_fn_t)(mem + loop_entry);
+    jit_num_compiled++;
+
+    return true;
+}
+
+/**
+Count a call or back-edge to a function, and compile it once it
+becomes hot. Returns true if the function should run in machine code.
+*/
+bool jit_tier_up(bc_fun_t* fun, bool backedge)
+{
+    // Machine code recurses on the C stack, which can't be suspended,
+    // and which may run out before the VM stack. Coroutines and deep
+    // calls run in the bytecode interpreter instead, as does code on
+    // worker threads, since machine code uses the main thread's state.
+    if (coro_current || vm_cstack_low() || task_on_worker())
+        return false;
+
+    if (fun->jit_code)
+        return true;
+
+    tier_count(fun->ast, backedge);
+
+    if (tier_hotness(fun->ast) < jit_threshold)
+        return false;
+
+    clock_t start = clock();
+
+    if (!jit_compile(fun))
+        return false;
+
+    tier_promote(fun->ast, TIER_JIT, start);
+
+    return true;
+}
+
+/**
+Execute a function in its register frame, in machine code if compiled
+Tail calls out of compiled code are made here, so that chains of tail
+calls run in constant C stack space.
+*/
+value_t jit_enter(bc_fun_t* fun, clos_t* clos, value_t* regs)
+{
+    for (;;)
+    {
+        value_t ret;
+
+        if (opt_jit && jit_tier_up(fun, false))
+            ret = fun->jit_code(regs, clos);
+        else
+            ret = bc_exec(fun, clos, regs);
+
+        if (ret.tag != JIT_TAIL_TAG)
+            return ret;
+
+        clos = jit_tail_clos;
+        fun = bc_get_fun(clos->fun);
+
+        vm_pop_frame(regs);
+        vm_push_frame(fun->num_regs);
+    }
+}
+
+/**
+Continue the execution of a hot loop in machine code, from its header
+The function must have been compiled, and the frame holds the values
+of the current iteration.
+*/
+value_t jit_enter_loop(bc_fun_t* fun, clos_t* clos, value_t* regs)
+{
+    value_t ret = fun->jit_loop_code(regs, clos);
+
+    if (ret.tag != JIT_TAIL_TAG)
+        return ret;
+
+    clos = jit_tail_clos;
+    fun = bc_get_fun(clos->fun);
+
+    vm_pop_frame(regs);
+    vm_push_frame(fun->num_regs);
+
+    return jit_enter(fun, clos, regs);
+}
+
+/// Check that a unit evaluates to the same value with the JIT
+/// as with the AST interpreter
+void test_jit_eq(char* cstr)
+{
+    value_t expected = eval_unit(load_str(cstr, "test"));
+
+    opt_jit = true;
+    uint32_t num_compiled = jit_num_compiled;
+    value_t value = bc_eval_unit(load_str(cstr, "test"));
+    opt_jit = false;
+
+    if (!value_equals(value, expected) || jit_num_compiled == num_compiled)
+    {
+        printf("jit test failed for:\n%s\n", cstr);
+        printf("got: ");
+        value_print(value);
+        printf("\nexpected: ");
+        value_print(expected);
+        printf("\n");
+        exit(-1);
+    }
+}
+
+void test_jit()
+{
+#if defined(__x86_64__)
+    uint32_t threshold = jit_threshold;
+    jit_threshold = 1;
+
+    // The functions tested must be compiled, not inlined
+    opt_inline = false;
+
+    // Arithmetic and comparisons
+    test_jit_eq("let f = fun (x, y) x * y + x - y / 2\nf(7, 4)");
+    test_jit_eq("let f = fun (x, y) [x / y, x mod y]\nf(-7, 2)[1] + f(-7, -1)[0]");
+    test_jit_eq("let f = fun (x, y) x + y\nf(0x7FFFFFFFFFFFFFFF, 1)");
+    test_jit_eq("let f = fun (x, y) if x < y then x * y else x / y\nf(1.5, 2.0) + f(3.0, 2.0)");
+    test_jit_eq("let f = fun (x) [x == x, x != x, x < 1.0, x >= 1.0]\nf(0.0 / 0.0)[1]");
+    test_jit_eq("let f = fun (x) [x == x, x != x, x < 1.0, x >= 1.0]\nf(0.0 / 0.0)[0]");
+    test_jit_eq("let f = fun (x, y) x == y\nf('foo', 'foo')");
+    test_jit_eq("let f = fun (x, y) x != y\nf('foo', 3)");
+    test_jit_eq("let f = fun (x) -x + [x][0]\nf(3)");
+    test_jit_eq("let f = fun (x) not (x > 3 and x < 10) or x == 5\nf(5)");
+    test_jit_eq("let f = fun (x) if x then 1 else 2\nf(false)");
+
+    // Guard failures in specialized instructions
+    jit_threshold = 2;
+    test_jit_eq("let f = fun (x) x * x\nf(1.5)\nf(2.5)\nf(3)");
+    test_jit_eq("let f = fun (x, y) x - y < y\nf(1, 1)\nf(2, 1)\nf(0.5, 0.25)");
+    jit_threshold = 1;
+
+    // Calls, closures, cells and globals
+    test_jit_eq("let fib = fun (n) if n < 2 then n else fib(n-1) + fib(n-2)\nfib(15)");
+    test_jit_eq("let mk = fun (n) { var c = n\nfun () { c = c + 1\nc } }\nlet f = mk(5)\nf()\nf()");
+    test_jit_eq("let f = fun (x) { let g = fun (y) x + y\ng(2) }\nf(3)");
+    test_jit_eq("var g = 1\nlet f = fun () { g = g + 1\ng }\nf()\nf()");
+    test_jit_eq("let f = fun (x) max(x, 3) + abs(-2)\nf(7)");
+
+    // Tail calls run in constant stack space
+    test_jit_eq("let loop = fun (i, acc) if i == 0 then acc else loop(i - 1, acc + i)\nloop(100000, 0)");
+    test_jit_eq(
+        "let even = fun (n) if n == 0 then true else odd(n - 1)\n"
+        "let odd = fun (n) if n == 0 then false else even(n - 1)\n"
+        "even(100001)"
+    );
+
+    jit_threshold = threshold;
+    opt_inline = true;
+#endif
+}
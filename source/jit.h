@@ -0,0 +1,32 @@
+/**
+Baseline JIT compiler
+
+Hot bytecode functions are translated into x86-64 machine code, one
+instruction template at a time. The machine code uses the same register
+frames and call headers as the bytecode interpreter, so the two can call
+each other freely. Common cases are compiled inline, guarded by type tag
+checks, and the remaining cases call back into the interpreter's
+generic paths.
+*/
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "vm.h"
+#include "interp.h"
+#include "bytecode.h"
+
+/// Enable the JIT compiler
+extern bool opt_jit;
+
+/// Hotness at which functions are compiled to machine code
+extern uint32_t jit_threshold;
+
+bool jit_compile(bc_fun_t* fun);
+bool jit_tier_up(bc_fun_t* fun, bool backedge);
+value_t jit_enter(bc_fun_t* fun, clos_t* clos, value_t* regs);
+value_t jit_enter_loop(bc_fun_t* fun, clos_t* clos, value_t* regs);
+
+void test_jit();
+
+#endif
@@ -5,9 +5,24 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include "vm.h"
 #include "parser.h"
 #include "interp.h"
+#include "bytecode.h"
+#include "opt.h"
+#include "ir.h"
+#include "profile.h"
+#include "x86.h"
+#include "jit.h"
+#include "tier.h"
+#include "cgen.h"
+#include "coro.h"
+#include "task.h"
+#include "io.h"
+#include "par.h"
+#include "seq.h"
+#include "simd.h"
 
 /// Read a text file
 char* read_file(char* file_name)
@@ -29,7 +44,7 @@ char* read_file(char* file_name)
 
     printf("%ld bytes\n", len);
 
-    char* buf = malloc(len);
+    char* buf = malloc(len+1);
 
     // Read into the allocated buffer
     int read = fread(buf, 1, len, file);
@@ -40,12 +55,46 @@ char* read_file(char* file_name)
         return NULL;
     }
 
+    // Add a null terminator to the string
+    buf[len] = '\0';
+
     // Close the input file
     fclose(file);
 
     return buf;
 }
 
+/// Translate a source file to C and write the code to an output file
+bool write_c_file(char* cstr, char* src_name, char* out_name)
+{
+    char out_buf[strlen(src_name) + 3];
+
+    if (out_name == NULL)
+    {
+        sprintf(out_buf, "%s.c", src_name);
+        out_name = out_buf;
+    }
+
+    char* code = cgen_unit(load_str(cstr, src_name), src_name);
+
+    FILE* file = fopen(out_name, "w");
+
+    if (!file)
+    {
+        printf("failed to open output file \"%s\"\n", out_name);
+        free(code);
+        return false;
+    }
+
+    fputs(code, file);
+    fclose(file);
+    free(code);
+
+    printf("wrote \"%s\"\n", out_name);
+
+    return true;
+}
+
 /// Read a line from standard input
 char* read_line()
 {
@@ -94,6 +143,9 @@ void run_repl()
     printf("likely crash on you or give cryptic error messages.\n");
     printf("\n");
 
+    // Lines entered in the shell share the same global variables
+    globals_t* globals = globals_alloc();
+
     for (;;)
     {
         printf("z> ");
@@ -101,7 +153,8 @@ void run_repl()
         char* cstr = read_line();
 
         // Evaluate the code string
-        value_t value = eval_str(cstr, "shell");
+        ast_fun_t* unit_fun = load_str_in(cstr, "shell", globals);
+        value_t value = exec_unit(unit_fun);
 
         free(cstr);
 
@@ -111,40 +164,226 @@ void run_repl()
     }
 }
 
+/// Run a benchmark, executing a source unit repeatedly
+void run_bench(char* cstr, char* src_name, int num_iters)
+{
+    // Parsing and variable resolution are not timed
+    ast_fun_t* unit_fun = load_str(cstr, src_name);
+
+    clock_t start = clock();
+
+    for (int i = 0; i < num_iters; ++i)
+        exec_unit(unit_fun);
+
+    double msecs = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    printf(
+        "%s (%s%s): %d iterations, %.1f ms, %.3f us/iteration\n",
+        src_name,
+        opt_tiered? "tiered":(opt_jit? "jit":(opt_bytecode? "bytecode":"ast")),
+        opt_ir? ", ir":"",
+        num_iters,
+        msecs,
+        1000.0 * msecs / num_iters
+    );
+}
+
 int main(int argc, char** argv)
 {
     vm_init();
     parser_init();
+    interp_init();
+
+    char* file_name = NULL;
+    int bench_iters = 0;
+    bool emit_c = false;
+    char* out_name = NULL;
 
-    // Test mode
-    if (argc == 2 && strcmp(argv[1], "--test") == 0)
+    // Parse the command-line options
+    for (int i = 1; i < argc; ++i)
     {
-        test_vm();
-        test_parser();
-        test_interp();
-        return 0;
+        // Test mode
+        if (strcmp(argv[i], "--test") == 0)
+        {
+            test_vm();
+            test_parser();
+            test_interp();
+            test_bytecode();
+            test_opt();
+            test_profile();
+            test_x86();
+            test_jit();
+            test_tier();
+            test_cgen();
+            test_ir();
+            test_coro();
+            test_task();
+            test_io();
+            test_par();
+            test_seq();
+            test_simd();
+            return 0;
+        }
+
+        // Use the bytecode interpreter
+        else if (strcmp(argv[i], "--bytecode") == 0)
+        {
+            opt_bytecode = true;
+        }
+
+        // Compile hot functions to machine code
+        // The JIT compiles from bytecode, so this implies --bytecode
+        else if (strcmp(argv[i], "--jit") == 0)
+        {
+            opt_bytecode = true;
+            opt_jit = true;
+        }
+
+        // Tiered execution, functions start in the AST interpreter and
+        // are promoted to bytecode, then machine code, as they get hot
+        else if (strcmp(argv[i], "--tiered") == 0)
+        {
+            opt_tiered = true;
+            opt_jit = true;
+        }
+
+        // Hotness thresholds for tiering up
+        else if (strcmp(argv[i], "--bc-threshold") == 0 && i + 1 < argc)
+        {
+            tier_bc_threshold = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc)
+        {
+            jit_threshold = atoi(argv[++i]);
+        }
+
+        // Log tier transitions
+        else if (strcmp(argv[i], "--log-tiers") == 0)
+        {
+            opt_log_tiers = true;
+        }
+
+        // Compile to bytecode through the SSA IR, optionally printing
+        // the optimized IR and bytecode of each function compiled
+        else if (strcmp(argv[i], "--ir") == 0)
+        {
+            opt_bytecode = true;
+            opt_ir = true;
+        }
+        else if (strcmp(argv[i], "--dump-ir") == 0)
+        {
+            opt_bytecode = true;
+            opt_ir = true;
+            opt_dump_ir = true;
+        }
+
+        // Disable the AST optimization passes
+        else if (strcmp(argv[i], "--no-fold") == 0)
+        {
+            opt_fold = false;
+        }
+
+        // Disable function inlining
+        else if (strcmp(argv[i], "--no-inline") == 0)
+        {
+            opt_inline = false;
+        }
+
+        // Disable escape analysis and scalar replacement
+        else if (strcmp(argv[i], "--no-escape") == 0)
+        {
+            opt_escape = false;
+        }
+
+        // Collect type feedback and print it after execution
+        // Profiling is done by the bytecode interpreter
+        else if (strcmp(argv[i], "--profile-types") == 0)
+        {
+            opt_bytecode = true;
+            opt_profile = true;
+        }
+
+        // Translate the file to C instead of executing it
+        // The output file name defaults to the source file name plus ".c"
+        else if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            emit_c = true;
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out_name = argv[++i];
+        }
+
+        // Number of worker threads running tasks, one per core by default
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+        {
+            task_num_workers = atoi(argv[++i]);
+        }
+
+        // Instruction set of the array kernels, the best available by default
+        else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+        {
+            const char* level = argv[++i];
+            if (strcmp(level, "scalar") == 0)
+                simd_force = SIMD_SCALAR;
+            else if (strcmp(level, "sse2") == 0)
+                simd_force = SIMD_SSE2;
+            else if (strcmp(level, "avx2") == 0)
+                simd_force = SIMD_AVX2;
+            else
+            {
+                printf("unknown instruction set: \"%s\"\n", level);
+                return -1;
+            }
+        }
+
+        // Benchmark mode, execute the file a number of times
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+        {
+            bench_iters = atoi(argv[++i]);
+        }
+
+        else if (argv[i][0] == '-')
+        {
+            printf("unknown option: \"%s\"\n", argv[i]);
+            return -1;
+        }
+
+        else
+        {
+            file_name = argv[i];
+        }
     }
 
     // File name passed
-    if (argc == 2)
+    if (file_name)
     {
-        char* cstr = read_file(argv[1]);
+        char* cstr = read_file(file_name);
 
         if (cstr == NULL)
             return -1;
 
-        // Evaluate the code string
-        eval_str(cstr, argv[1]);
+        if (emit_c)
+        {
+            if (!write_c_file(cstr, file_name, out_name))
+                return -1;
+        }
+        else if (bench_iters > 0)
+            run_bench(cstr, file_name, bench_iters);
+        else
+            eval_str(cstr, file_name);
 
         free(cstr);
+
+        if (opt_profile)
+            prof_dump();
     }
 
     // No file names passed. Read-eval-print loop.
-    if (argc == 1)
+    else
     {
         run_repl();
     }
 
     return 0;
 }
-
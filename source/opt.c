@@ -0,0 +1,1612 @@
+#include <stdio.h>
+#include <assert.h>
+#include "opt.h"
+#include "interp.h"
+#include "bytecode.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Enable the AST optimization passes
+bool opt_fold = true;
+
+/// Enable function inlining
+bool opt_inline = true;
+
+/// Enable escape analysis and scalar replacement
+bool opt_escape = true;
+
+/// Test if an expression is a constant
+bool is_const(heapptr_t expr)
+{
+    return get_shape(expr) == SHAPE_AST_CONST;
+}
+
+/// Get the value of a constant expression
+value_t const_val(heapptr_t expr)
+{
+    return ((ast_const_t*)expr)->val;
+}
+
+/**
+Test if a binary operator can be evaluated at compile time on two
+constant values. Operations which would fail at run time, such as
+an integer division by zero or a type error, are left in place so
+that the error is reported when and if they are executed.
+*/
+bool binop_foldable(const opinfo_t* op, value_t v0, value_t v1)
+{
+    if (op == &OP_EQ || op == &OP_NE)
+        return true;
+
+    bool arith = (
+        op == &OP_ADD || op == &OP_SUB || op == &OP_MUL ||
+        op == &OP_DIV || op == &OP_MOD ||
+        op == &OP_LT || op == &OP_LE || op == &OP_GT || op == &OP_GE
+    );
+
+    if (!arith)
+        return false;
+
+    if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+    {
+        if ((op == &OP_DIV || op == &OP_MOD) && v1.word.int64 == 0)
+            return false;
+
+        return true;
+    }
+
+    if (v0.tag == TAG_FLOAT64 && v1.tag == TAG_FLOAT64)
+        return op != &OP_MOD;
+
+    return false;
+}
+
+/**
+Test if evaluating an expression has no effect besides producing a value
+Such expressions can be dropped when their value is unused
+*/
+bool is_pure(heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    // Note: reading a global may fail if it is undefined
+    if (shape == SHAPE_AST_REF)
+        return !((ast_ref_t*)expr)->global;
+
+    return (
+        shape == SHAPE_AST_CONST ||
+        shape == SHAPE_STRING ||
+        shape == SHAPE_AST_FUN
+    );
+}
+
+/**
+Fold and simplify an expression
+Constant operations are evaluated with the interpreter's semantics,
+if expressions with a constant test are replaced by the branch taken
+and sequences are flattened. Returns the simplified expression, and
+may modify the expression in place.
+*/
+heapptr_t fold_expr(heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        // The left side of an assignment is not a value
+        if (binop->op != &OP_ASSIGN)
+            binop->left_expr = fold_expr(binop->left_expr);
+
+        binop->right_expr = fold_expr(binop->right_expr);
+
+        if (is_const(binop->left_expr) && is_const(binop->right_expr))
+        {
+            value_t v0 = const_val(binop->left_expr);
+            value_t v1 = const_val(binop->right_expr);
+
+            if (binop_foldable(binop->op, v0, v1))
+                return ast_const_alloc(eval_binop_vals(binop->op, v0, v1));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+
+        unop->expr = fold_expr(unop->expr);
+
+        if (is_const(unop->expr))
+        {
+            value_t v0 = const_val(unop->expr);
+
+            if (unop->op == &OP_NEG &&
+                (v0.tag == TAG_INT64 || v0.tag == TAG_FLOAT64))
+                return ast_const_alloc(eval_neg(v0));
+
+            if (unop->op == &OP_NOT && v0.tag == TAG_BOOL)
+                return ast_const_alloc(eval_truth(v0)? VAL_FALSE:VAL_TRUE);
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_SEQ)
+    {
+        ast_seq_t* seqexpr = (ast_seq_t*)expr;
+        array_t* expr_list = seqexpr->expr_list;
+
+        // Scopes are per-function, so nested sequences can be
+        // spliced into their parent
+        array_t* new_list = array_alloc(expr_list->len);
+
+        for (size_t i = 0; i < expr_list->len; ++i)
+        {
+            heapptr_t sub_expr = fold_expr(array_get_ptr(expr_list, i));
+
+            if (get_shape(sub_expr) == SHAPE_AST_SEQ)
+            {
+                array_t* sub_list = ((ast_seq_t*)sub_expr)->expr_list;
+
+                for (size_t j = 0; j < sub_list->len; ++j)
+                    new_list = array_append(new_list, array_get(sub_list, j));
+            }
+            else
+            {
+                new_list = array_append(
+                    new_list,
+                    value_from_heapptr(sub_expr, TAG_OBJECT)
+                );
+            }
+        }
+
+        // Drop the values computed only to be discarded
+        array_t* kept_list = array_alloc(new_list->len);
+
+        for (size_t i = 0; i < new_list->len; ++i)
+        {
+            heapptr_t sub_expr = array_get_ptr(new_list, i);
+
+            if (i + 1 < new_list->len && is_pure(sub_expr))
+                continue;
+
+            kept_list = array_append(kept_list, array_get(new_list, i));
+        }
+
+        if (kept_list->len == 1)
+            return array_get_ptr(kept_list, 0);
+
+        seqexpr->expr_list = kept_list;
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+
+        ifexpr->test_expr = fold_expr(ifexpr->test_expr);
+        ifexpr->then_expr = fold_expr(ifexpr->then_expr);
+        ifexpr->else_expr = fold_expr(ifexpr->else_expr);
+
+        if (is_const(ifexpr->test_expr))
+        {
+            value_t t = const_val(ifexpr->test_expr);
+
+            if (t.tag == TAG_BOOL)
+                return eval_truth(t)? ifexpr->then_expr:ifexpr->else_expr;
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        for (size_t i = 0; i < array_expr->len; ++i)
+        {
+            heapptr_t elem = fold_expr(array_get_ptr(array_expr, i));
+            array_set(array_expr, i, value_from_heapptr(elem, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        callexpr->fun_expr = fold_expr(callexpr->fun_expr);
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            heapptr_t arg = fold_expr(array_get_ptr(arg_exprs, i));
+            array_set(arg_exprs, i, value_from_heapptr(arg, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_FUN)
+    {
+        opt_pass((ast_fun_t*)expr);
+        return expr;
+    }
+
+    // Constants, strings, references and declarations
+    return expr;
+}
+
+/**
+Optimize a function and the functions nested in it
+Note: variable resolution must have been performed first
+*/
+void opt_pass(ast_fun_t* fun)
+{
+    if (!opt_fold)
+        return;
+
+    fun->body_expr = fold_expr(fun->body_expr);
+}
+
+/// Maximum size of the functions inlined, in AST nodes
+#define INLINE_MAX_SIZE 32
+
+/// Maximum number of AST nodes inlined into a single function
+#define INLINE_MAX_GROWTH 512
+
+/// Size of an expression in AST nodes
+/// Nested functions are never inlined, they count as too large
+uint32_t expr_size(heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        return 1 + expr_size(binop->left_expr) + expr_size(binop->right_expr);
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+        return 1 + expr_size(((ast_unop_t*)expr)->expr);
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        uint32_t size = 1;
+        for (size_t i = 0; i < list->len; ++i)
+            size += expr_size(array_get_ptr(list, i));
+        return size;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        return (
+            1 +
+            expr_size(ifexpr->test_expr) +
+            expr_size(ifexpr->then_expr) +
+            expr_size(ifexpr->else_expr)
+        );
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        uint32_t size = 1 + expr_size(callexpr->fun_expr);
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            size += expr_size(array_get_ptr(callexpr->arg_exprs, i));
+        return size;
+    }
+
+    if (shape == SHAPE_AST_FUN)
+        return INLINE_MAX_SIZE + 1;
+
+    return 1;
+}
+
+/**
+Test if an expression references a global slot, or assigns it
+Nested functions are not searched
+*/
+bool refs_global(heapptr_t expr, uint32_t idx, bool assigned)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+        return !assigned && ref->global && ref->idx == idx;
+    }
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op == &OP_ASSIGN && assigned)
+        {
+            heapptr_t lhs = binop->left_expr;
+
+            if (get_shape(lhs) == SHAPE_AST_DECL &&
+                ((ast_decl_t*)lhs)->global && ((ast_decl_t*)lhs)->idx == idx)
+                return true;
+
+            if (get_shape(lhs) == SHAPE_AST_REF &&
+                ((ast_ref_t*)lhs)->global && ((ast_ref_t*)lhs)->idx == idx)
+                return true;
+        }
+
+        return (
+            refs_global(binop->left_expr, idx, assigned) ||
+            refs_global(binop->right_expr, idx, assigned)
+        );
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+        return refs_global(((ast_unop_t*)expr)->expr, idx, assigned);
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+            if (refs_global(array_get_ptr(list, i), idx, assigned))
+                return true;
+
+        return false;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        return (
+            refs_global(ifexpr->test_expr, idx, assigned) ||
+            refs_global(ifexpr->then_expr, idx, assigned) ||
+            refs_global(ifexpr->else_expr, idx, assigned)
+        );
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        if (refs_global(callexpr->fun_expr, idx, assigned))
+            return true;
+
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            if (refs_global(array_get_ptr(callexpr->arg_exprs, i), idx, assigned))
+                return true;
+
+        return false;
+    }
+
+    return false;
+}
+
+/**
+Add a fresh local variable to a function, after variable resolution
+*/
+ast_decl_t* new_local(ast_fun_t* fun, string_t* name)
+{
+    ast_decl_t* decl = (ast_decl_t*)ast_decl_alloc((heapptr_t)name, false);
+    decl->idx = fun->local_decls->len;
+    decl->init = true;
+
+    fun->local_decls = array_append(
+        fun->local_decls,
+        value_from_heapptr((heapptr_t)decl, TAG_OBJECT)
+    );
+
+    return decl;
+}
+
+/**
+Copy the body of an inlined function into a caller
+The callee's local variables are replaced by the caller's
+declarations they are mapped to. Variables captured by the callee
+are read from the caller's frame or closure.
+*/
+heapptr_t inline_copy(heapptr_t expr, ast_decl_t** decls, ast_fun_t* caller)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+        ast_ref_t* copy = (ast_ref_t*)ast_ref_alloc((heapptr_t)ref->name);
+        *copy = *ref;
+
+        if (ref->capt && fun_owns_decl(caller, ref->decl))
+        {
+            copy->capt = false;
+            copy->idx = ref->decl->idx;
+        }
+        else if (ref->capt)
+        {
+            copy->idx = capt_idx(caller, ref->decl);
+        }
+        else if (!ref->global && !ref->builtin)
+        {
+            copy->decl = decls[ref->idx];
+            copy->idx = copy->decl->idx;
+        }
+
+        return (heapptr_t)copy;
+    }
+
+    if (shape == SHAPE_AST_DECL)
+        return (heapptr_t)decls[((ast_decl_t*)expr)->idx];
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        return ast_binop_alloc(
+            binop->op,
+            inline_copy(binop->left_expr, decls, caller),
+            inline_copy(binop->right_expr, decls, caller)
+        );
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        return ast_unop_alloc(unop->op, inline_copy(unop->expr, decls, caller));
+    }
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        array_t* copy = array_alloc(list->len);
+        for (size_t i = 0; i < list->len; ++i)
+        {
+            heapptr_t elem = inline_copy(array_get_ptr(list, i), decls, caller);
+            copy = array_append(copy, value_from_heapptr(elem, TAG_OBJECT));
+        }
+
+        if (shape == SHAPE_ARRAY)
+            return (heapptr_t)copy;
+        return ast_seq_alloc(copy);
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        return ast_if_alloc(
+            inline_copy(ifexpr->test_expr, decls, caller),
+            inline_copy(ifexpr->then_expr, decls, caller),
+            inline_copy(ifexpr->else_expr, decls, caller)
+        );
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        array_t* args = array_alloc(arg_exprs->len);
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            heapptr_t arg = inline_copy(array_get_ptr(arg_exprs, i), decls, caller);
+            args = array_append(args, value_from_heapptr(arg, TAG_OBJECT));
+        }
+
+        return ast_call_alloc(inline_copy(callexpr->fun_expr, decls, caller), args);
+    }
+
+    // Constants and strings are never modified, they can be shared
+    return expr;
+}
+
+/**
+Inlining state for a function
+*/
+typedef struct
+{
+    /// Functions that calls can be inlined to, by global slot index
+    ast_fun_t** callees;
+
+    /// Function being inlined into
+    ast_fun_t* fun;
+
+    /// Number of AST nodes inlined into the function so far
+    uint32_t growth;
+
+} inline_ctx_t;
+
+/**
+Inline a call to a known function
+The call is replaced by a sequence assigning the arguments to fresh
+local variables of the caller, followed by a copy of the callee body
+*/
+heapptr_t inline_call(inline_ctx_t* ctx, ast_call_t* callexpr, ast_fun_t* callee)
+{
+    ast_fun_t* fun = ctx->fun;
+    array_t* local_decls = callee->local_decls;
+    ast_decl_t* decls[local_decls->len + 1];
+
+    for (size_t i = 0; i < local_decls->len; ++i)
+    {
+        ast_decl_t* local = (ast_decl_t*)array_get_ptr(local_decls, i);
+        decls[i] = new_local(fun, local->name);
+        decls[i]->cst = local->cst;
+        decls[i]->mut = local->mut;
+    }
+
+    array_t* arg_exprs = callexpr->arg_exprs;
+    array_t* expr_list = array_alloc(arg_exprs->len + 1);
+
+    for (size_t i = 0; i < arg_exprs->len; ++i)
+    {
+        heapptr_t assign = ast_binop_alloc(
+            &OP_ASSIGN,
+            (heapptr_t)decls[i],
+            array_get_ptr(arg_exprs, i)
+        );
+
+        expr_list = array_append(
+            expr_list,
+            value_from_heapptr(assign, TAG_OBJECT)
+        );
+    }
+
+    heapptr_t body = inline_copy(callee->body_expr, decls, fun);
+    expr_list = array_append(expr_list, value_from_heapptr(body, TAG_OBJECT));
+
+    ctx->growth += expr_size(callee->body_expr);
+
+    return ast_seq_alloc(expr_list);
+}
+
+/**
+Inline the calls to known functions in an expression
+Returns the resulting expression, and may modify the expression in place
+*/
+heapptr_t inline_expr(inline_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        binop->left_expr = inline_expr(ctx, binop->left_expr);
+        binop->right_expr = inline_expr(ctx, binop->right_expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        unop->expr = inline_expr(ctx, unop->expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+        {
+            heapptr_t elem = inline_expr(ctx, array_get_ptr(list, i));
+            array_set(list, i, value_from_heapptr(elem, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        ifexpr->test_expr = inline_expr(ctx, ifexpr->test_expr);
+        ifexpr->then_expr = inline_expr(ctx, ifexpr->then_expr);
+        ifexpr->else_expr = inline_expr(ctx, ifexpr->else_expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            heapptr_t arg = inline_expr(ctx, array_get_ptr(arg_exprs, i));
+            array_set(arg_exprs, i, value_from_heapptr(arg, TAG_OBJECT));
+        }
+
+        callexpr->fun_expr = inline_expr(ctx, callexpr->fun_expr);
+
+        if (get_shape(callexpr->fun_expr) != SHAPE_AST_REF)
+            return expr;
+
+        ast_ref_t* ref = (ast_ref_t*)callexpr->fun_expr;
+
+        if (!ref->global)
+            return expr;
+
+        ast_fun_t* callee = ctx->callees[ref->idx];
+
+        // Calls with the wrong argument count fail at run time
+        if (callee == NULL ||
+            callee->param_decls->len != arg_exprs->len ||
+            ctx->growth + expr_size(callee->body_expr) > INLINE_MAX_GROWTH)
+            return expr;
+
+        return inline_call(ctx, callexpr, callee);
+    }
+
+    if (shape == SHAPE_AST_FUN)
+    {
+        inline_ctx_t fun_ctx = { ctx->callees, (ast_fun_t*)expr, 0 };
+        fun_ctx.fun->body_expr = inline_expr(&fun_ctx, fun_ctx.fun->body_expr);
+        return expr;
+    }
+
+    // Constants, strings, references and declarations
+    return expr;
+}
+
+/**
+Inline calls to small global functions of a source unit
+Only functions bound with let in a top-level statement of the unit, and
+never redefined, are inlined, into the statements after it. These are
+always defined by the time the calls execute. Functions which are too
+large, recursive or contain nested functions are not inlined.
+Note: the unit must have its own global scope, since units sharing it
+could redefine its functions
+*/
+void inline_pass(ast_fun_t* unit_fun)
+{
+    if (!opt_inline || get_shape(unit_fun->body_expr) != SHAPE_AST_SEQ)
+        return;
+
+    globals_t* globals = unit_fun->globals;
+    ast_fun_t* callees[globals->len + 1];
+    for (uint32_t i = 0; i < globals->len; ++i)
+        callees[i] = NULL;
+
+    inline_ctx_t ctx = { callees, unit_fun, 0 };
+    array_t* stmts = ((ast_seq_t*)unit_fun->body_expr)->expr_list;
+
+    for (size_t i = 0; i < stmts->len; ++i)
+    {
+        heapptr_t stmt = inline_expr(&ctx, array_get_ptr(stmts, i));
+        array_set(stmts, i, value_from_heapptr(stmt, TAG_OBJECT));
+
+        if (get_shape(stmt) != SHAPE_AST_BINOP)
+            continue;
+
+        ast_binop_t* binop = (ast_binop_t*)stmt;
+
+        if (binop->op != &OP_ASSIGN ||
+            get_shape(binop->left_expr) != SHAPE_AST_DECL ||
+            get_shape(binop->right_expr) != SHAPE_AST_FUN)
+            continue;
+
+        ast_decl_t* decl = (ast_decl_t*)binop->left_expr;
+        ast_fun_t* fun = (ast_fun_t*)binop->right_expr;
+
+        if (!decl->cst || !decl->global)
+            continue;
+
+        if (expr_size(fun->body_expr) > INLINE_MAX_SIZE ||
+            fun->capt_vars->len > 0 ||
+            refs_global(fun->body_expr, decl->idx, false))
+            continue;
+
+        // The variable must not be assigned anywhere else in the unit
+        bool redefined = false;
+        for (size_t j = 0; j < stmts->len; ++j)
+        {
+            heapptr_t other = array_get_ptr(stmts, j);
+            if (j != i && refs_global(other, decl->idx, true))
+                redefined = true;
+        }
+
+        if (!redefined)
+            callees[decl->idx] = fun;
+    }
+}
+
+/// Fold a source string, returns the resulting unit function body
+heapptr_t test_fold_str(char* cstr)
+{
+    ast_fun_t* unit_fun = load_str(cstr, "test");
+    return unit_fun->body_expr;
+}
+
+/// Maximum length of the arrays replaced by local variables
+#define SCALAR_MAX_LEN 8
+
+/// Test if an expression is a constant index within an array length
+bool is_const_idx(heapptr_t expr, uint32_t len)
+{
+    if (!is_const(expr))
+        return false;
+
+    value_t idx = const_val(expr);
+    return idx.tag == TAG_INT64 && idx.word.int64 >= 0 && idx.word.int64 < len;
+}
+
+/// Test if an expression is a reference to a given local variable
+bool is_local_ref(heapptr_t expr, ast_decl_t* decl)
+{
+    if (get_shape(expr) != SHAPE_AST_REF)
+        return false;
+
+    ast_ref_t* ref = (ast_ref_t*)expr;
+    return !ref->global && !ref->capt && !ref->builtin && ref->decl == decl;
+}
+
+/// Create a reference to a local variable
+heapptr_t local_ref(ast_decl_t* decl)
+{
+    ast_ref_t* ref = (ast_ref_t*)ast_ref_alloc((heapptr_t)decl->name);
+    ref->idx = decl->idx;
+    ref->decl = decl;
+    return (heapptr_t)ref;
+}
+
+/**
+Count the uses of a local variable holding an array or closure literal
+in an expression, and check that its value doesn't escape through them.
+Arrays may only be indexed with constants within their length, and
+closures only called with the right number of arguments. Any other use,
+such as passing the value to a function, returning or storing it,
+lets it escape. Returns false if the value may escape.
+Note: nested functions are not searched, the variable must not be
+captured
+*/
+bool local_uses(heapptr_t expr, ast_decl_t* decl, heapptr_t val, uint32_t* count)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_REF)
+        return !is_local_ref(expr, decl);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        // Assigning an element is left to the interpreters, which reject it
+        if (binop->op == &OP_ASSIGN &&
+            get_shape(binop->left_expr) == SHAPE_AST_BINOP &&
+            ((ast_binop_t*)binop->left_expr)->op == &OP_INDEX &&
+            is_local_ref(((ast_binop_t*)binop->left_expr)->left_expr, decl))
+            return false;
+
+        if (binop->op == &OP_INDEX && is_local_ref(binop->left_expr, decl))
+        {
+            if (get_shape(val) != SHAPE_ARRAY ||
+                !is_const_idx(binop->right_expr, ((array_t*)val)->len))
+                return false;
+
+            (*count)++;
+            return true;
+        }
+
+        return (
+            local_uses(binop->left_expr, decl, val, count) &&
+            local_uses(binop->right_expr, decl, val, count)
+        );
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+        return local_uses(((ast_unop_t*)expr)->expr, decl, val, count);
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+            if (!local_uses(array_get_ptr(list, i), decl, val, count))
+                return false;
+
+        return true;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        return (
+            local_uses(ifexpr->test_expr, decl, val, count) &&
+            local_uses(ifexpr->then_expr, decl, val, count) &&
+            local_uses(ifexpr->else_expr, decl, val, count)
+        );
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        if (is_local_ref(callexpr->fun_expr, decl))
+        {
+            if (get_shape(val) != SHAPE_AST_FUN ||
+                ((ast_fun_t*)val)->param_decls->len != arg_exprs->len)
+                return false;
+
+            (*count)++;
+        }
+        else if (!local_uses(callexpr->fun_expr, decl, val, count))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+            if (!local_uses(array_get_ptr(arg_exprs, i), decl, val, count))
+                return false;
+
+        return true;
+    }
+
+    return true;
+}
+
+/**
+Scalar replacement state for a local variable
+*/
+typedef struct
+{
+    /// Variable replaced and its initial value
+    ast_decl_t* decl;
+    heapptr_t val;
+
+    /// Variables replacing the array elements
+    ast_decl_t** elems;
+
+    /// Inlining state, for closures
+    inline_ctx_t inline_ctx;
+
+} scalar_ctx_t;
+
+/**
+Replace the uses of a non-escaping local variable
+Array elements are read from the variables that replace them, and
+calls to closures are inlined
+*/
+heapptr_t replace_uses(scalar_ctx_t* ctx, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op == &OP_INDEX && is_local_ref(binop->left_expr, ctx->decl))
+            return local_ref(ctx->elems[const_val(binop->right_expr).word.int64]);
+
+        binop->left_expr = replace_uses(ctx, binop->left_expr);
+        binop->right_expr = replace_uses(ctx, binop->right_expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        unop->expr = replace_uses(ctx, unop->expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+        {
+            heapptr_t elem = replace_uses(ctx, array_get_ptr(list, i));
+            array_set(list, i, value_from_heapptr(elem, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        ifexpr->test_expr = replace_uses(ctx, ifexpr->test_expr);
+        ifexpr->then_expr = replace_uses(ctx, ifexpr->then_expr);
+        ifexpr->else_expr = replace_uses(ctx, ifexpr->else_expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            heapptr_t arg = replace_uses(ctx, array_get_ptr(arg_exprs, i));
+            array_set(arg_exprs, i, value_from_heapptr(arg, TAG_OBJECT));
+        }
+
+        if (is_local_ref(callexpr->fun_expr, ctx->decl))
+            return inline_call(&ctx->inline_ctx, callexpr, (ast_fun_t*)ctx->val);
+
+        callexpr->fun_expr = replace_uses(ctx, callexpr->fun_expr);
+        return expr;
+    }
+
+    return expr;
+}
+
+/**
+Try to replace a local variable initialized with an array or closure
+literal, in statement i of a sequence. This is possible if its value
+never escapes the function, and all its uses follow the initialization
+in the same sequence, so that they always see the initial value.
+Returns the statement replacing the initialization, or NULL.
+*/
+heapptr_t scalar_replace(ast_fun_t* fun, array_t* stmts, size_t i)
+{
+    ast_binop_t* init = (ast_binop_t*)array_get_ptr(stmts, i);
+    ast_decl_t* decl = (ast_decl_t*)init->left_expr;
+    heapptr_t val = init->right_expr;
+
+    if (decl->global)
+        return NULL;
+
+    // Flags are set on the first declaration of a variable
+    decl = (ast_decl_t*)array_get_ptr(fun->local_decls, decl->idx);
+
+    // The variable must not be captured or assigned again, and the
+    // value of the initialization must not be used
+    if (decl->capt || decl->mut || i + 1 == stmts->len)
+        return NULL;
+
+    uint32_t size = 0;
+
+    // Empty arrays have no elements to replace, and are left alone
+    if (get_shape(val) == SHAPE_ARRAY)
+    {
+        uint32_t len = ((array_t*)val)->len;
+        if (len == 0 || len > SCALAR_MAX_LEN)
+            return NULL;
+    }
+    else
+    {
+        size = expr_size(((ast_fun_t*)val)->body_expr);
+        if (size > INLINE_MAX_SIZE)
+            return NULL;
+    }
+
+    uint32_t num_uses = 0;
+    if (!local_uses(fun->body_expr, decl, val, &num_uses))
+        return NULL;
+
+    uint32_t num_after = 0;
+    for (size_t j = i + 1; j < stmts->len; ++j)
+        local_uses(array_get_ptr(stmts, j), decl, val, &num_after);
+
+    if (num_after != num_uses || num_uses * size > INLINE_MAX_GROWTH)
+        return NULL;
+
+    scalar_ctx_t ctx;
+    ctx.decl = decl;
+    ctx.val = val;
+    ctx.inline_ctx = (inline_ctx_t){ NULL, fun, 0 };
+
+    heapptr_t stmt;
+
+    // The array elements are assigned to variables, in order
+    if (get_shape(val) == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)val;
+        ast_decl_t* elems[array_expr->len];
+        array_t* expr_list = array_alloc(array_expr->len);
+
+        for (size_t k = 0; k < array_expr->len; ++k)
+        {
+            elems[k] = new_local(fun, decl->name);
+            heapptr_t assign = ast_binop_alloc(
+                &OP_ASSIGN,
+                (heapptr_t)elems[k],
+                array_get_ptr(array_expr, k)
+            );
+            expr_list = array_append(
+                expr_list,
+                value_from_heapptr(assign, TAG_OBJECT)
+            );
+        }
+
+        ctx.elems = elems;
+        for (size_t j = i + 1; j < stmts->len; ++j)
+        {
+            heapptr_t other = replace_uses(&ctx, array_get_ptr(stmts, j));
+            array_set(stmts, j, value_from_heapptr(other, TAG_OBJECT));
+        }
+
+        stmt = ast_seq_alloc(expr_list);
+    }
+
+    // The closure is no longer needed once its calls are inlined
+    else
+    {
+        ctx.elems = NULL;
+        for (size_t j = i + 1; j < stmts->len; ++j)
+        {
+            heapptr_t other = replace_uses(&ctx, array_get_ptr(stmts, j));
+            array_set(stmts, j, value_from_heapptr(other, TAG_OBJECT));
+        }
+
+        stmt = ast_const_alloc(VAL_FALSE);
+    }
+
+    return stmt;
+}
+
+/**
+Replace the indexing of an array literal with a constant by the element
+The other elements are still evaluated, in order, if they have effects
+*/
+heapptr_t index_literal(ast_fun_t* fun, array_t* array_expr, uint32_t idx)
+{
+    bool pure = true;
+    for (size_t i = 0; i < array_expr->len; ++i)
+        if (i != idx && !is_pure(array_get_ptr(array_expr, i)))
+            pure = false;
+
+    if (pure)
+        return array_get_ptr(array_expr, idx);
+
+    array_t* expr_list = array_alloc(array_expr->len + 1);
+    ast_decl_t* elem = NULL;
+
+    for (size_t i = 0; i < array_expr->len; ++i)
+    {
+        ast_decl_t* decl = new_local(fun, vm_get_cstr("$elem"));
+        heapptr_t assign = ast_binop_alloc(
+            &OP_ASSIGN,
+            (heapptr_t)decl,
+            array_get_ptr(array_expr, i)
+        );
+        expr_list = array_append(expr_list, value_from_heapptr(assign, TAG_OBJECT));
+
+        if (i == idx)
+            elem = decl;
+    }
+
+    expr_list = array_append(
+        expr_list,
+        value_from_heapptr(local_ref(elem), TAG_OBJECT)
+    );
+
+    return ast_seq_alloc(expr_list);
+}
+
+/**
+Replace the non-escaping arrays and closures of a function's expression
+Nested functions are processed separately
+*/
+heapptr_t escape_expr(ast_fun_t* fun, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        binop->left_expr = escape_expr(fun, binop->left_expr);
+        binop->right_expr = escape_expr(fun, binop->right_expr);
+
+        if (binop->op != &OP_INDEX)
+            return expr;
+
+        // Index of a literal, possibly at the end of a sequence
+        heapptr_t array_expr = binop->left_expr;
+        ast_seq_t* seqexpr = NULL;
+
+        if (get_shape(array_expr) == SHAPE_AST_SEQ)
+        {
+            seqexpr = (ast_seq_t*)array_expr;
+            if (seqexpr->expr_list->len == 0)
+                return expr;
+            array_expr = array_get_ptr(seqexpr->expr_list, seqexpr->expr_list->len - 1);
+        }
+
+        if (get_shape(array_expr) != SHAPE_ARRAY ||
+            !is_const_idx(binop->right_expr, ((array_t*)array_expr)->len))
+            return expr;
+
+        heapptr_t elem = index_literal(
+            fun,
+            (array_t*)array_expr,
+            const_val(binop->right_expr).word.int64
+        );
+
+        if (seqexpr == NULL)
+            return elem;
+
+        array_set(
+            seqexpr->expr_list,
+            seqexpr->expr_list->len - 1,
+            value_from_heapptr(elem, TAG_OBJECT)
+        );
+        return (heapptr_t)seqexpr;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        unop->expr = escape_expr(fun, unop->expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+        {
+            heapptr_t elem = escape_expr(fun, array_get_ptr(list, i));
+            array_set(list, i, value_from_heapptr(elem, TAG_OBJECT));
+        }
+
+        if (shape == SHAPE_ARRAY)
+            return expr;
+
+        // Local variables initialized with literals
+        for (size_t i = 0; i < list->len; ++i)
+        {
+            heapptr_t stmt = array_get_ptr(list, i);
+
+            if (get_shape(stmt) != SHAPE_AST_BINOP)
+                continue;
+
+            ast_binop_t* binop = (ast_binop_t*)stmt;
+            shapeidx_t val_shape = get_shape(binop->right_expr);
+
+            if (binop->op != &OP_ASSIGN ||
+                get_shape(binop->left_expr) != SHAPE_AST_DECL ||
+                (val_shape != SHAPE_ARRAY && val_shape != SHAPE_AST_FUN))
+                continue;
+
+            heapptr_t new_stmt = scalar_replace(fun, list, i);
+
+            if (new_stmt)
+                array_set(list, i, value_from_heapptr(new_stmt, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        ifexpr->test_expr = escape_expr(fun, ifexpr->test_expr);
+        ifexpr->then_expr = escape_expr(fun, ifexpr->then_expr);
+        ifexpr->else_expr = escape_expr(fun, ifexpr->else_expr);
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        callexpr->fun_expr = escape_expr(fun, callexpr->fun_expr);
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            heapptr_t arg = escape_expr(fun, array_get_ptr(arg_exprs, i));
+            array_set(arg_exprs, i, value_from_heapptr(arg, TAG_OBJECT));
+        }
+
+        return expr;
+    }
+
+    if (shape == SHAPE_AST_FUN)
+    {
+        escape_pass((ast_fun_t*)expr);
+        return expr;
+    }
+
+    return expr;
+}
+
+/**
+Escape analysis and scalar replacement
+Arrays and closures created from literals in a function, and which
+can't escape it, are replaced by local variables: array literals that
+are only indexed with constants by their elements, and closures that
+are only called by inlined copies of their body. This avoids their
+heap allocation. Nested functions are processed first, so that their
+bodies are optimized before being inlined.
+*/
+void escape_pass(ast_fun_t* fun)
+{
+    if (!opt_escape)
+        return;
+
+    fun->body_expr = escape_expr(fun, fun->body_expr);
+}
+
+/// Maximum nesting of calls followed by the purity analysis
+#define PURE_MAX_DEPTH 16
+
+/**
+Purity analysis state, closures being analyzed
+Calls back to these are assumed pure, the analysis of the outermost
+call decides for the whole cycle.
+*/
+typedef struct
+{
+    clos_t* clos[PURE_MAX_DEPTH];
+    uint32_t depth;
+
+} pure_ctx_t;
+
+bool pure_clos(pure_ctx_t* ctx, clos_t* clos);
+
+/// Test if a callee is a pure builtin or a closure with a pure body
+bool pure_callee(pure_ctx_t* ctx, clos_t* clos, ast_ref_t* ref)
+{
+    if (ref->builtin)
+        return BUILTINS[ref->idx].pure;
+
+    // The values called are those of the variables now: the callees
+    // can't change while only pure code runs
+    value_t val;
+    if (ref->global)
+        val = clos->fun->globals->vals[ref->idx];
+    else if (ref->capt)
+        val = clos->env[ref->idx];
+    else
+        return false;
+
+    if (val.tag == TAG_RAW_PTR && ref->capt && decl_boxed(ref->decl))
+        val = ((cell_t*)val.word.heapptr)->val;
+
+    if (val.tag != TAG_CLOS)
+        return false;
+
+    return pure_clos(ctx, (clos_t*)val.word.heapptr);
+}
+
+/**
+Test if evaluating an expression in a closure has no effects besides
+producing a value, allocating and possibly failing
+*/
+bool pure_expr(pure_ctx_t* ctx, clos_t* clos, heapptr_t expr)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_CONST ||
+        shape == SHAPE_STRING ||
+        shape == SHAPE_AST_REF ||
+        shape == SHAPE_AST_DECL ||
+        shape == SHAPE_AST_FUN)
+        return true;
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        // Only the locals of the closure can be assigned
+        if (binop->op == &OP_ASSIGN)
+        {
+            heapptr_t lhs = binop->left_expr;
+
+            if (get_shape(lhs) == SHAPE_AST_DECL && ((ast_decl_t*)lhs)->global)
+                return false;
+
+            if (get_shape(lhs) == SHAPE_AST_REF &&
+                (((ast_ref_t*)lhs)->global || ((ast_ref_t*)lhs)->capt))
+                return false;
+
+            return pure_expr(ctx, clos, binop->right_expr);
+        }
+
+        return (
+            pure_expr(ctx, clos, binop->left_expr) &&
+            pure_expr(ctx, clos, binop->right_expr)
+        );
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+        return pure_expr(ctx, clos, ((ast_unop_t*)expr)->expr);
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+            if (!pure_expr(ctx, clos, array_get_ptr(list, i)))
+                return false;
+
+        return true;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        return (
+            pure_expr(ctx, clos, ifexpr->test_expr) &&
+            pure_expr(ctx, clos, ifexpr->then_expr) &&
+            pure_expr(ctx, clos, ifexpr->else_expr)
+        );
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            if (!pure_expr(ctx, clos, array_get_ptr(callexpr->arg_exprs, i)))
+                return false;
+
+        if (get_shape(callexpr->fun_expr) != SHAPE_AST_REF)
+            return false;
+
+        return pure_callee(ctx, clos, (ast_ref_t*)callexpr->fun_expr);
+    }
+
+    return false;
+}
+
+bool pure_clos(pure_ctx_t* ctx, clos_t* clos)
+{
+    for (uint32_t i = 0; i < ctx->depth; ++i)
+        if (ctx->clos[i] == clos)
+            return true;
+
+    if (ctx->depth == PURE_MAX_DEPTH)
+        return false;
+
+    ctx->clos[ctx->depth++] = clos;
+    bool pure = pure_expr(ctx, clos, clos->fun->body_expr);
+    ctx->depth--;
+
+    return pure;
+}
+
+/**
+Test if calling a closure can have no side effects
+The closure may only assign its own locals, and call pure builtins and
+closures bound to variables, which are analyzed in turn. Calls through
+parameters and other computed callees are assumed impure. Such calls
+can run concurrently, and in any order.
+*/
+bool clos_is_pure(clos_t* clos)
+{
+    pure_ctx_t ctx;
+    ctx.depth = 0;
+    return pure_clos(&ctx, clos);
+}
+
+/// Count the nodes of a given shape in an expression and its nested functions
+uint32_t test_count_shape(heapptr_t expr, shapeidx_t node_shape)
+{
+    shapeidx_t shape = get_shape(expr);
+    uint32_t count = (shape == node_shape)? 1:0;
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        count += test_count_shape(binop->left_expr, node_shape);
+        count += test_count_shape(binop->right_expr, node_shape);
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+        count += test_count_shape(((ast_unop_t*)expr)->expr, node_shape);
+
+    if (shape == SHAPE_AST_SEQ || shape == SHAPE_ARRAY)
+    {
+        array_t* list = (shape == SHAPE_ARRAY)?
+            (array_t*)expr:((ast_seq_t*)expr)->expr_list;
+
+        for (size_t i = 0; i < list->len; ++i)
+            count += test_count_shape(array_get_ptr(list, i), node_shape);
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        count += test_count_shape(ifexpr->test_expr, node_shape);
+        count += test_count_shape(ifexpr->then_expr, node_shape);
+        count += test_count_shape(ifexpr->else_expr, node_shape);
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+
+        count += test_count_shape(callexpr->fun_expr, node_shape);
+        for (size_t i = 0; i < callexpr->arg_exprs->len; ++i)
+            count += test_count_shape(array_get_ptr(callexpr->arg_exprs, i), node_shape);
+    }
+
+    if (shape == SHAPE_AST_FUN)
+        count += test_count_shape(((ast_fun_t*)expr)->body_expr, node_shape);
+
+    return count;
+}
+
+/// Check the number of nodes of a shape left after optimization,
+/// and the value of a unit
+void test_opt_eval(char* cstr, shapeidx_t shape, uint32_t count, int64_t expected)
+{
+    ast_fun_t* unit_fun = load_str(cstr, "test");
+    uint32_t num_nodes = test_count_shape(unit_fun->body_expr, shape);
+
+    value_t ast_value = eval_unit(unit_fun);
+    value_t bc_value = bc_eval_unit(load_str(cstr, "test"));
+
+    if (num_nodes != count ||
+        !value_equals(ast_value, value_from_int64(expected)) ||
+        !value_equals(bc_value, value_from_int64(expected)))
+    {
+        printf("optimization test failed for:\n%s\n", cstr);
+        printf("nodes left: %u, expected %u\n", num_nodes, count);
+        exit(-1);
+    }
+}
+
+void test_opt()
+{
+    heapptr_t expr;
+
+    // Constant arithmetic folds with wrapping semantics
+    expr = test_fold_str("3 + 2 * 5");
+    assert (is_const(expr));
+    assert (value_equals(const_val(expr), value_from_int64(13)));
+
+    expr = test_fold_str("-(7 + 3)");
+    assert (value_equals(const_val(expr), value_from_int64(-10)));
+
+    expr = test_fold_str("0x7FFFFFFFFFFFFFFF + 1");
+    assert (value_equals(const_val(expr), value_from_int64(INT64_MIN)));
+
+    expr = test_fold_str("not not true");
+    assert (value_equals(const_val(expr), VAL_TRUE));
+
+    expr = test_fold_str("1.5 * 2.0 < 4.0");
+    assert (value_equals(const_val(expr), VAL_TRUE));
+
+    // Operations that fail at run time are not folded
+    assert (get_shape(test_fold_str("1 / 0")) == SHAPE_AST_BINOP);
+    assert (get_shape(test_fold_str("1 + 2.0")) == SHAPE_AST_BINOP);
+    assert (get_shape(test_fold_str("-true")) == SHAPE_AST_UNOP);
+
+    // Dead branches are removed
+    expr = test_fold_str("if 1 < 2 then 'a' else 'b'");
+    assert (get_shape(expr) == SHAPE_STRING);
+    expr = test_fold_str("if 1 then 2 else 3");
+    assert (get_shape(expr) == SHAPE_AST_IF);
+
+    // Sequences are flattened, unused pure values dropped
+    expr = test_fold_str("{ 1 { 2 3 } }");
+    assert (value_equals(const_val(expr), value_from_int64(3)));
+
+    expr = test_fold_str("var x = 1\n{ 5 { x = 2 'foo' } x }");
+    assert (get_shape(expr) == SHAPE_AST_SEQ);
+    assert (((ast_seq_t*)expr)->expr_list->len == 3);
+
+    // Nested function bodies are optimized
+    expr = test_fold_str("fun (x) x + (2 * 3)");
+    ast_binop_t* body = (ast_binop_t*)((ast_fun_t*)expr)->body_expr;
+    assert (value_equals(const_val(body->right_expr), value_from_int64(6)));
+
+    // Small global functions are inlined into the statements after them
+    test_opt_eval("let sq = fun (x) x * x\nsq(3) + sq(4)", SHAPE_AST_CALL, 0, 25);
+    test_opt_eval("let sq = fun (x) x * x\nsq(sq(2))", SHAPE_AST_CALL, 0, 16);
+    test_opt_eval(
+        "let f = fun (x) { var y = x + 1\ny = y * 2\ny }\nf(3) + f(4)",
+        SHAPE_AST_CALL,
+        0,
+        18
+    );
+    test_opt_eval(
+        "let add = fun (a, b) a + b\n"
+        "let mk = fun (n) fun (m) add(n, m)\n"
+        "mk(40)(2)",
+        SHAPE_AST_CALL,
+        2,
+        42
+    );
+    test_opt_eval(
+        "let inc = fun (x) x + 1\n"
+        "let loop = fun (i, n) if i == n then i else loop(inc(i), n)\n"
+        "loop(0, 10)",
+        SHAPE_AST_CALL,
+        2,
+        10
+    );
+
+    // Recursive functions, functions used before their definition and
+    // redefined functions are not inlined
+    test_opt_eval("let f = fun (n) if n < 1 then 0 else f(n - 1)\nf(3)", SHAPE_AST_CALL, 2, 0);
+    test_opt_eval("let g = fun () f(1)\nlet f = fun (x) x\ng()", SHAPE_AST_CALL, 2, 1);
+    test_opt_eval(
+        "let f = fun () 1\nlet h = fun () f()\nlet f = fun () 2\nh()",
+        SHAPE_AST_CALL,
+        2,
+        2
+    );
+
+    // Calls with the wrong argument count are left to fail at run time
+    ast_fun_t* unit_fun = load_str("let f = fun (x) x\nlet g = fun () f()", "test");
+    assert (test_count_shape(unit_fun->body_expr, SHAPE_AST_CALL) == 1);
+
+    // Arrays indexed by constants are not allocated
+    expr = test_fold_str("[1, 2, 3][1]");
+    assert (value_equals(const_val(expr), value_from_int64(2)));
+    test_opt_eval(
+        "var x = 0\nlet r = [x = 5, 2][1]\nx * 10 + r",
+        SHAPE_ARRAY,
+        0,
+        52
+    );
+    test_opt_eval(
+        "let f = fun (a, b) { let v = [a + b, a - b]\nv[0] * v[1] }\nf(5, 3)",
+        SHAPE_ARRAY,
+        0,
+        16
+    );
+
+    // Arrays whose elements are assigned are kept, so that the
+    // assignment fails as it does without the optimization
+    for (int escape = 0; escape < 2; ++escape)
+    {
+        opt_escape = escape;
+        unit_fun = load_str("let f = fun () { let p = [1, 2]\np[0] = 7\np[0] }", "test");
+        assert (test_count_shape(unit_fun->body_expr, SHAPE_ARRAY) == 1);
+    }
+    opt_escape = true;
+
+    // Arrays that escape or are indexed by variables are kept, both in
+    // the function and in its inlined copy
+    test_opt_eval(
+        "let f = fun (a) { let v = [a, a]\nv }\nf(1)[0]",
+        SHAPE_ARRAY,
+       2,
+        1
+    );
+    test_opt_eval(
+        "let f = fun (a) { let v = [a, a]\nlen(v) }\nf(1)",
+        SHAPE_ARRAY,
+       2,
+        2
+    );
+    test_opt_eval(
+        "let f = fun (a, i) { let v = [a, a + 1]\nv[i] }\nf(1, 1)",
+        SHAPE_ARRAY,
+       2,
+        2
+    );
+
+    // Local closures that are only called are inlined, without allocation
+    test_opt_eval(
+        "let f = fun (n) { let add = fun (m) n + m\nadd(1) + add(2) }\nf(10)",
+        SHAPE_AST_FUN,
+        1,
+        23
+    );
+    test_opt_eval(
+        "let f = fun () { var x = 1\nlet inc = fun () x = x + 1\n"
+        "inc()\ninc()\nx }\nf()",
+        SHAPE_AST_FUN,
+        1,
+        3
+    );
+    test_opt_eval(
+        "let f = fun (n) { let add = fun (m) n + m\nadd }\nf(1)(2)",
+        SHAPE_AST_FUN,
+        2,
+        3
+    );
+}
@@ -0,0 +1,34 @@
+/**
+AST optimization passes
+
+These passes run on resolved function ASTs, between variable resolution
+and execution, and rewrite them in place into cheaper equivalent forms.
+Both the AST and bytecode interpreters benefit from them.
+*/
+
+#ifndef __OPT_H__
+#define __OPT_H__
+
+#include "vm.h"
+#include "parser.h"
+#include "interp.h"
+
+/// Enable the AST optimization passes
+extern bool opt_fold;
+
+/// Enable function inlining
+extern bool opt_inline;
+
+/// Enable escape analysis and scalar replacement
+extern bool opt_escape;
+
+bool binop_foldable(const opinfo_t* op, value_t v0, value_t v1);
+heapptr_t fold_expr(heapptr_t expr);
+void opt_pass(ast_fun_t* fun);
+void inline_pass(ast_fun_t* unit_fun);
+void escape_pass(ast_fun_t* fun);
+bool clos_is_pure(clos_t* clos);
+
+void test_opt();
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "par.h"
+#include "task.h"
+#include "opt.h"
+#include "coro.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Kinds of array operations
+typedef enum
+{
+    PAR_ARRAY,
+    PAR_MAP,
+    PAR_FILTER,
+    PAR_REDUCE,
+    PAR_FOREACH
+} par_kind_t;
+
+/**
+Array operation split into chunks
+*/
+typedef struct
+{
+    par_kind_t kind;
+
+    clos_t* clos;
+
+    /// Input array, NULL when making an array
+    array_t* array;
+
+    /// Number of elements
+    uint32_t len;
+
+    uint32_t num_chunks;
+
+    /// Mapped elements, with the length of the input
+    array_t* out;
+
+    /// Filter results of each element
+    bool* keep;
+
+    /// Reduction of each chunk
+    value_t* partial;
+
+} par_op_t;
+
+/**
+Test if an operation on an array should run in parallel, without
+being asked to
+*/
+bool par_auto(uint32_t len, clos_t* clos)
+{
+    return (
+        len >= PAR_MIN_LEN &&
+        task_pool_size() > 1 &&
+        clos_is_pure(clos)
+    );
+}
+
+/// Number of chunks to split an array into
+static uint32_t par_num_chunks(uint32_t len, bool parallel)
+{
+    if (!parallel)
+        return 1;
+
+    // A few chunks per worker balance the load
+    uint32_t num_chunks = len / PAR_MIN_CHUNK;
+    if (num_chunks > 4 * task_pool_size())
+        num_chunks = 4 * task_pool_size();
+
+    return num_chunks? num_chunks:1;
+}
+
+/// Process one chunk of an array
+static void par_chunk(void* data, uint32_t chunk)
+{
+    par_op_t* op = (par_op_t*)data;
+    array_t* array = op->array;
+
+    uint32_t start = (uint64_t)op->len * chunk / op->num_chunks;
+    uint32_t end = (uint64_t)op->len * (chunk + 1) / op->num_chunks;
+
+    value_t args[2];
+
+    switch (op->kind)
+    {
+        case PAR_ARRAY:
+        for (uint32_t i = start; i < end; ++i)
+        {
+            args[0] = value_from_int64(i);
+            op->out->elems[i] = bc_call(op->clos, args, 1);
+        }
+        break;
+
+        case PAR_MAP:
+        for (uint32_t i = start; i < end; ++i)
+            op->out->elems[i] = bc_call(op->clos, &array->elems[i], 1);
+        break;
+
+        case PAR_FILTER:
+        for (uint32_t i = start; i < end; ++i)
+            op->keep[i] = eval_truth(bc_call(op->clos, &array->elems[i], 1));
+        break;
+
+        // Each chunk is reduced from its first element
+        case PAR_REDUCE:
+        args[0] = array->elems[start];
+        for (uint32_t i = start + 1; i < end; ++i)
+        {
+            args[1] = array->elems[i];
+            args[0] = bc_call(op->clos, args, 2);
+        }
+        op->partial[chunk] = args[0];
+        break;
+
+        case PAR_FOREACH:
+        for (uint32_t i = start; i < end; ++i)
+            bc_call(op->clos, &array->elems[i], 1);
+        break;
+    }
+}
+
+/// Run an operation, in parallel if it has more than one chunk
+static void par_run(par_op_t* op)
+{
+    if (op->num_chunks > 1)
+        task_parallel(op->num_chunks, par_chunk, op);
+    else
+        par_chunk(op, 0);
+}
+
+/**
+Make an array from a closure called on each index
+*/
+array_t* par_array(uint32_t len, clos_t* clos, bool parallel)
+{
+    par_op_t op;
+    op.kind = PAR_ARRAY;
+    op.clos = clos;
+    op.array = NULL;
+    op.len = len;
+    op.num_chunks = par_num_chunks(len, parallel);
+    op.out = array_alloc(len);
+    op.out->len = len;
+
+    par_run(&op);
+
+    return op.out;
+}
+
+/**
+Apply a closure to each element, producing an array of the results
+*/
+array_t* par_map(array_t* array, clos_t* clos, bool parallel)
+{
+    par_op_t op;
+    op.kind = PAR_MAP;
+    op.clos = clos;
+    op.array = array;
+    op.len = array->len;
+    op.num_chunks = par_num_chunks(array->len, parallel);
+    op.out = array_alloc(array->len);
+    op.out->len = array->len;
+
+    par_run(&op);
+
+    return op.out;
+}
+
+/**
+Select the elements for which a closure returns true
+*/
+array_t* par_filter(array_t* array, clos_t* clos, bool parallel)
+{
+    par_op_t op;
+    op.kind = PAR_FILTER;
+    op.clos = clos;
+    op.array = array;
+    op.len = array->len;
+    op.num_chunks = par_num_chunks(array->len, parallel);
+    op.keep = malloc(sizeof(bool) * array->len);
+
+    par_run(&op);
+
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < array->len; ++i)
+        len += op.keep[i];
+
+    array_t* out = array_alloc(len);
+    for (uint32_t i = 0; i < array->len; ++i)
+        if (op.keep[i])
+            out->elems[out->len++] = array->elems[i];
+
+    free(op.keep);
+
+    return out;
+}
+
+/**
+Combine the elements with a closure of two arguments, from left to
+right, starting from an initial value
+*/
+value_t par_reduce(array_t* array, clos_t* clos, value_t init, bool parallel)
+{
+    value_t args[2] = { init };
+
+    if (par_num_chunks(array->len, parallel) == 1)
+    {
+        for (uint32_t i = 0; i < array->len; ++i)
+        {
+            args[1] = array->elems[i];
+            args[0] = bc_call(clos, args, 2);
+        }
+
+        return args[0];
+    }
+
+    par_op_t op;
+    op.kind = PAR_REDUCE;
+    op.clos = clos;
+    op.array = array;
+    op.len = array->len;
+    op.num_chunks = par_num_chunks(array->len, parallel);
+
+    value_t partial[op.num_chunks];
+    op.partial = partial;
+
+    par_run(&op);
+
+    // The chunks are combined in order
+    for (uint32_t i = 0; i < op.num_chunks; ++i)
+    {
+        args[1] = partial[i];
+        args[0] = bc_call(clos, args, 2);
+    }
+
+    return args[0];
+}
+
+/**
+Call a closure on each element
+*/
+void par_foreach(array_t* array, clos_t* clos, bool parallel)
+{
+    par_op_t op;
+    op.kind = PAR_FOREACH;
+    op.clos = clos;
+    op.array = array;
+    op.len = array->len;
+    op.num_chunks = par_num_chunks(array->len, parallel);
+
+    par_run(&op);
+}
+
+void test_par()
+{
+    test_eval_modes("reduce(map([1, 2, 3], fun (x) x * 2), fun (a, x) a + x, 0)", 12);
+    test_eval_modes("len(filter([1, 2, 3, 4, 5], fun (x) x mod 2 == 1))", 3);
+    test_eval_modes("reduce([1, 2, 3], fun (a, x) a * 10 + x, 0)", 123);
+    test_eval_modes("reduce([], fun (a, x) a + x, 7)", 7);
+    test_eval_modes("len(map([], fun (x) x))", 0);
+    test_eval_modes("var n = 0\nforeach([1, 2, 3], fun (x) n = n * 10 + x)\nn", 123);
+    test_eval_modes("preduce(pmap([1, 2, 3], fun (x) x + 1), fun (a, x) a + x, 0)", 9);
+    test_eval_modes("pfilter([5, 6, 7], fun (x) x > 5)[1]", 7);
+    test_eval_modes("let a = array(5, fun (i) i * i)\nlen(a) * 100 + a[4]", 516);
+
+    // Calls through builtins recurse on the C stack, which is checked
+    test_eval_modes("let h = fun (n) if n == 0 then 0 else 1 + map([n - 1], h)[0]\nh(300)", 300);
+
+    // Closures proven pure
+    assert (clos_is_pure(test_eval_clos("fun (x) x * 2")));
+    assert (clos_is_pure(test_eval_clos("fun (x) { let y = x + 1\nvar z = y\nz = z * 2\nlet r = [y, z]\nr }")));
+    assert (clos_is_pure(test_eval_clos("let sq = fun (x) x * x\nfun (x) sq(x) + abs(x)")));
+    assert (clos_is_pure(test_eval_clos("let f = fun (n) if n == 0 then 0 else f(n - 1)\nf")));
+    assert (clos_is_pure(test_eval_clos("let k = 3\nlet g = fun () { let f = fun (x) x + k\nfun (x) f(x) }\ng()")));
+    assert (!clos_is_pure(test_eval_clos("var n = 0\nfun (x) n = n + x")));
+    assert (!clos_is_pure(test_eval_clos("fun (x) println(x)")));
+    assert (!clos_is_pure(test_eval_clos("fun (f) f(1)")));
+    assert (!clos_is_pure(test_eval_clos("let g = fun () { var c = 0\nfun (x) c = c + x }\ng()")));
+    assert (!clos_is_pure(test_eval_clos("let p = fun (x) println(x)\nlet q = fun (x) p(x)\nfun (x) q(x)")));
+
+    // Large arrays, in parallel, and with the JIT on the calling thread
+    uint32_t len = 10000;
+    array_t* array = array_alloc(len);
+    for (uint32_t i = 0; i < len; ++i)
+        array_set(array, i, value_from_int64(i));
+
+    clos_t* twice = test_eval_clos("let f = fun (x) x * 2\nfun (x) f(x)");
+    clos_t* even = test_eval_clos("fun (x) x mod 2 == 0");
+    clos_t* add = test_eval_clos("fun (a, x) a + x");
+    assert (par_auto(len, twice) == (task_pool_size() > 1));
+
+    bool jit = opt_jit;
+    uint32_t threshold = jit_threshold;
+
+    for (int mode = 0; mode < 4; ++mode)
+    {
+        bool parallel = mode & 1;
+        opt_jit = (mode & 2) != 0;
+        jit_threshold = 1;
+
+        array_t* indices = par_array(len, test_eval_clos("fun (i) i"), parallel);
+        for (uint32_t i = 0; i < len; ++i)
+            assert (array_get(indices, i).word.int64 == i);
+
+        array_t* doubled = par_map(array, twice, parallel);
+        assert (doubled->len == len);
+        for (uint32_t i = 0; i < len; ++i)
+            assert (array_get(doubled, i).word.int64 == 2 * i);
+
+        array_t* evens = par_filter(array, even, parallel);
+        assert (evens->len == len / 2);
+        for (uint32_t i = 0; i < evens->len; ++i)
+            assert (array_get(evens, i).word.int64 == 2 * i);
+
+        value_t sum = par_reduce(doubled, add, value_from_int64(1), parallel);
+        assert (sum.word.int64 == 1 + (int64_t)len * (len - 1));
+    }
+
+    opt_jit = jit;
+    jit_threshold = threshold;
+}
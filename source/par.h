@@ -0,0 +1,43 @@
+/**
+Array operations
+
+map, filter, reduce and foreach apply a closure to the elements of an
+array, and array makes an array from a closure called on each index:
+
+    array(3, fun (i) i + 1)                     // [1, 2, 3]
+    map([1, 2, 3], fun (x) x * 2)               // [2, 4, 6]
+    filter([1, 2, 3], fun (x) x mod 2 == 1)     // [1, 3]
+    reduce([1, 2, 3], fun (a, x) a + x, 0)      // 6
+    foreach([1, 2, 3], fun (x) println(x))
+
+Large arrays are split into chunks processed in parallel by the task
+workers (see task.h) when doing so can't be observed: array, map and
+filter run in parallel when their closure is pure (see clos_is_pure).
+The variants pmap, pfilter, preduce and pforeach always run in
+parallel, the caller vouches that the closure can be called concurrently
+and in any order, and for preduce, that it is associative. Results are
+always in the order of the elements.
+*/
+
+#ifndef __PAR_H__
+#define __PAR_H__
+
+#include "vm.h"
+#include "interp.h"
+
+/// Minimum array length for array, map and filter to run in parallel
+#define PAR_MIN_LEN 4096
+
+/// Minimum number of elements per parallel chunk
+#define PAR_MIN_CHUNK 256
+
+bool par_auto(uint32_t len, clos_t* clos);
+array_t* par_array(uint32_t len, clos_t* clos, bool parallel);
+array_t* par_map(array_t* array, clos_t* clos, bool parallel);
+array_t* par_filter(array_t* array, clos_t* clos, bool parallel);
+value_t par_reduce(array_t* array, clos_t* clos, value_t init, bool parallel);
+void par_foreach(array_t* array, clos_t* clos, bool parallel);
+
+void test_par();
+
+#endif
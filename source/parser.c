@@ -140,6 +140,24 @@ bool input_match_str(input_t* input, char* str)
     }
 }
 
+/// Try and match a keyword in the input
+/// The keyword must not be followed by an identifier character,
+/// so that it doesn't match the prefix of an identifier
+bool input_match_kw(input_t* input, char* str)
+{
+    input_t sub = *input;
+
+    if (!input_match_str(&sub, str))
+        return false;
+
+    char ch = input_peek_ch(&sub);
+    if (isalnum(ch) || ch == '$' || ch == '_')
+        return false;
+
+    *input = sub;
+    return true;
+}
+
 /// Consume whitespace and comments
 void input_eat_ws(input_t* input)
 {
@@ -207,6 +225,10 @@ heapptr_t ast_ref_alloc(heapptr_t name_str)
     assert (get_shape(name_str) == SHAPE_STRING);
     node->name = (string_t*)name_str;
     node->idx = 0xFFFF;
+    node->global = false;
+    node->capt = false;
+    node->builtin = false;
+    node->decl = NULL;
     return (heapptr_t)node;
 }
 
@@ -222,6 +244,9 @@ heapptr_t ast_decl_alloc(heapptr_t name_str, bool cst)
     node->idx = 0xFFFF;
     node->cst = cst;
     node->capt = false;
+    node->mut = false;
+    node->init = false;
+    node->global = false;
     return (heapptr_t)node;
 }
 
@@ -313,13 +338,30 @@ heapptr_t ast_fun_alloc(
         SHAPE_AST_FUN
     );
     node->parent = NULL;
+    node->name = NULL;
     node->param_decls = param_decls;
     node->local_decls = array_alloc(4);
     node->capt_vars = array_alloc(4);
+    node->globals = NULL;
     node->body_expr = body_expr;
+    node->bc_fun = NULL;
+    node->num_calls = 0;
+    node->num_backedges = 0;
+    node->tier = 0;
     return (heapptr_t)node;
 }
 
+/// Print the name of a function, for diagnostics
+void print_fun_name(ast_fun_t* fun)
+{
+    if (fun->name)
+        printf("%.*s", (int)fun->name->len, fun->name->data);
+    else if (fun->parent == NULL)
+        printf("<unit>");
+    else
+        printf("<anonymous>");
+}
+
 /**
 Parse an identifier
 */
@@ -360,7 +402,7 @@ heapptr_t parse_ident(input_t* input)
 
 /**
 Parse a number (integer or floating-point)
-Note: floating-point numbers are not supported by the core parser
+Note: floating-point numbers must be written in decimal
 */
 heapptr_t parse_number(input_t* input)
 {
@@ -389,6 +431,17 @@ heapptr_t parse_number(input_t* input)
     {
         numStart = input->str->data + input->idx;
         intVal = strtol(numStart, &endInt, 10);
+
+        // If there is a fractional part or an exponent,
+        // this is a floating-point literal
+        if ((endInt[0] == '.' && isdigit(endInt[1])) ||
+            endInt[0] == 'e' || endInt[0] == 'E')
+        {
+            char* endFloat = NULL;
+            double floatVal = strtod(numStart, &endFloat);
+            input->idx += endFloat - numStart;
+            return (heapptr_t)ast_const_alloc(value_from_float64(floatVal));
+        }
     }
 
     input->idx += endInt - numStart;
@@ -460,7 +513,7 @@ heapptr_t parse_if_expr(input_t* input)
     heapptr_t test_expr = parse_expr(input);
 
     input_eat_ws(input);
-    if (!input_match_str(input, "then"))
+    if (!input_match_kw(input, "then"))
     {
         input->error_str = "expected 'then' keyword";
         return NULL;
@@ -478,7 +531,7 @@ heapptr_t parse_if_expr(input_t* input)
 
     // If these is an else clause
     input_eat_ws(input);
-    if (input_match_str(input, "else"))
+    if (input_match_kw(input, "else"))
     {
        else_expr = parse_expr(input);
     }
@@ -520,7 +573,7 @@ array_t* parse_expr_list(input_t* input, char endCh, bool needSep)
         }
 
         // Write the expression to the array
-        array_set_obj(arr, arr->len, expr);
+        arr = array_append(arr, value_from_heapptr(expr, TAG_OBJECT));
 
         // Read whitespace
         input_eat_ws(input);
@@ -577,7 +630,10 @@ heapptr_t parse_fun_expr(input_t* input)
         heapptr_t decl = ast_decl_alloc(ident, false);
 
         // Write the expression to the array
-        array_set_obj(param_decls, param_decls->len, decl);
+        param_decls = array_append(
+            param_decls,
+            value_from_heapptr(decl, TAG_OBJECT)
+        );
 
         // Read whitespace
         input_eat_ws(input);
@@ -677,7 +733,7 @@ const opinfo_t* input_match_op(input_t* input, int minPrec, bool preUnary)
         break;
 
         case 'n':
-        if (input_match_str(input, "not"))  op = &OP_NOT;
+        if (input_match_kw(input, "not"))  op = &OP_NOT;
         break;
 
         case '*':
@@ -689,7 +745,7 @@ const opinfo_t* input_match_op(input_t* input, int minPrec, bool preUnary)
         break;
 
         case 'm':
-        if (input_match_str(input, "mod"))  op = &OP_MOD;
+        if (input_match_kw(input, "mod"))  op = &OP_MOD;
         break;
 
         case '+':
@@ -712,8 +768,8 @@ const opinfo_t* input_match_op(input_t* input, int minPrec, bool preUnary)
         break;
 
         case 'i':
-        if (input_match_str(input, "instanceof")) op = &OP_INST_OF;
-        if (input_match_str(input, "in")) op = &OP_IN;
+        if (input_match_kw(input, "instanceof")) op = &OP_INST_OF;
+        if (input_match_kw(input, "in")) op = &OP_IN;
         break;
 
         case '=':
@@ -726,11 +782,11 @@ const opinfo_t* input_match_op(input_t* input, int minPrec, bool preUnary)
         break;
 
         case 'a':
-        if (input_match_str(input, "and"))  op = &OP_AND;
+        if (input_match_kw(input, "and"))  op = &OP_AND;
         break;
 
         case 'o':
-        if (input_match_str(input, "or"))   op = &OP_OR;
+        if (input_match_kw(input, "or"))   op = &OP_OR;
         break;
     }
 
@@ -888,25 +944,25 @@ heapptr_t parse_atom(input_t* input)
     if (isalnum(input_peek_ch(input)))
     {
         // Variable declaration
-        if (input_match_str(input, "var"))
+        if (input_match_kw(input, "var"))
             return parse_var_decl(input);
 
         // Constant declaration
-        if (input_match_str(input, "let"))
+        if (input_match_kw(input, "let"))
             return parse_cst_decl(input);
 
         // If expression
-        if (input_match_str(input, "if"))
+        if (input_match_kw(input, "if"))
             return parse_if_expr(input);
 
         // Function expression
-        if (input_match_str(input, "fun"))
+        if (input_match_kw(input, "fun"))
             return parse_fun_expr(input);
 
         // true and false boolean constants
-        if (input_match_str(input, "true"))
+        if (input_match_kw(input, "true"))
             return (heapptr_t)ast_const_alloc(VAL_TRUE);
-        if (input_match_str(input, "false"))
+        if (input_match_kw(input, "false"))
             return (heapptr_t)ast_const_alloc(VAL_FALSE);
     }
 
@@ -1082,7 +1138,7 @@ ast_fun_t* parse_unit(input_t* input)
         }
 
         // Write the expression to the array
-        array_set_obj(arr, arr->len, expr);
+        arr = array_append(arr, value_from_heapptr(expr, TAG_OBJECT));
 
         // If this is the end of the input, stop
         input_eat_ws(input);
@@ -1164,6 +1220,9 @@ void test_parser()
     test_parse("123");
     test_parse("0xFF");
     test_parse("0b101");
+    test_parse("1.5");
+    test_parse("0.25e3");
+    test_parse("2E-2");
     test_parse("'abc'");
     test_parse("\"double-quoted string!\"");
     test_parse("\"double-quoted string, 'hi'!\"");
@@ -1281,6 +1340,7 @@ void test_parser()
     test_parse("fun (x,y) if x then y else 0");
     test_parse("obj.method = fun (this, x) this.x = x");
     test_parse("let f = fun () 0\nf()");
+    test_parse("let inc = fun (x) x + 1\ninc(iffy)");
     test_parse_fail("fun (x,y)");
     test_parse_fail("fun ('x') x");
     test_parse_fail("fun (x+y) y");
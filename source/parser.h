@@ -79,20 +79,30 @@ typedef struct
     uint32_t idx;
 
     /// Global variable flag
+    /// Note: for globals, idx is the global slot index
     bool global;
 
     /// Captured variable flag
+    /// Note: for captured variables, idx is the index in the
+    /// closure environment (see ast_fun_t.capt_vars)
     bool capt;
 
+    /// Builtin function flag
+    /// Note: for builtins, idx is the index in the builtin table
+    bool builtin;
+
     /// Identifier name string
     string_t* name;
 
+    /// Resolved declaration, NULL for builtins and undeclared globals
+    struct ast_decl* decl;
+
 } ast_ref_t;
 
 /**
 Variable/constant declaration node
 */
-typedef struct
+typedef struct ast_decl
 {
     shapeidx_t shape;
 
@@ -105,6 +115,18 @@ typedef struct
     /// Captured variable flag
     bool capt;
 
+    /// Mutable variable flag, set if the variable is assigned after its
+    /// initialization, or may be captured before being initialized
+    /// Captured mutable variables are boxed in cells
+    bool mut;
+
+    /// Initialization seen, used during variable resolution
+    bool init;
+
+    /// Global variable flag, set for declarations at the top level of a
+    /// source unit. Note: for globals, idx is the global slot index
+    bool global;
+
     /// Identifier name string
     string_t* name;
 
@@ -238,6 +260,10 @@ typedef struct ast_fun
     /// Parent (outer) function
     struct ast_fun* parent;
 
+    /// Name of the variable the function is bound to, used in
+    /// diagnostics. This is NULL for anonymous functions.
+    string_t* name;
+
     /// List of parameter declarations
     array_t* param_decls;
 
@@ -253,8 +279,41 @@ typedef struct ast_fun
     /// Function body expression
     heapptr_t body_expr;
 
+    /// Global variable slots of the source unit this function is part of
+    struct globals* globals;
+
+    /// Compiled bytecode, NULL until compiled (see bytecode.c)
+    /// Tasks may compile a function concurrently, so it is atomic
+    _Atomic(struct bc_fun*) bc_fun;
+
+    /// Hotness counters, calls and self tail calls (see tier.c)
+    uint32_t num_calls;
+    uint32_t num_backedges;
+
+    /// Execution tier the function was promoted to
+    uint8_t tier;
+
 } ast_fun_t;
 
+heapptr_t ast_const_alloc(value_t val);
+heapptr_t ast_ref_alloc(heapptr_t name_str);
+heapptr_t ast_decl_alloc(heapptr_t name_str, bool cst);
+heapptr_t ast_binop_alloc(
+    const opinfo_t* op,
+    heapptr_t left_expr,
+    heapptr_t right_expr
+);
+heapptr_t ast_unop_alloc(const opinfo_t* op, heapptr_t expr);
+heapptr_t ast_seq_alloc(array_t* expr_list);
+heapptr_t ast_if_alloc(
+    heapptr_t test_expr,
+    heapptr_t then_expr,
+    heapptr_t else_expr
+);
+heapptr_t ast_call_alloc(heapptr_t fun_expr, array_t* arg_exprs);
+heapptr_t ast_fun_alloc(array_t* param_decls, heapptr_t body_expr);
+void print_fun_name(ast_fun_t* fun);
+
 char* srcpos_to_str(srcpos_t pos, char* buf);
 
 input_t input_from_string(string_t* str);
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "profile.h"
+#include "bytecode.h"
+#include "interp.h"
+#include "opt.h"
+#include "builtins.h"
+#include "task.h"
+#include "vm.h"
+
+/// Enable type feedback collection
+bool opt_profile = false;
+
+/// Functions profiled, in order of first execution
+static bc_fun_t** prof_funs = NULL;
+static uint32_t num_prof_funs = 0;
+static uint32_t prof_funs_cap = 0;
+
+/// Type tag names, indexed by tag
+static const char* TAG_NAMES[8] = {
+    "bool",
+    "int64",
+    "float64",
+    "string",
+    "array",
+    "raw_ptr",
+    "object",
+    "closure"
+};
+
+/// Allocate the profile side table of a function
+static prof_entry_t* prof_alloc(bc_fun_t* fun)
+{
+    fun->prof = calloc(fun->code_len, sizeof(prof_entry_t));
+
+    if (num_prof_funs == prof_funs_cap)
+    {
+        prof_funs_cap = prof_funs_cap? (2 * prof_funs_cap):16;
+        prof_funs = realloc(prof_funs, sizeof(bc_fun_t*) * prof_funs_cap);
+    }
+
+    prof_funs[num_prof_funs++] = fun;
+
+    return fun->prof;
+}
+
+/// Record the type tag of an operand value
+static inline void prof_tag(prof_entry_t* entry, int i, value_t val)
+{
+    entry->tags[i] |= (uint8_t)(1 << val.tag);
+}
+
+/**
+Record the execution of an instruction, before it executes
+The operands recorded depend on the instruction kind. Only the main
+thread records, the profile isn't shared with workers.
+*/
+void prof_record(bc_fun_t* fun, uint32_t idx, value_t* regs)
+{
+    if (task_on_worker())
+        return;
+
+    prof_entry_t* entry = fun->prof? fun->prof:prof_alloc(fun);
+    entry += idx;
+
+    instr_t* instr = &fun->code[idx];
+    entry->count++;
+
+    switch (instr->op)
+    {
+        case BC_INDEX:
+        prof_tag(entry, 0, regs[instr->b]);
+        prof_tag(entry, 1, regs[instr->c]);
+        break;
+
+        case BC_NEG:
+        case BC_NOT:
+        case BC_SET_GLOBAL:
+        case BC_SET_CELL:
+        prof_tag(entry, 0, regs[instr->b]);
+        break;
+
+        case BC_JTRUE:
+        case BC_JFALSE:
+        case BC_RET:
+        prof_tag(entry, 0, regs[instr->a]);
+        break;
+
+        // For calls, record the callee and the first argument
+        case BC_CALL:
+        case BC_TCALL:
+        {
+            value_t callee = regs[instr->b];
+            prof_tag(entry, 0, callee);
+            if (instr->c > 0)
+                prof_tag(entry, 1, regs[instr->b + 1 + BC_CALL_HDR_REGS]);
+
+            if (callee.tag != TAG_CLOS)
+                break;
+
+            ast_fun_t* target = ((clos_t*)callee.word.heapptr)->fun;
+            if (entry->target == NULL)
+                entry->target = target;
+            else if (entry->target != target)
+                entry->target = PROF_POLY;
+        }
+        break;
+
+        case BC_NATIVE:
+        {
+            int arity = BUILTINS[instr->c].arity;
+            for (int i = 0; i < arity && i < 2; ++i)
+                prof_tag(entry, i, regs[instr->b + i]);
+        }
+        break;
+
+        default:
+        if (instr->op >= BC_ADD && instr->op <= BC_NE_STR)
+        {
+            prof_tag(entry, 0, regs[instr->b]);
+            prof_tag(entry, 1, regs[instr->c]);
+        }
+        else if (instr->op >= BC_JLT && instr->op <= BC_JNGE)
+        {
+            prof_tag(entry, 0, regs[instr->a]);
+            prof_tag(entry, 1, regs[instr->b]);
+        }
+        break;
+    }
+}
+
+/**
+Test if an instruction has seen more than one type for an operand,
+or more than one call target
+*/
+bool prof_poly(prof_entry_t* entry)
+{
+    for (int i = 0; i < 2; ++i)
+        if (entry->tags[i] & (entry->tags[i] - 1))
+            return true;
+
+    return entry->target == PROF_POLY;
+}
+
+/// Print a set of type tags
+static void print_tags(uint8_t tags)
+{
+    bool first = true;
+
+    for (int tag = 0; tag < 8; ++tag)
+    {
+        if ((tags & (1 << tag)) == 0)
+            continue;
+
+        printf("%s%s", first? "":"|", TAG_NAMES[tag]);
+        first = false;
+    }
+}
+
+/**
+Print the profile data collected for all functions executed
+Only the instructions executed are listed, with their current
+(possibly quickened) opcode.
+*/
+void prof_dump()
+{
+    for (uint32_t i = 0; i < num_prof_funs; ++i)
+    {
+        bc_fun_t* fun = prof_funs[i];
+
+        printf("profile of ");
+        print_fun_name(fun->ast);
+        printf(": %lu calls\n", (unsigned long)fun->prof[0].count);
+
+        for (uint32_t j = 0; j < fun->code_len; ++j)
+        {
+            prof_entry_t* entry = &fun->prof[j];
+
+            if (entry->count == 0)
+                continue;
+
+            printf(
+                "%4d: %-10s %10lu",
+                j,
+                BC_OP_NAMES[fun->code[j].op],
+                (unsigned long)entry->count
+            );
+
+            for (int k = 0; k < 2 && entry->tags[k]; ++k)
+            {
+                printf(k? ", ":"  ");
+                print_tags(entry->tags[k]);
+            }
+
+            if (entry->target == PROF_POLY)
+            {
+                printf(" -> <polymorphic>");
+            }
+            else if (entry->target)
+            {
+                printf(" -> ");
+                print_fun_name(entry->target);
+            }
+
+            if (prof_poly(entry))
+                printf("    ; polymorphic");
+
+            putchar('\n');
+        }
+    }
+}
+
+void test_profile()
+{
+    opt_profile = true;
+
+    // The calls profiled must not be inlined
+    opt_inline = false;
+
+    ast_fun_t* unit_fun = load_str(
+        "let f = fun (x) x + x\n"
+        "let g = fun (x) x\n"
+        "let h = fun (k, x) k(x)\n"
+        "f(1)\nf(2.5)\nh(f, 1)\nh(g, 1)",
+        "test"
+    );
+    bc_fun_t* fun = bc_get_fun(unit_fun);
+    bc_run(fun, NULL);
+
+    opt_profile = false;
+    opt_inline = true;
+
+    // The instructions of the unit are executed at most once
+    assert (fun->prof != NULL);
+    assert (fun->prof[0].count == 1);
+    for (uint32_t i = 0; i < fun->code_len; ++i)
+        assert (fun->prof[i].count <= 1);
+
+    for (uint32_t i = 0; i < fun->num_consts; ++i)
+    {
+        if (fun->consts[i].tag != TAG_RAW_PTR)
+            continue;
+
+        ast_fun_t* ast = (ast_fun_t*)fun->consts[i].word.heapptr;
+        bc_fun_t* nested = bc_get_fun(ast);
+        char first_ch = ast->name->data[0];
+
+        // The addition in f sees both integers and floats
+        if (first_ch == 'f')
+        {
+            assert (nested->prof[0].count == 3);
+            prof_entry_t* add = NULL;
+            for (uint32_t j = 0; j < nested->code_len; ++j)
+                if (nested->code[j].op == BC_ADD_F64 ||
+                    nested->code[j].op == BC_ADD_I64)
+                    add = &nested->prof[j];
+            assert (add != NULL);
+            assert (add->tags[0] == ((1 << TAG_INT64) | (1 << TAG_FLOAT64)));
+            assert (prof_poly(add));
+        }
+
+        // The call in h has two different targets
+        if (first_ch == 'h')
+        {
+            assert (nested->prof[0].count == 2);
+            for (uint32_t j = 0; j < nested->code_len; ++j)
+                if (nested->code[j].op == BC_TCALL)
+                    assert (nested->prof[j].target == PROF_POLY);
+        }
+    }
+}
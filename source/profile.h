@@ -0,0 +1,47 @@
+/**
+Type feedback and execution profiling
+
+When profiling is enabled, the bytecode interpreter records, for each
+instruction executed, an execution count, the set of operand type tags
+observed and, for calls, the functions called. The data is kept in a
+side table attached to each bytecode function, indexed by instruction,
+so that the instruction stream itself is unchanged.
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "vm.h"
+#include "parser.h"
+
+struct bc_fun;
+
+/// Call target state, more than one function called
+#define PROF_POLY ((ast_fun_t*)1)
+
+/**
+Profile entry for one instruction
+*/
+typedef struct prof_entry
+{
+    /// Execution count
+    uint64_t count;
+
+    /// Bit sets of the type tags observed for the first two operands
+    uint8_t tags[2];
+
+    /// Function called, NULL if none seen, PROF_POLY if more than one
+    ast_fun_t* target;
+
+} prof_entry_t;
+
+/// Enable type feedback collection
+extern bool opt_profile;
+
+void prof_record(struct bc_fun* fun, uint32_t idx, value_t* regs);
+bool prof_poly(prof_entry_t* entry);
+void prof_dump();
+
+void test_profile();
+
+#endif
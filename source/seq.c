@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "seq.h"
+#include "coro.h"
+#include "bytecode.h"
+#include "interp.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Shape of sequence objects
+shapeidx_t SHAPE_SEQ;
+
+/// Function receiving the elements of a sequence
+typedef void (*seq_sink_t)(void* data, value_t val);
+
+static seq_t* seq_alloc(seq_kind_t kind)
+{
+    seq_t* seq = (seq_t*)vm_alloc(sizeof(seq_t), SHAPE_SEQ);
+    seq->kind = kind;
+    seq->input = NULL;
+    seq->clos = NULL;
+    seq->array = NULL;
+    seq->start = 0;
+    seq->end = 0;
+    return seq;
+}
+
+/**
+Sequence of the integers from start up to end, excluded
+*/
+seq_t* seq_range(int64_t start, int64_t end)
+{
+    seq_t* seq = seq_alloc(SEQ_RANGE);
+    seq->start = start;
+    seq->end = end;
+    return seq;
+}
+
+/**
+Sequence of the elements of an array
+*/
+seq_t* seq_array(array_t* array)
+{
+    seq_t* seq = seq_alloc(SEQ_ARRAY);
+    seq->array = array;
+    return seq;
+}
+
+/**
+Add a map or filter stage to a sequence
+*/
+seq_t* seq_stage(seq_kind_t kind, seq_t* input, clos_t* clos)
+{
+    assert (kind == SEQ_MAP || kind == SEQ_FILTER);
+
+    seq_t* seq = seq_alloc(kind);
+    seq->input = input;
+    seq->clos = clos;
+    return seq;
+}
+
+/// Number of elements of a source
+static uint64_t seq_source_len(seq_t* source)
+{
+    if (source->kind == SEQ_ARRAY)
+        return source->array->len;
+
+    if (source->end <= source->start)
+        return 0;
+
+    return (uint64_t)source->end - (uint64_t)source->start;
+}
+
+/**
+Run a sequence in a single pass, passing its elements to a sink
+*/
+static void seq_run(seq_t* seq, seq_sink_t sink, void* data)
+{
+    // Find the source, and the stages from the source up
+    uint32_t num_stages = 0;
+    seq_t* source = seq;
+    for (; source->kind == SEQ_MAP || source->kind == SEQ_FILTER; source = source->input)
+        num_stages++;
+
+    seq_t* stages[num_stages + 1];
+    uint32_t idx = num_stages;
+    for (seq_t* stage = seq; stage != source; stage = stage->input)
+        stages[--idx] = stage;
+
+    uint64_t len = seq_source_len(source);
+
+    for (uint64_t i = 0; i < len; ++i)
+    {
+        value_t val;
+        if (source->kind == SEQ_RANGE)
+            val = value_from_int64((int64_t)((uint64_t)source->start + i));
+        else
+            val = array_get(source->array, i);
+
+        bool keep = true;
+
+        for (uint32_t j = 0; j < num_stages; ++j)
+        {
+            value_t out = bc_call(stages[j]->clos, &val, 1);
+
+            if (stages[j]->kind == SEQ_MAP)
+            {
+                val = out;
+            }
+            else if (!eval_truth(out))
+            {
+                keep = false;
+                break;
+            }
+        }
+
+        if (keep)
+            sink(data, val);
+    }
+}
+
+static void seq_collect_sink(void* data, value_t val)
+{
+    array_t** array = (array_t**)data;
+    *array = array_append(*array, val);
+}
+
+/**
+Make an array of the elements of a sequence
+*/
+array_t* seq_collect(seq_t* seq)
+{
+    // Sources without filters have a known length
+    bool filtered = false;
+    seq_t* source = seq;
+    for (; source->kind == SEQ_MAP || source->kind == SEQ_FILTER; source = source->input)
+        filtered = filtered || source->kind == SEQ_FILTER;
+
+    uint64_t len = seq_source_len(source);
+    uint32_t cap = (!filtered && len <= UINT32_MAX)? (uint32_t)len:0;
+
+    array_t* array = array_alloc(cap);
+    seq_run(seq, seq_collect_sink, &array);
+    return array;
+}
+
+/// State of a reduction, the closure and the value so far
+typedef struct
+{
+    clos_t* clos;
+    value_t args[2];
+
+} seq_reduce_t;
+
+static void seq_reduce_sink(void* data, value_t val)
+{
+    seq_reduce_t* reduce = (seq_reduce_t*)data;
+    reduce->args[1] = val;
+    reduce->args[0] = bc_call(reduce->clos, reduce->args, 2);
+}
+
+/**
+Combine the elements of a sequence with a closure of two arguments,
+from left to right, starting from an initial value
+*/
+value_t seq_reduce(seq_t* seq, clos_t* clos, value_t init)
+{
+    seq_reduce_t reduce;
+    reduce.clos = clos;
+    reduce.args[0] = init;
+    seq_run(seq, seq_reduce_sink, &reduce);
+    return reduce.args[0];
+}
+
+static void seq_foreach_sink(void* data, value_t val)
+{
+    bc_call((clos_t*)data, &val, 1);
+}
+
+/**
+Call a closure on each element of a sequence
+*/
+void seq_foreach(seq_t* seq, clos_t* clos)
+{
+    seq_run(seq, seq_foreach_sink, clos);
+}
+
+void test_seq()
+{
+    test_eval_modes("reduce(range(0, 10), fun (a, x) a + x, 0)", 45);
+    test_eval_modes("reduce(range(5, 5), fun (a, x) a + x, 7)", 7);
+    test_eval_modes("reduce(range(5, -5), fun (a, x) a + x, 7)", 7);
+    test_eval_modes(
+        "let s = map(filter(range(0, 100), fun (x) x mod 3 == 0), fun (x) x * x)\n"
+        "reduce(s, fun (a, x) a + x, 0)",
+        112761
+    );
+    test_eval_modes(
+        "let a = collect(map(seq([1, 2, 3]), fun (x) x + 1))\n"
+        "a[0] * 100 + a[2] * 10 + len(a)",
+        243
+    );
+    test_eval_modes("len(collect(filter(range(0, 1000), fun (x) x > 989)))", 10);
+
+    // Stages run element by element, once the sequence is consumed
+    test_eval_modes(
+        "var log = 0\n"
+        "let s = filter(range(0, 3), fun (x) { log = log * 10 + 1\nx != 1 })\n"
+        "let t = map(s, fun (x) { log = log * 10 + 2\nx })\n"
+        "let before = log\n"
+        "foreach(t, fun (x) log = log * 10 + 3)\n"
+        "before * 1000000000 + log",
+        1231123
+    );
+
+    // Sequences can be consumed again
+    test_eval_modes(
+        "let s = map(range(0, 4), fun (x) x * 2)\n"
+        "reduce(s, fun (a, x) a + x, 0) * 100 + reduce(s, fun (a, x) a + x, 0)",
+        1212
+    );
+
+    // Fused pipelines over ranges don't allocate
+    clos_t* inc = test_eval_clos("fun (x) x + 1");
+    clos_t* odd = test_eval_clos("fun (x) x mod 2 == 1");
+    clos_t* add = test_eval_clos("fun (a, x) a + x");
+    seq_t* seq = seq_stage(SEQ_FILTER, seq_stage(SEQ_MAP, seq_range(0, 100000), inc), odd);
+
+    uint8_t* allocptr = vm_thread.allocptr;
+    value_t sum = seq_reduce(seq, add, value_from_int64(0));
+    assert (vm_thread.allocptr == allocptr);
+    assert (sum.word.int64 == 50000L * 50000L);
+}
@@ -0,0 +1,73 @@
+/**
+Lazy sequences
+
+A sequence is a pipeline of stages over a source, an integer range or
+an array. map and filter on a sequence add a stage and return a new
+sequence, without calling the closure:
+
+    let s = map(filter(range(0, 1000000), fun (x) x mod 3 == 0), fun (x) x * x)
+    reduce(s, fun (a, x) a + x, 0)
+
+Nothing runs until the sequence is consumed by reduce, foreach or
+collect, which makes an array of its elements. The stages are then
+fused: each element of the source goes through all of them in turn
+before the next is read, so no intermediate arrays are allocated, and
+ranges have no backing array at all. Sequences can be consumed more
+than once, their stages run again each time.
+
+seq(a) makes a sequence of the elements of an array, to chain
+operations on it lazily, while map and filter on arrays make arrays.
+*/
+
+#ifndef __SEQ_H__
+#define __SEQ_H__
+
+#include "vm.h"
+#include "interp.h"
+
+/// Shape of sequence objects
+extern shapeidx_t SHAPE_SEQ;
+
+/// Kinds of sequences, sources and stages
+typedef enum
+{
+    SEQ_RANGE,
+    SEQ_ARRAY,
+    SEQ_MAP,
+    SEQ_FILTER
+} seq_kind_t;
+
+/**
+Sequence object
+*/
+typedef struct seq
+{
+    shapeidx_t shape;
+
+    seq_kind_t kind;
+
+    /// Input of map and filter stages
+    struct seq* input;
+
+    /// Closure of map and filter stages
+    clos_t* clos;
+
+    /// Elements of array sources
+    array_t* array;
+
+    /// Bounds of range sources, the end is excluded
+    int64_t start;
+    int64_t end;
+
+} seq_t;
+
+seq_t* seq_range(int64_t start, int64_t end);
+seq_t* seq_array(array_t* array);
+seq_t* seq_stage(seq_kind_t kind, seq_t* input, clos_t* clos);
+array_t* seq_collect(seq_t* seq);
+value_t seq_reduce(seq_t* seq, clos_t* clos, value_t init);
+void seq_foreach(seq_t* seq, clos_t* clos);
+
+void test_seq();
+
+#endif
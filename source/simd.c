@@ -0,0 +1,961 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simd.h"
+#include "interp.h"
+#include "vm.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/// Instruction set to use, -1 to use the best the CPU supports
+int simd_force = -1;
+
+/// Kernels selected for this CPU
+static const simd_kernels_t* simd_selected = NULL;
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+/*
+Scalar kernels, used on their own and for the elements left over by
+the vector kernels. Integer arithmetic is done unsigned, so that it
+wraps around on overflow.
+*/
+
+static bool scalar_sum_i64(const value_t* a, size_t n, int64_t* out)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_INT64)
+            return false;
+        sum += (uint64_t)a[i].word.int64;
+    }
+
+    *out = (int64_t)sum;
+    return true;
+}
+
+static bool scalar_sum_f64(const value_t* a, size_t n, double* out)
+{
+    double sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_FLOAT64)
+            return false;
+        sum += a[i].word.float64;
+    }
+
+    *out = sum;
+    return true;
+}
+
+static bool scalar_extremum_i64(const value_t* a, size_t n, int64_t* out, bool max)
+{
+    assert (n > 0);
+    int64_t m = a[0].word.int64;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_INT64)
+            return false;
+
+        int64_t x = a[i].word.int64;
+        if (max? (x > m):(x < m))
+            m = x;
+    }
+
+    *out = m;
+    return true;
+}
+
+/// NaNs are skipped, as with fmin and fmax, so the result is only a
+/// NaN if all the elements are
+static bool scalar_extremum_f64(const value_t* a, size_t n, double* out, bool max)
+{
+    assert (n > 0);
+    double m = a[0].word.float64;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_FLOAT64)
+            return false;
+
+        double x = a[i].word.float64;
+        if ((max? (x > m):(x < m)) || isnan(m))
+            m = x;
+    }
+
+    *out = m;
+    return true;
+}
+
+static bool scalar_min_i64(const value_t* a, size_t n, int64_t* out)
+{
+    return scalar_extremum_i64(a, n, out, false);
+}
+
+static bool scalar_max_i64(const value_t* a, size_t n, int64_t* out)
+{
+    return scalar_extremum_i64(a, n, out, true);
+}
+
+static bool scalar_min_f64(const value_t* a, size_t n, double* out)
+{
+    return scalar_extremum_f64(a, n, out, false);
+}
+
+static bool scalar_max_f64(const value_t* a, size_t n, double* out)
+{
+    return scalar_extremum_f64(a, n, out, true);
+}
+
+static bool scalar_dot_i64(const value_t* a, const value_t* b, size_t n, int64_t* out)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_INT64 || b[i].tag != TAG_INT64)
+            return false;
+        sum += (uint64_t)a[i].word.int64 * (uint64_t)b[i].word.int64;
+    }
+
+    *out = (int64_t)sum;
+    return true;
+}
+
+static bool scalar_dot_f64(const value_t* a, const value_t* b, size_t n, double* out)
+{
+    double sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_FLOAT64 || b[i].tag != TAG_FLOAT64)
+            return false;
+        sum += a[i].word.float64 * b[i].word.float64;
+    }
+
+    *out = sum;
+    return true;
+}
+
+static bool scalar_add_i64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_INT64 || b[i].tag != TAG_INT64)
+            return false;
+        uint64_t r = (uint64_t)a[i].word.int64 + (uint64_t)b[i].word.int64;
+        out[i] = value_from_int64((int64_t)r);
+    }
+
+    return true;
+}
+
+static bool scalar_add_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_FLOAT64 || b[i].tag != TAG_FLOAT64)
+            return false;
+        out[i] = value_from_float64(a[i].word.float64 + b[i].word.float64);
+    }
+
+    return true;
+}
+
+static bool scalar_mul_i64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_INT64 || b[i].tag != TAG_INT64)
+            return false;
+        uint64_t r = (uint64_t)a[i].word.int64 * (uint64_t)b[i].word.int64;
+        out[i] = value_from_int64((int64_t)r);
+    }
+
+    return true;
+}
+
+static bool scalar_mul_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (a[i].tag != TAG_FLOAT64 || b[i].tag != TAG_FLOAT64)
+            return false;
+        out[i] = value_from_float64(a[i].word.float64 * b[i].word.float64);
+    }
+
+    return true;
+}
+
+static void scalar_fill(value_t* out, size_t n, value_t val)
+{
+    for (size_t i = 0; i < n; ++i)
+        out[i] = val;
+}
+
+#if defined(__x86_64__)
+
+/*
+SSE2 kernels. A 128-bit register holds one value, with the word in the
+low lane and the tag in the low byte of the high lane. The rest of the
+high lane is padding, which is masked out. Tags are checked by or-ing
+together their differences with the expected tag, tested once at the
+end. Floating-point lanes holding tags are zeroed before arithmetic, so
+that their bits can't make slow denormals.
+*/
+
+static inline __m128i sse2_words(__m128i v)
+{
+    return _mm_and_si128(v, _mm_set_epi64x(0, -1));
+}
+
+/// Accumulate the difference between the tag of a value and a tag
+static inline __m128i sse2_check(__m128i bad, __m128i v, tag_t tag)
+{
+    __m128i t = _mm_and_si128(v, _mm_set_epi64x(0xFF, 0));
+    return _mm_or_si128(bad, _mm_xor_si128(t, _mm_set_epi64x(tag, 0)));
+}
+
+static inline bool sse2_ok(__m128i bad)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) == 0xFFFF;
+}
+
+static inline __m128i sse2_load(const value_t* p)
+{
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+/// Make a value from a result in the low lane
+static inline __m128i sse2_value(__m128i r, tag_t tag)
+{
+    return _mm_or_si128(sse2_words(r), _mm_set_epi64x(tag, 0));
+}
+
+static bool sse2_sum_i64(const value_t* a, size_t n, int64_t* out)
+{
+    __m128i bad = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v0 = sse2_load(&a[i]);
+        __m128i v1 = sse2_load(&a[i + 1]);
+        bad = sse2_check(sse2_check(bad, v0, TAG_INT64), v1, TAG_INT64);
+        acc0 = _mm_add_epi64(acc0, v0);
+        acc1 = _mm_add_epi64(acc1, v1);
+    }
+
+    int64_t tail;
+    if (!sse2_ok(bad) || !scalar_sum_i64(a + i, n - i, &tail))
+        return false;
+
+    uint64_t sum = (uint64_t)_mm_cvtsi128_si64(_mm_add_epi64(acc0, acc1));
+    *out = (int64_t)(sum + (uint64_t)tail);
+    return true;
+}
+
+static bool sse2_sum_f64(const value_t* a, size_t n, double* out)
+{
+    __m128i bad = _mm_setzero_si128();
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v0 = sse2_load(&a[i]);
+        __m128i v1 = sse2_load(&a[i + 1]);
+        bad = sse2_check(sse2_check(bad, v0, TAG_FLOAT64), v1, TAG_FLOAT64);
+        acc0 = _mm_add_pd(acc0, _mm_castsi128_pd(sse2_words(v0)));
+        acc1 = _mm_add_pd(acc1, _mm_castsi128_pd(sse2_words(v1)));
+    }
+
+    double tail;
+    if (!sse2_ok(bad) || !scalar_sum_f64(a + i, n - i, &tail))
+        return false;
+
+    *out = _mm_cvtsd_f64(_mm_add_pd(acc0, acc1)) + tail;
+    return true;
+}
+
+/// minpd and maxpd return their second operand when either is a NaN,
+/// so NaN elements are skipped as long as the running extremum starts
+/// from an infinity. If it is still that infinity at the end, all the
+/// elements may be NaNs, and the scalar kernel decides.
+static bool sse2_extremum_f64(const value_t* a, size_t n, double* out, bool max)
+{
+    assert (n > 0);
+    __m128i bad = _mm_setzero_si128();
+    __m128d m0 = _mm_set1_pd(max? -INFINITY:INFINITY);
+    __m128d m1 = m0;
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v0 = sse2_load(&a[i]);
+        __m128i v1 = sse2_load(&a[i + 1]);
+        bad = sse2_check(sse2_check(bad, v0, TAG_FLOAT64), v1, TAG_FLOAT64);
+        __m128d x0 = _mm_castsi128_pd(sse2_words(v0));
+        __m128d x1 = _mm_castsi128_pd(sse2_words(v1));
+        m0 = max? _mm_max_pd(x0, m0):_mm_min_pd(x0, m0);
+        m1 = max? _mm_max_pd(x1, m1):_mm_min_pd(x1, m1);
+    }
+
+    if (!sse2_ok(bad))
+        return false;
+
+    m0 = max? _mm_max_pd(m1, m0):_mm_min_pd(m1, m0);
+    double m = _mm_cvtsd_f64(m0);
+
+    double tail;
+    if (i < n)
+    {
+        if (!scalar_extremum_f64(a + i, n - i, &tail, max))
+            return false;
+        if (max? (tail > m):(tail < m))
+            m = tail;
+    }
+
+    if (m == (max? -INFINITY:INFINITY))
+        return scalar_extremum_f64(a, n, out, max);
+
+    *out = m;
+    return true;
+}
+
+static bool sse2_min_f64(const value_t* a, size_t n, double* out)
+{
+    return sse2_extremum_f64(a, n, out, false);
+}
+
+static bool sse2_max_f64(const value_t* a, size_t n, double* out)
+{
+    return sse2_extremum_f64(a, n, out, true);
+}
+
+static bool sse2_dot_f64(const value_t* a, const value_t* b, size_t n, double* out)
+{
+    __m128i bad = _mm_setzero_si128();
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i a0 = sse2_load(&a[i]);
+        __m128i a1 = sse2_load(&a[i + 1]);
+        __m128i b0 = sse2_load(&b[i]);
+        __m128i b1 = sse2_load(&b[i + 1]);
+        bad = sse2_check(sse2_check(bad, a0, TAG_FLOAT64), a1, TAG_FLOAT64);
+        bad = sse2_check(sse2_check(bad, b0, TAG_FLOAT64), b1, TAG_FLOAT64);
+        __m128d p0 = _mm_mul_pd(_mm_castsi128_pd(sse2_words(a0)), _mm_castsi128_pd(sse2_words(b0)));
+        __m128d p1 = _mm_mul_pd(_mm_castsi128_pd(sse2_words(a1)), _mm_castsi128_pd(sse2_words(b1)));
+        acc0 = _mm_add_pd(acc0, p0);
+        acc1 = _mm_add_pd(acc1, p1);
+    }
+
+    double tail;
+    if (!sse2_ok(bad) || !scalar_dot_f64(a + i, b + i, n - i, &tail))
+        return false;
+
+    *out = _mm_cvtsd_f64(_mm_add_pd(acc0, acc1)) + tail;
+    return true;
+}
+
+static bool sse2_add_i64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    __m128i bad = _mm_setzero_si128();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        __m128i x = sse2_load(&a[i]);
+        __m128i y = sse2_load(&b[i]);
+        bad = sse2_check(sse2_check(bad, x, TAG_INT64), y, TAG_INT64);
+        __m128i r = sse2_value(_mm_add_epi64(x, y), TAG_INT64);
+        _mm_storeu_si128((__m128i*)&out[i], r);
+    }
+
+    return sse2_ok(bad);
+}
+
+static bool sse2_arith_f64(const value_t* a, const value_t* b, value_t* out, size_t n, bool mul)
+{
+    __m128i bad = _mm_setzero_si128();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        __m128i x = sse2_load(&a[i]);
+        __m128i y = sse2_load(&b[i]);
+        bad = sse2_check(sse2_check(bad, x, TAG_FLOAT64), y, TAG_FLOAT64);
+        __m128d xd = _mm_castsi128_pd(sse2_words(x));
+        __m128d yd = _mm_castsi128_pd(sse2_words(y));
+        __m128d r = mul? _mm_mul_pd(xd, yd):_mm_add_pd(xd, yd);
+        _mm_storeu_si128((__m128i*)&out[i], sse2_value(_mm_castpd_si128(r), TAG_FLOAT64));
+    }
+
+    return sse2_ok(bad);
+}
+
+static bool sse2_add_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    return sse2_arith_f64(a, b, out, n, false);
+}
+
+static bool sse2_mul_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    return sse2_arith_f64(a, b, out, n, true);
+}
+
+static void sse2_fill(value_t* out, size_t n, value_t val)
+{
+    __m128i v = _mm_set_epi64x(val.tag, val.word.int64);
+
+    for (size_t i = 0; i < n; ++i)
+        _mm_storeu_si128((__m128i*)&out[i], v);
+}
+
+/*
+AVX2 kernels. A 256-bit register holds two values, words in lanes 0
+and 2 and tags in lanes 1 and 3, otherwise as with SSE2. AVX2 also has
+64-bit integer comparisons, for integer min and max.
+*/
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_words(__m256i v)
+{
+    return _mm256_and_si256(v, _mm256_set_epi64x(0, -1, 0, -1));
+}
+
+AVX2 static inline __m256i avx2_check(__m256i bad, __m256i v, tag_t tag)
+{
+    __m256i t = _mm256_and_si256(v, _mm256_set_epi64x(0xFF, 0, 0xFF, 0));
+    return _mm256_or_si256(bad, _mm256_xor_si256(t, _mm256_set_epi64x(tag, 0, tag, 0)));
+}
+
+AVX2 static inline bool avx2_ok(__m256i bad)
+{
+    return _mm256_testz_si256(bad, bad);
+}
+
+AVX2 static inline __m256i avx2_load(const value_t* p)
+{
+    return _mm256_loadu_si256((const __m256i*)p);
+}
+
+AVX2 static inline __m256i avx2_value(__m256i r, tag_t tag)
+{
+    return _mm256_or_si256(avx2_words(r), _mm256_set_epi64x(tag, 0, tag, 0));
+}
+
+AVX2 static bool avx2_sum_i64(const value_t* a, size_t n, int64_t* out)
+{
+    __m256i bad = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v0 = avx2_load(&a[i]);
+        __m256i v1 = avx2_load(&a[i + 2]);
+        bad = avx2_check(avx2_check(bad, v0, TAG_INT64), v1, TAG_INT64);
+        acc0 = _mm256_add_epi64(acc0, v0);
+        acc1 = _mm256_add_epi64(acc1, v1);
+    }
+
+    int64_t tail;
+    if (!avx2_ok(bad) || !scalar_sum_i64(a + i, n - i, &tail))
+        return false;
+
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    uint64_t sum = (uint64_t)_mm256_extract_epi64(acc0, 0) + (uint64_t)_mm256_extract_epi64(acc0, 2);
+    *out = (int64_t)(sum + (uint64_t)tail);
+    return true;
+}
+
+/// Add lanes 0 and 2 of a floating-point register
+AVX2 static inline double avx2_hadd(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, hi));
+}
+
+AVX2 static bool avx2_sum_f64(const value_t* a, size_t n, double* out)
+{
+    __m256i bad = _mm256_setzero_si256();
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v0 = avx2_load(&a[i]);
+        __m256i v1 = avx2_load(&a[i + 2]);
+        bad = avx2_check(avx2_check(bad, v0, TAG_FLOAT64), v1, TAG_FLOAT64);
+        acc0 = _mm256_add_pd(acc0, _mm256_castsi256_pd(avx2_words(v0)));
+        acc1 = _mm256_add_pd(acc1, _mm256_castsi256_pd(avx2_words(v1)));
+    }
+
+    double tail;
+    if (!avx2_ok(bad) || !scalar_sum_f64(a + i, n - i, &tail))
+        return false;
+
+    *out = avx2_hadd(_mm256_add_pd(acc0, acc1)) + tail;
+    return true;
+}
+
+/// Lanes holding tags take part in the comparisons, but are ignored
+AVX2 static bool avx2_extremum_i64(const value_t* a, size_t n, int64_t* out, bool max)
+{
+    assert (n > 0);
+    __m256i bad = _mm256_setzero_si256();
+    __m256i m0 = _mm256_set1_epi64x(a[0].word.int64);
+    __m256i m1 = m0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v0 = avx2_load(&a[i]);
+        __m256i v1 = avx2_load(&a[i + 2]);
+        bad = avx2_check(avx2_check(bad, v0, TAG_INT64), v1, TAG_INT64);
+        __m256i c0 = max? _mm256_cmpgt_epi64(v0, m0):_mm256_cmpgt_epi64(m0, v0);
+        __m256i c1 = max? _mm256_cmpgt_epi64(v1, m1):_mm256_cmpgt_epi64(m1, v1);
+        m0 = _mm256_blendv_epi8(m0, v0, c0);
+        m1 = _mm256_blendv_epi8(m1, v1, c1);
+    }
+
+    if (!avx2_ok(bad))
+        return false;
+
+    int64_t lanes[4] = {
+        _mm256_extract_epi64(m0, 0),
+        _mm256_extract_epi64(m0, 2),
+        _mm256_extract_epi64(m1, 0),
+        _mm256_extract_epi64(m1, 2)
+    };
+
+    int64_t m = lanes[0];
+    for (int j = 1; j < 4; ++j)
+        if (max? (lanes[j] > m):(lanes[j] < m))
+            m = lanes[j];
+
+    int64_t tail;
+    if (i < n)
+    {
+        if (!scalar_extremum_i64(a + i, n - i, &tail, max))
+            return false;
+        if (max? (tail > m):(tail < m))
+            m = tail;
+    }
+
+    *out = m;
+    return true;
+}
+
+AVX2 static bool avx2_min_i64(const value_t* a, size_t n, int64_t* out)
+{
+    return avx2_extremum_i64(a, n, out, false);
+}
+
+AVX2 static bool avx2_max_i64(const value_t* a, size_t n, int64_t* out)
+{
+    return avx2_extremum_i64(a, n, out, true);
+}
+
+/// NaNs are skipped as in the SSE2 kernel
+AVX2 static bool avx2_extremum_f64(const value_t* a, size_t n, double* out, bool max)
+{
+    assert (n > 0);
+    __m256i bad = _mm256_setzero_si256();
+    __m256d m0 = _mm256_set1_pd(max? -INFINITY:INFINITY);
+    __m256d m1 = m0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v0 = avx2_load(&a[i]);
+        __m256i v1 = avx2_load(&a[i + 2]);
+        bad = avx2_check(avx2_check(bad, v0, TAG_FLOAT64), v1, TAG_FLOAT64);
+        __m256d x0 = _mm256_castsi256_pd(avx2_words(v0));
+        __m256d x1 = _mm256_castsi256_pd(avx2_words(v1));
+        m0 = max? _mm256_max_pd(x0, m0):_mm256_min_pd(x0, m0);
+        m1 = max? _mm256_max_pd(x1, m1):_mm256_min_pd(x1, m1);
+    }
+
+    if (!avx2_ok(bad))
+        return false;
+
+    // Fold lanes 2 into lanes 0, with the order of the comparisons kept
+    m0 = max? _mm256_max_pd(m1, m0):_mm256_min_pd(m1, m0);
+    __m128d lo = _mm256_castpd256_pd128(m0);
+    __m128d hi = _mm256_extractf128_pd(m0, 1);
+    double m = _mm_cvtsd_f64(max? _mm_max_sd(hi, lo):_mm_min_sd(hi, lo));
+
+    double tail;
+    if (i < n)
+    {
+        if (!scalar_extremum_f64(a + i, n - i, &tail, max))
+            return false;
+        if (max? (tail > m):(tail < m))
+            m = tail;
+    }
+
+    if (m == (max? -INFINITY:INFINITY))
+        return scalar_extremum_f64(a, n, out, max);
+
+    *out = m;
+    return true;
+}
+
+AVX2 static bool avx2_min_f64(const value_t* a, size_t n, double* out)
+{
+    return avx2_extremum_f64(a, n, out, false);
+}
+
+AVX2 static bool avx2_max_f64(const value_t* a, size_t n, double* out)
+{
+    return avx2_extremum_f64(a, n, out, true);
+}
+
+AVX2 static bool avx2_dot_f64(const value_t* a, const value_t* b, size_t n, double* out)
+{
+    __m256i bad = _mm256_setzero_si256();
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i a0 = avx2_load(&a[i]);
+        __m256i a1 = avx2_load(&a[i + 2]);
+        __m256i b0 = avx2_load(&b[i]);
+        __m256i b1 = avx2_load(&b[i + 2]);
+        bad = avx2_check(avx2_check(bad, a0, TAG_FLOAT64), a1, TAG_FLOAT64);
+        bad = avx2_check(avx2_check(bad, b0, TAG_FLOAT64), b1, TAG_FLOAT64);
+        __m256d p0 = _mm256_mul_pd(_mm256_castsi256_pd(avx2_words(a0)), _mm256_castsi256_pd(avx2_words(b0)));
+        __m256d p1 = _mm256_mul_pd(_mm256_castsi256_pd(avx2_words(a1)), _mm256_castsi256_pd(avx2_words(b1)));
+        acc0 = _mm256_add_pd(acc0, p0);
+        acc1 = _mm256_add_pd(acc1, p1);
+    }
+
+    double tail;
+    if (!avx2_ok(bad) || !scalar_dot_f64(a + i, b + i, n - i, &tail))
+        return false;
+
+    *out = avx2_hadd(_mm256_add_pd(acc0, acc1)) + tail;
+    return true;
+}
+
+AVX2 static bool avx2_add_i64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m256i x = avx2_load(&a[i]);
+        __m256i y = avx2_load(&b[i]);
+        bad = avx2_check(avx2_check(bad, x, TAG_INT64), y, TAG_INT64);
+        __m256i r = avx2_value(_mm256_add_epi64(x, y), TAG_INT64);
+        _mm256_storeu_si256((__m256i*)&out[i], r);
+    }
+
+    return avx2_ok(bad) && scalar_add_i64(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static bool avx2_arith_f64(const value_t* a, const value_t* b, value_t* out, size_t n, bool mul)
+{
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m256i x = avx2_load(&a[i]);
+        __m256i y = avx2_load(&b[i]);
+        bad = avx2_check(avx2_check(bad, x, TAG_FLOAT64), y, TAG_FLOAT64);
+        __m256d xd = _mm256_castsi256_pd(avx2_words(x));
+        __m256d yd = _mm256_castsi256_pd(avx2_words(y));
+        __m256d r = mul? _mm256_mul_pd(xd, yd):_mm256_add_pd(xd, yd);
+        _mm256_storeu_si256((__m256i*)&out[i], avx2_value(_mm256_castpd_si256(r), TAG_FLOAT64));
+    }
+
+    if (!avx2_ok(bad))
+        return false;
+
+    if (mul)
+        return scalar_mul_f64(a + i, b + i, out + i, n - i);
+    return scalar_add_f64(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static bool avx2_add_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    return avx2_arith_f64(a, b, out, n, false);
+}
+
+AVX2 static bool avx2_mul_f64(const value_t* a, const value_t* b, value_t* out, size_t n)
+{
+    return avx2_arith_f64(a, b, out, n, true);
+}
+
+AVX2 static void avx2_fill(value_t* out, size_t n, value_t val)
+{
+    __m256i v = _mm256_set_epi64x(val.tag, val.word.int64, val.tag, val.word.int64);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        _mm256_storeu_si256((__m256i*)&out[i], v);
+
+    scalar_fill(out + i, n - i, val);
+}
+
+#endif
+
+/// Kernels of each instruction set, indexed by level
+static const simd_kernels_t SIMD_KERNELS[] = {
+    {
+        "scalar",
+        scalar_sum_i64, scalar_sum_f64,
+        scalar_min_i64, scalar_max_i64, scalar_min_f64, scalar_max_f64,
+        scalar_dot_i64, scalar_dot_f64,
+        scalar_add_i64, scalar_add_f64, scalar_mul_i64, scalar_mul_f64,
+        scalar_fill
+    },
+#if defined(__x86_64__)
+    {
+        "sse2",
+        sse2_sum_i64, sse2_sum_f64,
+        scalar_min_i64, scalar_max_i64, sse2_min_f64, sse2_max_f64,
+        scalar_dot_i64, sse2_dot_f64,
+        sse2_add_i64, sse2_add_f64, scalar_mul_i64, sse2_mul_f64,
+        sse2_fill
+    },
+    {
+        "avx2",
+        avx2_sum_i64, avx2_sum_f64,
+        avx2_min_i64, avx2_max_i64, avx2_min_f64, avx2_max_f64,
+        scalar_dot_i64, avx2_dot_f64,
+        avx2_add_i64, avx2_add_f64, scalar_mul_i64, avx2_mul_f64,
+        avx2_fill
+    },
+#endif
+};
+
+/**
+Find the best instruction set the CPU supports, using cpuid
+*/
+simd_level_t simd_detect()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return SIMD_SSE2;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+/**
+Get the kernels of an instruction set the CPU supports
+*/
+const simd_kernels_t* simd_kernels_for(simd_level_t level)
+{
+    assert (level <= simd_detect());
+    return &SIMD_KERNELS[level];
+}
+
+static void simd_select()
+{
+    simd_level_t level = simd_detect();
+
+    if (simd_force >= 0)
+    {
+        if (simd_force > (int)level)
+        {
+            const char* names[] = { "scalar", "sse2", "avx2" };
+            printf("%s instructions are not supported by this CPU\n", names[simd_force]);
+            exit(-1);
+        }
+
+        level = (simd_level_t)simd_force;
+    }
+
+    simd_selected = &SIMD_KERNELS[level];
+}
+
+/**
+Get the kernels selected for this CPU, or forced with --simd
+*/
+const simd_kernels_t* simd_kernels()
+{
+    pthread_once(&simd_once, simd_select);
+    return simd_selected;
+}
+
+/// Make an array of values from integers, as floats if asked
+static value_t* test_simd_vals(const int64_t* ints, size_t n, bool floats)
+{
+    value_t* vals = malloc(sizeof(value_t) * (n + 1));
+
+    // Fill the padding, which the kernels must ignore
+    memset(vals, 0xAB, sizeof(value_t) * (n + 1));
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        vals[i].word.int64 = ints[i];
+        vals[i].tag = TAG_INT64;
+
+        if (floats)
+        {
+            vals[i].word.float64 = (double)ints[i];
+            vals[i].tag = TAG_FLOAT64;
+        }
+    }
+
+    return vals;
+}
+
+/// Check the kernels of a level against the scalar ones
+static void test_simd_level(simd_level_t level)
+{
+    const simd_kernels_t* k = simd_kernels_for(level);
+    const simd_kernels_t* s = simd_kernels_for(SIMD_SCALAR);
+
+    // Integers with exact float sums and products, and some that overflow
+    int64_t ints[37];
+    for (size_t i = 0; i < 37; ++i)
+        ints[i] = (int64_t)((i * 7919) % 61) - 30;
+    int64_t big[4] = { INT64_MAX, 1, INT64_MIN, -2 };
+
+    for (size_t n = 0; n <= 37; ++n)
+    {
+        value_t* ia = test_simd_vals(ints, n, false);
+        value_t* ib = test_simd_vals(ints + (37 - n), n, false);
+        value_t* fa = test_simd_vals(ints, n, true);
+        value_t* fb = test_simd_vals(ints + (37 - n), n, true);
+        value_t* out0 = malloc(sizeof(value_t) * (n + 1));
+        value_t* out1 = malloc(sizeof(value_t) * (n + 1));
+        int64_t i0, i1;
+        double f0, f1;
+
+        assert (k->sum_i64(ia, n, &i0) && s->sum_i64(ia, n, &i1) && i0 == i1);
+        assert (k->sum_f64(fa, n, &f0) && s->sum_f64(fa, n, &f1) && f0 == f1);
+        assert (k->dot_i64(ia, ib, n, &i0) && s->dot_i64(ia, ib, n, &i1) && i0 == i1);
+        assert (k->dot_f64(fa, fb, n, &f0) && s->dot_f64(fa, fb, n, &f1) && f0 == f1);
+
+        if (n > 0)
+        {
+            assert (k->min_i64(ia, n, &i0) && s->min_i64(ia, n, &i1) && i0 == i1);
+            assert (k->max_i64(ia, n, &i0) && s->max_i64(ia, n, &i1) && i0 == i1);
+            assert (k->min_f64(fa, n, &f0) && s->min_f64(fa, n, &f1) && f0 == f1);
+            assert (k->max_f64(fa, n, &f0) && s->max_f64(fa, n, &f1) && f0 == f1);
+
+            // NaNs anywhere are skipped, as by fmin and fmax
+            for (size_t i = 0; i < n; ++i)
+            {
+                double x = fa[i].word.float64;
+                fa[i].word.float64 = NAN;
+                double lo = NAN;
+                double hi = NAN;
+                for (size_t j = 0; j < n; ++j)
+                {
+                    lo = fmin(lo, fa[j].word.float64);
+                    hi = fmax(hi, fa[j].word.float64);
+                }
+                assert (k->min_f64(fa, n, &f0) && s->min_f64(fa, n, &f1));
+                assert ((f0 == lo && f1 == lo) || (isnan(lo) && isnan(f0) && isnan(f1)));
+                assert (k->max_f64(fa, n, &f0) && s->max_f64(fa, n, &f1));
+                assert ((f0 == hi && f1 == hi) || (isnan(hi) && isnan(f0) && isnan(f1)));
+                fa[i].word.float64 = x;
+            }
+        }
+
+        bool (*binops[4])(const value_t*, const value_t*, value_t*, size_t) = {
+            k->add_i64, k->mul_i64, k->add_f64, k->mul_f64
+        };
+        bool (*refs[4])(const value_t*, const value_t*, value_t*, size_t) = {
+            s->add_i64, s->mul_i64, s->add_f64, s->mul_f64
+        };
+
+        for (int j = 0; j < 4; ++j)
+        {
+            const value_t* a = (j < 2)? ia:fa;
+            const value_t* b = (j < 2)? ib:fb;
+            assert (binops[j](a, b, out0, n) && refs[j](a, b, out1, n));
+            for (size_t i = 0; i < n; ++i)
+                assert (value_equals(out0[i], out1[i]));
+        }
+
+        k->fill(out0, n, value_from_float64(1.5));
+        for (size_t i = 0; i < n; ++i)
+            assert (out0[i].tag == TAG_FLOAT64 && out0[i].word.float64 == 1.5);
+
+        // An element of the wrong type anywhere is found
+        for (size_t i = 0; i < n; ++i)
+        {
+            ia[i].tag = TAG_FLOAT64;
+            fa[i].tag = TAG_INT64;
+            assert (!k->sum_i64(ia, n, &i0) && !k->sum_f64(fa, n, &f0));
+            assert (!k->max_i64(ia, n, &i0) && !k->min_f64(fa, n, &f0));
+            assert (!k->add_i64(ia, ib, out0, n) && !k->mul_f64(fa, fb, out0, n));
+            assert (!k->add_i64(ib, ia, out0, n) && !k->dot_f64(fb, fa, n, &f0));
+            ia[i].tag = TAG_INT64;
+            fa[i].tag = TAG_FLOAT64;
+        }
+
+        free(ia);
+        free(ib);
+        free(fa);
+        free(fb);
+        free(out0);
+        free(out1);
+    }
+
+    // Integer arithmetic wraps around
+    value_t* vals = test_simd_vals(big, 4, false);
+    int64_t sum;
+    assert (k->sum_i64(vals, 4, &sum) && sum == -2);
+    assert (k->min_i64(vals, 4, &sum) && sum == INT64_MIN);
+    assert (k->max_i64(vals, 4, &sum) && sum == INT64_MAX);
+    free(vals);
+}
+
+void test_simd()
+{
+    for (int level = SIMD_SCALAR; level <= (int)simd_detect(); ++level)
+        test_simd_level((simd_level_t)level);
+
+    test_eval_modes("sum([1, 2, 3])", 6);
+    test_eval_modes("sum([])", 0);
+    test_eval_modes("to_int(sum([1.5, 2.5, 3.0]))", 7);
+    test_eval_modes("minimum([3, -1, 2]) * 10 + maximum([3, -1, 2])", -7);
+    test_eval_modes("to_int(maximum([0.5, 2.5, 1.0]) * 2.0)", 5);
+
+    // NaNs are skipped wherever they are, as by min and max
+    test_eval_modes(
+        "let n = 0.0 / 0.0\n"
+        "let m = maximum([n, 1.0, 3.0]) + maximum([1.0, n, 3.0]) + minimum([2.0, n])\n"
+        "to_int(m + max(n, 1.0) + min(1.0, n))",
+        10
+    );
+    test_eval_modes("let m = minimum([0.0 / 0.0])\nif m < 0.0 or m >= 0.0 then 0 else 1", 1);
+    test_eval_modes("dot([1, 2, 3], [4, 5, 6])", 32);
+    test_eval_modes("let a = vadd([1, 2, 3], [10, 20, 30])\na[0] + a[1] + a[2]", 66);
+    test_eval_modes("let a = vmul([1.5, 2.0], [2.0, 4.0])\nto_int(a[0] + a[1])", 11);
+    test_eval_modes("let a = fill(5, 7)\nlen(a) * 10 + a[4]", 57);
+    test_eval_modes("let a = array(1000, fun (i) i)\nsum(vmul(a, fill(1000, 2))) - dot(a, fill(1000, 1))", 499500);
+}
@@ -0,0 +1,76 @@
+/**
+Vectorized array kernels
+
+Native kernels for sum, minimum, maximum, dot product, elementwise add
+and multiply, and fill, over arrays of integers or of floats. They
+work directly on the value array: each 16-byte value is a word and a
+tag, so one SSE2 register holds a value, and one AVX2 register two.
+Vector kernels check the tags of all the elements as they go, without
+branching on each element, and fail if any is of the wrong type.
+
+The kernels used are selected at startup by the features of the CPU,
+found with the cpuid instruction: AVX2 if available, otherwise SSE2,
+which every x86-64 CPU has, and portable scalar code elsewhere. 64-bit
+integer multiplies have no vector instruction before AVX-512, so the
+integer dot product and multiply are always scalar, and so are integer
+min and max with SSE2.
+
+Floating-point sums and dot products are computed in several partial
+sums, added together at the end, which may round differently from
+adding the elements in order.
+*/
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "vm.h"
+
+/// Instruction set levels
+typedef enum
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+} simd_level_t;
+
+/**
+Kernel implementations for an instruction set
+Kernels over elements return false if an element isn't of their type
+*/
+typedef struct
+{
+    const char* name;
+
+    bool (*sum_i64)(const value_t* a, size_t n, int64_t* out);
+    bool (*sum_f64)(const value_t* a, size_t n, double* out);
+
+    /// Minimum and maximum of at least one element, skipping NaNs like
+    /// fmin and fmax
+    bool (*min_i64)(const value_t* a, size_t n, int64_t* out);
+    bool (*max_i64)(const value_t* a, size_t n, int64_t* out);
+    bool (*min_f64)(const value_t* a, size_t n, double* out);
+    bool (*max_f64)(const value_t* a, size_t n, double* out);
+
+    bool (*dot_i64)(const value_t* a, const value_t* b, size_t n, int64_t* out);
+    bool (*dot_f64)(const value_t* a, const value_t* b, size_t n, double* out);
+
+    /// Elementwise operations, writing n values to out
+    bool (*add_i64)(const value_t* a, const value_t* b, value_t* out, size_t n);
+    bool (*add_f64)(const value_t* a, const value_t* b, value_t* out, size_t n);
+    bool (*mul_i64)(const value_t* a, const value_t* b, value_t* out, size_t n);
+    bool (*mul_f64)(const value_t* a, const value_t* b, value_t* out, size_t n);
+
+    void (*fill)(value_t* out, size_t n, value_t val);
+
+} simd_kernels_t;
+
+/// Instruction set to use, -1 to use the best the CPU supports
+extern int simd_force;
+
+simd_level_t simd_detect();
+const simd_kernels_t* simd_kernels_for(simd_level_t level);
+const simd_kernels_t* simd_kernels();
+
+void test_simd();
+
+#endif
@@ -0,0 +1,627 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "task.h"
+#include "io.h"
+#include "coro.h"
+#include "interp.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Number of worker threads, 0 for one per core
+uint32_t task_num_workers = 0;
+
+/// Shape of task objects
+shapeidx_t SHAPE_TASK;
+
+/// Size of the C stacks of worker threads
+#define WORKER_CSTACK_SIZE (8 << 20)
+
+/// Initial capacity of task deques
+#define DEQUE_INIT_CAP 64
+
+/// Worker threads, started on the first spawn
+static worker_t* workers = NULL;
+static uint32_t num_workers = 0;
+
+/// Queue of the tasks spawned by the main program
+static deque_t main_queue;
+
+/// Lock guarding task states and wait lists
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Signaled when tasks become ready, for idle workers
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+/// Signaled when tasks are done, for threads blocked in a join
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/// Number of workers waiting for tasks to become ready
+static atomic_uint num_idle;
+
+/// Worker of the current thread, NULL on the main thread
+static _Thread_local worker_t* cur_worker = NULL;
+
+/// Task running on the current thread
+static _Thread_local task_t* cur_task = NULL;
+
+static void deque_init(deque_t* deque)
+{
+    deque->tasks = malloc(sizeof(task_t*) * DEQUE_INIT_CAP);
+    deque->cap = DEQUE_INIT_CAP;
+    deque->top = 0;
+    deque->bottom = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+}
+
+/// Push a task at the bottom of a deque
+static void deque_push(deque_t* deque, task_t* task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->cap)
+    {
+        task_t** tasks = malloc(sizeof(task_t*) * deque->cap * 2);
+        for (size_t i = deque->top; i < deque->bottom; ++i)
+            tasks[i & (deque->cap * 2 - 1)] = deque->tasks[i & (deque->cap - 1)];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->cap *= 2;
+    }
+
+    deque->tasks[deque->bottom++ & (deque->cap - 1)] = task;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/// Pop the newest task, from the bottom of a deque
+static task_t* deque_pop(deque_t* deque)
+{
+    task_t* task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top)
+        task = deque->tasks[--deque->bottom & (deque->cap - 1)];
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+/// Take the oldest task, from the top of a deque
+static task_t* deque_steal(deque_t* deque)
+{
+    task_t* task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top)
+        task = deque->tasks[deque->top++ & (deque->cap - 1)];
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+static bool deque_empty(deque_t* deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool empty = (deque->bottom == deque->top);
+    pthread_mutex_unlock(&deque->lock);
+    return empty;
+}
+
+/**
+Queue a ready task
+Tasks made ready by a worker go to its own deque, where they run next,
+and other tasks to the main queue. An idle worker is woken up if any.
+*/
+static void task_ready(task_t* task)
+{
+    deque_push(cur_worker? &cur_worker->deque:&main_queue, task);
+
+    // A worker going idle counts itself before checking the queues
+    // one last time, so either it finds this task, or it is counted
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load(&num_idle) > 0)
+    {
+        pthread_mutex_lock(&task_lock);
+        pthread_cond_signal(&ready_cond);
+        pthread_mutex_unlock(&task_lock);
+    }
+}
+
+/// Find a ready task for a worker, NULL if there is none
+static task_t* task_find(worker_t* worker)
+{
+    task_t* task = deque_pop(&worker->deque);
+
+    if (!task)
+        task = deque_steal(&main_queue);
+
+    // Steal from the other workers, starting from a random one
+    if (!task && num_workers > 1)
+    {
+        worker->seed = worker->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t start = (uint32_t)(worker->seed >> 33) % num_workers;
+
+        for (uint32_t i = 0; i < num_workers && !task; ++i)
+        {
+            worker_t* victim = &workers[(start + i) % num_workers];
+            if (victim != worker)
+                task = deque_steal(&victim->deque);
+        }
+    }
+
+    return task;
+}
+
+/// Test if any task is ready
+static bool task_any_ready()
+{
+    if (!deque_empty(&main_queue))
+        return true;
+
+    for (uint32_t i = 0; i < num_workers; ++i)
+        if (!deque_empty(&workers[i].deque))
+            return true;
+
+    return false;
+}
+
+/**
+Record the result of a task and wake up the tasks waiting for it
+Called with the scheduler lock held, which it releases
+*/
+static void task_finish(task_t* task, value_t ret)
+{
+    task->result = ret;
+    task->state = TASK_DONE;
+
+    // The tasks waiting for this one resume with its result
+    task_t* waiters = task->waiters;
+    task->waiters = NULL;
+
+    for (task_t* waiter = waiters; waiter; waiter = waiter->next_waiter)
+    {
+        waiter->state = TASK_READY;
+        waiter->val = ret;
+    }
+
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&task_lock);
+
+    while (waiters)
+    {
+        task_t* waiter = waiters;
+        waiters = waiter->next_waiter;
+        task_ready(waiter);
+    }
+}
+
+/**
+Run a task until it returns, or suspends in a join or yield
+*/
+static void task_run(task_t* task)
+{
+    task_t* prev_task = cur_task;
+    cur_task = task;
+
+    pthread_mutex_lock(&task_lock);
+    task->state = TASK_RUNNING;
+    pthread_mutex_unlock(&task_lock);
+
+    // Native tasks run to completion
+    if (task->fn)
+    {
+        task->fn(task->data);
+        cur_task = prev_task;
+
+        pthread_mutex_lock(&task_lock);
+        task_finish(task, VAL_TRUE);
+        return;
+    }
+
+    value_t ret = coro_resume(task->coro, task->val);
+
+    cur_task = prev_task;
+
+    pthread_mutex_lock(&task_lock);
+
+    // Suspended in a join, the task waits unless the joined task
+    // finished in the meantime
+    if (task->joining)
+    {
+        task_t* joined = task->joining;
+        task->joining = NULL;
+
+        if (joined->state == TASK_DONE)
+        {
+            task->state = TASK_READY;
+            task->val = joined->result;
+            pthread_mutex_unlock(&task_lock);
+            task_ready(task);
+            return;
+        }
+
+        task->state = TASK_WAITING;
+        task->next_waiter = joined->waiters;
+        joined->waiters = task;
+        pthread_mutex_unlock(&task_lock);
+        return;
+    }
+
+    // Suspended on I/O, the reactor wakes the task once done
+    if (task->io)
+    {
+        io_op_t* op = task->io;
+        task->io = NULL;
+        task->state = TASK_WAITING;
+        pthread_mutex_unlock(&task_lock);
+        io_park(op);
+        return;
+    }
+
+    // Suspended in a yield, the task goes back in the queue
+    if (task->coro->state != CORO_DONE)
+    {
+        task->state = TASK_READY;
+        task->val = ret;
+        pthread_mutex_unlock(&task_lock);
+        task_ready(task);
+        return;
+    }
+
+    task_finish(task, ret);
+}
+
+static void* worker_main(void* arg)
+{
+    worker_t* worker = (worker_t*)arg;
+    cur_worker = worker;
+
+    // Tasks run on the value stacks of their coroutines
+    vm_init_thread(CORO_STACK_SIZE);
+
+    for (;;)
+    {
+        task_t* task = task_find(worker);
+
+        if (task)
+        {
+            task_run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&task_lock);
+        atomic_fetch_add(&num_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!task_any_ready())
+            pthread_cond_wait(&ready_cond, &task_lock);
+
+        atomic_fetch_sub(&num_idle, 1);
+        pthread_mutex_unlock(&task_lock);
+    }
+
+    return NULL;
+}
+
+/**
+Number of worker threads, once started or when they will be
+*/
+uint32_t task_pool_size()
+{
+    if (workers)
+        return num_workers;
+
+    if (task_num_workers > 0)
+        return task_num_workers;
+
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_cores > 0)? (uint32_t)num_cores:1;
+}
+
+/// Test if the current thread is a worker thread
+bool task_on_worker()
+{
+    return cur_worker != NULL;
+}
+
+/// Start the worker threads
+static void task_start()
+{
+    num_workers = task_pool_size();
+
+    deque_init(&main_queue);
+    workers = calloc(num_workers, sizeof(worker_t));
+
+    for (uint32_t i = 0; i < num_workers; ++i)
+    {
+        deque_init(&workers[i].deque);
+        workers[i].seed = i + 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_CSTACK_SIZE);
+
+    for (uint32_t i = 0; i < num_workers; ++i)
+    {
+        if (pthread_create(&workers[i].thread, &attr, worker_main, &workers[i]) != 0)
+        {
+            printf("failed to start worker threads\n");
+            exit(-1);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+static task_t* task_alloc()
+{
+    if (workers == NULL)
+        task_start();
+
+    task_t* task = (task_t*)vm_alloc(sizeof(task_t), SHAPE_TASK);
+    task->state = TASK_READY;
+    task->coro = NULL;
+    task->fn = NULL;
+    task->data = NULL;
+    task->val = VAL_FALSE;
+    task->result = VAL_FALSE;
+    task->joining = NULL;
+    task->waiters = NULL;
+    task->next_waiter = NULL;
+    task->io = NULL;
+
+    return task;
+}
+
+/**
+Spawn a task running a closure of one argument
+*/
+task_t* task_spawn(clos_t* clos, value_t arg)
+{
+    task_t* task = task_alloc();
+    task->coro = coro_alloc(clos);
+    task->val = arg;
+
+    task_ready(task);
+
+    return task;
+}
+
+/**
+Spawn a task running a native function
+Native tasks can't be suspended, they run to completion once started.
+*/
+task_t* task_spawn_native(task_fn_t fn, void* data)
+{
+    task_t* task = task_alloc();
+    task->fn = fn;
+    task->data = data;
+
+    task_ready(task);
+
+    return task;
+}
+
+/// Set of parallel jobs, each participant takes the next job left
+typedef struct
+{
+    task_job_fn_t fn;
+    void* data;
+    uint32_t num_jobs;
+    atomic_uint next;
+
+} jobs_t;
+
+static void task_run_jobs(void* data)
+{
+    jobs_t* jobs = (jobs_t*)data;
+
+    for (;;)
+    {
+        uint32_t job = atomic_fetch_add(&jobs->next, 1);
+        if (job >= jobs->num_jobs)
+            break;
+
+        jobs->fn(jobs->data, job);
+    }
+}
+
+/**
+Run a number of jobs in parallel, on the calling thread and workers
+Returns once all the jobs are done.
+*/
+void task_parallel(uint32_t num_jobs, task_job_fn_t fn, void* data)
+{
+    jobs_t jobs;
+    jobs.fn = fn;
+    jobs.data = data;
+    jobs.num_jobs = num_jobs;
+    atomic_init(&jobs.next, 0);
+
+    // Jobs are handed out dynamically, helpers starting late may
+    // find none left
+    uint32_t num_helpers = num_jobs? num_jobs - 1:0;
+    if (num_helpers > task_pool_size())
+        num_helpers = task_pool_size();
+
+    task_t* helpers[num_helpers + 1];
+
+    for (uint32_t i = 0; i < num_helpers; ++i)
+        helpers[i] = task_spawn_native(task_run_jobs, &jobs);
+
+    task_run_jobs(&jobs);
+
+    for (uint32_t i = 0; i < num_helpers; ++i)
+        task_join(helpers[i]);
+}
+
+/**
+Wait for a task to finish, and get its result
+A task joining another is suspended, if it can be, and resumed with the
+result. Otherwise, workers run other tasks while they wait, and the
+main thread blocks.
+*/
+value_t task_join(task_t* task)
+{
+    if (task == cur_task)
+    {
+        printf("join: a task can't wait for itself\n");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&task_lock);
+    bool done = (task->state == TASK_DONE);
+    pthread_mutex_unlock(&task_lock);
+
+    if (done)
+        return task->result;
+
+    // The task is suspended, and task_run registers it as a waiter.
+    // Registering here could let another worker resume it before it
+    // is suspended.
+    if (task_can_suspend())
+    {
+        cur_task->joining = task;
+        return coro_yield(VAL_FALSE);
+    }
+
+    if (cur_worker)
+    {
+        for (;;)
+        {
+            pthread_mutex_lock(&task_lock);
+            done = (task->state == TASK_DONE);
+            pthread_mutex_unlock(&task_lock);
+
+            if (done)
+                return task->result;
+
+            task_t* other = task_find(cur_worker);
+
+            if (other)
+                task_run(other);
+            else
+                sched_yield();
+        }
+    }
+
+    pthread_mutex_lock(&task_lock);
+    while (task->state != TASK_DONE)
+        pthread_cond_wait(&done_cond, &task_lock);
+    pthread_mutex_unlock(&task_lock);
+
+    return task->result;
+}
+
+/**
+Test if the current thread runs a task that can be suspended: the task
+itself is running, rather than a coroutine it resumed, and it isn't
+inside a native call
+*/
+bool task_can_suspend()
+{
+    return cur_task && coro_current == cur_task->coro && coro_can_yield();
+}
+
+/**
+Suspend the current task until an I/O operation completes
+The task is resumed with the result of the operation.
+*/
+value_t task_wait_io(io_op_t* op)
+{
+    assert (task_can_suspend());
+
+    // The operation is parked by task_run, once the task is suspended
+    op->task = cur_task;
+    cur_task->io = op;
+    return coro_yield(VAL_FALSE);
+}
+
+/**
+Make a suspended task ready, resuming it with a value
+*/
+void task_wake(task_t* task, value_t val)
+{
+    pthread_mutex_lock(&task_lock);
+    assert (task->state == TASK_WAITING);
+    task->state = TASK_READY;
+    task->val = val;
+    pthread_mutex_unlock(&task_lock);
+
+    task_ready(task);
+}
+
+void test_task()
+{
+    // Run the tests on several workers, even on a single core
+    if (workers == NULL && task_num_workers == 0)
+        task_num_workers = 4;
+
+    test_eval_modes("join(spawn(fun (x) x * 2, 21))", 42);
+
+    // Joining a finished task gives its result again
+    test_eval_modes(
+        "let t = spawn(fun (x) x, 7)\n"
+        "join(t) + join(t)",
+        14
+    );
+
+    // Tasks yielding go back in the queue
+    test_eval_modes(
+        "let t = spawn(fun (x) { yield(0)\nx + 1 }, 1)\n"
+        "join(t)",
+        2
+    );
+
+    // Tasks spawning and joining tasks
+    test_eval_modes(
+        "let fib = fun (n) if n < 2 then n else {\n"
+        "let t = spawn(fib, n - 1)\n"
+        "let b = fib(n - 2)\n"
+        "join(t) + b\n"
+        "}\n"
+        "fib(12)",
+        144
+    );
+    test_eval_modes(
+        "let go = fun (i, n) if i == n then 0 else {\n"
+        "let t = spawn(fun (x) x * x, i)\n"
+        "let r = go(i + 1, n)\n"
+        "join(t) + r\n"
+        "}\n"
+        "go(0, 100)",
+        328350
+    );
+
+    // Tasks running the same code on integers and floats, which
+    // specializes and deoptimizes its instructions concurrently
+    test_eval_modes(
+        "let add = fun (a, b) a + b\n"
+        "let loop = fun (i, x) if i == 0 then x else loop(i - 1, add(x, x))\n"
+        "let work = fun (k) if k mod 2 == 0 then loop(20, 1) else to_int(loop(20, 1.0))\n"
+        "let ts = array(8, fun (k) spawn(work, k))\n"
+        "reduce(ts, fun (a, t) a + join(t), 0)",
+        8 << 20
+    );
+
+    // A task can't be suspended from inside a coroutine it resumed,
+    // the worker runs other tasks until the join completes
+    test_eval_modes(
+        "let t = spawn(fun (x) {\n"
+        "let co = coroutine(fun (y) join(spawn(fun (z) z + 1, y)))\n"
+        "resume(co, x)\n"
+        "}, 1)\n"
+        "join(t)",
+        2
+    );
+}
@@ -0,0 +1,137 @@
+/**
+Task scheduler
+
+Tasks are closures of one argument spawned to run concurrently, and
+joined to wait for their result:
+
+    let t = spawn(fun (n) fib(n), 30)
+    fib(29) + join(t)
+
+Tasks are multiplexed onto a pool of worker threads, one per core by
+default. Each task is a coroutine with its own value stack, so a task
+waiting in join is suspended, and its worker moves on to other tasks
+rather than blocking. Each worker has a deque of ready tasks: it pushes
+and pops tasks at the bottom, and idle workers steal the oldest tasks
+from the top of the other deques. Tasks spawned from the main program
+go through a shared queue.
+
+Tasks waiting for I/O are also suspended, see io.h.
+
+Tasks can also run native functions, such as the chunks of parallel
+array operations (see par.h).
+
+Tasks run in the bytecode interpreter. Their arguments and results are
+how they should communicate: accesses to variables shared between tasks
+aren't synchronized.
+*/
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include <pthread.h>
+#include "vm.h"
+#include "interp.h"
+#include "coro.h"
+
+/// Number of worker threads, 0 for one per core
+extern uint32_t task_num_workers;
+
+/// Shape of task objects
+extern shapeidx_t SHAPE_TASK;
+
+/// Native function run by a task
+typedef void (*task_fn_t)(void* data);
+
+/// Function running one of a set of parallel jobs
+typedef void (*task_job_fn_t)(void* data, uint32_t job);
+
+/// Task states
+typedef enum
+{
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_WAITING,
+    TASK_DONE
+} task_state_t;
+
+/**
+Task object
+The state and wait lists are guarded by the scheduler lock
+*/
+typedef struct task
+{
+    shapeidx_t shape;
+
+    task_state_t state;
+
+    /// Coroutine running the closure of the task
+    coro_t* coro;
+
+    /// Native function run instead of a closure, and its data
+    task_fn_t fn;
+    void* data;
+
+    /// Value the task is resumed with: its argument, then the
+    /// result of the pending join or yield
+    value_t val;
+
+    /// Value returned by the closure, once done
+    value_t result;
+
+    /// Task this one is suspended in a join on
+    struct task* joining;
+
+    /// Tasks suspended in a join on this one
+    struct task* waiters;
+    struct task* next_waiter;
+
+    /// I/O operation this task is suspended on
+    struct io_op* io;
+
+} task_t;
+
+/**
+Double-ended queue of ready tasks
+*/
+typedef struct
+{
+    /// Circular buffer, its capacity is a power of two
+    task_t** tasks;
+    size_t cap;
+
+    /// Positions of the oldest task and past the newest one
+    size_t top;
+    size_t bottom;
+
+    pthread_mutex_t lock;
+
+} deque_t;
+
+/**
+Worker thread
+*/
+typedef struct
+{
+    pthread_t thread;
+
+    /// Ready tasks of this worker
+    deque_t deque;
+
+    /// State of the random choice of victims to steal from
+    uint64_t seed;
+
+} worker_t;
+
+uint32_t task_pool_size();
+bool task_on_worker();
+task_t* task_spawn(clos_t* clos, value_t arg);
+task_t* task_spawn_native(task_fn_t fn, void* data);
+void task_parallel(uint32_t num_jobs, task_job_fn_t fn, void* data);
+value_t task_join(task_t* task);
+bool task_can_suspend();
+value_t task_wait_io(struct io_op* op);
+void task_wake(task_t* task, value_t val);
+
+void test_task();
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include "tier.h"
+#include "interp.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "task.h"
+#include "opt.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Enable tiered execution
+bool opt_tiered = false;
+
+/// Log tier transitions
+bool opt_log_tiers = false;
+
+/// Hotness at which functions are compiled to bytecode
+uint32_t tier_bc_threshold = 2;
+
+/// Tier names, for logging
+static const char* TIER_NAMES[] = { "ast", "bytecode", "jit" };
+
+/// Get the hotness of a function, its number of calls and back-edges
+uint32_t tier_hotness(ast_fun_t* fun)
+{
+    return fun->num_calls + fun->num_backedges;
+}
+
+/// Count a call or back-edge to a function
+void tier_count(ast_fun_t* fun, bool backedge)
+{
+    if (backedge)
+        fun->num_backedges++;
+    else
+        fun->num_calls++;
+}
+
+/**
+Count a call or back-edge to a function running in the AST interpreter
+Returns true if the function has tiered up, and should run as bytecode.
+*/
+bool tier_up_bc(ast_fun_t* fun, bool backedge)
+{
+    // Counters and tiers are only updated by the main thread, workers
+    // run everything as bytecode
+    if (task_on_worker())
+    {
+        bc_get_fun(fun);
+        return true;
+    }
+
+    if (fun->tier >= TIER_BYTECODE)
+        return true;
+
+    tier_count(fun, backedge);
+
+    if (tier_hotness(fun) < tier_bc_threshold)
+        return false;
+
+    clock_t start = clock();
+    bc_get_fun(fun);
+    tier_promote(fun, TIER_BYTECODE, start);
+
+    return true;
+}
+
+/**
+Record that a function was promoted to a higher tier
+The compilation started at the given time.
+*/
+void tier_promote(ast_fun_t* fun, tier_t tier, clock_t start)
+{
+    // Machine code is compiled from bytecode, so functions reaching
+    // the JIT tier always ran as bytecode first, even if only because
+    // they were called from bytecode
+    tier_t prev = (tier == TIER_JIT)? TIER_BYTECODE:fun->tier;
+
+    fun->tier = tier;
+
+    if (!opt_log_tiers)
+        return;
+
+    double msecs = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("tier: ");
+    print_fun_name(fun);
+    printf(
+        " %s -> %s after %u calls, %u back-edges (compiled in %.3f ms)\n",
+        TIER_NAMES[prev],
+        TIER_NAMES[tier],
+        fun->num_calls,
+        fun->num_backedges,
+        msecs
+    );
+}
+
+void test_tier()
+{
+    bool tiered = opt_tiered;
+    bool jit = opt_jit;
+    uint32_t bc_threshold = tier_bc_threshold;
+    uint32_t threshold = jit_threshold;
+
+    opt_tiered = true;
+    opt_jit = true;
+    tier_bc_threshold = 2;
+    jit_threshold = 4;
+
+    // The calls counted must not be inlined
+    opt_inline = false;
+
+    ast_fun_t* unit_fun = load_str(
+        "let f = fun (n) n + 1\n"
+        "let loop = fun (i) if i == 0 then 7 else loop(i - 1)\n"
+        "let r = [f(1), f(2), f(3), f(4), loop(10), f, loop]\n"
+        "r",
+        "test"
+    );
+    value_t val = exec_unit(unit_fun);
+    array_t* array = val.word.array;
+
+    // The results are the same in every tier
+    for (int i = 0; i < 4; ++i)
+        assert (value_equals(array_get(array, i), value_from_int64(i + 2)));
+    assert (value_equals(array_get(array, 4), value_from_int64(7)));
+
+    ast_fun_t* f = ((clos_t*)array_get(array, 5).word.heapptr)->fun;
+    ast_fun_t* loop = ((clos_t*)array_get(array, 6).word.heapptr)->fun;
+
+    // The unit runs once, in the AST interpreter
+    assert (unit_fun->tier == TIER_AST);
+
+    // The loop tiers up on its back-edges, during its first call
+    assert (loop->num_backedges >= 1);
+
+#if defined(__x86_64__)
+    assert (f->tier == TIER_JIT);
+    assert (loop->tier == TIER_JIT);
+#else
+    assert (f->tier == TIER_BYTECODE);
+    assert (loop->tier == TIER_BYTECODE);
+#endif
+
+    opt_tiered = tiered;
+    opt_jit = jit;
+    tier_bc_threshold = bc_threshold;
+    jit_threshold = threshold;
+    opt_inline = true;
+}
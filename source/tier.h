@@ -0,0 +1,42 @@
+/**
+Tiered execution
+
+In tiered mode, functions start out in the AST interpreter, which has
+no compilation cost. Each function counts its calls and back-edges
+(self tail calls, which is how Zeta code loops). Past a threshold, the
+function is compiled to bytecode, and past a second threshold, to
+machine code. A promotion takes effect on the next call to the function.
+*/
+
+#ifndef __TIER_H__
+#define __TIER_H__
+
+#include <time.h>
+#include "vm.h"
+#include "parser.h"
+
+/// Execution tiers, from cheapest to fastest
+typedef enum
+{
+    TIER_AST,
+    TIER_BYTECODE,
+    TIER_JIT
+} tier_t;
+
+/// Enable tiered execution
+extern bool opt_tiered;
+
+/// Log tier transitions
+extern bool opt_log_tiers;
+
+/// Hotness at which functions are compiled to bytecode
+extern uint32_t tier_bc_threshold;
+
+uint32_t tier_hotness(ast_fun_t* fun);
+void tier_count(ast_fun_t* fun, bool backedge);
+bool tier_up_bc(ast_fun_t* fun, bool backedge);
+void tier_promote(ast_fun_t* fun, tier_t tier, clock_t start);
+
+void test_tier();
+
+#endif
@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include "vm.h"
 #include <assert.h>
 #include <stdio.h>
@@ -6,6 +7,10 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
 //============================================================================
 // VM core
@@ -14,6 +19,12 @@
 /// Global VM instance
 vm_t vm;
 
+/// VM state of the current thread
+_Thread_local vm_thread_t vm_thread;
+
+/// Lock guarding the hand-out of heap regions
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /// Boolean constant values
 const value_t VAL_FALSE = { 0, TAG_BOOL };
 const value_t VAL_TRUE = { 1, TAG_BOOL };
@@ -40,11 +51,23 @@ value_t value_from_int64(int64_t v)
     return val;
 }
 
+value_t value_from_float64(double v)
+{
+    value_t val;
+    val.word.float64 = v;
+    val.tag = TAG_FLOAT64;
+    return val;
+}
+
 bool value_equals(value_t this, value_t that)
 {
     if (this.tag != that.tag)
         return false;
 
+    // Floating-point values compare numerically
+    if (this.tag == TAG_FLOAT64)
+        return this.word.float64 == that.word.float64;
+
     if (this.word.int64 != that.word.int64)
         return false;
 
@@ -59,7 +82,7 @@ void value_print(value_t value)
     switch (value.tag)
     {
         case TAG_BOOL:
-        if (value.word.int8 != 1)
+        if (value.word.int8 != 0)
             printf("true");
         else
             printf("false");
@@ -96,6 +119,14 @@ void value_print(value_t value)
         }
         break;
 
+        case TAG_CLOS:
+        printf("closure");
+        break;
+
+        case TAG_OBJECT:
+        printf("object");
+        break;
+
         default:
         printf("unknown value tag");
         break;
@@ -117,7 +148,9 @@ void vm_init()
     // Note: calloc also zeroes out the heap
     vm.heapstart = calloc(1, HEAP_SIZE);
     vm.heaplimit = vm.heapstart + HEAP_SIZE;
-    vm.allocptr = vm.heapstart;
+    vm.heapfree = vm.heapstart;
+
+    vm_init_thread(STACK_SIZE);
 
     // Allocate the shape table
     vm.shapetbl = array_alloc(4096);
@@ -157,6 +190,18 @@ void vm_init()
     );
     assert (vm.empty_shape->offset == FIELD_SIZEOF(object_t, shape));
 
+    // Define the extension table property (present on all objects)
+    // This keeps user properties from overlapping the table pointer
+    vm.empty_shape = shape_def_prop(
+        vm.empty_shape,
+        vm_get_cstr("ext_tbl"),
+        TAG_RAW_PTR,
+        ATTR_READ_ONLY,
+        FIELD_SIZEOF(object_t, ext_tbl),
+        NULL
+    );
+    assert (vm.empty_shape->offset == offsetof(object_t, ext_tbl));
+
     // Allocate the array and string shapes
     vm.array_shape = shape_alloc_empty();
     SHAPE_ARRAY = vm.array_shape->idx;
@@ -166,29 +211,75 @@ void vm_init()
 }
 
 /**
-Allocate an object in the hosted heap
-Initializes the object descriptor
+Initialize the VM state of the current thread
+The thread gets a value stack of the given size, in values, and takes
+its first allocation region from the heap when it first allocates
 */
-heapptr_t vm_alloc(uint32_t size, shapeidx_t shape)
+void vm_init_thread(size_t stack_size)
 {
-    assert (size >= sizeof(shapeidx_t));
+    vm_thread.allocptr = NULL;
+    vm_thread.alloclimit = NULL;
+
+    vm_thread.stackstart = vm_stack_reserve(stack_size);
+    vm_thread.stacklimit = vm_thread.stackstart + stack_size;
+    vm_thread.stacktop = vm_thread.stackstart;
+
+    // Native frames may use half of the C stack, the rest is left for
+    // the interpreters' own recursion and the frames of the host
+    size_t cstack_size = 8 << 20;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < cstack_size)
+        cstack_size = limit.rlim_cur;
+    uint8_t marker;
+    vm_thread.cstack_limit = &marker - cstack_size / 2;
+    vm_thread.cstack_end = &marker - cstack_size + cstack_size / 8;
+}
 
-    size_t availspace = vm.heaplimit - vm.allocptr;
+/**
+Take a new allocation region from the heap for the current thread
+Objects larger than a region get a region of their own size
+*/
+void vm_alloc_region(uint32_t size)
+{
+    size_t region_size = (size > REGION_SIZE)? ((size + 7) & -8):REGION_SIZE;
+
+    pthread_mutex_lock(&heap_lock);
 
-    if (availspace < size)
+    size_t availspace = vm.heaplimit - vm.heapfree;
+
+    if (availspace < region_size)
     {
         printf("insufficient heap space\n");
         printf("availSpace=%ld\n", availspace);
         exit(-1);
     }
 
-    uint8_t* ptr = vm.allocptr;
+    vm_thread.allocptr = vm.heapfree;
+    vm_thread.alloclimit = vm.heapfree + region_size;
+    vm.heapfree += region_size;
+
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/**
+Allocate an object in the hosted heap
+Initializes the object descriptor
+*/
+heapptr_t vm_alloc(uint32_t size, shapeidx_t shape)
+{
+    assert (size >= sizeof(shapeidx_t));
+
+    if ((size_t)(vm_thread.alloclimit - vm_thread.allocptr) < size)
+        vm_alloc_region(size);
+
+    uint8_t* ptr = vm_thread.allocptr;
 
     // Increment the allocation pointer
-    vm.allocptr += size;
+    vm_thread.allocptr += size;
 
     // Align the allocation pointer
-    vm.allocptr = (uint8_t*)(((ptrdiff_t)vm.allocptr + 7) & -8);
+    vm_thread.allocptr = (uint8_t*)(((ptrdiff_t)vm_thread.allocptr + 7) & -8);
 
     // Set the object shape
     *((shapeidx_t*)ptr) = shape;
@@ -196,6 +287,95 @@ heapptr_t vm_alloc(uint32_t size, shapeidx_t shape)
     return ptr;
 }
 
+/**
+Reserve space for a frame on the VM value stack
+Returns a pointer to the first slot of the frame
+*/
+value_t* vm_push_frame(uint32_t num_slots)
+{
+    if ((size_t)(vm_thread.stacklimit - vm_thread.stacktop) < num_slots)
+    {
+        printf("stack overflow\n");
+        exit(-1);
+    }
+
+    value_t* frame = vm_thread.stacktop;
+    vm_thread.stacktop += num_slots;
+
+    return frame;
+}
+
+/**
+Release a frame and all the frames pushed after it
+*/
+void vm_pop_frame(value_t* frame)
+{
+    assert (frame >= vm_thread.stackstart && frame <= vm_thread.stacktop);
+    vm_thread.stacktop = frame;
+}
+
+/**
+Reserve address space for a value stack
+Pages are only backed by memory once they are touched, so deep
+recursion is limited by available memory rather than a fixed size
+*/
+value_t* vm_stack_reserve(size_t num_slots)
+{
+    void* mem = mmap(
+        NULL,
+        sizeof(value_t) * num_slots,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+    {
+        printf("failed to reserve stack space\n");
+        exit(-1);
+    }
+
+    return (value_t*)mem;
+}
+
+/**
+Release a value stack, returning its memory to the system
+*/
+void vm_stack_release(value_t* stack, size_t num_slots)
+{
+    munmap(stack, sizeof(value_t) * num_slots);
+}
+
+/**
+Test if the C stack is running low
+Interpreted calls between Zeta functions don't use the C stack, but
+the AST interpreter and machine code recurse on it. They check this
+before making calls, and continue in the bytecode interpreter instead.
+*/
+bool vm_cstack_low()
+{
+    uint8_t marker;
+    return &marker < vm_thread.cstack_limit;
+}
+
+/**
+Fail if the C stack is nearly exhausted
+Builtins such as map call closures from the host, so calls through
+them recurse on the C stack in every interpreter. The host checks this
+before running Zeta code, to stop with an error instead of crashing.
+*/
+void vm_cstack_check()
+{
+    uint8_t marker;
+
+    if (&marker < vm_thread.cstack_end)
+    {
+        printf("stack overflow\n");
+        exit(-1);
+    }
+}
+
 //============================================================================
 // Strings and string interning
 //============================================================================
@@ -278,11 +458,50 @@ uint64_t murmur_hash_64a(const void* key, size_t len, uint64_t seed)
     return h;
 }
 
+/// Lock guarding the string table, which tasks and the I/O reactor
+/// may add strings to concurrently
+static pthread_mutex_t strtbl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Add a string to a free slot of a string table
+static void strtbl_insert(array_t* tbl, string_t* str)
+{
+    uint32_t hashIndex = str->hash & (tbl->len - 1);
+
+    while (array_get(tbl, hashIndex).word.string != NULL)
+        hashIndex = (hashIndex + 1) & (tbl->len - 1);
+
+    array_set(tbl, hashIndex, value_from_heapptr((heapptr_t)str, TAG_STRING));
+}
+
+/**
+Extend the string table's capacity, doubling its size
+*/
+static void strtbl_extend()
+{
+    array_t* curTbl = vm.stringtbl;
+    uint32_t newSize = 2 * curTbl->len;
+
+    array_t* newTbl = array_alloc(newSize);
+    for (uint32_t i = 0; i < newSize; ++i)
+        array_set(newTbl, i, VAL_FALSE);
+
+    for (uint32_t i = 0; i < curTbl->len; ++i)
+    {
+        string_t* slotVal = array_get(curTbl, i).word.string;
+        if (slotVal != NULL)
+            strtbl_insert(newTbl, slotVal);
+    }
+
+    vm.stringtbl = newTbl;
+}
+
 /**
 Find a string in the string table if duplicate, or add it to the string table
 */
 string_t* vm_get_tbl_str(string_t* str)
 {
+    pthread_mutex_lock(&strtbl_lock);
+
     // Get the hash code from the string object
     uint32_t hashCode = str->hash;
 
@@ -306,6 +525,7 @@ string_t* vm_get_tbl_str(string_t* str)
         if (string_equals(strVal, str))
         {
             // Return a reference to the string we found in the table
+            pthread_mutex_unlock(&strtbl_lock);
             return strVal;
         }
 
@@ -334,94 +554,35 @@ string_t* vm_get_tbl_str(string_t* str)
     if (vm.num_strings * STR_TBL_MAX_LOAD_DEN >
         vm.stringtbl->len * STR_TBL_MAX_LOAD_NUM)
     {
-        assert (false);
-
-        // Store the string pointer in a GC root object
-        //auto strRoot = GCRoot(str, Tag.STRING);
-
-        // Extend the string table
-        //extStrTable(vm, strTbl, tblSize, numStrings);
-
-        // Restore the string pointer
-        //str = strRoot.ptr;
+        strtbl_extend();
     }
 
+    pthread_mutex_unlock(&strtbl_lock);
+
     // Return a reference to the string object passed as argument
     return str;
 }
 
 /**
-Extend the string table's capacity
+Get the interned string object for a sequence of bytes, which may
+include nul bytes
 */
-/*
-void extStrTable(heapptr_t curTbl, uint32_t curSize, uint32_t numStrings)
+string_t* vm_get_str(const char* data, uint32_t len)
 {
-    // Compute the new table size
-    auto newSize = 2 * curSize;
-
-    //writefln("extending string table, old size: %s, new size: %s", curSize, newSize);
-
-    //printInt(curSize);
-    //printInt(newSize);
-
-    // Allocate a new, larger hash table
-    auto newTbl = strtbl_alloc(vm, newSize);
+    string_t* str = string_alloc(len);
 
-    // Set the number of strings stored
-    strtbl_set_num_strs(newTbl, numStrings);
+    memcpy(str->data, data, len);
 
-    // Initialize the string array
-    for (uint32_t i = 0; i < newSize; ++i)
-        strtbl_set_str(newTbl, i, null);
-
-    // For each entry in the current table
-    for (uint32_t curIdx = 0; curIdx < curSize; curIdx++)
-    {
-        // Get the value at this hash slot
-        auto slotVal = strtbl_get_str(curTbl, curIdx);
-
-        // If this slot is empty, skip it
-        if (slotVal == null)
-            continue;
-
-        // Get the hash code for the value
-        auto valHash = str_get_hash(slotVal);
-
-        // Get the hash table index for this hash value in the new table
-        auto startHashIndex = valHash & (newSize - 1);
-        auto hashIndex = startHashIndex;
-
-        // Until a free slot is encountered
-        while (true)
-        {
-            // Get the value at this hash slot
-            auto slotVal2 = strtbl_get_str(newTbl, hashIndex);
-
-            // If we have reached an empty slot
-            if (slotVal2 == null)
-            {
-                // Set the corresponding key and value in the slot
-                strtbl_set_str(newTbl, hashIndex, slotVal);
-
-                // Break out of the loop
-                break;
-            }
-
-            // Move to the next hash table slot
-            hashIndex = (hashIndex + 1) & (newSize - 1);
-
-            // Ensure that a free slot was found for this key
-            assert (
-                hashIndex != startHashIndex,
-                "no free slots found in extended hash table"
-            );
-        }
-    }
+    // Compute the hash code for the string
+    str->hash = (uint32_t)murmur_hash_64a(
+        &str->data,
+        str->len,
+        1337
+    );
 
-    // Update the string table reference
-    vm.strTbl = newTbl;
+    // Find/add the string in the string table
+    return vm_get_tbl_str(str);
 }
-*/
 
 /**
 Get the interned string object for a given C string
@@ -497,6 +658,27 @@ heapptr_t array_get_ptr(array_t* array, uint32_t idx)
     return array_get(array, idx).word.heapptr;
 }
 
+/**
+Append a value at the end of an array, growing it if it is full
+Returns the array, which is reallocated when its capacity is exceeded
+*/
+array_t* array_append(array_t* array, value_t val)
+{
+    if (array->len == array->cap)
+    {
+        array_t* new_array = array_alloc(array->cap? (2 * array->cap):4);
+
+        for (uint32_t i = 0; i < array->len; ++i)
+            array_set(new_array, i, array_get(array, i));
+
+        array = new_array;
+    }
+
+    array_set(array, array->len, val);
+
+    return array;
+}
+
 //============================================================================
 // Shapes and objects
 //============================================================================
@@ -529,6 +711,10 @@ shape_t* shape_alloc(
 
     shape->children = NULL;
 
+    shape->keys = NULL;
+
+    shape->key_defs = NULL;
+
     // Compute the aligned field offset
     if (parent)
     {
@@ -592,6 +778,22 @@ shape_t* shape_def_prop(
     // If this is a new property addition
     if (defShape == NULL)
     {
+        // Check if a child shape already exists for this definition,
+        // so that objects built the same way end up with the same shape
+        if (this->children != NULL)
+        {
+            for (uint32_t i = 0; i < this->children->len; ++i)
+            {
+                shape_t* child = array_get(this->children, i).word.shape;
+
+                if (child->prop_name == prop_name &&
+                    child->prop_tag == tag &&
+                    child->attrs == attrs &&
+                    child->field_size == field_size)
+                    return child;
+            }
+        }
+
         // Create the new shape
         shape_t* newShape = shape_alloc(
             defShape? defShape:this,
@@ -601,9 +803,13 @@ shape_t* shape_def_prop(
             field_size
         );
 
-        // Add it to the property definitions
-        //propDefs[propName][type] ~= newShape;
-        //assert (propDefs[propName][type].length > 0);
+        // Add it to the children of this shape
+        if (this->children == NULL)
+            this->children = array_alloc(4);
+        this->children = array_append(
+            this->children,
+            value_from_heapptr((heapptr_t)newShape, TAG_OBJECT)
+        );
 
         return newShape;
     }
@@ -669,23 +875,113 @@ shape_t* shape_get_def(shape_t* this, string_t* prop_name)
     return NULL;
 }
 
+/**
+Get the enumerable property names for a given shape, in definition order
+The key array is computed once and cached on the shape node, so that all
+objects with this shape share it. The properties inherited from the empty
+object shape (shape, cap) are not enumerable.
+*/
+array_t* shape_get_keys(shape_t* shape)
+{
+    if (shape->keys != NULL)
+        return shape->keys;
+
+    // Count the properties defined along the shape chain
+    uint32_t num_keys = 0;
+    for (shape_t* cur = shape; cur != vm.empty_shape; cur = cur->parent)
+    {
+        // Shape trees not rooted at the object shape have no properties
+        if (cur->parent == NULL)
+        {
+            num_keys = 0;
+            break;
+        }
+
+        num_keys++;
+    }
+
+    array_t* keys = array_alloc(num_keys);
+    array_t* key_defs = array_alloc(num_keys);
+    array_set_length(keys, num_keys);
+    array_set_length(key_defs, num_keys);
+
+    // Walk the chain backwards, filling the arrays from the end
+    shape_t* cur = shape;
+    for (uint32_t i = num_keys; i > 0; --i, cur = cur->parent)
+    {
+        array_set(
+            keys,
+            i - 1,
+            value_from_heapptr((heapptr_t)cur->prop_name, TAG_STRING)
+        );
+        array_set_obj(key_defs, i - 1, (heapptr_t)cur);
+    }
+
+    shape->key_defs = key_defs;
+    shape->keys = keys;
+
+    return keys;
+}
+
+/**
+Compute the allocation size of an object with a given capacity
+The capacity is the total object size in bytes, as property offsets
+are from the start of the object, header included
+*/
+size_t object_alloc_size(uint32_t cap)
+{
+    assert (cap >= sizeof(object_t));
+    return cap;
+}
+
 object_t* object_alloc(uint32_t cap)
 {
     assert (cap >= OBJ_MIN_CAP);
 
     object_t* obj = (object_t*)vm_alloc(
-        sizeof(object_t) + sizeof(word_t) * cap,
+        object_alloc_size(cap),
         TAG_OBJECT
     );
 
     obj->cap = cap;
 
+    obj->ext_tbl = NULL;
+
     // The object starts out with the empty shape
     obj->shape = vm.empty_shape->idx;
 
     return obj;
 }
 
+/**
+Produce a shallow copy of an object
+All objects of a given shape have the same layout, so the copy gets the
+same shape and capacity, and the payload is copied in one block instead
+of redefining each property. The extension table, if any, is copied too,
+so that the clone never shares mutable storage with the original.
+*/
+object_t* object_clone(object_t* obj)
+{
+    size_t size = object_alloc_size(obj->cap);
+
+    object_t* copy = (object_t*)vm_alloc(size, obj->shape);
+
+    memcpy(copy, obj, size);
+
+    if (obj->ext_tbl != NULL)
+        copy->ext_tbl = object_clone(obj->ext_tbl);
+
+    return copy;
+}
+
+/**
+Get the shape node for an object
+*/
+shape_t* object_get_shape(object_t* obj)
+{
+    return array_get(vm.shapetbl, obj->shape).word.shape;
+}
+
 bool object_set_prop(
     object_t* obj,
     string_t* prop_name,
@@ -694,7 +990,7 @@ bool object_set_prop(
 )
 {
     // Get the shape from the object
-    shape_t* objShape = array_get(vm.shapetbl, obj->shape).word.shape;
+    shape_t* objShape = object_get_shape(obj);
     assert (objShape != NULL);
 
     // Find the shape defining this property (if it exists)
@@ -802,45 +1098,51 @@ bool object_set_prop_val(object_t* obj, const char* prop_name, value_t value)
     );
 }
 
-value_t object_get_prop(object_t* obj, string_t* prop_name)
+/**
+Read a property value given the shape node defining it
+*/
+value_t object_read_prop(object_t* obj, shape_t* def_shape)
 {
-    // Get the shape from the object
-    shape_t* objShape = array_get(vm.shapetbl, obj->shape).word.shape;
-    assert (objShape != NULL);
+    uint32_t offset = def_shape->offset;
 
-    // Find the shape defining this property (if it exists)
-    shape_t* defShape = shape_get_def(objShape, prop_name);
+    //printf("read offset=%d, field_size=%d\n", offset, def_shape->field_size);
 
-    // If the property is defined
-    if (defShape != NULL)
-    {
-        uint32_t offset = defShape->offset;
+    // The core interpreter requires all properties to
+    // fit within the object capacity (no extension tables)
+    assert (offset + def_shape->field_size <= obj->cap);
 
-        //printf("read offset=%d, field_size=%d\n", offset, defShape->field_size);
+    value_t val;
+    val.tag = def_shape->prop_tag;
 
-        // The core interpreter requires all properties to
-        // fit within the object capacity (no extension tables)
-        assert (offset + defShape->field_size <= obj->cap);
+    heapptr_t word_ptr = ((heapptr_t)obj) + offset;
 
-        value_t val;
-        val.tag = defShape->prop_tag;
+    switch (def_shape->field_size)
+    {
+        case 4:
+        val.word.int32 = *(int32_t*)word_ptr;
+        return val;
 
-        heapptr_t word_ptr = ((heapptr_t)obj) + offset;
+        case 8:
+        val.word.int64 = *(int64_t*)word_ptr;
+        return val;
 
-        switch (defShape->field_size)
-        {
-            case 4:
-            val.word.int32 = *(int32_t*)word_ptr;
-            return val;
+        default:
+        assert (false);
+    }
+}
 
-            case 8:
-            val.word.int64 = *(int64_t*)word_ptr;
-            return val;
+value_t object_get_prop(object_t* obj, string_t* prop_name)
+{
+    // Get the shape from the object
+    shape_t* objShape = object_get_shape(obj);
+    assert (objShape != NULL);
 
-            default:
-            assert (false);
-        }
-    }
+    // Find the shape defining this property (if it exists)
+    shape_t* defShape = shape_get_def(objShape, prop_name);
+
+    // If the property is defined
+    if (defShape != NULL)
+        return object_read_prop(obj, defShape);
 
     // TODO: for now, no proto lookup
     /*
@@ -864,15 +1166,72 @@ value_t object_get_prop(object_t* obj, string_t* prop_name)
     exit(-1);
 }
 
+/**
+Get the enumerable property names of an object
+Note: the key array is shared by all objects of the same shape
+and must not be modified
+*/
+array_t* object_keys(object_t* obj)
+{
+    return shape_get_keys(object_get_shape(obj));
+}
+
+/**
+Call a function on each enumerable property of an object, in order
+*/
+void object_foreach_prop(object_t* obj, prop_fn_t fn, void* data)
+{
+    shape_t* shape = object_get_shape(obj);
+    array_t* keys = shape_get_keys(shape);
+
+    for (uint32_t i = 0; i < keys->len; ++i)
+    {
+        shape_t* def_shape = array_get(shape->key_defs, i).word.shape;
+        fn(obj, def_shape->prop_name, object_read_prop(obj, def_shape), data);
+    }
+}
+
 //============================================================================
 // VM tests
 //============================================================================
 
+/// Property enumeration callback counting true values
+void test_count_true(
+    object_t* obj,
+    string_t* prop_name,
+    value_t value,
+    void* data
+)
+{
+    assert (value_equals(object_get_prop(obj, prop_name), value));
+
+    if (value_equals(value, VAL_TRUE))
+        (*(size_t*)data)++;
+}
+
 void test_vm()
 {
     assert (sizeof(word_t) == 8);
     assert (sizeof(value_t) == 16);
 
+    // Test printing booleans, with the output read back through a pipe
+    int fds[2];
+    char buf[16] = { 0 };
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    assert (pipe(fds) == 0);
+    dup2(fds[1], STDOUT_FILENO);
+    value_print(VAL_TRUE);
+    printf(" ");
+    value_print(VAL_FALSE);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(fds[1]);
+    assert (read(fds[0], buf, sizeof(buf) - 1) == 10);
+    close(fds[0]);
+    assert (strcmp(buf, "true false") == 0);
+
     // Test the string table
     string_t* str_foo1 = vm_get_cstr("foo");
     assert (str_foo1->len == 3);
@@ -881,6 +1240,18 @@ void test_vm()
     string_t* str_foo2 = vm_get_cstr("foo");
     assert (str_foo1 == str_foo2);
 
+    // Strings with nul bytes, and enough strings to grow the table
+    assert (vm_get_str("a\0b", 3) == vm_get_str("a\0b", 3));
+    assert (vm_get_str("a\0b", 3) != vm_get_str("a\0c", 3));
+    for (int i = 0; i < STR_TBL_INIT_SIZE; ++i)
+    {
+        char buf[32];
+        sprintf(buf, "str_tbl_%d", i);
+        string_t* str = vm_get_cstr(buf);
+        assert (i % 97 != 0 || vm_get_cstr(buf) == str);
+    }
+    assert (vm_get_cstr("foo") == str_foo1);
+
     // Test object allocation, set prop, get prop
     object_t* obj = object_alloc(OBJ_MIN_CAP);
     bool set_ret = object_set_prop_val(obj, "foo", VAL_TRUE);
@@ -891,6 +1262,36 @@ void test_vm()
     value_t get_val = object_get_prop(obj, vm_get_cstr("foo"));
     assert (value_equals(get_val, VAL_TRUE));
 
+    // Test property enumeration
+    array_t* keys = object_keys(obj);
+    assert (keys->len == 2);
+    assert (array_get(keys, 0).word.string == str_foo1);
+    assert (array_get(keys, 1).word.string == str_bar);
+
+    // Objects of the same shape share the key array
+    object_t* obj2 = object_alloc(OBJ_MIN_CAP);
+    object_set_prop_val(obj2, "foo", VAL_FALSE);
+    object_set_prop_val(obj2, "bar", VAL_TRUE);
+    assert (obj2->shape == obj->shape);
+    assert (object_keys(obj2) == keys);
+    assert (object_keys(object_alloc(OBJ_MIN_CAP))->len == 0);
+
+    size_t num_true = 0;
+    object_foreach_prop(obj2, test_count_true, &num_true);
+    assert (num_true == 1);
+
+    // Test object cloning
+    object_t* copy = object_clone(obj2);
+    assert (copy != obj2);
+    assert (copy->shape == obj2->shape);
+    assert (copy->cap == obj2->cap);
+    assert (object_alloc_size(copy->cap) == OBJ_MIN_CAP);
+    assert (copy->ext_tbl == NULL);
+    assert (value_equals(object_get_prop(copy, str_bar), VAL_TRUE));
+    object_set_prop(copy, str_bar, VAL_FALSE, ATTR_DEFAULT);
+    assert (value_equals(object_get_prop(copy, str_bar), VAL_FALSE));
+    assert (value_equals(object_get_prop(obj2, str_bar), VAL_TRUE));
+
     // TODO: helper methods, set_prop_int, set_prop_obj
     // wait to see if those are needed
 
@@ -31,6 +31,14 @@ typedef uint32_t shapeidx_t;
 /// Initial VM heap size
 #define HEAP_SIZE (1 << 24)
 
+/// Size of the heap regions threads allocate objects in
+#define REGION_SIZE (1 << 16)
+
+/// VM value stack size, in values
+/// The stack is reserved as address space, and memory is only committed
+/// as it gets used, so this is a limit rather than an allocation
+#define STACK_SIZE (1 << 27)
+
 /// String table parameters
 #define STR_TBL_INIT_SIZE       16384
 #define STR_TBL_MAX_LOAD_NUM    3
@@ -99,7 +107,9 @@ typedef struct
 
     uint8_t* heaplimit;
 
-    uint8_t* allocptr;
+    /// Start of the part of the heap not yet handed out as
+    /// allocation regions, guarded by the heap lock
+    uint8_t* heapfree;
 
     array_t* shapetbl;
 
@@ -120,6 +130,36 @@ typedef struct
 
 } vm_t;
 
+/**
+VM state of a thread running Zeta code
+Each thread has its own value stack, and allocates objects in a region
+of the heap of its own, so that allocating doesn't need any locking.
+The shape and string tables are only modified by the main thread.
+*/
+typedef struct
+{
+    /// Current allocation region
+    uint8_t* allocptr;
+
+    uint8_t* alloclimit;
+
+    /// Value stack, holding the local variables of interpreter frames
+    value_t* stackstart;
+
+    value_t* stacklimit;
+
+    value_t* stacktop;
+
+    /// Lowest C stack address native frames may use. Below it, calls
+    /// continue in the bytecode interpreter, on the VM stack.
+    uint8_t* cstack_limit;
+
+    /// Lowest C stack address the host may reenter the interpreters at,
+    /// leaving space for the frames of the host and of one call
+    uint8_t* cstack_end;
+
+} vm_thread_t;
+
 /**
 String (heap object)
 */
@@ -210,6 +250,13 @@ typedef struct shape
     /// KISS for now, just an array
     array_t* children;
 
+    /// Enumerable property names, in definition order
+    /// Computed lazily, shared by all objects with this shape
+    array_t* keys;
+
+    /// Shape nodes defining each enumerable property, parallel to keys
+    array_t* key_defs;
+
 } shape_t;
 
 /**
@@ -230,16 +277,39 @@ typedef struct object
 
 } object_t;
 
+/// Property enumeration callback, see object_foreach_prop
+typedef void (*prop_fn_t)(
+    object_t* obj,
+    string_t* prop_name,
+    value_t value,
+    void* data
+);
+
 value_t value_from_heapptr(heapptr_t v, tag_t tag);
 value_t value_from_int64(int64_t v);
+value_t value_from_float64(double v);
 void value_print(value_t value);
 bool value_equals(value_t this, value_t that);
 
 shapeidx_t get_shape(heapptr_t obj);
 
+/// Global VM instance
+extern vm_t vm;
+
+/// VM state of the current thread
+extern _Thread_local vm_thread_t vm_thread;
+
 void vm_init();
+void vm_init_thread(size_t stack_size);
 heapptr_t vm_alloc(uint32_t size, shapeidx_t shape);
+value_t* vm_push_frame(uint32_t num_slots);
+void vm_pop_frame(value_t* frame);
+value_t* vm_stack_reserve(size_t num_slots);
+void vm_stack_release(value_t* stack, size_t num_slots);
+bool vm_cstack_low();
+void vm_cstack_check();
 string_t* vm_get_tbl_str(string_t* str);
+string_t* vm_get_str(const char* data, uint32_t len);
 string_t* vm_get_cstr(const char* cstr);
 
 string_t* string_alloc(uint32_t len);
@@ -250,6 +320,7 @@ void array_set(array_t* array, uint32_t idx, value_t val);
 void array_set_obj(array_t* array, uint32_t idx, heapptr_t val);
 value_t array_get(array_t* array, uint32_t idx);
 heapptr_t array_get_ptr(array_t* array, uint32_t idx);
+array_t* array_append(array_t* array, value_t val);
 
 shape_t* shape_alloc(
     shape_t* parent,
@@ -267,6 +338,23 @@ shape_t* shape_def_prop(
     uint8_t field_size,
     shape_t* defShape
 );
+shape_t* shape_get_def(shape_t* this, string_t* prop_name);
+array_t* shape_get_keys(shape_t* shape);
+
+object_t* object_alloc(uint32_t cap);
+object_t* object_clone(object_t* obj);
+shape_t* object_get_shape(object_t* obj);
+bool object_set_prop(
+    object_t* obj,
+    string_t* prop_name,
+    value_t value,
+    uint8_t def_attrs
+);
+bool object_set_prop_val(object_t* obj, const char* prop_name, value_t value);
+value_t object_read_prop(object_t* obj, shape_t* def_shape);
+value_t object_get_prop(object_t* obj, string_t* prop_name);
+array_t* object_keys(object_t* obj);
+void object_foreach_prop(object_t* obj, prop_fn_t fn, void* data);
 
 void test_vm();
 
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "x86.h"
+
+void x86_init(x86_asm_t* a)
+{
+    a->cap = 4096;
+    a->len = 0;
+    a->code = malloc(a->cap);
+}
+
+void x86_free(x86_asm_t* a)
+{
+    free(a->code);
+    a->code = NULL;
+    a->len = 0;
+    a->cap = 0;
+}
+
+void x86_byte(x86_asm_t* a, uint8_t b)
+{
+    if (a->len == a->cap)
+    {
+        a->cap *= 2;
+        a->code = realloc(a->code, a->cap);
+    }
+
+    a->code[a->len++] = b;
+}
+
+void x86_u32(x86_asm_t* a, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        x86_byte(a, (uint8_t)(v >> (8 * i)));
+}
+
+void x86_u64(x86_asm_t* a, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        x86_byte(a, (uint8_t)(v >> (8 * i)));
+}
+
+/**
+Emit a REX prefix, if needed
+w selects a 64-bit operand size, reg and rm are the registers encoded
+in the ModRM reg and r/m fields
+*/
+static void x86_rex(x86_asm_t* a, bool w, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (w? 8:0) | ((reg & 8)? 4:0) | ((rm & 8)? 1:0);
+
+    if (rex != 0x40)
+        x86_byte(a, rex);
+}
+
+/// Emit a ModRM byte for a register-direct operand
+static void x86_modrm_rr(x86_asm_t* a, int reg, int rm)
+{
+    x86_byte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/// Emit a ModRM byte, and SIB if needed, for a [base + disp32] operand
+static void x86_modrm_mem(x86_asm_t* a, int reg, x86_reg_t base, int32_t disp)
+{
+    x86_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+
+    // RSP and R12 as a base require a SIB byte
+    if ((base & 7) == RSP)
+        x86_byte(a, 0x24);
+
+    x86_u32(a, (uint32_t)disp);
+}
+
+void x86_push(x86_asm_t* a, x86_reg_t r)
+{
+    x86_rex(a, false, 0, r);
+    x86_byte(a, 0x50 + (r & 7));
+}
+
+void x86_pop(x86_asm_t* a, x86_reg_t r)
+{
+    x86_rex(a, false, 0, r);
+    x86_byte(a, 0x58 + (r & 7));
+}
+
+void x86_ret(x86_asm_t* a)
+{
+    x86_byte(a, 0xC3);
+}
+
+/// mov dst, src
+void x86_mov_rr(x86_asm_t* a, x86_reg_t dst, x86_reg_t src)
+{
+    x86_rex(a, true, src, dst);
+    x86_byte(a, 0x89);
+    x86_modrm_rr(a, src, dst);
+}
+
+/// mov dst, imm64
+/// Immediates which fit in 32 bits use the shorter encodings
+void x86_mov_ri(x86_asm_t* a, x86_reg_t dst, uint64_t imm)
+{
+    if (imm <= UINT32_MAX)
+    {
+        x86_rex(a, false, 0, dst);
+        x86_byte(a, 0xB8 + (dst & 7));
+        x86_u32(a, (uint32_t)imm);
+        return;
+    }
+
+    x86_rex(a, true, 0, dst);
+    x86_byte(a, 0xB8 + (dst & 7));
+    x86_u64(a, imm);
+}
+
+/// mov dst, [base + disp]
+void x86_mov_rm(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_rex(a, true, dst, base);
+    x86_byte(a, 0x8B);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// mov [base + disp], src
+void x86_mov_mr(x86_asm_t* a, x86_reg_t base, int32_t disp, x86_reg_t src)
+{
+    x86_rex(a, true, src, base);
+    x86_byte(a, 0x89);
+    x86_modrm_mem(a, src, base, disp);
+}
+
+/// mov qword [base + disp], imm32 (sign-extended)
+void x86_mov_mi(x86_asm_t* a, x86_reg_t base, int32_t disp, int32_t imm)
+{
+    x86_rex(a, true, 0, base);
+    x86_byte(a, 0xC7);
+    x86_modrm_mem(a, 0, base, disp);
+    x86_u32(a, (uint32_t)imm);
+}
+
+/// lea dst, [base + disp]
+void x86_lea(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_rex(a, true, dst, base);
+    x86_byte(a, 0x8D);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// <op> dst, [base + disp]
+void x86_alu_rm(x86_asm_t* a, x86_alu_t op, x86_reg_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_rex(a, true, dst, base);
+    x86_byte(a, (uint8_t)op);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// <op> dst, src
+void x86_alu_rr(x86_asm_t* a, x86_alu_t op, x86_reg_t dst, x86_reg_t src)
+{
+    x86_rex(a, true, dst, src);
+    x86_byte(a, (uint8_t)op);
+    x86_modrm_rr(a, dst, src);
+}
+
+/// imul dst, [base + disp]
+void x86_imul_rm(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_rex(a, true, dst, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0xAF);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// cmp r, imm32 (sign-extended)
+void x86_cmp_ri(x86_asm_t* a, x86_reg_t r, int32_t imm)
+{
+    x86_rex(a, true, 0, r);
+    x86_byte(a, 0x81);
+    x86_modrm_rr(a, 7, r);
+    x86_u32(a, (uint32_t)imm);
+}
+
+/// cmp byte [base + disp], imm8
+void x86_cmp_m8i(x86_asm_t* a, x86_reg_t base, int32_t disp, uint8_t imm)
+{
+    x86_rex(a, false, 0, base);
+    x86_byte(a, 0x80);
+    x86_modrm_mem(a, 7, base, disp);
+    x86_byte(a, imm);
+}
+
+/// Sign-extend rax into rdx:rax
+void x86_cqo(x86_asm_t* a)
+{
+    x86_byte(a, 0x48);
+    x86_byte(a, 0x99);
+}
+
+/// Signed division of rdx:rax by r
+void x86_idiv(x86_asm_t* a, x86_reg_t r)
+{
+    x86_rex(a, true, 0, r);
+    x86_byte(a, 0xF7);
+    x86_modrm_rr(a, 7, r);
+}
+
+/// Set the low byte of r to the condition flag
+/// Note: only the registers with a legacy byte form (rax..rbx) are allowed
+void x86_setcc(x86_asm_t* a, x86_cc_t cc, x86_reg_t r)
+{
+    assert (r <= RBX);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x90 + cc);
+    x86_modrm_rr(a, 0, r);
+}
+
+/// movzx dst32, src8
+void x86_movzx_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src)
+{
+    assert (src <= RBX);
+    x86_rex(a, false, dst, src);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0xB6);
+    x86_modrm_rr(a, dst, src);
+}
+
+/// and dst8, src8
+void x86_and_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src)
+{
+    assert (dst <= RBX && src <= RBX);
+    x86_byte(a, 0x20);
+    x86_modrm_rr(a, src, dst);
+}
+
+/// or dst8, src8
+void x86_or_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src)
+{
+    assert (dst <= RBX && src <= RBX);
+    x86_byte(a, 0x08);
+    x86_modrm_rr(a, src, dst);
+}
+
+/// test r8, r8
+void x86_test_r8(x86_asm_t* a, x86_reg_t r)
+{
+    assert (r <= RBX);
+    x86_byte(a, 0x84);
+    x86_modrm_rr(a, r, r);
+}
+
+/// movsd dst, [base + disp]
+void x86_movsd_rm(x86_asm_t* a, x86_xmm_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_byte(a, 0xF2);
+    x86_rex(a, false, dst, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x10);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// movsd [base + disp], src
+void x86_movsd_mr(x86_asm_t* a, x86_reg_t base, int32_t disp, x86_xmm_t src)
+{
+    x86_byte(a, 0xF2);
+    x86_rex(a, false, src, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x11);
+    x86_modrm_mem(a, src, base, disp);
+}
+
+/// <op>sd dst, [base + disp]
+void x86_sse_rm(x86_asm_t* a, x86_sse_t op, x86_xmm_t dst, x86_reg_t base, int32_t disp)
+{
+    x86_byte(a, 0xF2);
+    x86_rex(a, false, dst, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, (uint8_t)op);
+    x86_modrm_mem(a, dst, base, disp);
+}
+
+/// ucomisd x0, x1
+void x86_ucomisd(x86_asm_t* a, x86_xmm_t x0, x86_xmm_t x1)
+{
+    x86_byte(a, 0x66);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x2E);
+    x86_modrm_rr(a, x0, x1);
+}
+
+/// call r
+void x86_call_r(x86_asm_t* a, x86_reg_t r)
+{
+    x86_rex(a, false, 0, r);
+    x86_byte(a, 0xFF);
+    x86_modrm_rr(a, 2, r);
+}
+
+/**
+Emit a jump with a 32-bit displacement
+Returns the position of the displacement, to be patched with x86_patch
+*/
+size_t x86_jmp(x86_asm_t* a)
+{
+    x86_byte(a, 0xE9);
+    x86_u32(a, 0);
+    return a->len - 4;
+}
+
+/// Emit a conditional jump, see x86_jmp
+size_t x86_jcc(x86_asm_t* a, x86_cc_t cc)
+{
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x80 + cc);
+    x86_u32(a, 0);
+    return a->len - 4;
+}
+
+/// Set the target of a jump to a position in the code buffer
+void x86_patch(x86_asm_t* a, size_t jump_pos, size_t target)
+{
+    int32_t disp = (int32_t)(target - (jump_pos + 4));
+    memcpy(a->code + jump_pos, &disp, sizeof(disp));
+}
+
+/// Check that the code emitted by an assembler call matches the expected bytes
+#define TEST_X86(call, ...) \
+{ \
+    uint8_t expected[] = { __VA_ARGS__ }; \
+    x86_asm_t a; \
+    x86_init(&a); \
+    call; \
+    if (a.len != sizeof(expected) || \
+        memcmp(a.code, expected, sizeof(expected)) != 0) \
+    { \
+        printf("incorrect encoding for %s:", #call); \
+        for (size_t i = 0; i < a.len; ++i) \
+            printf(" %02X", a.code[i]); \
+        printf("\n"); \
+        exit(-1); \
+    } \
+    x86_free(&a); \
+}
+
+void test_x86()
+{
+    TEST_X86(x86_push(&a, RBX), 0x53);
+    TEST_X86(x86_push(&a, R12), 0x41, 0x54);
+    TEST_X86(x86_pop(&a, R12), 0x41, 0x5C);
+    TEST_X86(x86_mov_rr(&a, RBX, RDI), 0x48, 0x89, 0xFB);
+    TEST_X86(x86_mov_rr(&a, R12, RSI), 0x49, 0x89, 0xF4);
+    TEST_X86(x86_mov_ri(&a, RDX, 7), 0xBA, 0x07, 0x00, 0x00, 0x00);
+    TEST_X86(
+        x86_mov_ri(&a, RAX, 0x1122334455667788),
+        0x48, 0xB8, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11
+    );
+    TEST_X86(x86_mov_rm(&a, RAX, RBX, 16), 0x48, 0x8B, 0x83, 0x10, 0, 0, 0);
+    TEST_X86(x86_mov_rm(&a, RCX, R12, 8), 0x49, 0x8B, 0x8C, 0x24, 0x08, 0, 0, 0);
+    TEST_X86(x86_mov_mr(&a, RBX, 0, RDX), 0x48, 0x89, 0x93, 0, 0, 0, 0);
+    TEST_X86(x86_mov_mi(&a, RBX, 8, 1), 0x48, 0xC7, 0x83, 0x08, 0, 0, 0, 1, 0, 0, 0);
+    TEST_X86(x86_lea(&a, RDI, RBX, 32), 0x48, 0x8D, 0xBB, 0x20, 0, 0, 0);
+    TEST_X86(x86_alu_rm(&a, ALU_ADD, RAX, RBX, 16), 0x48, 0x03, 0x83, 0x10, 0, 0, 0);
+    TEST_X86(x86_alu_rr(&a, ALU_ADD, RDX, RDI), 0x48, 0x03, 0xD7);
+    TEST_X86(x86_alu_rr(&a, ALU_CMP, R8, RAX), 0x4C, 0x3B, 0xC0);
+    TEST_X86(x86_imul_rm(&a, RAX, RBX, 0), 0x48, 0x0F, 0xAF, 0x83, 0, 0, 0, 0);
+    TEST_X86(x86_cmp_ri(&a, RCX, -1), 0x48, 0x81, 0xF9, 0xFF, 0xFF, 0xFF, 0xFF);
+    TEST_X86(x86_cmp_m8i(&a, RBX, 8, 1), 0x80, 0xBB, 0x08, 0, 0, 0, 0x01);
+    TEST_X86(x86_cqo(&a), 0x48, 0x99);
+    TEST_X86(x86_idiv(&a, RCX), 0x48, 0xF7, 0xF9);
+    TEST_X86(x86_setcc(&a, CC_L, RAX), 0x0F, 0x9C, 0xC0);
+    TEST_X86(x86_movzx_r8(&a, RAX, RAX), 0x0F, 0xB6, 0xC0);
+    TEST_X86(x86_and_r8(&a, RAX, RCX), 0x20, 0xC8);
+    TEST_X86(x86_test_r8(&a, RAX), 0x84, 0xC0);
+    TEST_X86(x86_movsd_rm(&a, XMM0, RBX, 16), 0xF2, 0x0F, 0x10, 0x83, 0x10, 0, 0, 0);
+    TEST_X86(x86_movsd_mr(&a, RBX, 0, XMM1), 0xF2, 0x0F, 0x11, 0x8B, 0, 0, 0, 0);
+    TEST_X86(x86_sse_rm(&a, SSE_ADD, XMM0, RBX, 0), 0xF2, 0x0F, 0x58, 0x83, 0, 0, 0, 0);
+    TEST_X86(x86_ucomisd(&a, XMM0, XMM1), 0x66, 0x0F, 0x2E, 0xC1);
+    TEST_X86(x86_call_r(&a, RAX), 0xFF, 0xD0);
+    TEST_X86(x86_jmp(&a), 0xE9, 0, 0, 0, 0);
+    TEST_X86(x86_jcc(&a, CC_NE), 0x0F, 0x85, 0, 0, 0, 0);
+}
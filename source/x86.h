@@ -0,0 +1,118 @@
+/**
+x86-64 machine code assembler
+
+A minimal assembler for the subset of x86-64 instructions needed by the
+JIT compiler. Instructions are appended to a growable code buffer. Memory
+operands are always of the form [base + disp32].
+*/
+
+#ifndef __X86_H__
+#define __X86_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/// General-purpose registers
+typedef enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} x86_reg_t;
+
+/// SSE registers
+typedef enum
+{
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7
+} x86_xmm_t;
+
+/// Condition codes, as encoded in jcc and setcc
+typedef enum
+{
+    CC_O  = 0x0,
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_P  = 0xA,
+    CC_NP = 0xB,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF
+} x86_cc_t;
+
+/// Negate a condition code
+#define X86_CC_NOT(cc) ((x86_cc_t)((cc) ^ 1))
+
+/// Integer ALU operations with a register destination
+typedef enum
+{
+    ALU_ADD = 0x03,
+    ALU_SUB = 0x2B,
+    ALU_CMP = 0x3B
+} x86_alu_t;
+
+/// SSE2 scalar double operations
+typedef enum
+{
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5C,
+    SSE_DIV = 0x5E
+} x86_sse_t;
+
+/**
+Machine code buffer
+*/
+typedef struct
+{
+    uint8_t* code;
+
+    size_t len;
+
+    size_t cap;
+
+} x86_asm_t;
+
+void x86_init(x86_asm_t* a);
+void x86_free(x86_asm_t* a);
+void x86_byte(x86_asm_t* a, uint8_t b);
+void x86_u32(x86_asm_t* a, uint32_t v);
+void x86_u64(x86_asm_t* a, uint64_t v);
+
+void x86_push(x86_asm_t* a, x86_reg_t r);
+void x86_pop(x86_asm_t* a, x86_reg_t r);
+void x86_ret(x86_asm_t* a);
+void x86_mov_rr(x86_asm_t* a, x86_reg_t dst, x86_reg_t src);
+void x86_mov_ri(x86_asm_t* a, x86_reg_t dst, uint64_t imm);
+void x86_mov_rm(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp);
+void x86_mov_mr(x86_asm_t* a, x86_reg_t base, int32_t disp, x86_reg_t src);
+void x86_mov_mi(x86_asm_t* a, x86_reg_t base, int32_t disp, int32_t imm);
+void x86_lea(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp);
+void x86_alu_rm(x86_asm_t* a, x86_alu_t op, x86_reg_t dst, x86_reg_t base, int32_t disp);
+void x86_alu_rr(x86_asm_t* a, x86_alu_t op, x86_reg_t dst, x86_reg_t src);
+void x86_imul_rm(x86_asm_t* a, x86_reg_t dst, x86_reg_t base, int32_t disp);
+void x86_cmp_ri(x86_asm_t* a, x86_reg_t r, int32_t imm);
+void x86_cmp_m8i(x86_asm_t* a, x86_reg_t base, int32_t disp, uint8_t imm);
+void x86_cqo(x86_asm_t* a);
+void x86_idiv(x86_asm_t* a, x86_reg_t r);
+void x86_setcc(x86_asm_t* a, x86_cc_t cc, x86_reg_t r);
+void x86_movzx_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src);
+void x86_and_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src);
+void x86_or_r8(x86_asm_t* a, x86_reg_t dst, x86_reg_t src);
+void x86_test_r8(x86_asm_t* a, x86_reg_t r);
+void x86_movsd_rm(x86_asm_t* a, x86_xmm_t dst, x86_reg_t base, int32_t disp);
+void x86_movsd_mr(x86_asm_t* a, x86_reg_t base, int32_t disp, x86_xmm_t src);
+void x86_sse_rm(x86_asm_t* a, x86_sse_t op, x86_xmm_t dst, x86_reg_t base, int32_t disp);
+void x86_ucomisd(x86_asm_t* a, x86_xmm_t x0, x86_xmm_t x1);
+void x86_call_r(x86_asm_t* a, x86_reg_t r);
+size_t x86_jmp(x86_asm_t* a);
+size_t x86_jcc(x86_asm_t* a, x86_cc_t cc);
+void x86_patch(x86_asm_t* a, size_t jump_pos, size_t target);
+
+void test_x86();
+
+#endif